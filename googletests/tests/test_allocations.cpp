@@ -0,0 +1,175 @@
+#include <gtest/gtest.h>
+#include "../../inc/Channel.hpp"
+#include "../../inc/Client.hpp"
+#include "../../inc/ChannelsClientsManager.hpp"
+#include "../../inc/MemoryBudget.hpp"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// Counts every heap allocation made while g_counting is set. This replaces the
+// global operator new for the whole binary, keep it out of the other test targets.
+
+static bool g_counting = false;
+static size_t g_allocations = 0;
+
+void* operator new(size_t size) {
+	if (g_counting)
+		g_allocations++;
+	void* ptr = std::malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* ptr) throw() {
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr) throw() {
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) throw() {
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) throw() {
+	std::free(ptr);
+}
+
+static Client* registeredClient(ChannelsClientsManager& manager, int sv[2], const std::string& nick) {
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+	Client* client = new Client(sv[1]);
+	client->setHostname("127.0.0.1");
+	manager.addClient(client);
+	std::string reg = "PASS pass\r\nNICK " + nick + "\r\nUSER " + nick + " 0 * :Alloc Test\r\n";
+	manager.handleClientInput(client, reg.c_str(), reg.size());
+	return client;
+}
+
+static void drain(int fd) {
+	char buffer[65536];
+	while (recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+		;
+}
+
+// One loop iteration as the server runs it: parse, dispatch, fan out, reset the arena
+static void deliver(ChannelsClientsManager& manager, Client* sender, const char* line, int readers[], int count) {
+	manager.handleClientInput(sender, line, std::strlen(line));
+	manager.resetArena();
+	for (int i = 0; i < count; ++i)
+		drain(readers[i]);
+}
+
+TEST(AllocationTest, PrivmsgSteadyStateAllocatesNothing) {
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+	int a[2], b[2], c[2];
+	Client* alice = registeredClient(manager, a, "alice");
+	Client* bob = registeredClient(manager, b, "bob");
+	Client* carol = registeredClient(manager, c, "carol");
+	const char* join = "JOIN #alloc\r\n";
+	manager.handleClientInput(alice, join, std::strlen(join));
+	manager.handleClientInput(bob, join, std::strlen(join));
+	manager.handleClientInput(carol, join, std::strlen(join));
+	int readers[] = { a[0], b[0], c[0] };
+	drain(a[0]);
+	drain(b[0]);
+	drain(c[0]);
+
+	const char* toChannel = "PRIVMSG #alloc :hello everyone, this line is long enough to need the heap\r\n";
+	const char* toUser = "PRIVMSG bob :and a private one that does not fit in any small string buffer\r\n";
+	// Server tags are dropped and client-only ones relayed, both without the heap
+	const char* tagged = "@+draft/reply=1a2b;msgid=3c4d;+typing=done PRIVMSG #alloc :tagged and long enough for the heap too\r\n";
+	bob->setCaps(CAP_MESSAGE_TAGS);
+	carol->setCaps(CAP_SERVER_TIME | CAP_ECHO_MESSAGE);
+	// Warm up: the arena settles on its chunk, the channel history fills up
+	for (int i = 0; i < HISTORY_DEPTH; ++i) {
+		deliver(manager, alice, toChannel, readers, 3);
+		deliver(manager, alice, toUser, readers, 3);
+		deliver(manager, carol, tagged, readers, 3);
+	}
+
+	g_allocations = 0;
+	g_counting = true;
+	for (int i = 0; i < 1000; ++i) {
+		deliver(manager, alice, toChannel, readers, 3);
+		deliver(manager, carol, toUser, readers, 3);
+		deliver(manager, carol, tagged, readers, 3);
+	}
+	g_counting = false;
+	EXPECT_EQ(g_allocations, 0u);
+
+	// The fast path must say exactly what the IRCCommand path says
+	deliver(manager, alice, toChannel, readers, 0);
+	char buffer[512];
+	ssize_t n = recv(b[0], buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+	ASSERT_GT(n, 0);
+	buffer[n] = '\0';
+	// bob has message-tags, so the channel message comes with its msgid
+	EXPECT_STREQ(buffer + 8 + HISTORY_MSGID_SIZE, "alice!alice@127.0.0.1 PRIVMSG #alloc :hello everyone, this line is long enough to need the heap\r\n");
+	EXPECT_EQ(recv(a[0], buffer, sizeof(buffer), MSG_DONTWAIT), -1); // not echoed to the sender
+
+	manager.removeClient(*alice);
+	manager.removeClient(*bob);
+	manager.removeClient(*carol);
+	close(a[0]);
+	close(b[0]);
+	close(c[0]);
+}
+
+TEST(AllocationTest, ArenaSettlesOnOneChunk) {
+	Arena arena;
+	for (int i = 0; i < 100; ++i)
+		arena.allocate(1000);
+	size_t grown = arena.capacity();
+	arena.reset();
+	EXPECT_GE(arena.capacity(), grown);
+
+	g_allocations = 0;
+	g_counting = true;
+	for (int round = 0; round < 10; ++round) {
+		for (int i = 0; i < 100; ++i)
+			arena.allocate(1000);
+		arena.reset();
+	}
+	g_counting = false;
+	EXPECT_EQ(g_allocations, 0u);
+}
+
+TEST(AllocationTest, ArenaShrinksBackAfterBurst) {
+	size_t outputBefore = MemoryBudget::used(MEM_OUTPUT);
+	{
+		Arena arena;
+		// One burst iteration, then the merged chunk sticks around for a while
+		for (int i = 0; i < 200; ++i)
+			arena.allocate(1000);
+		arena.reset();
+		size_t burst = arena.capacity();
+		EXPECT_GT(burst, (size_t)ARENA_CHUNK_SIZE);
+		EXPECT_EQ(MemoryBudget::used(MEM_OUTPUT), outputBefore + burst);
+		for (int round = 0; round < ARENA_SHRINK_RESETS - 2; ++round) {
+			arena.allocate(1000);
+			arena.reset();
+		}
+		EXPECT_EQ(arena.capacity(), burst);
+
+		// Quiet iterations: back to one ordinary chunk
+		arena.allocate(1000);
+		arena.reset();
+		EXPECT_EQ(arena.capacity(), (size_t)ARENA_CHUNK_SIZE);
+		EXPECT_EQ(MemoryBudget::used(MEM_OUTPUT), outputBefore + ARENA_CHUNK_SIZE);
+	}
+	EXPECT_EQ(MemoryBudget::used(MEM_OUTPUT), outputBefore);
+}
@@ -0,0 +1,1257 @@
+#include <gtest/gtest.h>
+#include "../../inc/Channel.hpp"
+#include "../../inc/Client.hpp"
+#include "../../inc/ChannelsClientsManager.hpp"
+#include "../../inc/ObjectPool.hpp"
+#include "../../inc/HistoryLog.hpp"
+#include "../../inc/MaskList.hpp"
+#include "../../inc/ConnectionLimiter.hpp"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <cstdio>
+#include <fstream>
+#include <array>
+#include <iostream>
+
+// Benchmarks print their numbers and only assert on things that must hold
+// regardless of the machine (no leaks, bounded pools...). Run the binary
+// directly to see the timings: ./benchmark_test
+
+static double nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static long rssKb() {
+	std::ifstream statm("/proc/self/statm");
+	long pages = 0;
+	long resident = 0;
+	statm >> pages >> resident;
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static Client *connectClient(std::vector<pollfd>& pollfds, std::map<int, Client*>& clients_map, int sv[2], const std::string& nick) {
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+	Client* client = new Client(sv[1]);
+	client->addToBuffer("PASS pass\r\nNICK " + nick + "\r\nUSER " + nick + " 0 * :Bench User\r\n");
+	pollfd pfd;
+	pfd.fd = sv[1];
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	pollfds.push_back(pfd);
+	clients_map[sv[1]] = client;
+	return client;
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> ALLOCATOR <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+struct ClientSized {
+	char bytes[sizeof(Client)];
+};
+
+TEST(BenchmarkTest, SlabPoolVersusHeap) {
+	const size_t rounds = 200;
+	const size_t batch = 1000;
+	std::vector<void*> ptrs(batch);
+
+	ObjectPool<ClientSized> pool;
+	double start = nowMs();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (size_t i = 0; i < batch; ++i)
+			ptrs[i] = pool.allocate();
+		// free every other one first so the free list gets shuffled like real churn
+		for (size_t i = 0; i < batch; i += 2)
+			pool.deallocate(ptrs[i]);
+		for (size_t i = 1; i < batch; i += 2)
+			pool.deallocate(ptrs[i]);
+	}
+	double poolMs = nowMs() - start;
+
+	start = nowMs();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (size_t i = 0; i < batch; ++i)
+			ptrs[i] = ::operator new(sizeof(ClientSized));
+		for (size_t i = 0; i < batch; i += 2)
+			::operator delete(ptrs[i]);
+		for (size_t i = 1; i < batch; i += 2)
+			::operator delete(ptrs[i]);
+	}
+	double heapMs = nowMs() - start;
+
+	double ops = rounds * batch;
+	std::cout << "[ bench ] alloc+free of " << sizeof(ClientSized) << " bytes: pool "
+		<< poolMs * 1000000.0 / ops << " ns/op, heap " << heapMs * 1000000.0 / ops << " ns/op" << std::endl;
+
+	PoolStats stats = pool.stats();
+	EXPECT_EQ(stats.live, 0u);
+	EXPECT_EQ(stats.highWater, batch);
+	EXPECT_EQ(stats.free, stats.slabs * 64);
+}
+
+TEST(BenchmarkTest, ConnectRegisterJoinQuitChurn) {
+	const int cycles = 2000;
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	server_pfd.fd = -1;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+
+	// A resident keeps #churn alive so joins hit an existing channel too
+	int resident[2];
+	Client* keeper = connectClient(pollfds, clients_map, resident, "keeper");
+	manager.handleClientMessage(keeper);
+	keeper->addToBuffer("JOIN #churn\r\n");
+	manager.handleClientMessage(keeper);
+
+	PoolStats clientsBefore = Client::poolStats();
+	PoolStats channelsBefore = Channel::poolStats();
+	long rssBefore = rssKb();
+	char drain[4096];
+	double start = nowMs();
+	for (int i = 0; i < cycles; ++i) {
+		int sv[2];
+		Client* client = connectClient(pollfds, clients_map, sv, "churner");
+		manager.handleClientMessage(client);
+		client->addToBuffer("JOIN #churn,#solo\r\n");
+		manager.handleClientMessage(client);
+		manager.removeClient(*client);
+		while (recv(resident[0], drain, sizeof(drain), MSG_DONTWAIT) > 0)
+			;
+		close(sv[0]);
+	}
+	double elapsed = nowMs() - start;
+	long rssAfter = rssKb();
+
+	PoolStats clientsAfter = Client::poolStats();
+	PoolStats channelsAfter = Channel::poolStats();
+	std::cout << "[ bench ] connect/register/join/quit: " << elapsed * 1000.0 / cycles << " us/cycle, RSS "
+		<< rssBefore << " -> " << rssAfter << " kB" << std::endl;
+	std::cout << "[ bench ] client pool live " << clientsAfter.live << " free " << clientsAfter.free
+		<< " high-water " << clientsAfter.highWater << ", channel pool live " << channelsAfter.live
+		<< " free " << channelsAfter.free << " high-water " << channelsAfter.highWater << std::endl;
+
+	// Churn must recycle slots, not grow the pools
+	EXPECT_EQ(clientsAfter.live, clientsBefore.live);
+	EXPECT_EQ(channelsAfter.live, channelsBefore.live);
+	EXPECT_EQ(clientsAfter.slabs, clientsBefore.slabs);
+	EXPECT_EQ(channelsAfter.slabs, channelsBefore.slabs);
+
+	manager.removeClient(*keeper);
+	close(resident[0]);
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> MEMBERSHIP <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+TEST(BenchmarkTest, QuitFromTwoHundredChannels) {
+	const int channels = 200;
+	const int rounds = 50;
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	server_pfd.fd = -1;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+
+	// Residents keep every channel populated so the quitter's removal never deletes one
+	int resident[2];
+	Client* keeper = connectClient(pollfds, clients_map, resident, "keeper");
+	manager.handleClientMessage(keeper);
+	std::vector<std::string> joins;
+	for (int c = 0; c < channels; ++c)
+		joins.push_back("JOIN #room" + std::to_string(c) + "\r\n");
+	char drain[65536];
+	for (int c = 0; c < channels; ++c) {
+		keeper->addToBuffer(joins[c]);
+		manager.handleClientMessage(keeper);
+		while (recv(resident[0], drain, sizeof(drain), MSG_DONTWAIT) > 0)
+			;
+	}
+
+	double total = 0;
+	for (int r = 0; r < rounds; ++r) {
+		int sv[2];
+		Client* client = connectClient(pollfds, clients_map, sv, "hopper");
+		manager.handleClientMessage(client);
+		// Drain both ends as we go, unix sockets fill up fast with many small writes
+		for (int c = 0; c < channels; ++c) {
+			client->addToBuffer(joins[c]);
+			manager.handleClientMessage(client);
+			while (recv(resident[0], drain, sizeof(drain), MSG_DONTWAIT) > 0)
+				;
+			while (recv(sv[0], drain, sizeof(drain), MSG_DONTWAIT) > 0)
+				;
+		}
+		double start = nowMs();
+		manager.removeClient(*client);
+		total += nowMs() - start;
+		close(sv[0]);
+	}
+	std::cout << "[ bench ] removeClient from " << channels << " channels: " << total * 1000.0 / rounds << " us" << std::endl;
+
+	EXPECT_EQ(manager.getChannelsSize(), channels);
+	EXPECT_EQ(keeper->getMemberships().size(), (size_t)channels);
+	manager.removeClient(*keeper);
+	EXPECT_EQ(manager.getChannelsSize(), 0);
+	close(resident[0]);
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> CLIENT LAYOUT <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+// The two IdleScan tests walk the same number of idle clients the way the poll
+// loop does on every wakeup (lookup by fd, check the timeout). Both read the
+// clock once per scan and find clients through an fd-indexed table, so only
+// the client layout differs. Compare their cache misses with `make perf_bench`,
+// the timings alone are printed here.
+
+// What a Client used to look like: every string inline
+struct LegacyClient {
+	int						fd;
+	std::string				nickname;
+	std::string				username;
+	std::string				realname;
+	std::string				hostname;
+	std::string				buffer;
+	bool					authenticated;
+	bool					registered;
+	time_t					connectionTime;
+	std::vector<Channel*>	channels;
+	std::vector<Channel*>	invites;
+	bool					isCAPNegotiation;
+};
+
+static const int idleClients = 50000;
+static const int idleScans = 200;
+static const int firstFakeFd = 100;
+
+TEST(BenchmarkTest, IdleScanLegacyLayout) {
+	std::vector<LegacyClient*> clients(firstFakeFd + idleClients, (LegacyClient*)NULL);
+	std::vector<pollfd> pollfds;
+	std::vector<std::string*> noise;
+	for (int i = 0; i < idleClients; ++i) {
+		LegacyClient* client = new LegacyClient;
+		client->fd = firstFakeFd + i;
+		client->nickname = "idle" + std::to_string(i);
+		client->username = client->nickname;
+		client->realname = "Idle Bench User";
+		client->hostname = "127.0.0.1";
+		client->connectionTime = time(NULL);
+		clients[client->fd] = client;
+		// Other allocations land between clients like they do in a running server
+		noise.push_back(new std::string(64, 'x'));
+		pollfd pfd;
+		pfd.fd = client->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		pollfds.push_back(pfd);
+	}
+
+	size_t expired = 0;
+	double start = nowMs();
+	for (int r = 0; r < idleScans; ++r) {
+		time_t now = time(NULL);
+		for (size_t i = 0; i < pollfds.size(); ++i) {
+			int fd = pollfds[i].fd;
+			LegacyClient* client = (fd >= 0 && static_cast<size_t>(fd) < clients.size()) ? clients[fd] : NULL;
+			if (client != NULL && now - client->connectionTime >= 3600)
+				expired++;
+		}
+	}
+	double elapsed = nowMs() - start;
+	std::cout << "[ bench ] idle scan, legacy layout (" << sizeof(LegacyClient) << " bytes, fd table): "
+		<< elapsed * 1000000.0 / ((double)idleScans * idleClients) << " ns/client" << std::endl;
+	EXPECT_EQ(expired, 0u);
+
+	for (size_t i = 0; i < clients.size(); ++i)
+		delete clients[i];
+	for (size_t i = 0; i < noise.size(); ++i)
+		delete noise[i];
+}
+
+TEST(BenchmarkTest, IdleScanHotTable) {
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+	std::vector<std::string*> noise;
+	for (int i = 0; i < idleClients; ++i) {
+		Client* client = new Client(firstFakeFd + i);
+		client->setNickname("idle" + std::to_string(i));
+		client->setUsername(client->getNickname().str());
+		client->setRealname("Idle Bench User");
+		client->setHostname("127.0.0.1");
+		manager.addClient(client);
+		noise.push_back(new std::string(64, 'x'));
+	}
+
+	size_t expired = 0;
+	double start = nowMs();
+	for (int r = 0; r < idleScans; ++r) {
+		time_t now = time(NULL);
+		for (size_t i = 0; i < pollfds.size(); ++i) {
+			Client* client = manager.getClientByFd(pollfds[i].fd);
+			if (client != NULL && client->getTimePassed(now) >= 3600)
+				expired++;
+		}
+	}
+	double elapsed = nowMs() - start;
+	std::cout << "[ bench ] idle scan, hot/cold split (" << sizeof(Client) << " + " << sizeof(ClientIdentity)
+		<< " bytes, fd table): " << elapsed * 1000000.0 / ((double)idleScans * idleClients) << " ns/client" << std::endl;
+	EXPECT_EQ(expired, 0u);
+	EXPECT_EQ(manager.getClientByFd(firstFakeFd + idleClients), (Client*)NULL);
+
+	// The fds are fake, free the clients directly instead of going through removeClient
+	for (std::map<int, Client*>::iterator it = clients_map.begin(); it != clients_map.end(); ++it)
+		delete it->second;
+	for (size_t i = 0; i < noise.size(); ++i)
+		delete noise[i];
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> NAMES <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+// Handlers turn a target into a ChannelName once (findChannel) and look it
+// up with that, so the hash is paid once per command, not once per compare.
+// At -O2 that makes lookups 20-30% faster than with std::string keys; this
+// -O0 build doesn't inline the compares and comes out a bit slower, so only
+// the timings are printed.
+TEST(BenchmarkTest, ChannelMapInlineNames) {
+	const int channels = 20000;
+	const int rounds = 20;
+	std::vector<std::string> names;
+	for (int i = 0; i < channels; ++i)
+		names.push_back("#project-discussion-" + std::to_string(i));
+	// Channels aren't created or looked up in name order, scatter both
+	for (int i = channels - 1; i > 0; --i)
+		std::swap(names[i], names[(i * 104729) % (i + 1)]);
+	std::map<std::string, int> heapKeys;
+	std::map<ChannelName, int> inlineKeys;
+	for (int i = 0; i < channels; ++i) {
+		heapKeys[names[i]] = i;
+		inlineKeys[names[i]] = i;
+	}
+	for (int i = channels - 1; i > 0; --i)
+		std::swap(names[i], names[(i * 7919) % (i + 1)]);
+
+	// Converted once per command at the parse boundary, outside the lookup
+	std::vector<ChannelName> keys(names.begin(), names.end());
+	long found = 0;
+	double start = nowMs();
+	for (int r = 0; r < rounds; ++r)
+		for (int i = 0; i < channels; ++i)
+			found += heapKeys.find(names[i])->second;
+	double heapMs = nowMs() - start;
+	start = nowMs();
+	for (int r = 0; r < rounds; ++r)
+		for (int i = 0; i < channels; ++i)
+			found -= inlineKeys.find(keys[i])->second;
+	double inlineMs = nowMs() - start;
+
+	double ops = (double)rounds * channels;
+	std::cout << "[ bench ] channel map lookup: std::string keys " << heapMs * 1000000.0 / ops
+		<< " ns, inline hashed keys " << inlineMs * 1000000.0 / ops << " ns (sizeof " << sizeof(ChannelName) << ")" << std::endl;
+	EXPECT_EQ(found, 0);
+}
+
+// Every JOIN sends the joiner the member list. Rebuilding it per joiner makes
+// a storm quadratic, the cached payload only gets the new token appended.
+TEST(BenchmarkTest, NamesJoinStorm) {
+	const int members = 10000;
+	const int joiners = 1000;
+	std::vector<Client*> clients;
+	for (int i = 0; i < members + joiners; ++i) {
+		Client* client = new Client(firstFakeFd + i);
+		client->setNickname("member" + std::to_string(i));
+		clients.push_back(client);
+	}
+	Channel* channel = new Channel("#storm");
+	for (int i = 0; i < members; ++i)
+		channel->addClient(clients[i]);
+	channel->addOperator(clients[0]);
+	channel->getNames(false);
+	size_t rebuiltBytes = 0;
+	size_t cachedBytes = 0;
+
+	// What JOIN did before the cache: walk every member for each joiner
+	double start = nowMs();
+	for (int i = members; i < members + joiners; ++i) {
+		channel->addClient(clients[i]);
+		NamesCache rebuilt;
+		rebuiltBytes += rebuilt.payload(channel->getMembers(), false).size();
+	}
+	double rebuildMs = nowMs() - start;
+	for (int i = members; i < members + joiners; ++i)
+		channel->removeClient(clients[i]);
+
+	unsigned long builds = channel->getNamesCache().builds();
+	start = nowMs();
+	for (int i = members; i < members + joiners; ++i) {
+		channel->addClient(clients[i]);
+		cachedBytes += channel->getNames(false).size();
+	}
+	double cachedMs = nowMs() - start;
+	std::cout << "[ bench ] NAMES for " << joiners << " joiners into " << members << " members: rebuilt "
+		<< rebuildMs * 1000.0 / joiners << " us/join, cached " << cachedMs * 1000.0 / joiners << " us/join" << std::endl;
+	EXPECT_EQ(cachedBytes, rebuiltBytes);
+	EXPECT_EQ(channel->getNamesCache().builds(), builds);
+
+	delete channel;
+	for (size_t i = 0; i < clients.size(); ++i)
+		delete clients[i];
+}
+
+// LIST >100 on a network with many small channels and a few big ones. The
+// naive way walks the channel map, reading every Channel; the directory
+// starts at the right place in its user count index.
+TEST(BenchmarkTest, ListDirectoryFilter) {
+	const int smallChannels = 50000;
+	const int bigChannels = 20;
+	const int bigMembers = 200;
+	const int rounds = 20;
+	// Joins check the client's own memberships, so spread the small channels over many lurkers
+	std::vector<Client*> crowd;
+	for (int i = 0; i < 1000; ++i) {
+		crowd.push_back(new Client(firstFakeFd + i));
+		crowd.back()->setNickname("crowd" + std::to_string(i));
+	}
+	ChannelDirectory directory;
+	std::map<ChannelName, Channel*> channels;
+	for (int i = 0; i < smallChannels + bigChannels; ++i) {
+		std::string name = "#channel-" + std::to_string(i);
+		Channel* channel = new Channel(name);
+		channel->listIn(&directory);
+		channel->setTopic("a topic that is about as long as most topics are");
+		if (i % (smallChannels / bigChannels) == 0 && i / (smallChannels / bigChannels) < bigChannels)
+			for (int m = 0; m < bigMembers; ++m)
+				channel->addClient(crowd[m]);
+		else
+			channel->addClient(crowd[i % crowd.size()]);
+		channels[channel->getName()] = channel;
+	}
+
+	size_t naiveFound = 0;
+	double start = nowMs();
+	for (int r = 0; r < rounds; ++r) {
+		std::string out;
+		for (std::map<ChannelName, Channel*>::iterator it = channels.begin(); it != channels.end(); ++it)
+			if (it->second->getClientCount() > 100) {
+				out += ":ft_irc.42.de 322 lurker " + it->second->getName() + " " + std::to_string(it->second->getClientCount())
+					+ " :" + it->second->getTopic() + "\r\n";
+				naiveFound++;
+			}
+	}
+	double naiveMs = nowMs() - start;
+	size_t indexedFound = 0;
+	start = nowMs();
+	for (int r = 0; r < rounds; ++r) {
+		ListQuery query;
+		query.parse(">100", time(NULL));
+		std::vector<Channel*> found;
+		while (directory.next(query, found, LIST_BATCH))
+			;
+		indexedFound += found.size();
+	}
+	double indexedMs = nowMs() - start;
+	std::cout << "[ bench ] LIST >100 over " << smallChannels + bigChannels << " channels: map walk "
+		<< naiveMs * 1000.0 / rounds << " us, directory index " << indexedMs * 1000.0 / rounds << " us" << std::endl;
+	EXPECT_EQ(naiveFound, (size_t)bigChannels * rounds);
+	EXPECT_EQ(indexedFound, naiveFound);
+
+	for (std::map<ChannelName, Channel*>::iterator it = channels.begin(); it != channels.end(); ++it)
+		delete it->second;
+	EXPECT_EQ(directory.size(), 0u);
+	for (size_t i = 0; i < crowd.size(); ++i)
+		delete crowd[i];
+}
+
+// WHO <mask> at 100k users, through the manager: the index walks only the
+// clients under the mask's literal prefix, a full scan tests everyone
+TEST(BenchmarkTest, WhoMaskAtHundredThousandUsers) {
+	const int users = 100000;
+	const int rounds = 50;
+	const int scanRounds = 5;
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	server_pfd.fd = -1;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+	int sv[2];
+	Client* asker = connectClient(pollfds, clients_map, sv, "asker");
+	manager.handleClientMessage(asker);
+	for (int i = 0; i < users; ++i) {
+		Client* client = new Client(firstFakeFd + i);
+		client->setNickname("user" + std::to_string(i));
+		client->setUsername("ident" + std::to_string(i % 5000));
+		client->setHostname("10." + std::to_string(i / 65536) + "." + std::to_string(i / 256 % 256) + "." + std::to_string(i % 256));
+		client->setRealname("Bench User");
+		client->setRegistered(true);
+		manager.addClient(client);
+	}
+	char drain[65536];
+	while (recv(sv[0], drain, sizeof(drain), MSG_DONTWAIT) > 0)
+		;
+
+	const char* masks[] = { "user4242*", "*@10.0.17.*", "ident42", "*!ident4999@*" };
+	for (size_t m = 0; m < sizeof(masks) / sizeof(masks[0]); ++m) {
+		std::string line = std::string("WHO ") + masks[m] + "\r\n";
+		size_t replies = 0;
+		double start = nowMs();
+		for (int r = 0; r < rounds; ++r) {
+			asker->addToBuffer(line);
+			manager.handleClientMessage(asker);
+			manager.resetArena();
+			ssize_t n;
+			while ((n = recv(sv[0], drain, sizeof(drain) - 1, MSG_DONTWAIT)) > 0) {
+				drain[n] = '\0';
+				for (char* p = strstr(drain, " 352 "); p; p = strstr(p + 1, " 352 "))
+					replies++;
+			}
+		}
+		double indexedMs = nowMs() - start;
+
+		WhoQuery query;
+		query.parse(masks[m], "");
+		size_t scanned = 0;
+		start = nowMs();
+		for (int r = 0; r < scanRounds; ++r)
+			for (std::map<int, Client*>::iterator it = clients_map.begin(); it != clients_map.end(); ++it)
+				if (it->second->isRegistered() && query.matches(*it->second))
+					scanned++;
+		double scanMs = nowMs() - start;
+		std::cout << "[ bench ] WHO " << masks[m] << " at " << users << " users: indexed "
+			<< indexedMs * 1000.0 / rounds << " us, full scan " << scanMs * 1000.0 / scanRounds << " us ("
+			<< replies / rounds << " replies)" << std::endl;
+		EXPECT_EQ(replies / rounds, scanned / scanRounds);
+	}
+
+	// The fds are fake, free the clients directly instead of going through removeClient
+	manager.removeClient(*asker);
+	close(sv[0]);
+	for (std::map<int, Client*>::iterator it = clients_map.begin(); it != clients_map.end(); ++it)
+		delete it->second;
+}
+
+// Nick changes of one watched client, with users other clients online.
+// The push goes to the watcher only, so the cost shouldn't follow users.
+static double monitorPushUs(int users, size_t& pushes) {
+	const int changes = 20000;
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	server_pfd.fd = -1;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+	int sv[2][2];
+	Client* clients[2];
+	const char* nicks[] = { "watcher", "flip" };
+	for (int i = 0; i < 2; ++i) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]);
+		fcntl(sv[i][0], F_SETFL, fcntl(sv[i][0], F_GETFL, 0) | O_NONBLOCK);
+		clients[i] = new Client(sv[i][1]);
+		manager.addClient(clients[i]);
+		std::string reg = "PASS pass\r\nNICK " + std::string(nicks[i]) + "\r\nUSER u 0 * :Bench User\r\n";
+		manager.handleClientInput(clients[i], reg.c_str(), reg.size());
+	}
+	Client* watcher = clients[0];
+	Client* flipper = clients[1];
+	int* sw = sv[0];
+	int* sf = sv[1];
+	for (int i = 0; i < users; ++i) {
+		Client* client = new Client(firstFakeFd + i);
+		client->setNickname("user" + std::to_string(i));
+		client->setUsername("user");
+		client->setHostname("10.0.0.1");
+		client->setRegistered(true);
+		manager.addClient(client);
+	}
+	std::string monitor = "MONITOR + flip,flop\r\n";
+	manager.handleClientInput(watcher, monitor.c_str(), monitor.size());
+	char drain[65536];
+	while (recv(sw[0], drain, sizeof(drain), MSG_DONTWAIT) > 0 || recv(sf[0], drain, sizeof(drain), MSG_DONTWAIT) > 0)
+		;
+	const std::string lines[2] = { "NICK flop\r\n", "NICK flip\r\n" };
+	pushes = 0;
+	double start = nowMs();
+	for (int i = 0; i < changes; ++i) {
+		manager.handleClientInput(flipper, lines[i % 2].c_str(), lines[i % 2].size());
+		manager.resetArena();
+		if (i % 64 == 63) {
+			ssize_t n;
+			while ((n = recv(sw[0], drain, sizeof(drain) - 1, MSG_DONTWAIT)) > 0) {
+				drain[n] = '\0';
+				for (char* p = strstr(drain, " 73"); p; p = strstr(p + 1, " 73"))
+					pushes++;
+			}
+		}
+	}
+	double us = (nowMs() - start) * 1000.0 / changes;
+	manager.removeClient(*watcher);
+	manager.removeClient(*flipper);
+	close(sw[0]);
+	close(sf[0]);
+	for (std::map<int, Client*>::iterator it = clients_map.begin(); it != clients_map.end(); ++it)
+		delete it->second;
+	return us;
+}
+
+TEST(BenchmarkTest, MonitorPushIndependentOfUsers) {
+	size_t fewPushes, manyPushes;
+	double few = monitorPushUs(1000, fewPushes);
+	double many = monitorPushUs(100000, manyPushes);
+	std::cout << "[ bench ] MONITOR push per nick change: " << few << " us at 1000 users, "
+		<< many << " us at 100000 users" << std::endl;
+	// Every change is an offline and an online line; the last partial batch isn't read
+	EXPECT_GE(fewPushes, 2u * 19968);
+	EXPECT_GE(manyPushes, 2u * 19968);
+}
+
+// 1000 bans of the usual kinds on a channel with traffic: what a JOIN check
+// and a member's PRIVMSG cost, against running every mask every time
+TEST(BenchmarkTest, ThousandBansOnBusyChannel) {
+	const int bans = 1000;
+	const int checks = 20000;
+	const int messages = 50000;
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+	int sv[2][2];
+	Client* clients[2];
+	const char* nicks[] = { "op", "talker" };
+	for (int i = 0; i < 2; ++i) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]);
+		fcntl(sv[i][0], F_SETFL, fcntl(sv[i][0], F_GETFL, 0) | O_NONBLOCK);
+		clients[i] = new Client(sv[i][1]);
+		clients[i]->setHostname(i ? "cust42.dsl.example.com" : "10.0.0.1");
+		manager.addClient(clients[i]);
+		std::string reg = "PASS pass\r\nNICK " + std::string(nicks[i]) + "\r\nUSER u 0 * :Bench User\r\nJOIN #busy\r\n";
+		manager.handleClientInput(clients[i], reg.c_str(), reg.size());
+	}
+	Channel* channel = manager.getChannel("#busy");
+	Client* talker = clients[1];
+	char drain[65536];
+	std::string line = "PRIVMSG #busy :an ordinary line of chat, about as long as most of them are\r\n";
+	auto privmsgNs = [&]() {
+		double begin = nowMs();
+		for (int i = 0; i < messages; ++i) {
+			manager.handleClientInput(talker, line.c_str(), line.size());
+			manager.resetArena();
+			if (i % 64 == 63)
+				while (recv(sv[0][0], drain, sizeof(drain), MSG_DONTWAIT) > 0)
+					;
+		}
+		return (nowMs() - begin) * 1e6 / messages;
+	};
+	double withoutBansNs = privmsgNs();
+	std::vector<std::string> masks;
+	for (int i = 0; i < bans; ++i) {
+		std::string n = std::to_string(i);
+		if (i % 20 == 0)
+			masks.push_back("spammer" + n + "!*@*");
+		else if (i % 3 == 0)
+			masks.push_back("*!*@" + std::to_string(i % 200 + 11) + "." + std::to_string(i / 200) + ".*");
+		else if (i % 3 == 1)
+			masks.push_back("*!*@*.isp" + n + ".net");
+		else
+			masks.push_back("*!*@host" + n + ".cable" + n + ".org");
+		std::string line = "MODE #busy +b " + masks.back() + "\r\n";
+		manager.handleClientInput(clients[0], line.c_str(), line.size());
+	}
+	ASSERT_EQ(channel->getMaskCount(), (size_t)bans);
+	while (recv(sv[0][0], drain, sizeof(drain), MSG_DONTWAIT) > 0 || recv(sv[1][0], drain, sizeof(drain), MSG_DONTWAIT) > 0)
+		;
+
+	// JOIN: the bucketed lists against every mask in turn
+	size_t banned = 0;
+	double start = nowMs();
+	for (int i = 0; i < checks; ++i)
+		banned += channel->isBanned(talker);
+	double bucketedUs = (nowMs() - start) * 1000.0 / checks;
+	std::string hostmask = talker->getNickname() + "!" + talker->getUsername() + "@" + talker->getHostname();
+	start = nowMs();
+	for (int i = 0; i < checks / 10; ++i)
+		for (size_t m = 0; m < masks.size(); ++m)
+			banned += maskMatch(masks[m], hostmask);
+	double linearUs = (nowMs() - start) * 1000.0 / (checks / 10);
+	EXPECT_EQ(banned, 0u);
+
+	// PRIVMSG: the member's verdict is kept until the lists change
+	double cachedNs = privmsgNs();
+	std::cout << "[ bench ] " << bans << " bans, JOIN check: bucketed " << bucketedUs << " us, every mask "
+		<< linearUs << " us; PRIVMSG " << cachedNs << " ns (" << withoutBansNs << " ns without bans)" << std::endl;
+
+	manager.removeClient(*clients[0]);
+	manager.removeClient(*clients[1]);
+	close(sv[0][0]);
+	close(sv[1][0]);
+}
+
+static bool backtrackingMatch(const char* mask, const char* text) {
+	if (!*mask)
+		return !*text;
+	if (*mask == '*')
+		return backtrackingMatch(mask + 1, text) || (*text && backtrackingMatch(mask, text + 1));
+	return *text && (*mask == '?' || ircFold(*mask) == ircFold(*text)) && backtrackingMatch(mask + 1, text + 1);
+}
+
+static double matchNsPerChar(const CompiledMask& compiled, const std::string& mask, const std::string& text, bool compiledEngine) {
+	const int rounds = 200;
+	size_t matched = 0;
+	double start = nowMs();
+	for (int i = 0; i < rounds; ++i)
+		matched += compiledEngine ? compiled.matches(text) : maskMatch(mask, text);
+	double ns = (nowMs() - start) * 1e6 / rounds / text.size();
+	EXPECT_EQ(matched, 0u);
+	return ns;
+}
+
+TEST(BenchmarkTest, AdversarialMasksStayLinear) {
+	// A long run after a star against a text that almost fits everywhere:
+	// backtracking to the star retries the run at every offset
+	std::string mask = "*" + std::string(32, 'a') + "b*";
+	CompiledMask compiled(mask);
+	std::string shortText(1024, 'a'), longText(16384, 'a');
+	double compiledShort = matchNsPerChar(compiled, mask, shortText, true);
+	double compiledLong = matchNsPerChar(compiled, mask, longText, true);
+	double greedyLong = matchNsPerChar(compiled, mask, longText, false);
+	// Same with a '?' in the run, the bit table case
+	std::string wild = "*" + std::string(20, 'a') + "?" + std::string(11, 'a') + "b*";
+	CompiledMask compiledWild(wild);
+	double wildLong = matchNsPerChar(compiledWild, wild, longText, true);
+	std::cout << "[ bench ] *a{32}b* on 16k chars: compiled " << compiledLong << " ns/char (" << compiledShort
+		<< " on 1k), greedy " << greedyLong << " ns/char; with a '?' " << wildLong << " ns/char" << std::endl;
+	EXPECT_LT(compiledLong, compiledShort * 4 + 1);
+
+	// Many stars: plain recursion tries every way of spreading the text over
+	// them, already slow on a nickname-sized text
+	std::string stars = "*a*a*a*a*a*a*b";
+	std::string text(28, 'a');
+	double start = nowMs();
+	EXPECT_FALSE(backtrackingMatch(stars.c_str(), text.c_str()));
+	double recursiveUs = (nowMs() - start) * 1000.0;
+	CompiledMask compiledStars(stars);
+	start = nowMs();
+	for (int i = 0; i < 10000; ++i)
+		EXPECT_FALSE(compiledStars.matches(text));
+	double compiledStarsUs = (nowMs() - start) * 1000.0 / 10000;
+	std::cout << "[ bench ] " << stars << " on 28 chars: recursive " << recursiveUs << " us, compiled "
+		<< compiledStarsUs << " us" << std::endl;
+
+	// Verdicts: a thousand masks that all have to run against a client,
+	// rechecked with and without the per identity cache
+	MaskList list;
+	for (int i = 0; i < 1000; ++i)
+		list.add("*spam" + std::to_string(i) + "*!*@*", "op", 0);
+	Client client(-1);
+	client.setNickname("regular");
+	client.setUsername("user");
+	client.setHostname("cust42.dsl.example.com");
+	std::string hostmask = "regular!user@cust42.dsl.example.com";
+	const int checks = 2000;
+	size_t banned = list.matches(client);
+	start = nowMs();
+	for (int i = 0; i < checks; ++i)
+		banned += list.matches(client);
+	double cachedUs = (nowMs() - start) * 1000.0 / checks;
+	start = nowMs();
+	for (int i = 0; i < checks; ++i)
+		banned += list.matches(hostmask, client.getHostname());
+	double uncachedUs = (nowMs() - start) * 1000.0 / checks;
+	EXPECT_EQ(banned, 0u);
+	std::cout << "[ bench ] 1000 unbucketed masks: cached verdicts " << cachedUs << " us, matched "
+		<< uncachedUs << " us" << std::endl;
+}
+
+// A bot announcing to 10 channels of 100 members, each member in 5 of them
+TEST(BenchmarkTest, MultiTargetPrivmsgDedup) {
+	const int members = 100;
+	const int channels = 10;
+	const int rounds = 200;
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+	std::vector<std::array<int, 2> > sv(members + 1);
+	std::vector<Client*> clients;
+	std::string all;
+	for (int c = 0; c < channels; ++c)
+		all += (c ? ",#chan" : "#chan") + std::to_string(c);
+	for (int i = 0; i <= members; ++i) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i].data());
+		fcntl(sv[i][0], F_SETFL, fcntl(sv[i][0], F_GETFL, 0) | O_NONBLOCK);
+		Client* client = new Client(sv[i][1]);
+		client->setHostname("10.0.0.1");
+		manager.addClient(client);
+		std::string joins;
+		for (int c = 0; c < channels; ++c)
+			if (i == 0 || (c + i) % 2 == 0)
+				joins += (joins.empty() ? "" : ",") + std::string("#chan") + std::to_string(c);
+		std::string reg = "PASS pass\r\nNICK n" + std::to_string(i) + "\r\nUSER u 0 * :Bench\r\nJOIN " + joins + "\r\n";
+		manager.handleClientInput(client, reg.c_str(), reg.size());
+		clients.push_back(client);
+	}
+	char buffer[65536];
+	auto drainAll = [&]() {
+		size_t bytes = 0;
+		for (int i = 0; i <= members; ++i) {
+			ssize_t n;
+			while ((n = recv(sv[i][0], buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+				if (i)
+					bytes += n;
+		}
+		return bytes;
+	};
+	drainAll();
+	auto run = [&](const std::vector<std::string>& lines, size_t& bytes) {
+		double spent = 0;
+		bytes = 0;
+		for (int r = 0; r < rounds; ++r) {
+			double start = nowMs();
+			for (size_t l = 0; l < lines.size(); ++l)
+				manager.handleClientInput(clients[0], lines[l].c_str(), lines[l].size());
+			manager.resetArena();
+			spent += nowMs() - start;
+			bytes += drainAll();
+		}
+		return spent * 1000.0 / rounds;
+	};
+	std::vector<std::string> separate;
+	for (int c = 0; c < channels; ++c)
+		separate.push_back("PRIVMSG #chan" + std::to_string(c) + " :announcement for everybody in all of these channels\r\n");
+	std::vector<std::string> combined(1, "PRIVMSG " + all + " :announcement for everybody in all of these channels\r\n");
+	size_t separateBytes, combinedBytes;
+	double separateUs = run(separate, separateBytes);
+	double combinedUs = run(combined, combinedBytes);
+	std::cout << "[ bench ] " << channels << " channels x " << members / 2 << " members: one per channel "
+		<< separateUs << " us, " << separateBytes / rounds << " bytes; multi-target " << combinedUs << " us, "
+		<< combinedBytes / rounds << " bytes" << std::endl;
+	EXPECT_EQ(combinedBytes * 5, separateBytes);
+
+	for (int i = 0; i <= members; ++i) {
+		manager.removeClient(*clients[i]);
+		close(sv[i][0]);
+	}
+}
+
+// A user in 50 channels, with the same 50 peers in all of them, goes away
+TEST(BenchmarkTest, QuitFanoutToSharedPeers) {
+	const int peers = 50;
+	const int channels = 50;
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+	std::string all;
+	for (int c = 0; c < channels; ++c)
+		all += (c ? ",#room" : "#room") + std::to_string(c);
+	std::vector<std::array<int, 2> > sv(peers + 2);
+	std::vector<Client*> clients;
+	char buffer[65536];
+	for (int i = 0; i < peers + 2; ++i) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i].data());
+		fcntl(sv[i][0], F_SETFL, fcntl(sv[i][0], F_GETFL, 0) | O_NONBLOCK);
+		Client* client = new Client(sv[i][1]);
+		client->setHostname("10.0.0.1");
+		manager.addClient(client);
+		std::string reg = "PASS pass\r\nNICK q" + std::to_string(i) + "\r\nUSER u 0 * :Bench\r\nJOIN " + all + "\r\n";
+		manager.handleClientInput(client, reg.c_str(), reg.size());
+		clients.push_back(client);
+		// The joins are a lot of lines, keep them out of the send queues
+		for (int j = 0; j <= i; ++j)
+			while (recv(sv[j][0], buffer, sizeof(buffer), MSG_DONTWAIT) > 0 || clients[j]->hasPendingOutput())
+				clients[j]->flushSendQueue();
+	}
+	auto drainPeers = [&]() {
+		size_t bytes = 0;
+		for (int i = 0; i < peers; ++i) {
+			ssize_t n;
+			while ((n = recv(sv[i][0], buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+				bytes += n;
+		}
+		return bytes;
+	};
+
+	// What a broadcast per channel would do
+	Client* first = clients[peers];
+	std::string quit = ":" + first->getNickname().str() + "!u@10.0.0.1 QUIT :Connection closed\r\n";
+	double start = nowMs();
+	for (size_t m = 0; m < first->getMemberships().size(); ++m)
+		first->getMemberships()[m]->channel->broadcast(quit, first);
+	double perChannelUs = (nowMs() - start) * 1000.0;
+	size_t perChannelBytes = drainPeers();
+
+	start = nowMs();
+	manager.removeClient(*clients[peers + 1]);
+	double dedupUs = (nowMs() - start) * 1000.0;
+	size_t dedupBytes = drainPeers();
+	std::cout << "[ bench ] QUIT from " << channels << " channels to " << peers << " shared peers: per channel "
+		<< perChannelUs << " us, " << perChannelBytes << " bytes; deduplicated " << dedupUs << " us (whole removal), "
+		<< dedupBytes << " bytes" << std::endl;
+	EXPECT_EQ(perChannelBytes, dedupBytes * channels);
+
+	for (int i = 0; i <= peers; ++i) {
+		manager.removeClient(*clients[i]);
+		close(sv[i][0]);
+	}
+	close(sv[peers + 1][0]);
+}
+
+// A user in 200 channels with the same 20 peers in each changes nick
+TEST(BenchmarkTest, NickChangeInTwoHundredChannels) {
+	const int peers = 20;
+	const int channels = 200;
+	const int renames = 200;
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+	std::string all;
+	for (int c = 0; c < channels; ++c)
+		all += (c ? ",#hall" : "#hall") + std::to_string(c);
+	std::vector<std::array<int, 2> > sv(peers + 1);
+	std::vector<Client*> clients;
+	char buffer[65536];
+	for (int i = 0; i <= peers; ++i) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i].data());
+		fcntl(sv[i][0], F_SETFL, fcntl(sv[i][0], F_GETFL, 0) | O_NONBLOCK);
+		Client* client = new Client(sv[i][1]);
+		client->setHostname("10.0.0.1");
+		manager.addClient(client);
+		std::string reg = "PASS pass\r\nNICK p" + std::to_string(i) + "\r\nUSER u 0 * :Bench\r\nJOIN " + all + "\r\n";
+		manager.handleClientInput(client, reg.c_str(), reg.size());
+		clients.push_back(client);
+		for (int j = 0; j <= i; ++j)
+			while (recv(sv[j][0], buffer, sizeof(buffer), MSG_DONTWAIT) > 0 || clients[j]->hasPendingOutput())
+				clients[j]->flushSendQueue();
+	}
+	Client* renamer = clients[peers];
+	size_t bytes = 0;
+	double spent = 0;
+	for (int r = 0; r < renames; ++r) {
+		std::string line = "NICK renamed" + std::to_string(r) + "\r\n";
+		double start = nowMs();
+		manager.handleClientInput(renamer, line.c_str(), line.size());
+		manager.resetArena();
+		spent += nowMs() - start;
+		for (int i = 0; i < peers; ++i) {
+			ssize_t n;
+			while ((n = recv(sv[i][0], buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+				bytes += n;
+		}
+	}
+	std::cout << "[ bench ] NICK in " << channels << " channels, " << peers << " shared peers: "
+		<< spent * 1000.0 / renames << " us, " << bytes / renames / peers << " bytes per peer" << std::endl;
+	EXPECT_LT(bytes / renames / peers, 64u);
+
+	for (int i = 0; i <= peers; ++i) {
+		manager.removeClient(*clients[i]);
+		close(sv[i][0]);
+	}
+}
+
+// One client pastes 2000 lines into a channel of 50 in a single read. Without
+// flood control every line fans out; with it a burst does and the rest is
+// held back until the client is over FLOOD_EXCESS_BYTES and dropped.
+static double floodIntoChannel(bool floodControl, size_t& relayed) {
+	const int members = 50;
+	const int lines = 2000;
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+	std::vector<std::array<int, 2> > sv(members);
+	std::vector<Client*> clients;
+	char buffer[65536];
+	for (int i = 0; i < members; ++i) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i].data());
+		fcntl(sv[i][0], F_SETFL, fcntl(sv[i][0], F_GETFL, 0) | O_NONBLOCK);
+		Client* client = new Client(sv[i][1]);
+		manager.addClient(client);
+		std::string reg = "PASS pass\r\nNICK m" + std::to_string(i) + "\r\nUSER u 0 * :Bench\r\nJOIN #flood\r\n";
+		manager.handleClientInput(client, reg.c_str(), reg.size());
+		clients.push_back(client);
+		for (int j = 0; j <= i; ++j)
+			while (recv(sv[j][0], buffer, sizeof(buffer), MSG_DONTWAIT) > 0 || clients[j]->hasPendingOutput())
+				clients[j]->flushSendQueue();
+	}
+	manager.setFloodControl(floodControl);
+	std::string paste;
+	for (int l = 0; l < lines; ++l)
+		paste += "PRIVMSG #flood :pasted line " + std::to_string(l) + "\r\n";
+	Client* flooder = clients[0];
+	double start = nowMs();
+	manager.handleClientInput(flooder, paste.c_str(), paste.size());
+	double spent = nowMs() - start;
+	std::string received;
+	ssize_t n;
+	while ((n = recv(sv[1][0], buffer, sizeof(buffer), MSG_DONTWAIT)) > 0 || clients[1]->hasPendingOutput()) {
+		if (n > 0)
+			received.append(buffer, n);
+		clients[1]->flushSendQueue();
+	}
+	relayed = 0;
+	for (size_t at = received.find(" PRIVMSG "); at != std::string::npos; at = received.find(" PRIVMSG ", at + 1))
+		++relayed;
+	for (int i = 0; i < members; ++i) {
+		manager.removeClient(*clients[i]);
+		close(sv[i][0]);
+	}
+	return spent;
+}
+
+TEST(BenchmarkTest, FloodControlCapsPasteFanout) {
+	FloodControl flood;
+	const int commands = 1000000;
+	const std::string line = "PRIVMSG #a,#b :hello there\r\n";
+	unsigned long long now = 0;
+	int admitted = 0;
+	double start = nowMs();
+	for (int i = 0; i < commands; ++i) {
+		now += 1500;
+		admitted += flood.admit(now, FloodControl::costOf(line.c_str(), line.size()));
+	}
+	double perCommand = (nowMs() - start) * 1000000.0 / commands;
+	EXPECT_EQ(admitted, commands);
+
+	size_t relayedOff, relayedOn;
+	double off = floodIntoChannel(false, relayedOff);
+	double on = floodIntoChannel(true, relayedOn);
+	std::cout << "[ bench ] flood control charge: " << perCommand << " ns per command" << std::endl;
+	std::cout << "[ bench ] 2000 line paste into 50 members: " << off << " ms, " << relayedOff
+		<< " relayed without flood control; " << on << " ms, " << relayedOn << " relayed with it" << std::endl;
+	EXPECT_LE(relayedOn, 12u);
+	EXPECT_LT(on, off);
+}
+
+// 100k hosts from all over the address space connected at once, then one more
+// admit and release per accept. The walk is bounded by the 32 bits of the key.
+TEST(BenchmarkTest, ConnectionLimiterWithHundredThousandHosts) {
+	const int hosts = 100000;
+	const int checks = 1000000;
+	ConnectionLimiter limiter;
+	limiter.setLimits(CONNECTIONS_PER_HOST, CONNECTIONS_PER_NETWORK, CONNECT_NETWORK_PREFIX, CONNECT_THROTTLE_MS);
+	unsigned long long now = 1000000;
+	unsigned int seed = 1;
+	std::vector<unsigned int> addresses;
+	for (int i = 0; i < hosts; ++i) {
+		seed = seed * 1103515245u + 12345u;
+		unsigned int address = seed ^ (seed >> 15) * 2654435761u;
+		if (limiter.admit(address, now) == ConnectionLimiter::ADMITTED)
+			addresses.push_back(address);
+	}
+	now += 10 * CONNECT_BURST_MS;
+	size_t admitted = 0;
+	double start = nowMs();
+	for (int i = 0; i < checks; ++i) {
+		unsigned int address = addresses[i % addresses.size()] ^ 1;
+		if (limiter.admit(address, now) == ConnectionLimiter::ADMITTED) {
+			++admitted;
+			limiter.release(address, now);
+		}
+		now += 1;
+	}
+	double perCheck = (nowMs() - start) * 1000000.0 / checks;
+	std::cout << "[ bench ] connection admission with " << addresses.size() << " hosts: " << perCheck
+		<< " ns per admit+release, " << limiter.nodes() << " trie nodes ("
+		<< limiter.nodes() * 32 / 1024 << " KiB)" << std::endl;
+	EXPECT_GT(admitted, 0u);
+	// Idle hosts stay until their clock catches up, one attempt a ms here
+	EXPECT_LE(limiter.nodes(), 2 * (addresses.size() + CONNECT_THROTTLE_MS + CONNECT_EXPIRE_PER_ADMIT));
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> MESSAGE TAGS <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+static double relayNs(ChannelsClientsManager& manager, Client* sender, const std::string& line, int readers[2]) {
+	const int messages = 50000;
+	char buffer[65536];
+	double start = nowMs();
+	for (int i = 0; i < messages; ++i) {
+		manager.handleClientInput(sender, line.c_str(), line.size());
+		manager.resetArena();
+		for (int r = 0; r < 2; ++r)
+			while (recv(readers[r], buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+				;
+	}
+	return (nowMs() - start) * 1000000.0 / messages;
+}
+
+TEST(BenchmarkTest, TaggedPrivmsgCost) {
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+	int sv[3][2];
+	Client* clients[3];
+	const char* nicks[] = { "sender", "plain", "tagged" };
+	for (int i = 0; i < 3; ++i) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]);
+		fcntl(sv[i][0], F_SETFL, fcntl(sv[i][0], F_GETFL, 0) | O_NONBLOCK);
+		clients[i] = new Client(sv[i][1]);
+		manager.addClient(clients[i]);
+		std::string reg = "PASS pass\r\nNICK " + std::string(nicks[i]) + "\r\nUSER u 0 * :Bench User\r\nJOIN #bench\r\n";
+		manager.handleClientInput(clients[i], reg.c_str(), reg.size());
+	}
+	clients[2]->setCaps(CAP_MESSAGE_TAGS);
+	int readers[2] = { sv[1][0], sv[2][0] };
+
+	std::string text = "PRIVMSG #bench :an ordinary line of chat, about as long as most of them are\r\n";
+	std::string serverTags = "@time=2026-01-01T12:00:00.000Z;msgid=8f2a9c;label=42 " + text;
+	std::string clientTags = "@+draft/reply=8f2a9c;+typing=done;msgid=8f2a9d " + text;
+	relayNs(manager, clients[0], text, readers); // warm up
+	double untaggedNs = relayNs(manager, clients[0], text, readers);
+	double droppedNs = relayNs(manager, clients[0], serverTags, readers);
+	double relayedNs = relayNs(manager, clients[0], clientTags, readers);
+	std::cout << "[ bench ] channel PRIVMSG: untagged " << untaggedNs << " ns, tags dropped "
+		<< droppedNs << " ns, client tags relayed " << relayedNs << " ns" << std::endl;
+
+	for (int i = 0; i < 3; ++i) {
+		manager.removeClient(*clients[i]);
+		close(sv[i][0]);
+	}
+	EXPECT_EQ(manager.getClientsSize(), 0);
+}
+
+// Same channel, same message: everyone without capabilities, then members
+// spread over every combination of them. Recipients share the serialized lines.
+TEST(BenchmarkTest, CapabilityFanout) {
+	const int members = 100;
+	const int messages = 2000;
+	std::string pass = "pass";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	ChannelsClientsManager manager(clients_map, pass, pollfds);
+	std::vector<int> readers;
+	std::vector<Client*> clients;
+	for (int i = 0; i < members; ++i) {
+		int sv[2];
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+		fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+		Client* client = new Client(sv[1]);
+		manager.addClient(client);
+		std::string reg = "PASS pass\r\nNICK fan" + std::to_string(i) + "\r\nUSER u 0 * :Bench User\r\nJOIN #fanout\r\n";
+		manager.handleClientInput(client, reg.c_str(), reg.size());
+		readers.push_back(sv[0]);
+		clients.push_back(client);
+	}
+	std::string line = "@+draft/reply=8f2a9c PRIVMSG #fanout :an ordinary line of chat, about as long as most of them are\r\n";
+	char buffer[65536];
+	double results[2];
+	for (int pass = 0; pass < 2; ++pass) {
+		for (int i = 0; i < members; ++i)
+			clients[i]->setCaps(pass ? i % (CAP_ALL + 1) : 0);
+		double start = nowMs();
+		for (int m = 0; m < messages; ++m) {
+			manager.handleClientInput(clients[0], line.c_str(), line.size());
+			manager.resetArena();
+			if (m % 50 == 49)
+				for (int i = 0; i < members; ++i)
+					while (recv(readers[i], buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+						;
+		}
+		results[pass] = (nowMs() - start) * 1000000.0 / ((double)messages * members);
+	}
+	std::cout << "[ bench ] fan-out to " << members << " members: no capabilities " << results[0]
+		<< " ns/recipient, all capability combinations " << results[1] << " ns/recipient" << std::endl;
+
+	for (int i = 0; i < members; ++i) {
+		manager.removeClient(*clients[i]);
+		close(readers[i]);
+	}
+	EXPECT_EQ(manager.getClientsSize(), 0);
+}
+
+// What server-time would cost done naively: strftime for every recipient
+TEST(BenchmarkTest, ServerTimeFormatting) {
+	const int recipients = 1000000;
+	char naive[64];
+	size_t bytes = 0;
+	double start = nowMs();
+	for (int i = 0; i < recipients; ++i) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		struct tm utc;
+		gmtime_r(&now.tv_sec, &utc);
+		size_t size = strftime(naive, sizeof(naive), "time=%Y-%m-%dT%H:%M:%S", &utc);
+		size += snprintf(naive + size, sizeof(naive) - size, ".%03dZ", (int)(now.tv_usec / 1000));
+		bytes += size;
+	}
+	double naiveMs = nowMs() - start;
+
+	unsigned long formats = ServerTime::formatCount();
+	start = nowMs();
+	for (int i = 0; i < recipients; ++i)
+		bytes -= ServerTime::tag().size;
+	double cachedMs = nowMs() - start;
+	formats = ServerTime::formatCount() - formats;
+
+	std::cout << "[ bench ] server-time per recipient: strftime " << naiveMs * 1000000.0 / recipients
+		<< " ns, cached " << cachedMs * 1000000.0 / recipients << " ns (" << formats << " strftime calls)" << std::endl;
+	EXPECT_EQ(bytes, 0u);
+	EXPECT_LE(formats, (unsigned long)(cachedMs / 1000) + 2); // once per second at most
+}
+
+// What storing one channel message costs the event loop: the history log
+// only queues it, versus writing and syncing it right there
+TEST(BenchmarkTest, HistoryLogAppendCost) {
+	char path[] = "/tmp/ircserv_bench_XXXXXX";
+	ASSERT_NE(mkdtemp(path), (char*)NULL);
+	std::string dir = path;
+	std::string line = "alice!alice@127.0.0.1 PRIVMSG #bench :the quick brown fox jumps over the lazy dog\r\n";
+	const int syncMessages = 500;
+	std::string syncPath = dir + "/sync.log";
+	int fd = open(syncPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	ASSERT_GE(fd, 0);
+	double start = nowMs();
+	for (int i = 0; i < syncMessages; ++i) {
+		ASSERT_EQ(write(fd, line.data(), line.size()), (ssize_t)line.size());
+		fdatasync(fd);
+	}
+	double syncMs = nowMs() - start;
+	close(fd);
+
+	const int messages = 50000;
+	double queuedMs;
+	double flushMs;
+	{
+		HistoryLog log(dir, HISTORY_LOG_BYTES, 0);
+		ChannelHistory history;
+		start = nowMs();
+		for (int i = 0; i < messages; ++i)
+			log.append(ChannelName("#bench"), history.append(1000 + i, StringSpan(line.data(), line.size())));
+		queuedMs = nowMs() - start;
+		log.flush();
+		flushMs = nowMs() - start;
+
+		HistoryLogView view;
+		HistoryRange range;
+		range.byTime = true;
+		range.low = 1000 + messages / 2;
+		range.limit = 50;
+		std::vector<HistoryRecord> records;
+		start = nowMs();
+		for (int i = 0; i < 1000; ++i) {
+			records.clear();
+			log.select(ChannelName("#bench"), range, records, view);
+		}
+		std::cout << "[ bench ] 50-message range query in " << messages << " logged: "
+			<< (nowMs() - start) * 1000.0 / 1000 << " us" << std::endl;
+		EXPECT_EQ(records.size(), 50u);
+	}
+	std::cout << "[ bench ] history store on the loop: write+fdatasync " << syncMs * 1000.0 / syncMessages
+		<< " us/message, queued for the writer " << queuedMs * 1000.0 / messages << " us/message ("
+		<< flushMs << " ms until all " << messages << " were on disk)" << std::endl;
+	std::system(("rm -rf " + dir).c_str());
+}
+
+int main(int argc, char **argv) {
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
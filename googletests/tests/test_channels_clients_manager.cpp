@@ -4,11 +4,20 @@
 #include "../../inc/IRCCommand.hpp"
 #include "../../inc/ChannelsClientsManager.hpp"
 #include "../../inc/Reply.hpp"
+#include "../../inc/MemoryBudget.hpp"
+#include "../../inc/HistoryLog.hpp"
+#include "../../inc/HotRestart.hpp"
+#include "../../inc/MaskList.hpp"
+#include "../../inc/ConnectionLimiter.hpp"
 #include <sys/socket.h>
 #include <unistd.h>
 #include <array>
 #include <fcntl.h>
 #include <errno.h>
+#include <sstream>
+#include <cstring>
+#include <dirent.h>
+#include <algorithm>
 
 void setSocketPair(int sv[2]) {
     if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
@@ -865,6 +874,1919 @@ TEST(ChannelsClientsManagerTest, AllModesTest) {
 	EXPECT_EQ(manager.getChannel("#modechannel")->isInviteOnly(), false);
 }
 
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> HOT RESTART <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+TEST(ChannelsClientsManagerTest, HotRestartStateRoundTrip) {
+	int sv[2];
+	int sv2[2];
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+
+	Client* op = returnReadyToConnectClient(pollfds, clients_map, sv, correctPass, "opuser", "opuser");
+	Client* user = returnReadyToConnectClient(pollfds, clients_map, sv2, correctPass, "regular", "regular");
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	manager.handleClientMessage(op);
+	manager.handleClientMessage(user);
+	op->addToBuffer("JOIN #keep\r\nMODE #keep +k secret\r\nTOPIC #keep :survives upgrades\r\n");
+	manager.handleClientMessage(op);
+	user->addToBuffer("MONITOR + opuser,ghost\r\nJOIN #keep secret\r\nPRIVMSG #keep :half a li");
+	manager.handleClientMessage(user);
+	op->addToBuffer("MODE #keep +v regular\r\nPRIVMSG #keep :remember me\r\n");
+	manager.handleClientMessage(op);
+	const HistoryBlock* said = manager.getChannel("#keep")->getHistory().at(0);
+	// Back-date the channel so the restored times can't be the restore time
+	manager.getChannel("#keep")->setCreated(1000000);
+	manager.getChannel("#keep")->setTopic("survives upgrades", 2000000);
+	// A slow reader: the socket is full and the rest waits in the send queue
+	const std::string filler = std::string(4000, 'x') + "\r\n";
+	size_t fillers = 0;
+	while (!user->hasPendingOutput()) {
+		user->sendMessage(filler);
+		fillers++;
+	}
+	user->sendMessage("PING :tail\r\n");
+
+	std::ostringstream oss;
+	std::vector<int> fds;
+	manager.saveState(oss, fds);
+	ASSERT_EQ(fds.size(), 2);
+
+	// The new process sees different fd numbers for the same sockets
+	std::vector<int> newFds;
+	newFds.push_back(-1); // listening socket slot
+	for (size_t i = 0; i < fds.size(); ++i)
+		newFds.push_back(dup(fds[i]));
+	std::vector<pollfd> pollfds2;
+	std::map<int, Client*> clients_map2;
+	pollfds2.push_back(server_pfd);
+	ChannelsClientsManager restored(clients_map2, correctPass, pollfds2);
+	std::istringstream iss(oss.str());
+	ASSERT_TRUE(restored.restoreState(iss, newFds, 1));
+
+	EXPECT_EQ(restored.getClientsSize(), 2);
+	EXPECT_EQ(restored.getPollSize(), 3);
+	Channel* ch = restored.getChannel("#keep");
+	ASSERT_TRUE(ch != NULL);
+	EXPECT_EQ(ch->getKey(), "secret");
+	EXPECT_EQ(ch->getTopic(), "survives upgrades");
+	EXPECT_EQ(ch->getCreated(), 1000000);
+	EXPECT_EQ(ch->getTopicTime(), 2000000);
+	EXPECT_EQ(ch->getClients().size(), 2);
+	ASSERT_EQ(ch->getOperators().size(), 1);
+	EXPECT_EQ(ch->getOperators()[0]->getNickname(), "opuser");
+	Client* restoredUser = clients_map2[newFds[2]];
+	ASSERT_TRUE(restoredUser != NULL);
+	EXPECT_TRUE(restoredUser->isRegistered());
+	EXPECT_EQ(restoredUser->getBuffer(), "PRIVMSG #keep :half a li");
+	EXPECT_TRUE(ch->isVoiced(restoredUser));
+	EXPECT_EQ(ch->getNames(false), "@opuser +regular");
+	// History comes along even without a log to reload it from
+	ASSERT_EQ(ch->getHistory().size(), 1u);
+	EXPECT_EQ(ch->getHistory().at(0)->id, said->id);
+	EXPECT_EQ(ch->getHistory().at(0)->time, said->time);
+	EXPECT_EQ(ch->getHistory().at(0)->line().str(), said->line().str());
+	// Every byte that was queued comes out of the new process, in order
+	char buffer[8192];
+	std::string received;
+	ssize_t n;
+	while ((n = recv_nonblocking(sv2[0], buffer, sizeof(buffer) - 1)) > 0 || restoredUser->hasPendingOutput()) {
+		if (n > 0)
+			received.append(buffer, n);
+		restoredUser->flushSendQueue();
+	}
+	EXPECT_EQ(static_cast<size_t>(std::count(received.begin(), received.end(), 'x')), fillers * 4000);
+	ASSERT_GE(received.size(), 12u);
+	EXPECT_EQ(received.substr(received.size() - 12), "PING :tail\r\n");
+	restoredUser->clearBuffer();
+	restoredUser->addToBuffer("MONITOR L\r\n");
+	restored.handleClientMessage(restoredUser);
+	recv_nonblocking(sv2[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), ":ft_irc.42.de 732 regular :opuser,ghost\r\n"
+		":ft_irc.42.de 733 regular :End of MONITOR list\r\n");
+	// LIST filters on the old times too
+	restoredUser->addToBuffer("LIST C>60\r\n");
+	restored.handleClientMessage(restoredUser);
+	memset(buffer, 0, sizeof(buffer));
+	recv_nonblocking(sv2[0], buffer, sizeof(buffer) - 1);
+	EXPECT_NE(std::string(buffer).find(" 322 regular #keep "), std::string::npos) << buffer;
+
+	for (size_t i = 1; i < newFds.size(); ++i)
+		close(newFds[i]);
+	close(sv[0]);
+	close(sv[1]);
+	close(sv2[0]);
+	close(sv2[1]);
+}
+
+// A state from a binary with another record layout is refused, not misread
+TEST(ChannelsClientsManagerTest, HotRestartRejectsOtherLayouts) {
+	int sv[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	std::string state;
+	std::vector<int> fds;
+	ASSERT_TRUE(HotRestart::sendState(sv[0], "0 0 ", fds));
+	EXPECT_TRUE(HotRestart::receiveState(sv[1], state, fds));
+	EXPECT_EQ(state, "0 0 ");
+	const char* older[] = { "IRCUPG1", "IRCUPG2", "IRCUPG3", "IRCUPG4" };
+	for (size_t i = 0; i < sizeof(older) / sizeof(older[0]); ++i) {
+		std::string old = std::string(older[i]) + " 4 0\n0 0 ";
+		ASSERT_EQ(write(sv[0], old.c_str(), old.size()), static_cast<ssize_t>(old.size()));
+		EXPECT_FALSE(HotRestart::receiveState(sv[1], state, fds)) << older[i];
+		// what the refused header announced is still in the socket
+		char rest[4];
+		ASSERT_EQ(read(sv[1], rest, sizeof(rest)), 4);
+	}
+	close(sv[0]);
+	close(sv[1]);
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> MEMBERSHIP / PART <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+TEST(ChannelsClientsManagerTest, PartNotifiesAndUnlinks) {
+	int sv[2];
+	int sv2[2];
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+
+	Client* stays = returnReadyToConnectClient(pollfds, clients_map, sv, correctPass, "stays", "stays");
+	Client* leaves = returnReadyToConnectClient(pollfds, clients_map, sv2, correctPass, "leaves", "leaves");
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	manager.handleClientMessage(stays);
+	manager.handleClientMessage(leaves);
+	stays->addToBuffer("JOIN #a,#b\r\n");
+	manager.handleClientMessage(stays);
+	leaves->addToBuffer("JOIN #a,#b,#c\r\n");
+	manager.handleClientMessage(leaves);
+	ASSERT_EQ(leaves->getMemberships().size(), 3);
+	ASSERT_EQ(manager.getChannelsSize(), 3);
+	char buffer[4096] = {0};
+	recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1);
+	recv_nonblocking(sv2[0], buffer, sizeof(buffer) - 1);
+
+	leaves->addToBuffer("PART #a,#c,#nope :bye\r\n");
+	manager.handleClientMessage(leaves);
+	ssize_t n = recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1);
+	EXPECT_GT(n, 0);
+	EXPECT_EQ(std::string(buffer), ":leaves!leaves@ PART #a :bye\r\n");
+	n = recv_nonblocking(sv2[0], buffer, sizeof(buffer) - 1);
+	EXPECT_NE(std::string(buffer).find("PART #c :bye"), std::string::npos);
+	EXPECT_NE(std::string(buffer).find("403"), std::string::npos);
+
+	EXPECT_FALSE(manager.getChannel("#a")->isClientInChannel(leaves));
+	EXPECT_TRUE(manager.getChannel("#b")->isClientInChannel(leaves));
+	EXPECT_TRUE(manager.getChannel("#c") == NULL); // emptied channels go away
+	ASSERT_EQ(leaves->getMemberships().size(), 1);
+	EXPECT_EQ(leaves->getMemberships()[0]->channel->getName(), "#b");
+	EXPECT_EQ(leaves->getMemberships()[0]->clientSlot, 0);
+
+	close(sv[0]);
+	close(sv2[0]);
+}
+
+TEST(ChannelsClientsManagerTest, RemoveClientUnlinksAllMemberships) {
+	int sv[2];
+	int sv2[2];
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+
+	Client* stays = returnReadyToConnectClient(pollfds, clients_map, sv, correctPass, "stays", "stays");
+	Client* quits = returnReadyToConnectClient(pollfds, clients_map, sv2, correctPass, "quits", "quits");
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	manager.handleClientMessage(stays);
+	manager.handleClientMessage(quits);
+	size_t nodesBefore = Membership::poolStats().live;
+	stays->addToBuffer("JOIN #one,#two,#three\r\n");
+	manager.handleClientMessage(stays);
+	quits->addToBuffer("JOIN #one,#two,#three,#four\r\n");
+	manager.handleClientMessage(quits);
+	stays->addToBuffer("INVITE quits #two\r\n");
+	manager.handleClientMessage(stays);
+	EXPECT_EQ(Membership::poolStats().live, nodesBefore + 7);
+
+	manager.removeClient(*quits);
+	EXPECT_EQ(Membership::poolStats().live, nodesBefore + 3);
+	EXPECT_EQ(manager.getChannelsSize(), 3);
+	for (size_t i = 0; i < stays->getMemberships().size(); ++i) {
+		Channel* ch = stays->getMemberships()[i]->channel;
+		EXPECT_EQ(ch->getClientCount(), 1);
+		EXPECT_EQ(ch->getMembers()[0]->client, stays);
+		EXPECT_TRUE(ch->isOperator(stays));
+		EXPECT_TRUE(ch->getInvited().empty());
+	}
+
+	close(sv[0]);
+	close(sv[1]);
+	close(sv2[0]);
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> NAMES <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+TEST(ChannelsClientsManagerTest, NamesAreCaseInsensitiveAndBounded) {
+	NickName nick("Foo[bar]");
+	EXPECT_EQ(nick, "foo{bar}");
+	EXPECT_EQ(nick.hash(), NickName("FOO{BAR}").hash());
+	EXPECT_STREQ(nick.c_str(), "Foo[bar]"); // shown as typed
+	EXPECT_NE(nick, "foo{bar");
+	std::string tooLong(NICKLEN + 1, 'n');
+	EXPECT_TRUE(NickName(tooLong).truncated());
+	EXPECT_NE(NickName(tooLong), tooLong.substr(0, NICKLEN));
+
+	int sv[2];
+	int sv2[2];
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	Client* first = returnReadyToConnectClient(pollfds, clients_map, sv, correctPass, "Alice", "alice");
+	Client* second = returnReadyToConnectClient(pollfds, clients_map, sv2, correctPass, "ALICE", "alice2");
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	manager.handleClientMessage(first);
+	manager.handleClientMessage(second);
+	char buffer[4096];
+	recv_nonblocking(sv2[0], buffer, sizeof(buffer) - 1);
+	EXPECT_NE(std::string(buffer).find(" 433 "), std::string::npos);
+	EXPECT_FALSE(second->isRegistered());
+
+	second->addToBuffer("NICK " + tooLong + "\r\n");
+	manager.handleClientMessage(second);
+	recv_nonblocking(sv2[0], buffer, sizeof(buffer) - 1);
+	EXPECT_NE(std::string(buffer).find(" 432 "), std::string::npos);
+	second->addToBuffer("NICK bob\r\n");
+	manager.handleClientMessage(second);
+	EXPECT_TRUE(second->isRegistered());
+
+	// Own nick in another case is not a collision
+	first->addToBuffer("NICK aLiCe\r\n");
+	manager.handleClientMessage(first);
+	EXPECT_STREQ(first->getNickname().c_str(), "aLiCe");
+
+	first->addToBuffer("JOIN #Room\r\n");
+	manager.handleClientMessage(first);
+	second->addToBuffer("JOIN #ROOM,#" + std::string(CHANNELLEN, 'c') + "\r\n");
+	manager.handleClientMessage(second);
+	EXPECT_EQ(manager.getChannelsSize(), 1);
+	ASSERT_NE(manager.getChannel("#room"), (Channel*)NULL);
+	EXPECT_EQ(manager.getChannel("#room")->getClientCount(), 2u);
+	EXPECT_STREQ(manager.getChannel("#room")->getName().c_str(), "#Room");
+
+	close(sv[0]);
+	close(sv[1]);
+	close(sv2[0]);
+	close(sv2[1]);
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> INPUT <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+TEST(ChannelsClientsManagerTest, InputSplitAcrossReads) {
+	int sv[2];
+	setSocketPair(sv);
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	Client* client = new Client(sv[1]);
+	manager.addClient(client);
+	size_t inputBefore = MemoryBudget::used(MEM_INPUT);
+
+	// Reads cut lines anywhere, including between \r and \n
+	const char* reads[] = {
+		"PASS correct_password\r\nNI",
+		"CK splitter\r",
+		"\nUSER splitter 0 * :Split Real Name That Is Long Enough To Leave Inline Storage\r\nJOIN #sp",
+		"lit\r\n"
+	};
+	for (size_t i = 0; i < 4; ++i)
+		manager.handleClientInput(client, reads[i], strlen(reads[i]));
+
+	EXPECT_TRUE(client->isRegistered());
+	EXPECT_EQ(client->getNickname(), "splitter");
+	ASSERT_NE(manager.getChannel("#split"), (Channel*)NULL);
+	EXPECT_TRUE(manager.getChannel("#split")->isClientInChannel(client));
+	// Nothing left over: no tail, no heap behind it
+	EXPECT_TRUE(client->getBuffer().empty());
+	EXPECT_EQ(client->getBuffer().capacity(), std::string().capacity());
+	EXPECT_EQ(MemoryBudget::used(MEM_INPUT), inputBefore);
+
+	// A long unfinished line is kept until its end arrives
+	std::string partial = "PRIVMSG #split :" + std::string(100, 'a');
+	manager.handleClientInput(client, partial.c_str(), partial.size());
+	EXPECT_EQ(client->getBuffer(), partial);
+	EXPECT_GT(MemoryBudget::used(MEM_INPUT), inputBefore);
+	manager.handleClientInput(client, "\r\n", 2);
+	EXPECT_TRUE(client->getBuffer().empty());
+	EXPECT_EQ(MemoryBudget::used(MEM_INPUT), inputBefore);
+
+	manager.removeClient(*client);
+	close(sv[0]);
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> MESSAGE TAGS <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+static Client* registerTagsClient(ChannelsClientsManager& manager, int sv[2], const std::string& nick, bool tags) {
+	setSocketPair(sv);
+	Client* client = new Client(sv[1]);
+	manager.addClient(client);
+	std::string input = "PASS correct_password\r\nNICK " + nick + "\r\nUSER " + nick + " 0 * :" + nick + "\r\n";
+	if (tags)
+		input = "CAP REQ :message-tags\r\n" + input;
+	input += "CAP END\r\nJOIN #tags\r\n";
+	manager.handleClientInput(client, input.c_str(), input.size());
+	char buffer[4096];
+	while (recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1) > 0)
+		;
+	return client;
+}
+
+TEST(ChannelsClientsManagerTest, MessageTagsAreSplitOffAndRelayed) {
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int sa[2], sb[2], sc[2];
+	Client* alice = registerTagsClient(manager, sa, "alice", true);
+	Client* bob = registerTagsClient(manager, sb, "bob", true);
+	registerTagsClient(manager, sc, "carol", false);
+	EXPECT_TRUE(alice->hasCap(CAP_MESSAGE_TAGS));
+	ASSERT_NE(manager.getChannel("#tags"), (Channel*)NULL);
+	EXPECT_EQ(manager.getChannel("#tags")->getClientCount(), 3u);
+	char buffer[4096];
+	while (recv_nonblocking(sa[0], buffer, sizeof(buffer) - 1) > 0
+		|| recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1) > 0)
+		; // join notices of the later clients
+
+	// Server tags are dropped, client-only tags go out byte for byte (after our own msgid)
+	std::string line = "@+typing=active;msgid=abc;+draft/reply=a\\sb PRIVMSG #tags :hi there\r\n";
+	manager.handleClientInput(alice, line.c_str(), line.size());
+	recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer).substr(0, 7), "@msgid=");
+	EXPECT_EQ(std::string(buffer).substr(7 + HISTORY_MSGID_SIZE), ";+typing=active;+draft/reply=a\\sb alice!alice@ PRIVMSG #tags :hi there\r\n");
+	recv_nonblocking(sc[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), "alice!alice@ PRIVMSG #tags :hi there\r\n");
+
+	// TAGMSG only reaches clients that asked for tags
+	line = "@+typing=paused TAGMSG #tags\r\n";
+	manager.handleClientInput(alice, line.c_str(), line.size());
+	recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), "@+typing=paused alice!alice@ TAGMSG #tags\r\n");
+	EXPECT_EQ(recv_nonblocking(sc[0], buffer, sizeof(buffer) - 1), 0);
+
+	// Tags in front of any other command no longer hide it
+	line = "@label=1 JOIN #other\r\n@label=2 PRIVMSG bob :direct\r\n";
+	manager.handleClientInput(alice, line.c_str(), line.size());
+	EXPECT_NE(manager.getChannel("#other"), (Channel*)NULL);
+	recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), "alice!alice@ PRIVMSG bob :direct\r\n");
+
+	line = "CAP REQ :message-tags sasl\r\n";
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+	EXPECT_NE(std::string(buffer).find("CAP bob NAK :message-tags sasl"), std::string::npos);
+	EXPECT_TRUE(bob->hasCap(CAP_MESSAGE_TAGS));
+
+	close(sa[0]);
+	close(sb[0]);
+	close(sc[0]);
+}
+
+TEST(ChannelsClientsManagerTest, CapabilityNegotiation) {
+	int sv[2];
+	setSocketPair(sv);
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	Client* client = new Client(sv[1]);
+	manager.addClient(client);
+	char buffer[4096];
+
+	std::string input = "CAP LS 302\r\nPASS correct_password\r\nNICK capper\r\nUSER capper 0 * :Cap\r\n";
+	manager.handleClientInput(client, input.c_str(), input.size());
+	recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), ":ft_irc.42.de CAP * LS :server-time message-tags echo-message multi-prefix batch\r\n");
+	EXPECT_FALSE(client->isRegistered()); // held until CAP END
+
+	input = "CAP REQ :echo-message chathistory\r\n";
+	manager.handleClientInput(client, input.c_str(), input.size());
+	recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), ":ft_irc.42.de CAP capper NAK :echo-message chathistory\r\n");
+	EXPECT_EQ(client->getCaps(), 0u);
+
+	input = "CAP REQ :server-time echo-message batch\r\nCAP REQ -batch\r\nCAP LIST\r\nCAP END\r\n";
+	manager.handleClientInput(client, input.c_str(), input.size());
+	EXPECT_TRUE(client->isRegistered());
+	EXPECT_EQ(client->getCaps(), static_cast<unsigned int>(CAP_SERVER_TIME | CAP_ECHO_MESSAGE));
+	recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1);
+	std::string replies(buffer);
+	EXPECT_NE(replies.find("CAP capper ACK :server-time echo-message batch\r\n"), std::string::npos);
+	EXPECT_NE(replies.find("CAP capper ACK :-batch\r\n"), std::string::npos);
+	EXPECT_NE(replies.find("CAP capper LIST :server-time echo-message\r\n"), std::string::npos);
+	EXPECT_NE(replies.find(" 001 capper "), std::string::npos);
+
+	// echo-message: our own message comes back, with server-time it carries a timestamp
+	input = "JOIN #caps\r\nPRIVMSG #caps :echo me\r\n";
+	manager.handleClientInput(client, input.c_str(), input.size());
+	recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1);
+	std::string echoed(buffer);
+	size_t at = echoed.rfind("@time=");
+	ASSERT_NE(at, std::string::npos);
+	EXPECT_EQ(echoed.substr(at + 29, 2), "Z ");
+	EXPECT_EQ(echoed.substr(at + 31), "capper!capper@ PRIVMSG #caps :echo me\r\n");
+
+	// Lines the server writes itself are stamped too
+	EXPECT_EQ(echoed.find("@time="), 0u);
+	EXPECT_NE(echoed.find(" Welcome to #caps channel!\r\n@time="), std::string::npos) << echoed;
+
+	input = "CAP FOO\r\n";
+	manager.handleClientInput(client, input.c_str(), input.size());
+	recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1);
+	EXPECT_NE(std::string(buffer).find(" 410 capper FOO "), std::string::npos);
+	EXPECT_EQ(buffer[0], '@');
+
+	manager.removeClient(*client);
+	close(sv[0]);
+}
+
+TEST(ChannelsClientsManagerTest, ServerTimeIsFormattedOncePerSecond) {
+	struct timeval now;
+	now.tv_sec = 1767225600; // 2026-01-01 00:00:00 UTC
+	now.tv_usec = 7000;
+	unsigned long formats = ServerTime::formatCount();
+	EXPECT_EQ(ServerTime::tag(now).str(), "time=2026-01-01T00:00:00.007Z");
+	now.tv_usec = 999999;
+	EXPECT_EQ(ServerTime::tag(now).str(), "time=2026-01-01T00:00:00.999Z");
+	now.tv_usec = 123456;
+	EXPECT_EQ(ServerTime::tag(now).str(), "time=2026-01-01T00:00:00.123Z");
+	EXPECT_EQ(ServerTime::formatCount(), formats + 1);
+	now.tv_sec += 86399;
+	EXPECT_EQ(ServerTime::tag(now).str(), "time=2026-01-01T23:59:59.123Z");
+	EXPECT_EQ(ServerTime::formatCount(), formats + 2);
+	EXPECT_EQ(ServerTime::tag().size, (size_t)SERVER_TIME_TAG_SIZE);
+}
+
+TEST(ChannelsClientsManagerTest, OutgoingMessageBuildsOneLinePerCapabilitySet) {
+	Arena arena;
+	std::string body = "nick!u@h PRIVMSG #c :hi\r\n";
+	std::string tags = "+typing=active";
+	OutgoingMessage message(arena, StringSpan(body.data(), body.size()), StringSpan(tags.data(), tags.size()));
+	// Plain clients get the body itself, no copy
+	EXPECT_EQ(message.lineFor(0).data, body.data());
+	EXPECT_EQ(message.lineFor(CAP_ECHO_MESSAGE | CAP_BATCH).data, body.data());
+	EXPECT_EQ(message.lineFor(CAP_MESSAGE_TAGS).str(), "@+typing=active " + body);
+	const char* first = message.lineFor(CAP_MESSAGE_TAGS | CAP_SERVER_TIME).data;
+	EXPECT_EQ(message.lineFor(CAP_MESSAGE_TAGS | CAP_SERVER_TIME | CAP_MULTI_PREFIX).data, first);
+	EXPECT_EQ(message.lineFor(CAP_SERVER_TIME).str().substr(0, 6), "@time=");
+	EXPECT_EQ(message.lineFor(CAP_MESSAGE_TAGS | CAP_SERVER_TIME).str().find(";+typing=active " + body), 30u);
+	EXPECT_EQ(message.variantsBuilt(), 4u);
+
+	OutgoingMessage tagOnly(arena, StringSpan(body.data(), body.size()), StringSpan(tags.data(), tags.size()), true);
+	EXPECT_TRUE(tagOnly.lineFor(CAP_SERVER_TIME).empty());
+	EXPECT_FALSE(tagOnly.lineFor(CAP_MESSAGE_TAGS).empty());
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> HISTORY <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+TEST(ChannelsClientsManagerTest, HistoryRingIsBoundedAndSearchable) {
+	ChannelHistory::setLimits(4, 1000, HISTORY_MEMORY);
+	size_t historyBefore = MemoryBudget::used(MEM_HISTORY);
+	{
+		ChannelHistory history;
+		std::string line = "n!u@h PRIVMSG #c :message\r\n";
+		unsigned long long firstId = 0;
+		for (int i = 0; i < 6; ++i) {
+			HistoryBlock* block = history.append(1000 + i * 10, StringSpan(line.data(), line.size()));
+			if (i == 0)
+				firstId = block->id;
+		}
+		ASSERT_EQ(history.size(), 4u); // depth
+		EXPECT_EQ(history.at(0)->time, 1020u);
+		EXPECT_EQ(history.findId(firstId), history.size()); // evicted
+		EXPECT_EQ(history.findId(firstId + 3), 1u);
+		EXPECT_EQ(history.lowerBound(1030), 1u);
+		EXPECT_EQ(history.upperBound(1030), 2u);
+		EXPECT_EQ(history.lowerBound(1035), 2u);
+		EXPECT_EQ(history.upperBound(5000), 4u);
+
+		// Replays keep their block alive after the ring moved on
+		HistoryBlock* held = history.at(0);
+		held->retain();
+		std::string big(950, 'x');
+		history.append(2000, StringSpan(big.data(), big.size()));
+		EXPECT_EQ(history.size(), 2u); // bytes
+		EXPECT_EQ(held->line().str(), line);
+		held->release();
+
+		char id[HISTORY_MSGID_SIZE];
+		unsigned long long parsed;
+		history.at(1)->formatId(id);
+		ASSERT_TRUE(HistoryBlock::parseId(std::string(id, HISTORY_MSGID_SIZE), parsed));
+		EXPECT_EQ(parsed, history.at(1)->id);
+		EXPECT_FALSE(HistoryBlock::parseId("xyz", parsed));
+		EXPECT_GT(MemoryBudget::used(MEM_HISTORY), historyBefore);
+	}
+	EXPECT_EQ(MemoryBudget::used(MEM_HISTORY), historyBefore);
+	ChannelHistory::setLimits(HISTORY_DEPTH, HISTORY_CHANNEL_BYTES, HISTORY_MEMORY);
+
+	unsigned long long ms;
+	ASSERT_TRUE(ServerTime::parse("2026-01-01T00:00:01.250Z", ms));
+	EXPECT_EQ(ms, 1767225601250ull);
+	ASSERT_TRUE(ServerTime::parse("2026-01-01T00:00:01Z", ms));
+	EXPECT_EQ(ms, 1767225601000ull);
+	EXPECT_FALSE(ServerTime::parse("yesterday", ms));
+}
+
+TEST(ChannelsClientsManagerTest, HistoryMemoryEvictsOldestAcrossChannels) {
+	std::string line(100, 'x');
+	StringSpan span(line.data(), line.size());
+	ChannelHistory::setLimits(HISTORY_DEPTH, HISTORY_CHANNEL_BYTES, ChannelHistory::totalBytes() + 100 * line.size());
+	{
+		ChannelHistory idle, busy;
+		for (int i = 0; i < 80; ++i)
+			idle.append(1000, span);
+		// Replays and the log writer holding blocks don't make the rings drop more
+		HistoryBlock* held = idle.at(0);
+		held->retain();
+		for (int i = 0; i < 500; ++i)
+			busy.append(2000, span);
+		EXPECT_EQ(idle.size(), (size_t)HISTORY_FLOOR);
+		EXPECT_EQ(busy.size(), 100u - HISTORY_FLOOR);
+		EXPECT_EQ(held->line().str(), line);
+		held->release();
+
+		// The oldest line goes, whichever channel has it
+		idle.append(3000, span);
+		EXPECT_EQ(idle.size(), (size_t)HISTORY_FLOOR + 1);
+		EXPECT_EQ(busy.size(), 100u - HISTORY_FLOOR - 1);
+		busy.append(4000, span); // which is idle's again, it's above the floor
+		EXPECT_EQ(idle.size(), (size_t)HISTORY_FLOOR);
+		EXPECT_EQ(busy.size(), 100u - HISTORY_FLOOR);
+	}
+	ChannelHistory::setLimits(HISTORY_DEPTH, HISTORY_CHANNEL_BYTES, HISTORY_MEMORY);
+}
+
+TEST(ChannelsClientsManagerTest, ChathistoryReplaysChannelMessages) {
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int sa[2], sb[2];
+	Client* alice = registerTagsClient(manager, sa, "alice", false);
+	Client* bob = registerTagsClient(manager, sb, "bob", false);
+	for (int i = 0; i < 10; ++i) {
+		std::string line = "PRIVMSG #tags :message " + std::to_string(i) + "\r\n";
+		manager.handleClientInput(alice, line.c_str(), line.size());
+	}
+	char buffer[8192];
+	while (recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1) > 0)
+		;
+	ChannelHistory& history = manager.getChannel("#tags")->getHistory();
+	ASSERT_EQ(history.size(), 10u);
+	char id[HISTORY_MSGID_SIZE];
+	std::string msgid5 = "msgid=" + std::string(id, history.at(5)->formatId(id));
+
+	// Plain client: just the stored lines, oldest first
+	std::string query = "CHATHISTORY LATEST #tags * 3\r\n";
+	manager.handleClientInput(bob, query.c_str(), query.size());
+	recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), "alice!alice@ PRIVMSG #tags :message 7\r\nalice!alice@ PRIVMSG #tags :message 8\r\n"
+		"alice!alice@ PRIVMSG #tags :message 9\r\n");
+
+	query = "CHATHISTORY BEFORE #tags " + msgid5 + " 2\r\n";
+	manager.handleClientInput(bob, query.c_str(), query.size());
+	recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), "alice!alice@ PRIVMSG #tags :message 3\r\nalice!alice@ PRIVMSG #tags :message 4\r\n");
+
+	query = "CHATHISTORY AFTER #tags " + msgid5 + " 2\r\n";
+	manager.handleClientInput(bob, query.c_str(), query.size());
+	recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), "alice!alice@ PRIVMSG #tags :message 6\r\nalice!alice@ PRIVMSG #tags :message 7\r\n");
+
+	query = "CHATHISTORY AROUND #tags " + msgid5 + " 3\r\n";
+	manager.handleClientInput(bob, query.c_str(), query.size());
+	recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), "alice!alice@ PRIVMSG #tags :message 4\r\nalice!alice@ PRIVMSG #tags :message 5\r\n"
+		"alice!alice@ PRIVMSG #tags :message 6\r\n");
+
+	// By timestamp, with batch and tags: the original time and msgid come back
+	bob->setCaps(CAP_BATCH | CAP_SERVER_TIME | CAP_MESSAGE_TAGS);
+	std::string after = ServerTime::tag(history.at(8)->time).str().substr(5);
+	query = "CHATHISTORY AFTER #tags timestamp=" + after + " 5\r\n";
+	manager.handleClientInput(bob, query.c_str(), query.size());
+	recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+	std::string replay(buffer);
+	size_t start = replay.find(" BATCH +");
+	ASSERT_NE(start, std::string::npos);
+	std::string reference = replay.substr(start + 8, replay.find(' ', start + 8) - start - 8);
+	std::string expected = "@batch=" + reference + ";" + ServerTime::tag(history.at(9)->time).str() + ";msgid="
+		+ std::string(id, history.at(9)->formatId(id)) + " alice!alice@ PRIVMSG #tags :message 9\r\n";
+	if (history.at(8)->time == history.at(9)->time)
+		expected.clear(); // same millisecond, nothing is after it
+	EXPECT_NE(replay.find("chathistory #tags\r\n" + expected), std::string::npos) << replay;
+	EXPECT_NE(replay.find(" BATCH -" + reference + "\r\n"), std::string::npos);
+
+	query = "CHATHISTORY LATEST #nowhere * 5\r\nCHATHISTORY LATEST #tags bogus 5\r\n";
+	manager.handleClientInput(bob, query.c_str(), query.size());
+	recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+	EXPECT_NE(std::string(buffer).find("FAIL CHATHISTORY INVALID_TARGET LATEST #nowhere"), std::string::npos);
+	EXPECT_NE(std::string(buffer).find("FAIL CHATHISTORY INVALID_PARAMS LATEST bogus"), std::string::npos);
+
+	close(sa[0]);
+	close(sb[0]);
+}
+
+static std::string makeLogDir() {
+	char path[] = "/tmp/ircserv_history_XXXXXX";
+	return mkdtemp(path) ? std::string(path) : std::string();
+}
+
+static std::vector<HistoryRecord> selectLog(HistoryLog& log, const char* channel, const HistoryRange& range, HistoryLogView& view) {
+	std::vector<HistoryRecord> records;
+	log.select(ChannelName(channel), range, records, view);
+	return records;
+}
+
+TEST(ChannelsClientsManagerTest, HistoryLogIsSegmentedIndexedAndRetained) {
+	std::string dir = makeLogDir();
+	ASSERT_FALSE(dir.empty());
+	std::vector<unsigned long long> ids;
+	{
+		HistoryLog log(dir, HISTORY_LOG_BYTES, 0, 2048);
+		ChannelHistory history;
+		for (int i = 0; i < 300; ++i) {
+			std::string line = "n!u@h PRIVMSG #Log :message " + std::to_string(i) + "\r\n";
+			HistoryBlock* block = history.append(1000 + i, StringSpan(line.data(), line.size()));
+			ids.push_back(block->id);
+			log.append(ChannelName("#Log"), block);
+		}
+		log.flush();
+		EXPECT_GT(log.segmentCount(ChannelName("#log")), 5u);
+
+		HistoryLogView view;
+		HistoryRange range;
+		range.limit = 3;
+		range.fromEnd = true;
+		std::vector<HistoryRecord> records = selectLog(log, "#LOG", range, view);
+		ASSERT_EQ(records.size(), 3u);
+		EXPECT_EQ(records[0].line.str(), "n!u@h PRIVMSG #Log :message 297\r\n");
+		EXPECT_EQ(records[2].id, ids[299]);
+
+		range.byTime = true;
+		range.high = 1199;
+		records = selectLog(log, "#log", range, view);
+		ASSERT_EQ(records.size(), 3u);
+		EXPECT_EQ(records[0].time, 1197u);
+		EXPECT_EQ(records[2].time, 1199u);
+
+		range.fromEnd = false;
+		range.low = 1100;
+		records = selectLog(log, "#log", range, view);
+		ASSERT_EQ(records.size(), 3u);
+		EXPECT_EQ(records[0].id, ids[100]);
+		EXPECT_EQ(records[2].line.str(), "n!u@h PRIVMSG #Log :message 102\r\n");
+
+		// The ring's part is left out
+		HistoryRange older;
+		older.idLimit = ids[250];
+		older.limit = 2;
+		older.fromEnd = true;
+		records = selectLog(log, "#log", older, view);
+		ASSERT_EQ(records.size(), 2u);
+		EXPECT_EQ(records[1].id, ids[249]);
+		EXPECT_TRUE(selectLog(log, "#other", older, view).empty());
+	}
+
+	// Reopened: everything is back, a torn last record is cut off
+	std::string last = dir + "/" + HistoryLog::channelDir(ChannelName("#Log"));
+	{
+		HistoryLog log(dir, HISTORY_LOG_BYTES, 0, 2048);
+		HistoryLogView view;
+		HistoryRange all;
+		all.limit = 1000;
+		ASSERT_EQ(selectLog(log, "#log", all, view).size(), 300u);
+	}
+	std::string newest;
+	{
+		HistoryLog log(dir, HISTORY_LOG_BYTES, 0, 2048);
+		HistoryLogView view;
+		HistoryRange latest;
+		latest.limit = 1;
+		latest.fromEnd = true;
+		newest = selectLog(log, "#log", latest, view)[0].line.str();
+	}
+	DIR* segments = opendir(last.c_str());
+	ASSERT_NE(segments, (DIR*)NULL);
+	std::string newestFile;
+	while (struct dirent* entry = readdir(segments)) {
+		if (entry->d_name[0] != '.' && std::string(entry->d_name) > newestFile)
+			newestFile = entry->d_name;
+	}
+	closedir(segments);
+	int fd = open((last + "/" + newestFile).c_str(), O_WRONLY | O_APPEND);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(write(fd, "\x40\0\0\0garbage", 11), 11);
+	close(fd);
+	{
+		HistoryLog log(dir, 4096, 0, 2048);
+		HistoryLogView view;
+		HistoryRange all;
+		all.limit = 1000;
+		std::vector<HistoryRecord> records = selectLog(log, "#log", all, view);
+		ASSERT_FALSE(records.empty());
+		EXPECT_EQ(records.back().line.str(), newest);
+		// Size retention dropped the oldest segments
+		EXPECT_LE(log.segmentCount(ChannelName("#log")), 3u);
+		EXPECT_GT(records.front().id, ids[0]);
+	}
+	{
+		HistoryLog log(dir, HISTORY_LOG_BYTES, 24 * 60 * 60 * 1000ULL, 2048);
+		EXPECT_EQ(log.segmentCount(ChannelName("#log")), 0u); // all from 1970
+	}
+
+	// A mostly expired segment keeps only its live tail
+	{
+		HistoryLog log(dir, HISTORY_LOG_BYTES, 0);
+		ChannelHistory history;
+		unsigned long long now = ServerTime::now();
+		for (int i = 0; i < 30; ++i) {
+			std::string line = "n!u@h PRIVMSG #aged :message " + std::to_string(i) + "\r\n";
+			HistoryBlock* block = history.append(i < 20 ? now - 2 * 24 * 60 * 60 * 1000ULL : now, StringSpan(line.data(), line.size()));
+			log.append(ChannelName("#aged"), block);
+		}
+		log.flush();
+	}
+	{
+		HistoryLog log(dir, HISTORY_LOG_BYTES, 24 * 60 * 60 * 1000ULL);
+		HistoryLogView view;
+		HistoryRange all;
+		all.limit = 100;
+		std::vector<HistoryRecord> records = selectLog(log, "#aged", all, view);
+		ASSERT_EQ(records.size(), 10u);
+		EXPECT_EQ(records[0].line.str(), "n!u@h PRIVMSG #aged :message 20\r\n");
+		EXPECT_EQ(log.segmentCount(ChannelName("#aged")), 1u);
+	}
+	std::system(("rm -rf " + dir).c_str());
+}
+
+TEST(ChannelsClientsManagerTest, ChathistoryReadsThroughToTheLog) {
+	ChannelHistory::setLimits(4, HISTORY_CHANNEL_BYTES, HISTORY_MEMORY);
+	std::string dir = makeLogDir();
+	ASSERT_FALSE(dir.empty());
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	char buffer[8192];
+	std::vector<unsigned long long> ids;
+	{
+		HistoryLog log(dir, HISTORY_LOG_BYTES, 0);
+		ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+		manager.setHistoryLog(&log);
+		int sa[2], sb[2];
+		Client* alice = registerTagsClient(manager, sa, "alice", false);
+		Client* bob = registerTagsClient(manager, sb, "bob", false);
+		for (int i = 0; i < 10; ++i) {
+			std::string line = "PRIVMSG #tags :message " + std::to_string(i) + "\r\n";
+			manager.handleClientInput(alice, line.c_str(), line.size());
+		}
+		log.flush();
+		while (recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1) > 0)
+			;
+		EXPECT_EQ(manager.getChannel("#tags")->getHistory().size(), 4u);
+
+		// Six from the log, the last two from the ring
+		std::string query = "CHATHISTORY LATEST #tags * 8\r\n";
+		manager.handleClientInput(bob, query.c_str(), query.size());
+		recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+		std::string expected;
+		for (int i = 2; i < 10; ++i)
+			expected += "alice!alice@ PRIVMSG #tags :message " + std::to_string(i) + "\r\n";
+		EXPECT_EQ(std::string(buffer), expected);
+
+		HistoryLogView view;
+		HistoryRange all;
+		all.limit = 10;
+		std::vector<HistoryRecord> records = selectLog(log, "#tags", all, view);
+		ASSERT_EQ(records.size(), 10u);
+		for (size_t i = 0; i < records.size(); ++i)
+			ids.push_back(records[i].id);
+		close(sa[0]);
+		close(sb[0]);
+	}
+
+	// "Restart": a new manager over the same directory
+	HistoryLog log(dir, HISTORY_LOG_BYTES, 0);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	manager.setHistoryLog(&log);
+	int sc[2];
+	Client* carol = registerTagsClient(manager, sc, "carol", false);
+	ChannelHistory& history = manager.getChannel("#tags")->getHistory();
+	ASSERT_EQ(history.size(), 4u);
+	EXPECT_EQ(history.at(0)->id, ids[6]);
+
+	std::string query = "CHATHISTORY LATEST #tags * 5\r\n";
+	manager.handleClientInput(carol, query.c_str(), query.size());
+	recv_nonblocking(sc[0], buffer, sizeof(buffer) - 1);
+	std::string expected;
+	for (int i = 5; i < 10; ++i)
+		expected += "alice!alice@ PRIVMSG #tags :message " + std::to_string(i) + "\r\n";
+	EXPECT_EQ(std::string(buffer), expected);
+
+	char id[HISTORY_MSGID_SIZE];
+	query = "CHATHISTORY AROUND #tags msgid=" + std::string(id, HistoryBlock::formatId(ids[2], id)) + " 3\r\n";
+	manager.handleClientInput(carol, query.c_str(), query.size());
+	recv_nonblocking(sc[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), "alice!alice@ PRIVMSG #tags :message 1\r\nalice!alice@ PRIVMSG #tags :message 2\r\n"
+		"alice!alice@ PRIVMSG #tags :message 3\r\n");
+
+	query = "CHATHISTORY AFTER #tags msgid=" + std::string(id, HistoryBlock::formatId(ids[4], id)) + " 3\r\n";
+	manager.handleClientInput(carol, query.c_str(), query.size());
+	recv_nonblocking(sc[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), "alice!alice@ PRIVMSG #tags :message 5\r\nalice!alice@ PRIVMSG #tags :message 6\r\n"
+		"alice!alice@ PRIVMSG #tags :message 7\r\n");
+	close(sc[0]);
+	ChannelHistory::setLimits(HISTORY_DEPTH, HISTORY_CHANNEL_BYTES, HISTORY_MEMORY);
+	std::system(("rm -rf " + dir).c_str());
+}
+
+// >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> MEMORY LIMITS <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+// NAMES payload from the 353 lines waiting on fd, every line checked against the 512 limit
+static std::string namesFrom(int fd, const std::string& nick, const std::string& channel, size_t* lines = NULL) {
+	std::string reply;
+	char buffer[8192];
+	while (recv_nonblocking(fd, buffer, sizeof(buffer) - 1) > 0)
+		reply += buffer;
+	std::string header = ":ft_irc.42.de 353 " + nick + " = " + channel + " :";
+	std::string names;
+	size_t count = 0;
+	size_t start = 0;
+	while (start < reply.size()) {
+		size_t end = reply.find("\r\n", start) + 2;
+		std::string line = reply.substr(start, end - start);
+		start = end;
+		EXPECT_LE(line.size(), 512u);
+		if (line.compare(0, 18, ":ft_irc.42.de 366 ") == 0) {
+			EXPECT_EQ(line, ":ft_irc.42.de 366 " + nick + " " + channel + " :End of /NAMES list.\r\n");
+		}
+		if (line.compare(0, header.size(), header) != 0)
+			continue; // mode changes and parts seen in the meantime
+		names += (names.empty() ? "" : " ") + line.substr(header.size(), line.size() - header.size() - 2);
+		count++;
+	}
+	if (lines)
+		*lines = count;
+	return names;
+}
+
+TEST(ChannelsClientsManagerTest, NamesAreChunkedAndKeptInStep) {
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int sa[2], sb[2];
+	registerTagsClient(manager, sa, "alice", false);
+	Client* bob = registerTagsClient(manager, sb, "bob", false);
+	Channel* channel = manager.getChannel("#tags");
+	ASSERT_NE(channel, (Channel*)NULL);
+	std::string expected = "@alice bob";
+	int sv[20][2];
+	for (int i = 0; i < 20; ++i) {
+		std::string nick = std::string(28, 'n') + char('a' + i / 26) + char('a' + i % 26);
+		registerTagsClient(manager, sv[i], nick, false);
+		expected += " " + nick;
+	}
+	EXPECT_EQ(channel->getNamesCache().builds(), 1u); // the first JOIN, every other one appended
+
+	// 22 members with 30 char nicks don't fit one line, nothing is cut inside a nick
+	std::string line = "NAMES #tags\r\n";
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	size_t lines;
+	EXPECT_EQ(namesFrom(sb[0], "bob", "#tags", &lines), expected);
+	EXPECT_EQ(lines, 2u);
+
+	// Modes, nick changes and parts patch the cached payload
+	Client* alice = manager.getClientByFd(sa[1]);
+	line = "MODE #tags +v bob\r\nMODE #tags +v alice\r\n";
+	manager.handleClientInput(alice, line.c_str(), line.size());
+	line = "NICK robert\r\n";
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	line = "PART #tags\r\n";
+	manager.handleClientInput(manager.getClientByFd(sv[0][1]), line.c_str(), line.size());
+	expected.replace(0, 10, "@alice +robert");
+	expected.erase(expected.find(" " + std::string(28, 'n') + "aa"), 31);
+	line = "NAMES #tags\r\n";
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	EXPECT_EQ(namesFrom(sb[0], "robert", "#tags"), expected);
+	EXPECT_EQ(channel->getNamesCache().builds(), 1u);
+
+	// multi-prefix shows every prefix, from its own cached variant
+	bob->setCaps(CAP_MULTI_PREFIX);
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	EXPECT_EQ(namesFrom(sb[0], "robert", "#tags").substr(0, 15), "@+alice +robert");
+	EXPECT_EQ(channel->getNamesCache().builds(), 2u);
+	line = "MODE #tags -o alice\r\n";
+	manager.handleClientInput(alice, line.c_str(), line.size());
+	line = "NAMES #tags\r\n";
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	EXPECT_EQ(namesFrom(sb[0], "robert", "#tags").substr(0, 14), "+alice +robert");
+	EXPECT_EQ(channel->getNamesCache().builds(), 2u);
+
+	// Unknown channels and no channel at all only get the end reply
+	char buffer[1024];
+	line = "NAMES\r\nNAMES #nowhere\r\n";
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), ":ft_irc.42.de 366 robert * :End of /NAMES list.\r\n"
+		":ft_irc.42.de 366 robert #nowhere :End of /NAMES list.\r\n");
+}
+
+// Channel names out of the 322 lines waiting on fd, in order
+static std::string listFrom(int fd) {
+	std::string reply;
+	char buffer[8192];
+	while (recv_nonblocking(fd, buffer, sizeof(buffer) - 1) > 0)
+		reply += buffer;
+	std::string names;
+	std::istringstream lines(reply);
+	std::string line;
+	while (std::getline(lines, line)) {
+		std::istringstream words(line);
+		std::string server, code, nick, channel;
+		words >> server >> code >> nick >> channel;
+		if (code == "322")
+			names += (names.empty() ? "" : " ") + channel;
+	}
+	EXPECT_NE(reply.find(" 323 "), std::string::npos);
+	return names;
+}
+
+TEST(ChannelsClientsManagerTest, ListFiltersTheChannelDirectory) {
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int sa[2], sb[2], sc[2];
+	Client* alice = registerTagsClient(manager, sa, "alice", false);
+	Client* bob = registerTagsClient(manager, sb, "bob", false);
+	Client* carol = registerTagsClient(manager, sc, "carol", false);
+	std::string line = "JOIN #solo\r\n";
+	manager.handleClientInput(alice, line.c_str(), line.size());
+	line = "JOIN #pair\r\n";
+	manager.handleClientInput(carol, line.c_str(), line.size());
+	line = "JOIN #pair\r\nTOPIC #pair :paired up\r\n";
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	char buffer[4096];
+	while (recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1) > 0)
+		;
+
+	line = "LIST\r\n";
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), ":ft_irc.42.de 321 bob Channel :Users  Name\r\n"
+		":ft_irc.42.de 322 bob #tags 3 :\r\n"
+		":ft_irc.42.de 322 bob #solo 1 :\r\n"
+		":ft_irc.42.de 322 bob #pair 2 :paired up\r\n"
+		":ft_irc.42.de 323 bob :End of /LIST\r\n");
+
+	// Conditions: user counts walk the count index, smallest first
+	const char* queries[][2] = {
+		{ "LIST >1\r\n", "#pair #tags" },
+		{ "LIST <3\r\n", "#solo #pair" },
+		{ "LIST >1,<3\r\n", "#pair" },
+		{ "LIST #P*\r\n", "#pair" },
+		{ "LIST !#p*,#*\r\n", "#tags #solo" },
+		{ "LIST #solo,#nowhere\r\n", "#solo" },
+		{ "LIST T<5\r\n", "#pair" },
+		{ "LIST T>5\r\n", "" },
+		{ "LIST C<5\r\n", "#tags #solo #pair" },
+		{ "LIST C>5\r\n", "" },
+	};
+	for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); ++i) {
+		line = queries[i][0];
+		manager.handleClientInput(bob, line.c_str(), line.size());
+		EXPECT_EQ(listFrom(sb[0]), queries[i][1]) << queries[i][0];
+	}
+
+	// Counts follow parts and quits
+	line = "PART #pair\r\n";
+	manager.handleClientInput(carol, line.c_str(), line.size());
+	manager.removeClient(*alice);
+	line = "LIST <2\r\n";
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	EXPECT_EQ(listFrom(sb[0]), "#pair");
+}
+
+TEST(ChannelsClientsManagerTest, ListStreamsUnderBackpressure) {
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int so[2], sr[2];
+	Client* owner = registerTagsClient(manager, so, "owner", false);
+	Client* reader = registerTagsClient(manager, sr, "reader", false);
+	const int channels = 3000;
+	std::string topic(200, 't');
+	char buffer[65536];
+	for (int i = 0; i < channels; ++i) {
+		std::string line = "JOIN #room" + std::to_string(i) + "\r\nTOPIC #room" + std::to_string(i) + " :" + topic + "\r\n";
+		manager.handleClientInput(owner, line.c_str(), line.size());
+		while (recv_nonblocking(so[0], buffer, sizeof(buffer) - 1) > 0)
+			;
+	}
+
+	// The first round stops at the watermark instead of queueing all of it
+	std::string line = "LIST\r\n";
+	manager.handleClientInput(reader, line.c_str(), line.size());
+	EXPECT_GE(reader->getSendQueueSize(), (size_t)LIST_SENDQ_WATERMARK);
+	EXPECT_LT(reader->getSendQueueSize(), (size_t)LIST_SENDQ_WATERMARK + LIST_BATCH * 512);
+	EXPECT_FALSE(manager.hasRunnableListings()); // nothing to do until the client reads
+
+	// What the server loop does: flush on POLLOUT, then let the listing continue
+	std::string reply;
+	size_t maxQueued = 0;
+	for (int round = 0; round < 1000 && reply.find(" 323 ") == std::string::npos; ++round) {
+		ssize_t n;
+		while ((n = recv_nonblocking(sr[0], buffer, sizeof(buffer) - 1)) > 0)
+			reply.append(buffer, n);
+		reader->flushSendQueue();
+		manager.continueListings();
+		maxQueued = std::max(maxQueued, reader->getSendQueueSize());
+	}
+	ssize_t n;
+	while ((n = recv_nonblocking(sr[0], buffer, sizeof(buffer) - 1)) > 0)
+		reply.append(buffer, n);
+	EXPECT_LT(maxQueued, (size_t)LIST_SENDQ_WATERMARK + LIST_BATCH * 512);
+	size_t entries = 0;
+	for (size_t position = reply.find(" 322 "); position != std::string::npos; position = reply.find(" 322 ", position + 1))
+		entries++;
+	EXPECT_EQ(entries, (size_t)channels + 1); // and #tags
+	std::string end = ":ft_irc.42.de 323 reader :End of /LIST\r\n";
+	ASSERT_GE(reply.size(), end.size());
+	EXPECT_EQ(reply.substr(reply.size() - end.size()), end);
+	EXPECT_FALSE(manager.hasRunnableListings());
+}
+
+static Client* registerWhoClient(ChannelsClientsManager& manager, int sv[2], const std::string& nick,
+	const std::string& user, const std::string& host, const std::string& realname) {
+	setSocketPair(sv);
+	Client* client = new Client(sv[1]);
+	client->setHostname(host);
+	manager.addClient(client);
+	std::string input = "PASS correct_password\r\nNICK " + nick + "\r\nUSER " + user + " 0 * :" + realname + "\r\n";
+	manager.handleClientInput(client, input.c_str(), input.size());
+	char buffer[4096];
+	while (recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1) > 0)
+		;
+	return client;
+}
+
+// Nicks (the 6th word) of the 352 lines waiting on fd, sorted
+static std::string whoFrom(int fd) {
+	std::string reply;
+	char buffer[8192];
+	while (recv_nonblocking(fd, buffer, sizeof(buffer) - 1) > 0)
+		reply += buffer;
+	std::vector<std::string> nicks;
+	std::istringstream lines(reply);
+	std::string line;
+	while (std::getline(lines, line)) {
+		std::istringstream words(line);
+		std::string server, code, me, channel, user, host, host2, nick;
+		words >> server >> code >> me >> channel >> user >> host >> host2 >> nick;
+		if (code == "352")
+			nicks.push_back(nick);
+	}
+	EXPECT_NE(reply.find(" 315 "), std::string::npos);
+	std::sort(nicks.begin(), nicks.end());
+	std::string joined;
+	for (size_t i = 0; i < nicks.size(); ++i)
+		joined += (i ? " " : "") + nicks[i];
+	return joined;
+}
+
+TEST(ChannelsClientsManagerTest, WhoUsesChannelsAndIndexes) {
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int sa[2], sb[2], sc[2], sd[2];
+	Client* alice = registerWhoClient(manager, sa, "alice", "ali", "10.0.0.1", "Alice Liddell");
+	Client* bob = registerWhoClient(manager, sb, "bob", "bobby", "10.0.0.2", "Bob Builder");
+	Client* carol = registerWhoClient(manager, sc, "Carol", "carol", "192.168.1.7", "Carol Danvers");
+	registerWhoClient(manager, sd, "dave", "dave", "10.1.0.9", "Dave");
+	std::string line = "JOIN #who\r\n";
+	manager.handleClientInput(alice, line.c_str(), line.size());
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	line = "MODE #who +v bob\r\n";
+	manager.handleClientInput(alice, line.c_str(), line.size());
+	char buffer[4096];
+	while (recv_nonblocking(sa[0], buffer, sizeof(buffer) - 1) > 0 || recv_nonblocking(sb[0], buffer, sizeof(buffer) - 1) > 0)
+		;
+
+	// Channel members come with their prefixes
+	line = "WHO #who\r\n";
+	manager.handleClientInput(carol, line.c_str(), line.size());
+	recv_nonblocking(sc[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), ":ft_irc.42.de 352 Carol #who ali 10.0.0.1 ft_irc.42.de alice H@ :0 Alice Liddell\r\n"
+		":ft_irc.42.de 352 Carol #who bobby 10.0.0.2 ft_irc.42.de bob H+ :0 Bob Builder\r\n"
+		":ft_irc.42.de 315 Carol #who :End of WHO list\r\n");
+
+	// Masks: a plain one matches nick, user or host, nick!user@host all three
+	const char* queries[][2] = {
+		{ "WHO a*\r\n", "alice" },
+		{ "WHO CAR*\r\n", "Carol" },
+		{ "WHO bob*\r\n", "bob" },              // nick and user index, listed once
+		{ "WHO 10.0.*\r\n", "alice bob" },
+		{ "WHO 10.*\r\n", "alice bob dave" },
+		{ "WHO *.7\r\n", "Carol" },             // no prefix: one walk over everybody
+		{ "WHO *!da*@10.*\r\n", "dave" },
+		{ "WHO b?b!*@*\r\n", "bob" },
+		{ "WHO *@192.168.*\r\n", "Carol" },
+		{ "WHO *\r\n", "Carol alice bob dave" },
+		{ "WHO nobody\r\n", "" },
+		{ "WHO *builder r\r\n", "bob" },        // realname, asked for with 'r'
+		{ "WHO *builder\r\n", "" },
+	};
+	for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); ++i) {
+		line = queries[i][0];
+		manager.handleClientInput(carol, line.c_str(), line.size());
+		EXPECT_EQ(whoFrom(sc[0]), queries[i][1]) << queries[i][0];
+	}
+
+	// WHOX picks the fields, in their fixed order, and echoes the token
+	line = "WHO #who %nfrt,42\r\n";
+	manager.handleClientInput(carol, line.c_str(), line.size());
+	recv_nonblocking(sc[0], buffer, sizeof(buffer) - 1);
+	EXPECT_EQ(std::string(buffer), ":ft_irc.42.de 354 Carol 42 alice H@ :Alice Liddell\r\n"
+		":ft_irc.42.de 354 Carol 42 bob H+ :Bob Builder\r\n"
+		":ft_irc.42.de 315 Carol #who :End of WHO list\r\n");
+
+	// The indexes follow nick changes and quits
+	line = "NICK zed\r\n";
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	manager.removeClient(*alice);
+	line = "WHO z*\r\nWHO bob\r\nWHO 10.0.0.*\r\n";
+	manager.handleClientInput(carol, line.c_str(), line.size());
+	EXPECT_EQ(whoFrom(sc[0]), "zed zed");
+}
+
+TEST(ChannelsClientsManagerTest, WhoStreamsUnderBackpressure) {
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int sv[2];
+	Client* asker = registerWhoClient(manager, sv, "asker", "asker", "10.0.0.1", "Asker");
+	// Nobody ever writes to these, the fds only have to be unique
+	const int users = 3000;
+	std::vector<Client*> crowd;
+	for (int i = 0; i < users; ++i) {
+		Client* client = new Client(1000 + i);
+		client->setNickname("crowd" + std::to_string(i));
+		client->setUsername("crowd");
+		client->setHostname("10.9.0.1");
+		client->setRealname(std::string(200, 'r'));
+		client->setRegistered(true);
+		manager.addClient(client);
+		crowd.push_back(client);
+	}
+
+	std::string line = "WHO crowd*\r\n";
+	manager.handleClientInput(asker, line.c_str(), line.size());
+	EXPECT_GE(asker->getSendQueueSize(), (size_t)LIST_SENDQ_WATERMARK);
+	EXPECT_FALSE(manager.hasRunnableListings());
+	std::string reply;
+	char buffer[65536];
+	size_t maxQueued = 0;
+	for (int round = 0; round < 1000 && reply.find(" 315 ") == std::string::npos; ++round) {
+		ssize_t n;
+		while ((n = recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1)) > 0)
+			reply.append(buffer, n);
+		asker->flushSendQueue();
+		manager.continueListings();
+		maxQueued = std::max(maxQueued, asker->getSendQueueSize());
+	}
+	ssize_t n;
+	while ((n = recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1)) > 0)
+		reply.append(buffer, n);
+	EXPECT_LT(maxQueued, (size_t)LIST_SENDQ_WATERMARK + LIST_BATCH * 512);
+	size_t entries = 0;
+	for (size_t position = reply.find(" 352 "); position != std::string::npos; position = reply.find(" 352 ", position + 1))
+		entries++;
+	EXPECT_EQ(entries, (size_t)users); // found through the nick and the user index, listed once
+	std::string end = ":ft_irc.42.de 315 asker crowd* :End of WHO list\r\n";
+	ASSERT_GE(reply.size(), end.size());
+	EXPECT_EQ(reply.substr(reply.size() - end.size()), end);
+
+	for (size_t i = 0; i < crowd.size(); ++i) {
+		clients_map.erase(crowd[i]->getFd());
+		delete crowd[i];
+	}
+}
+
+static std::string drain(int fd) {
+	std::string reply;
+	char buffer[8192];
+	ssize_t n;
+	while ((n = recv_nonblocking(fd, buffer, sizeof(buffer) - 1)) > 0)
+		reply.append(buffer, n);
+	return reply;
+}
+
+TEST(ChannelsClientsManagerTest, MonitorPushesPresenceToWatchers) {
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int sw[2], so[2], sa[2], sb[2];
+	Client* watcher = registerWhoClient(manager, sw, "watcher", "w", "10.0.0.1", "Watcher");
+	Client* other = registerWhoClient(manager, so, "other", "o", "10.0.0.2", "Other");
+	Client* alice = registerWhoClient(manager, sa, "alice", "ali", "10.0.0.3", "Alice");
+
+	// Adding reports the current state, case doesn't matter and duplicates are ignored
+	std::string line = "MONITOR + ALICE,bob,alice\r\n";
+	manager.handleClientInput(watcher, line.c_str(), line.size());
+	EXPECT_EQ(drain(sw[0]), ":ft_irc.42.de 730 watcher :alice!ali@10.0.0.3\r\n"
+		":ft_irc.42.de 731 watcher :bob\r\n");
+
+	// bob registers: only his watcher hears about it
+	Client* bob = registerWhoClient(manager, sb, "bob", "bobby", "10.0.0.4", "Bob");
+	(void)bob;
+	EXPECT_EQ(drain(sw[0]), ":ft_irc.42.de 730 watcher :bob!bobby@10.0.0.4\r\n");
+	EXPECT_EQ(drain(so[0]), "");
+
+	// A nick change is the old nick leaving and the new one arriving
+	line = "NICK Alicia\r\n";
+	manager.handleClientInput(alice, line.c_str(), line.size());
+	EXPECT_EQ(drain(sw[0]), ":ft_irc.42.de 731 watcher :alice\r\n");
+	line = "MONITOR + alicia\r\n";
+	manager.handleClientInput(watcher, line.c_str(), line.size());
+	drain(sw[0]);
+	line = "NICK ALICIA\r\n"; // same nick in other case, no notification
+	manager.handleClientInput(alice, line.c_str(), line.size());
+	EXPECT_EQ(drain(sw[0]), "");
+	manager.removeClient(*alice);
+	EXPECT_EQ(drain(sw[0]), ":ft_irc.42.de 731 watcher :ALICIA\r\n");
+
+	line = "MONITOR - bob\r\nMONITOR L\r\nMONITOR S\r\n";
+	manager.handleClientInput(watcher, line.c_str(), line.size());
+	EXPECT_EQ(drain(sw[0]), ":ft_irc.42.de 732 watcher :ALICE,alicia\r\n"
+		":ft_irc.42.de 733 watcher :End of MONITOR list\r\n"
+		":ft_irc.42.de 731 watcher :ALICE,alicia\r\n");
+	line = "NICK bobby\r\n";
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	EXPECT_EQ(drain(sw[0]), "");
+
+	// The limit: what doesn't fit is named in the error
+	std::string many = "MONITOR + ";
+	for (int i = 0; i < MONITOR_LIMIT + 2; ++i) {
+		std::ostringstream nick;
+		nick << "n" << i;
+		many += (i ? "," : "") + nick.str();
+	}
+	many += "\r\n";
+	manager.handleClientInput(other, many.c_str(), many.size());
+	std::string reply = drain(so[0]);
+	std::ostringstream full;
+	full << ":ft_irc.42.de 734 other " << MONITOR_LIMIT << " n" << MONITOR_LIMIT << ",n" << MONITOR_LIMIT + 1
+		<< " :Monitor list is full\r\n";
+	EXPECT_NE(reply.find(full.str()), std::string::npos) << reply;
+	size_t lines = 0;
+	for (size_t i = 0; i < reply.size(); ++i)
+		if (reply[i] == '\n') {
+			lines++;
+			EXPECT_LE(reply.rfind('\n', i - 1) == std::string::npos ? i + 1 : i - reply.rfind('\n', i - 1), 512u);
+		}
+	EXPECT_GE(lines, 2u);
+
+	// Leaving drops the watcher's list
+	manager.removeClient(*watcher);
+	line = "NICK alice\r\n";
+	manager.handleClientInput(bob, line.c_str(), line.size());
+	EXPECT_EQ(drain(so[0]), "");
+}
+
+TEST(ChannelsClientsManagerTest, CompiledMasksAgreeWithMaskMatch) {
+	const char* masks[] = { "*", "a*", "*a", "a*b*c", "*!*@*.example.com", "nick!*@*", "?ick!*@10.0.*",
+		"*a*a*", "**x", "a?c", "exact!user@host", "*!*@*", "[]\\^*", "a*?", "" };
+	const char* texts[] = { "", "a", "abc", "aXbYc", "nick!user@dsl.example.com", "NICK!u@h", "kick!u@10.0.0.1",
+		"aaa", "x", "abd", "EXACT!user@HOST", "{}|~nick", "ab", "nick!user@example.com", "aa" };
+	for (size_t m = 0; m < sizeof(masks) / sizeof(masks[0]); ++m) {
+		CompiledMask compiled(masks[m]);
+		for (size_t t = 0; t < sizeof(texts) / sizeof(texts[0]); ++t)
+			EXPECT_EQ(compiled.matches(texts[t]), maskMatch(masks[m], texts[t])) << masks[m] << " / " << texts[t];
+	}
+
+	// Every bucket finds its masks, and only for hosts they can match
+	MaskList list;
+	EXPECT_EQ(MaskList::normalize("troll"), "troll!*@*");
+	EXPECT_EQ(MaskList::normalize("*@10.0.*"), "*!*@10.0.*");
+	EXPECT_EQ(MaskList::normalize("bad!ident"), "bad!ident@*");
+	list.add("*!*@*.dsl.example.com", "op", 0);  // last two labels
+	list.add("*!*@*.org", "op", 0);              // last label
+	list.add("*!*@10.0.*", "op", 0);             // first label
+	list.add("troll!*@*", "op", 0);              // unbucketed
+	list.add("*!*@exact.host", "op", 0);
+	EXPECT_FALSE(list.add("*!*@*.ORG", "op", 0));
+	EXPECT_TRUE(list.matches("a!b@x.dsl.EXAMPLE.com", "x.dsl.EXAMPLE.com"));
+	EXPECT_FALSE(list.matches("a!b@x.cable.example.com", "x.cable.example.com"));
+	EXPECT_TRUE(list.matches("a!b@wiki.org", "wiki.org"));
+	EXPECT_TRUE(list.matches("a!b@10.0.3.4", "10.0.3.4"));
+	EXPECT_FALSE(list.matches("a!b@10.1.3.4", "10.1.3.4"));
+	EXPECT_TRUE(list.matches("Troll!b@anywhere", "anywhere"));
+	EXPECT_TRUE(list.matches("a!b@exact.host", "exact.host"));
+	EXPECT_TRUE(list.remove("*!*@*.org"));
+	EXPECT_FALSE(list.matches("a!b@wiki.org", "wiki.org"));
+	EXPECT_EQ(list.size(), 4u);
+}
+
+TEST(ChannelsClientsManagerTest, MultiTargetMessagesReachEachClientOnce) {
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int sb[2], sx[2], sy[2], sd[2];
+	Client* bot = registerWhoClient(manager, sb, "bot", "bot", "10.0.0.1", "Bot");
+	Client* both = registerWhoClient(manager, sx, "both", "x", "10.0.0.2", "In both");
+	Client* second = registerWhoClient(manager, sy, "second", "y", "10.0.0.3", "In #b");
+	Client* direct = registerWhoClient(manager, sd, "direct", "d", "10.0.0.4", "Nowhere");
+	std::string line = "JOIN #a,#b\r\n";
+	manager.handleClientInput(bot, line.c_str(), line.size());
+	manager.handleClientInput(both, line.c_str(), line.size());
+	line = "JOIN #b\r\n";
+	manager.handleClientInput(second, line.c_str(), line.size());
+	drain(sb[0]);
+	drain(sx[0]);
+	drain(sy[0]);
+	(void)direct;
+
+	// "both" is in #a and #b and named as well: one copy, through #a
+	line = "PRIVMSG #a,#b,Direct,both,#a :hello all\r\n";
+	manager.handleClientInput(bot, line.c_str(), line.size());
+	EXPECT_EQ(drain(sx[0]), "bot!bot@10.0.0.1 PRIVMSG #a :hello all\r\n");
+	EXPECT_EQ(drain(sy[0]), "bot!bot@10.0.0.1 PRIVMSG #b :hello all\r\n");
+	EXPECT_EQ(drain(sd[0]), "bot!bot@10.0.0.1 PRIVMSG Direct :hello all\r\n");
+	EXPECT_EQ(drain(sb[0]), "");
+	// The next message is a new delivery
+	line = "NOTICE #b,#a :again\r\n";
+	manager.handleClientInput(bot, line.c_str(), line.size());
+	EXPECT_EQ(drain(sx[0]), "bot!bot@10.0.0.1 NOTICE #b :again\r\n");
+	EXPECT_EQ(drain(sy[0]), "bot!bot@10.0.0.1 NOTICE #b :again\r\n");
+
+	// Bad targets are reported one by one, the good ones still get it
+	line = "PRIVMSG #a,#nope,ghost :partly\r\n";
+	manager.handleClientInput(bot, line.c_str(), line.size());
+	std::string reply = drain(sb[0]);
+	EXPECT_NE(reply.find("403"), std::string::npos) << reply;
+	EXPECT_NE(reply.find("401"), std::string::npos) << reply;
+	EXPECT_EQ(drain(sx[0]), "bot!bot@10.0.0.1 PRIVMSG #a :partly\r\n");
+	// NOTICE never answers
+	line = "NOTICE #a,#nope,ghost :quiet\r\n";
+	manager.handleClientInput(bot, line.c_str(), line.size());
+	EXPECT_EQ(drain(sb[0]), "");
+	EXPECT_EQ(drain(sx[0]), "bot!bot@10.0.0.1 NOTICE #a :quiet\r\n");
+
+	// Past TARGMAX
+	line = "PRIVMSG #a";
+	for (int i = 0; i < MESSAGE_TARGETS_LIMIT + 1; ++i)
+		line += ",direct";
+	line += " :many\r\n";
+	manager.handleClientInput(bot, line.c_str(), line.size());
+	EXPECT_EQ(drain(sb[0]), ":ft_irc.42.de 407 bot direct :Too many recipients\r\n"
+		":ft_irc.42.de 407 bot direct :Too many recipients\r\n");
+	EXPECT_EQ(drain(sd[0]), "bot!bot@10.0.0.1 PRIVMSG direct :many\r\n");
+	EXPECT_EQ(drain(sx[0]), "bot!bot@10.0.0.1 PRIVMSG #a :many\r\n");
+}
+
+TEST(ChannelsClientsManagerTest, QuitReachesEachPeerOnce) {
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int sl[2], ss[2], so[2], sn[2];
+	Client* leaver = registerWhoClient(manager, sl, "leaver", "l", "10.0.0.1", "Leaver");
+	Client* shared = registerWhoClient(manager, ss, "shared", "s", "10.0.0.2", "In all three");
+	Client* one = registerWhoClient(manager, so, "one", "o", "10.0.0.3", "In #c");
+	Client* none = registerWhoClient(manager, sn, "none", "n", "10.0.0.4", "Elsewhere");
+	std::string line = "JOIN #a,#b,#c\r\n";
+	manager.handleClientInput(leaver, line.c_str(), line.size());
+	manager.handleClientInput(shared, line.c_str(), line.size());
+	line = "JOIN #c,#other\r\n";
+	manager.handleClientInput(one, line.c_str(), line.size());
+	line = "JOIN #other\r\n";
+	manager.handleClientInput(none, line.c_str(), line.size());
+	drain(ss[0]);
+	drain(so[0]);
+	drain(sn[0]);
+
+	// A dropped connection
+	manager.removeClient(*leaver, "Ping timeout");
+	EXPECT_EQ(drain(ss[0]), ":leaver!l@10.0.0.1 QUIT :Ping timeout\r\n");
+	EXPECT_EQ(drain(so[0]), ":leaver!l@10.0.0.1 QUIT :Ping timeout\r\n");
+	EXPECT_EQ(drain(sn[0]), "");
+	EXPECT_EQ(manager.getChannel("#a")->getClientCount(), 1u);
+	close(sl[0]);
+
+	// QUIT itself: ERROR for the client, the reason for the peers, and
+	// nothing after it is handled
+	line = "QUIT :gone fishing\r\nPRIVMSG #c :never sent\r\n";
+	manager.handleClientInput(shared, line.c_str(), line.size());
+	EXPECT_TRUE(shared->hasQuit());
+	EXPECT_EQ(drain(ss[0]), "ERROR :Closing Link: 10.0.0.2 (Quit: gone fishing)\r\n");
+	EXPECT_EQ(drain(so[0]), ":shared!s@10.0.0.2 QUIT :Quit: gone fishing\r\n");
+	EXPECT_EQ(manager.getChannel("#a"), (Channel*)NULL);
+	manager.removeClient(*shared);
+	EXPECT_EQ(drain(so[0]), "");
+	close(ss[0]);
+	manager.removeClient(*one);
+	manager.removeClient(*none);
+	close(so[0]);
+	close(sn[0]);
+}
+
+TEST(ChannelsClientsManagerTest, NickChangeReachesEachPeerOnce) {
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int sr[2], ss[2], sn[2];
+	Client* renamer = registerWhoClient(manager, sr, "old", "r", "10.0.0.1", "Renamer");
+	Client* shared = registerWhoClient(manager, ss, "shared", "s", "10.0.0.2", "In both");
+	Client* none = registerWhoClient(manager, sn, "none", "n", "10.0.0.3", "Elsewhere");
+	std::string line = "JOIN #a,#b\r\n";
+	manager.handleClientInput(renamer, line.c_str(), line.size());
+	manager.handleClientInput(shared, line.c_str(), line.size());
+	drain(sr[0]);
+	drain(ss[0]);
+	(void)none;
+
+	line = "NICK New\r\n";
+	manager.handleClientInput(renamer, line.c_str(), line.size());
+	EXPECT_EQ(drain(sr[0]), ":old!r@10.0.0.1 NICK :New\r\n");
+	EXPECT_EQ(drain(ss[0]), ":old!r@10.0.0.1 NICK :New\r\n");
+	EXPECT_EQ(drain(sn[0]), "");
+	EXPECT_EQ(renamer->getHostmask(), "New!r@10.0.0.1");
+
+	// The new nick is in place everywhere: lookups, messages and NAMES
+	line = "PRIVMSG new :hi\r\nNAMES #b\r\n";
+	manager.handleClientInput(shared, line.c_str(), line.size());
+	EXPECT_EQ(drain(sr[0]), "shared!s@10.0.0.2 PRIVMSG new :hi\r\n");
+	EXPECT_EQ(namesFrom(ss[0], "shared", "#b"), "@New shared");
+	line = "PRIVMSG #a :renamed\r\n";
+	manager.handleClientInput(renamer, line.c_str(), line.size());
+	EXPECT_EQ(drain(ss[0]), "New!r@10.0.0.1 PRIVMSG #a :renamed\r\n");
+
+	// Same nick, nothing to say; a change of case is still announced
+	line = "NICK New\r\nNICK NEW\r\n";
+	manager.handleClientInput(renamer, line.c_str(), line.size());
+	EXPECT_EQ(drain(ss[0]), ":New!r@10.0.0.1 NICK :NEW\r\n");
+}
+
+static size_t countLines(const std::string& text, const std::string& what) {
+	size_t count = 0;
+	for (size_t at = text.find(what); at != std::string::npos; at = text.find(what, at + 1))
+		++count;
+	return count;
+}
+
+TEST(ChannelsClientsManagerTest, FloodControlDefersAndDisconnects) {
+	// The budget itself, with the clock under control
+	FloodControl flood;
+	int admitted = 0;
+	while (flood.admit(5000, 1000))
+		++admitted;
+	EXPECT_EQ(admitted, 11);
+	EXPECT_EQ(flood.readyAt(), 6000u);
+	EXPECT_FALSE(flood.admit(5999, 0));
+	EXPECT_TRUE(flood.admit(6000, 1000));
+	EXPECT_TRUE(flood.admit(100000, 1000)); // idle long enough, a full burst again
+	EXPECT_EQ(flood.readyAt(), 100000u - FLOOD_BURST_MS + 1000u);
+	EXPECT_EQ(FloodControl::costOf("PRIVMSG a,b,c :x\r\n", 18), 2000u);
+	EXPECT_EQ(FloodControl::costOf("privmsg a :x,y,z", 16), 1000u);
+	EXPECT_EQ(FloodControl::costOf("@label=1 :n!u@h PING x\r\n", 24), 0u);
+	EXPECT_EQ(FloodControl::costOf("LIST", 4), 3000u);
+	EXPECT_EQ(FloodControl::costOf("FOO bar", 7), 500u);
+
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int sf[2], sp[2], sx[2];
+	Client* flooder = registerWhoClient(manager, sf, "flooder", "f", "10.0.0.1", "Flooder");
+	Client* peer = registerWhoClient(manager, sp, "peer", "p", "10.0.0.2", "Peer");
+	Client* excess = registerWhoClient(manager, sx, "excess", "x", "10.0.0.3", "Excess");
+	EXPECT_EQ(manager.deferredTimeout(), -1);
+	manager.setFloodControl(true);
+
+	// Twenty lines at once: a burst goes through, the rest waits in order
+	std::string line;
+	for (int i = 0; i < 20; ++i)
+		line += "PRIVMSG peer :line " + std::to_string(i) + "\r\n";
+	manager.handleClientInput(flooder, line.c_str(), line.size());
+	size_t delivered = countLines(drain(sp[0]), " PRIVMSG ");
+	EXPECT_GE(delivered, 11u);
+	EXPECT_LE(delivered, 12u);
+	EXPECT_TRUE(flooder->hasDeferredInput());
+	int timeout = manager.deferredTimeout();
+	EXPECT_GT(timeout, 0);
+	EXPECT_LE(timeout, 1000);
+
+	// Later input queues up behind it, even a free PING
+	line = "PING :after\r\n";
+	manager.handleClientInput(flooder, line.c_str(), line.size());
+	EXPECT_EQ(drain(sf[0]), "");
+	manager.continueDeferred();
+	EXPECT_EQ(drain(sp[0]), "");
+	usleep((timeout + 20) * 1000);
+	manager.continueDeferred();
+	std::string released = drain(sp[0]);
+	EXPECT_EQ(countLines(released, " PRIVMSG "), 1u);
+	EXPECT_NE(released.find(":line " + std::to_string(delivered) + "\r\n"), std::string::npos);
+	EXPECT_FALSE(flooder->hasQuit());
+
+	// More than FLOOD_EXCESS_BYTES held back is the end of it
+	line.clear();
+	while (line.size() <= FLOOD_EXCESS_BYTES + 2000)
+		line += "PRIVMSG peer :" + std::string(60, 'x') + "\r\n";
+	manager.handleClientInput(excess, line.c_str(), line.size());
+	EXPECT_TRUE(excess->hasQuit());
+	EXPECT_NE(drain(sx[0]).find("ERROR :Closing Link: 10.0.0.3 (Excess Flood)\r\n"), std::string::npos);
+	EXPECT_FALSE(excess->hasDeferredInput());
+	manager.removeClient(*excess);
+	manager.continueDeferred();
+	(void)peer;
+}
+
+static unsigned int ipv4(unsigned int a, unsigned int b, unsigned int c, unsigned int d) {
+	return (a << 24) | (b << 16) | (c << 8) | d;
+}
+
+TEST(ChannelsClientsManagerTest, ConnectionLimiterCountsHostsAndNetworks) {
+	ConnectionLimiter limiter;
+	limiter.setLimits(3, 5, 24, 0);
+	unsigned long long now = 1000000;
+	for (int i = 0; i < 3; ++i)
+		EXPECT_EQ(limiter.admit(ipv4(10, 0, 0, 1), now), ConnectionLimiter::ADMITTED);
+	EXPECT_EQ(limiter.admit(ipv4(10, 0, 0, 1), now), ConnectionLimiter::TOO_MANY_FROM_HOST);
+	EXPECT_EQ(limiter.admit(ipv4(10, 0, 0, 2), now), ConnectionLimiter::ADMITTED);
+	EXPECT_EQ(limiter.admit(ipv4(10, 0, 0, 200), now), ConnectionLimiter::ADMITTED);
+	EXPECT_EQ(limiter.admit(ipv4(10, 0, 0, 3), now), ConnectionLimiter::TOO_MANY_FROM_NETWORK);
+	EXPECT_EQ(limiter.admit(ipv4(10, 0, 1, 3), now), ConnectionLimiter::ADMITTED);
+	EXPECT_EQ(limiter.connections(ipv4(10, 0, 0, 1), 32), 3u);
+	EXPECT_EQ(limiter.connections(ipv4(10, 0, 0, 0), 24), 5u);
+	EXPECT_EQ(limiter.connections(ipv4(10, 0, 0, 0), 25), 4u);
+	EXPECT_EQ(limiter.connections(ipv4(10, 0, 0, 0), 16), 6u);
+	EXPECT_EQ(limiter.connections(0, 0), 6u);
+	EXPECT_EQ(limiter.connections(ipv4(10, 0, 0, 3), 32), 0u);
+	limiter.release(ipv4(10, 0, 0, 1), now);
+	EXPECT_EQ(limiter.admit(ipv4(10, 0, 0, 3), now), ConnectionLimiter::ADMITTED);
+	// Releasing what was never admitted changes nothing
+	limiter.release(ipv4(10, 0, 0, 99), now);
+	limiter.release(0, now);
+	EXPECT_EQ(limiter.connections(0, 0), 6u);
+
+	// Loopback is let in however often
+	limiter.exempt(ipv4(127, 0, 0, 0), 8);
+	for (int i = 0; i < 20; ++i)
+		EXPECT_EQ(limiter.admit(ipv4(127, 0, 0, 1), now), ConnectionLimiter::ADMITTED);
+	EXPECT_EQ(limiter.connections(ipv4(127, 0, 0, 0), 8), 20u);
+
+	// Reconnects: a burst, then one per CONNECT_THROTTLE_MS, refusals charged too
+	limiter.setLimits(100, 100, 24, CONNECT_THROTTLE_MS);
+	unsigned int host = ipv4(192, 168, 1, 1);
+	int admitted = 0;
+	while (limiter.admit(host, now) == ConnectionLimiter::ADMITTED)
+		++admitted;
+	EXPECT_EQ(admitted, CONNECT_BURST_MS / CONNECT_THROTTLE_MS + 1);
+	EXPECT_EQ(limiter.admit(host, now + CONNECT_THROTTLE_MS), ConnectionLimiter::THROTTLED);
+	EXPECT_EQ(limiter.admit(host, now + 3 * CONNECT_THROTTLE_MS), ConnectionLimiter::ADMITTED);
+	EXPECT_EQ(limiter.admit(ipv4(192, 168, 1, 2), now), ConnectionLimiter::ADMITTED);
+
+	// Everybody gone and their clocks caught up, only the exemption is left
+	unsigned long long later = now + 10 * CONNECT_BURST_MS;
+	for (int i = 0; i < 20; ++i)
+		limiter.release(ipv4(127, 0, 0, 1), later);
+	while (limiter.connections(host, 32))
+		limiter.release(host, later);
+	unsigned int others[] = { ipv4(10, 0, 0, 1), ipv4(10, 0, 0, 1), ipv4(10, 0, 0, 2), ipv4(10, 0, 0, 200),
+		ipv4(10, 0, 1, 3), ipv4(10, 0, 0, 3), ipv4(192, 168, 1, 2) };
+	for (size_t i = 0; i < sizeof(others) / sizeof(others[0]); ++i)
+		limiter.release(others[i], later);
+	EXPECT_EQ(limiter.connections(0, 0), 0u);
+	EXPECT_EQ(limiter.admit(ipv4(127, 0, 0, 1), later), ConnectionLimiter::ADMITTED);
+	EXPECT_EQ(limiter.nodes(), 2u);
+
+	// A host whose clock is still running is kept, then forgotten by a later admit
+	limiter.admit(ipv4(172, 16, 0, 1), later);
+	limiter.release(ipv4(172, 16, 0, 1), later);
+	EXPECT_GT(limiter.nodes(), 2u);
+	EXPECT_EQ(limiter.admit(ipv4(127, 0, 0, 1), later + CONNECT_THROTTLE_MS), ConnectionLimiter::ADMITTED);
+	EXPECT_EQ(limiter.nodes(), 2u);
+}
+
+TEST(ChannelsClientsManagerTest, ConnectionLimiterFuzzAgainstReference) {
+	// Few hosts on purpose: forks get created, split and collapsed all the time
+	ConnectionLimiter limiter;
+	limiter.setLimits(1000, 100000, 24, 0);
+	std::map<unsigned int, size_t> reference;
+	unsigned int seed = 7;
+	unsigned long long now = 1;
+	const unsigned int lengths[] = { 0, 1, 8, 15, 16, 22, 23, 24, 29, 31, 32 };
+	for (int round = 0; round < 20000; ++round) {
+		seed = seed * 1103515245u + 12345u;
+		unsigned int address = ipv4(10 + ((seed >> 8) & 1), (seed >> 9) & 3, (seed >> 11) & 3, (seed >> 13) & 7);
+		seed = seed * 1103515245u + 12345u;
+		if ((seed >> 16) % 3) {
+			ASSERT_EQ(limiter.admit(address, now), ConnectionLimiter::ADMITTED);
+			++reference[address];
+		}
+		else {
+			limiter.release(address, now);
+			if (reference[address])
+				--reference[address];
+		}
+		now += 1000;
+		if (round % 97)
+			continue;
+		for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+			unsigned int mask = lengths[l] ? ~0u << (32 - lengths[l]) : 0;
+			size_t expected = 0;
+			for (std::map<unsigned int, size_t>::iterator it = reference.begin(); it != reference.end(); ++it)
+				expected += (it->first & mask) == (address & mask) ? it->second : 0;
+			ASSERT_EQ(limiter.connections(address, lengths[l]), expected) << round << " /" << lengths[l];
+		}
+	}
+	size_t hosts = 0;
+	for (std::map<unsigned int, size_t>::iterator it = reference.begin(); it != reference.end(); ++it)
+		hosts += it->second != 0;
+	// A host and at most one fork for each, idle hosts are dropped on release
+	EXPECT_LE(limiter.nodes(), 2 * hosts);
+}
+
+// Straight from the definition, exponential but obviously right
+static bool referenceMatch(const char* mask, const char* text) {
+	if (!*mask)
+		return !*text;
+	if (*mask == '*')
+		return referenceMatch(mask + 1, text) || (*text && referenceMatch(mask, text + 1));
+	return *text && (*mask == '?' || ircFold(*mask) == ircFold(*text)) && referenceMatch(mask + 1, text + 1);
+}
+
+TEST(ChannelsClientsManagerTest, MaskEngineFuzzAgainstReference) {
+	// Small alphabets so that masks and texts actually overlap; 'A'/'a' and
+	// '['/'{' are the same letter under rfc1459
+	const char maskChars[] = "ab*?A[{";
+	const char textChars[] = "abA[{";
+	unsigned int seed = 42;
+	for (int round = 0; round < 200000; ++round) {
+		seed = seed * 1103515245u + 12345u;
+		std::string mask, text;
+		size_t maskLen = (seed >> 8) % 9;
+		size_t textLen = (seed >> 16) % 13;
+		for (size_t i = 0; i < maskLen; ++i) {
+			seed = seed * 1103515245u + 12345u;
+			mask += maskChars[(seed >> 16) % (sizeof(maskChars) - 1)];
+		}
+		for (size_t i = 0; i < textLen; ++i) {
+			seed = seed * 1103515245u + 12345u;
+			text += textChars[(seed >> 16) % (sizeof(textChars) - 1)];
+		}
+		bool expected = referenceMatch(mask.c_str(), text.c_str());
+		ASSERT_EQ(CompiledMask(mask).matches(text), expected) << mask << " / " << text;
+		ASSERT_EQ(maskMatch(mask, text), expected) << mask << " / " << text;
+	}
+
+	// Runs with a '?' up to 64 go through the bit table, longer ones don't
+	std::string text = std::string(100, 'x') + std::string(70, 'a') + "b" + std::string(30, 'x');
+	std::string mid64 = std::string(63, '?') + "b";
+	std::string mid70 = std::string(69, '?') + "b";
+	EXPECT_TRUE(CompiledMask("*" + mid64 + "*").matches(text));
+	EXPECT_TRUE(CompiledMask("*" + mid70 + "*").matches(text));
+	EXPECT_FALSE(CompiledMask("*" + mid70 + "?*").matches(text.substr(0, 171)));
+	EXPECT_TRUE(CompiledMask("*x?a*a?b*").matches(text));
+	EXPECT_FALSE(CompiledMask("*a?a*?ax*x").matches(std::string(200, 'a') + "x"));
+}
+
+TEST(ChannelsClientsManagerTest, MaskVerdictsFollowClientIdentity) {
+	MaskVerdictCache cache(100);
+	CompiledMask bad("bad!*@*");
+	EXPECT_EQ(cache.find(bad.id(), 7), -1);
+	EXPECT_FALSE(cache.matches(bad, 7, "good!u@h"));
+	EXPECT_EQ(cache.find(bad.id(), 7), 0);
+	EXPECT_TRUE(cache.matches(bad, 8, "BAD!u@h"));
+	EXPECT_EQ(cache.find(bad.id(), 8), 1);
+	EXPECT_NE(CompiledMask("bad!*@*").id(), bad.id());
+
+	// A client's stamp changes with its nick!user@host, so a rename is checked afresh
+	Client client(-1);
+	client.setNickname("good");
+	client.setUsername("u");
+	client.setHostname("h.example.com");
+	MaskList list;
+	list.add("bad!*@*", "op", 0);
+	list.add("*!*@*.example.org", "op", 0);
+	unsigned long before = client.getIdentityStamp();
+	EXPECT_FALSE(list.matches(client));
+	size_t hits = MaskList::verdicts().hits();
+	EXPECT_FALSE(list.matches(client));
+	EXPECT_EQ(MaskList::verdicts().hits(), hits + 1);
+	client.setNickname("Bad");
+	EXPECT_NE(client.getIdentityStamp(), before);
+	EXPECT_TRUE(list.matches(client));
+	client.setHostname("h.example.org");
+	client.setNickname("good");
+	EXPECT_TRUE(list.matches(client));
+}
+
+TEST(ChannelsClientsManagerTest, BanExceptionAndInviteExceptionLists) {
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	int so[2], sb[2], sg[2], sm[2];
+	Client* op = registerWhoClient(manager, so, "op", "op", "10.0.0.1", "Op");
+	Client* bad = registerWhoClient(manager, sb, "bad", "bad", "x.dsl.example.com", "Bad");
+	Client* good = registerWhoClient(manager, sg, "good", "good", "y.dsl.example.com", "Good");
+	Client* member = registerWhoClient(manager, sm, "member", "member", "10.0.0.5", "Member");
+	std::string line = "JOIN #mod\r\nMODE #mod +b *!*@*.dsl.example.com\r\nMODE #mod +e good\r\n";
+	manager.handleClientInput(op, line.c_str(), line.size());
+	drain(so[0]);
+
+	// Anybody may read the lists
+	line = "MODE #mod +b\r\nMODE #mod e\r\n";
+	manager.handleClientInput(member, line.c_str(), line.size());
+	std::string reply = drain(sm[0]);
+	EXPECT_NE(reply.find(" 367 member #mod *!*@*.dsl.example.com op "), std::string::npos) << reply;
+	EXPECT_NE(reply.find(" 368 member #mod :End of channel ban list\r\n"), std::string::npos) << reply;
+	EXPECT_NE(reply.find(" 348 member #mod good!*@* op "), std::string::npos) << reply;
+
+	// Banned stays out, the exception gets in
+	line = "JOIN #mod\r\n";
+	manager.handleClientInput(bad, line.c_str(), line.size());
+	EXPECT_NE(drain(sb[0]).find("474"), std::string::npos);
+	manager.handleClientInput(good, line.c_str(), line.size());
+	manager.handleClientInput(member, line.c_str(), line.size());
+	Channel* channel = manager.getChannel("#mod");
+	ASSERT_TRUE(channel != NULL);
+	EXPECT_TRUE(channel->isClientInChannel(good));
+	EXPECT_FALSE(channel->isClientInChannel(bad));
+	drain(so[0]);
+	drain(sg[0]);
+	drain(sm[0]);
+
+	// A ban on a member silences them, unless voiced; a nick change is checked again
+	line = "MODE #mod +b troll\r\n";
+	manager.handleClientInput(op, line.c_str(), line.size());
+	line = "PRIVMSG #mod :still here\r\n";
+	manager.handleClientInput(member, line.c_str(), line.size());
+	EXPECT_NE(drain(so[0]).find("still here"), std::string::npos);
+	line = "NICK troll\r\nPRIVMSG #mod :now banned\r\n";
+	manager.handleClientInput(member, line.c_str(), line.size());
+	EXPECT_EQ(drain(so[0]).find("now banned"), std::string::npos);
+	EXPECT_NE(drain(sm[0]).find(" 404 troll #mod :Cannot send to channel"), std::string::npos);
+	line = "MODE #mod +v troll\r\n";
+	manager.handleClientInput(op, line.c_str(), line.size());
+	line = "PRIVMSG #mod :voiced\r\n";
+	manager.handleClientInput(member, line.c_str(), line.size());
+	EXPECT_NE(drain(so[0]).find("voiced"), std::string::npos);
+	line = "MODE #mod -v troll\r\nMODE #mod -b troll\r\n";
+	manager.handleClientInput(op, line.c_str(), line.size());
+	line = "PRIVMSG #mod :unbanned\r\n";
+	manager.handleClientInput(member, line.c_str(), line.size());
+	EXPECT_NE(drain(so[0]).find("unbanned"), std::string::npos);
+
+	// +I lets a matching client past +i without an invite
+	line = "JOIN #closed\r\nMODE #closed +i\r\nMODE #closed +I *!*@10.0.0.*\r\n";
+	manager.handleClientInput(op, line.c_str(), line.size());
+	line = "JOIN #closed\r\n";
+	manager.handleClientInput(member, line.c_str(), line.size());
+	manager.handleClientInput(good, line.c_str(), line.size());
+	EXPECT_TRUE(manager.getChannel("#closed")->isClientInChannel(member));
+	EXPECT_FALSE(manager.getChannel("#closed")->isClientInChannel(good));
+	EXPECT_EQ(manager.getChannel("#closed")->getMaskCount(), 1u);
+}
+
+TEST(ChannelsClientsManagerTest, SendQueueIsAccountedAndCapped) {
+	int sv[2];
+	setSocketPair(sv);
+	MemoryBudget::setLimits(CLIENT_RECVQ_LIMIT, 64 * 1024, SERVER_MEMORY_LIMIT);
+	Client* client = new Client(sv[1]);
+	size_t outputBefore = MemoryBudget::used(MEM_OUTPUT);
+
+	// Nobody reads sv[0]: the socket fills up, then the queue, then the client is cut off
+	std::string line(500, 'x');
+	line += "\r\n";
+	for (int i = 0; i < 2000 && !client->isSendQueueExceeded(); ++i)
+		client->sendMessage(line);
+	EXPECT_TRUE(client->isSendQueueExceeded());
+	// and is handed to the server once, without it scanning every client
+	std::vector<int> exceeded;
+	Client::takeSendQueueExceeded(exceeded);
+	EXPECT_EQ(std::count(exceeded.begin(), exceeded.end(), sv[1]), 1);
+	client->sendMessage(line);
+	Client::takeSendQueueExceeded(exceeded);
+	EXPECT_TRUE(exceeded.empty());
+	EXPECT_TRUE(client->hasPendingOutput());
+	EXPECT_LE(client->getSendQueueSize(), 64u * 1024);
+	EXPECT_GE(MemoryBudget::used(MEM_OUTPUT), outputBefore + client->getSendQueueSize());
+
+	// Reading makes room, flushing hands the queue to the socket
+	char drain[65536];
+	while (client->hasPendingOutput()) {
+		while (recv(sv[0], drain, sizeof(drain), MSG_DONTWAIT) > 0)
+			;
+		EXPECT_TRUE(client->flushSendQueue());
+	}
+	EXPECT_EQ(MemoryBudget::used(MEM_OUTPUT), outputBefore);
+
+	delete client;
+	MemoryBudget::setLimits(CLIENT_RECVQ_LIMIT, CLIENT_SENDQ_LIMIT, SERVER_MEMORY_LIMIT);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+TEST(ChannelsClientsManagerTest, StatsMemoryReport) {
+	int sv[2];
+	int sv2[2];
+	std::string correctPass = "correct_password";
+	std::vector<pollfd> pollfds;
+	std::map<int, Client*> clients_map;
+	pollfd server_pfd;
+	pollfds.push_back(server_pfd);
+
+	Client* local = returnReadyToConnectClient(pollfds, clients_map, sv, correctPass, "admin", "admin");
+	Client* remote = returnReadyToConnectClient(pollfds, clients_map, sv2, correctPass, "guest", "guest");
+	local->setHostname("127.0.0.1");
+	remote->setHostname("10.0.0.7");
+	ChannelsClientsManager manager(clients_map, correctPass, pollfds);
+	manager.handleClientMessage(local);
+	manager.handleClientMessage(remote);
+	char buffer[4096];
+	recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1);
+	recv_nonblocking(sv2[0], buffer, sizeof(buffer) - 1);
+
+	local->addToBuffer("STATS z\r\n");
+	manager.handleClientMessage(local);
+	recv_nonblocking(sv[0], buffer, sizeof(buffer) - 1);
+	std::string report(buffer);
+	EXPECT_NE(report.find(":ft_irc.42.de 249 admin :sendq "), std::string::npos);
+	EXPECT_NE(report.find(":ft_irc.42.de 249 admin :channels "), std::string::npos);
+	EXPECT_NE(report.find(":ft_irc.42.de 249 admin :in use: 2 clients, 0 channels\r\n"), std::string::npos);
+	EXPECT_NE(report.find(":ft_irc.42.de 219 admin z :End of STATS report\r\n"), std::string::npos);
+
+	remote->addToBuffer("STATS z\r\n");
+	manager.handleClientMessage(remote);
+	recv_nonblocking(sv2[0], buffer, sizeof(buffer) - 1);
+	report = buffer;
+	EXPECT_NE(report.find(":ft_irc.42.de 481 guest :"), std::string::npos);
+	EXPECT_EQ(report.find(" 249 "), std::string::npos);
+
+	close(sv[0]);
+	close(sv[1]);
+	close(sv2[0]);
+	close(sv2[1]);
+}
+
 // // Test JOIN with invalid channel name
 // TEST(ChannelsClientsManagerTest, JoinInvalidChannelName) {
 // 	int sv[2];
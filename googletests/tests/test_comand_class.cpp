@@ -3,6 +3,7 @@
 #include "../../inc/Client.hpp"
 #include "../../inc/IRCCommand.hpp"
 #include "../../inc/ReplyNumbers.hpp"
+#include "../../inc/MessageView.hpp"
 
 TEST(CommandClassTest, ExecuteMethodTest)
 {
@@ -679,6 +680,62 @@ TEST(CommandClassTest, PongCommandValidTest) {
 	EXPECT_EQ(cmd.getErrorNum(), "");
 }
 
+TEST(CommandClassTest, MessageViewSplitsInPlace)
+{
+	std::string line = ":nick!u@h PRIVMSG  #chan :hello  there\r\n";
+	MessageView view;
+	ASSERT_TRUE(view.parse(line.c_str(), line.size()));
+	EXPECT_EQ(view.prefix().str(), "nick!u@h");
+	EXPECT_EQ(view.command().str(), "PRIVMSG");
+	EXPECT_EQ(view.args().str(), "#chan :hello  there");
+	ASSERT_EQ(view.paramCount(), 2u);
+	EXPECT_EQ(view.param(0).str(), "#chan");
+	EXPECT_EQ(view.param(1).str(), "hello  there");
+	EXPECT_TRUE(view.param(2).empty());
+	// Views point into the line, nothing is copied
+	EXPECT_EQ(view.command().data, line.c_str() + 10);
+
+	std::string noCommand = "   \r\n";
+	EXPECT_FALSE(view.parse(noCommand.c_str(), noCommand.size()));
+}
+
+TEST(CommandClassTest, MessageTagsAreParsedLazily)
+{
+	std::string line = "@+typing=active;time=2026-01-01T00:00:00Z;+x/reply=a\\:b\\sc;flag :nick PRIVMSG #chan :hi\r\n";
+	MessageView view;
+	ASSERT_TRUE(view.parse(line.c_str(), line.size()));
+	EXPECT_EQ(view.tags().data, line.c_str() + 1);
+	EXPECT_EQ(view.prefix().str(), "nick");
+	EXPECT_EQ(view.command().str(), "PRIVMSG");
+	EXPECT_EQ(view.param(1).str(), "hi");
+
+	StringSpan value;
+	ASSERT_TRUE(view.tag("+typing", value));
+	EXPECT_EQ(value.str(), "active");
+	ASSERT_TRUE(view.tag("flag", value));
+	EXPECT_TRUE(value.empty());
+	EXPECT_FALSE(view.tag("typing", value));
+	ASSERT_TRUE(view.tag("+x/reply", value));
+	EXPECT_EQ(value.str(), "a\\:b\\sc");
+
+	Arena arena;
+	EXPECT_EQ(MessageView::unescapeTagValue(value, arena).str(), "a;b c");
+	StringSpan plain("no-escapes", 10);
+	EXPECT_EQ(MessageView::unescapeTagValue(plain, arena).data, plain.data);
+	EXPECT_EQ(MessageView::clientOnlyTags(view.tags(), arena).str(), "+typing=active;+x/reply=a\\:b\\sc");
+	StringSpan onlyClient("+a;+b=1", 7);
+	EXPECT_EQ(MessageView::clientOnlyTags(onlyClient, arena).data, onlyClient.data);
+	EXPECT_TRUE(MessageView::clientOnlyTags(StringSpan("time=1", 6), arena).empty());
+
+	IRCCommand cmd("@time=1;+a=b JOIN #chan\r\n");
+	EXPECT_TRUE(cmd.isValid());
+	EXPECT_EQ(cmd.getCommand(), "JOIN");
+	EXPECT_EQ(cmd.getTags(), "time=1;+a=b");
+	EXPECT_EQ(cmd.getParamAt(0), "#chan");
+	IRCCommand tagsOnly("@time=1\r\n");
+	EXPECT_FALSE(tagsOnly.isValid());
+}
+
 
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
@@ -192,7 +192,10 @@ TEST_F(ServerTest, BasicCommunication) {
     sendMessage(client_fd_1, "NICK testuser1\r\nUSER testuser1 0 * :Test1 User1\r\n");
 
     response = receiveMessage(client_fd_1, &bytes_received);
-    EXPECT_EQ(response, ":ft_irc.42.de 001 testuser1 :Welcome to the ft_IRC Network\r\n");
+    EXPECT_EQ(response, ":ft_irc.42.de 001 testuser1 :Welcome to the ft_IRC Network\r\n"
+        ":ft_irc.42.de 005 testuser1 CASEMAPPING=rfc1459 CHANMODES=beI,k,l,it CHANNELLEN=50 CHANTYPES=#& ELIST=CMNTU"
+        " EXCEPTS INVEX MAXLIST=beI:1000 MONITOR=100 NICKLEN=30 PREFIX=(ov)@+ TARGMAX=NOTICE:10,PRIVMSG:10 WHOX"
+        " :are supported by this server\r\n");
 
     int select_result = waitForData(client_fd_1, 3);
     ASSERT_EQ(select_result, 0) << "Timeout waiting for server response";
@@ -218,3 +221,23 @@ TEST_F(ServerTest, ClientTimeout) {
 
     close(client_fd_1);
 }
+
+// A restart brings everybody back at once: far more than one connection per
+// wakeup, and more than the old backlog of 10, all get their greeting
+TEST_F(ServerTest, ReconnectStormIsAccepted) {
+    const int clients = 300;
+    std::vector<int> fds;
+    for (int i = 0; i < clients; ++i)
+        fds.push_back(returnClientFd(test_port));
+    int greeted = 0;
+    for (int i = 0; i < clients; ++i) {
+        if (waitForData(fds[i], 2) > 0) {
+            int bytes_received;
+            std::string response = receiveMessage(fds[i], &bytes_received);
+            greeted += response.find(" 001 ") != std::string::npos;
+        }
+    }
+    for (int i = 0; i < clients; ++i)
+        close(fds[i]);
+    EXPECT_EQ(greeted, clients);
+}
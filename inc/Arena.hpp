@@ -0,0 +1,87 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Bump-pointer arena for transient data of one event-loop iteration: parsed
+// spans that need a copy, formatted replies and broadcasts. Nothing is freed
+// individually, reset() drops everything at once. When an iteration needed
+// more than one chunk, reset() replaces them with a single chunk that size,
+// so a steady load settles on one chunk and stops allocating. After a burst,
+// the chunk shrinks back to what the last ARENA_SHRINK_RESETS iterations
+// needed, never below ARENA_CHUNK_SIZE.
+
+# define ARENA_CHUNK_SIZE       16384
+# define ARENA_SHRINK_RESETS    256     // iterations looked at before shrinking
+
+// A view into bytes owned by someone else (the receive buffer, the arena...)
+struct StringSpan {
+    const char* data;
+    size_t      size;
+
+    StringSpan() : data(NULL), size(0) {}
+    StringSpan(const char* d, size_t s) : data(d), size(s) {}
+    bool        empty() const { return size == 0; }
+    char        operator[](size_t i) const { return data[i]; }
+    bool        equals(const char* str) const { return std::strlen(str) == size && std::memcmp(data, str, size) == 0; }
+    std::string str() const { return std::string(data, size); }
+};
+
+class Arena {
+private:
+    std::vector<char*>  _chunks;
+    size_t              _chunkSize;     // size of the newest chunk
+    size_t              _offset;        // used bytes in the newest chunk
+    size_t              _total;         // capacity of all chunks
+    size_t              _peak;          // most one iteration used since the last resize
+    size_t              _resets;        // iterations since the last resize
+
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    void        grow(size_t atLeast);
+    void        release();
+
+public:
+    Arena();
+    ~Arena();
+
+    char*       allocate(size_t size);
+    StringSpan  copy(const char* data, size_t size);
+    void        reset();
+    size_t      capacity() const { return _total; }
+    // Of every arena, MemoryBudget reports it with the send queues
+    static size_t   totalCapacity();
+};
+
+// Concatenates into arena memory: ArenaWriter w(arena); w << "a" << name; w.span()
+// Grows by moving to a bigger block in the same arena, the old block is just left behind.
+class ArenaWriter {
+private:
+    Arena&  _arena;
+    char*   _data;
+    size_t  _size;
+    size_t  _capacity;
+
+    void    reserve(size_t extra);
+
+public:
+    ArenaWriter(Arena& arena, size_t expected = 512);
+
+    ArenaWriter&    append(const char* data, size_t size);
+    ArenaWriter&    operator<<(const char* str) { return append(str, std::strlen(str)); }
+    ArenaWriter&    operator<<(const std::string& str) { return append(str.data(), str.size()); }
+    ArenaWriter&    operator<<(const StringSpan& span) { return append(span.data, span.size); }
+    ArenaWriter&    operator<<(char c) { return append(&c, 1); }
+    template <typename Name>
+    ArenaWriter&    name(const Name& name) { return append(name.c_str(), name.size()); }
+
+    const char*     data() const { return _data; }
+    size_t          size() const { return _size; }
+    StringSpan      span() const { return StringSpan(_data, _size); }
+};
+
+#endif
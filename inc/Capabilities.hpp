@@ -0,0 +1,30 @@
+#ifndef CAPABILITIES_HPP
+#define CAPABILITIES_HPP
+
+#include <string>
+
+// IRCv3 capabilities a client can enable with CAP REQ, one bit each in Client::_caps
+enum Capability {
+    CAP_SERVER_TIME     = 1 << 0,
+    CAP_MESSAGE_TAGS    = 1 << 1,
+    CAP_ECHO_MESSAGE    = 1 << 2,
+    CAP_MULTI_PREFIX    = 1 << 3,
+    CAP_BATCH           = 1 << 4,
+    CAP_ALL             = (1 << 5) - 1
+};
+
+// Only these change the bytes of a relayed message, so a message never needs
+// more than CAP_VARIANTS different lines however many clients see it
+# define CAP_VARIANTS 4
+
+class Capabilities {
+public:
+    static unsigned int fromName(const std::string& name); // 0 when unknown
+    static std::string  names(unsigned int caps);          // space separated, as in CAP LS
+    static size_t       variant(unsigned int caps)
+    {
+        return ((caps & CAP_MESSAGE_TAGS) ? 1 : 0) | ((caps & CAP_SERVER_TIME) ? 2 : 0);
+    }
+};
+
+#endif
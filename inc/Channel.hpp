@@ -3,21 +3,50 @@
 
 #include <string>
 #include <vector>
+#include "ObjectPool.hpp"
+#include "Membership.hpp"
+#include "FixedString.hpp"
+#include "OutgoingMessage.hpp"
+#include "ChannelHistory.hpp"
+#include "NamesCache.hpp"
+#include "ChannelDirectory.hpp"
+#include "MaskList.hpp"
 // #include <atomic>
 
 class Client;
 
+// +b, +e and +I, allocated with the first mask: most channels never have one
+struct ChannelMasks {
+    MaskList    bans;
+    MaskList    exceptions;
+    MaskList    inviteExceptions;
+};
+
 class Channel {
 private:
-    std::string                 _name;
+    ChannelName                 _name;  // inline, no heap
     std::string                 _topic;
-    std::vector<Client*>        _clients; // TODO clean when Clients are deleted
-    std::vector<Client*>        _operators; // TODO clean when Clients are deleted
-    std::vector<Client*>        _invited; // TODO clean when Clients are deleted
+    std::vector<Membership*>    _members; // operator status lives in the membership node
+    size_t                      _operatorCount;
+    std::vector<Client*>        _invited; // mirrored by Client::_invites so a quitting client can clean up
     bool                        _isInviteOnly;
     bool                        _topicProtected;
     std::string                 _key; // password
     size_t                      _userLimit;
+    size_t                      _accounted; // bytes reported to MemoryBudget
+    ChannelHistory              _history;   // last PRIVMSGs, for CHATHISTORY
+    NamesCache                  _names;     // NAMES payload, kept in step with the members
+    time_t                      _topicTime;
+    time_t                      _created;
+    ChannelDirectory*           _directory; // where LIST finds us, NULL when not listed
+    unsigned long               _directoryId;
+    ChannelMasks*               _masks;
+    unsigned                    _maskGeneration; // bumped on every +b/+e change, see Membership::bansChecked
+
+    Channel(const Channel&);
+    Channel& operator=(const Channel&);
+
+    void                account();
 
     // Unique identifier for the channel (if needed)
     // std::uint64_t id_;
@@ -26,12 +55,29 @@ public:
     Channel(const std::string& name);
     ~Channel();
 
+    // Channels come from a slab pool, see ObjectPool.hpp
+    static void*        operator new(size_t size);
+    static void         operator delete(void* ptr, size_t size);
+    static PoolStats    poolStats();
+
     void                addClient(Client* client);
     void                removeClient(Client* client);
     void                removeClient(const std::string& client);
+    void                removeMembership(Membership* membership);
     void                addOperator(Client* client);
     void                removeOperator(Client* client);
+    void                setVoiced(Client* client, bool voiced);
+    bool                isVoiced(Client* client) const;
+    void                memberRenamed(const std::string& oldNick, Membership* membership)
+    {
+        _names.renamed(oldNick, *membership);
+        membership->bansChecked = 0;
+    }
     void                broadcast(const std::string& message, Client* sender = NULL);
+    void                broadcast(const char* data, size_t len, Client* sender = NULL, unsigned long delivery = 0);
+    // Each member gets the line for its capabilities, the sender only with echo-message.
+    // A nonzero delivery skips members that already got it (Client::markDelivered).
+    void                broadcast(const OutgoingMessage& message, Client* sender, unsigned long delivery = 0);
     bool                isClientInChannel(Client* client) const;
     bool                isClientInChannel(const std::string& client) const;
     bool                isOperator(Client* client) const;
@@ -39,7 +85,7 @@ public:
     bool                isInviteOnly() const;
     void                setTopicProtected(bool status) { _topicProtected = status; }
     bool                isTopicProtected() const { return _topicProtected; }
-    void                setKey(const std::string& key) { _key = key; }
+    void                setKey(const std::string& key) { _key = key; account(); }
     void                setUserLimit(size_t limit) { _userLimit = limit; }
     size_t              getUserLimit() const { return _userLimit; }
     const std::string&  getKey() const { return _key; }
@@ -47,11 +93,34 @@ public:
     void                removeInvited(Client* client);
     bool                isInvited(Client* client) const;
     // Getters & Setters
-    const std::string&  getName() const;
+    const ChannelName&  getName() const;
     const std::string&  getTopic() const;
     void                setTopic(const std::string& topic);
-    std::vector<Client*>& getClients();
-    std::vector<Client*>& getOperators();
+    void                setTopic(const std::string& topic, time_t setAt); // a hot restart keeps the old time
+    time_t              getTopicTime() const { return _topicTime; }
+    time_t              getCreated() const { return _created; }
+    void                setCreated(time_t created);
+    void                listIn(ChannelDirectory* directory);
+    const std::vector<Membership*>& getMembers() const { return _members; }
+    size_t              getClientCount() const { return _members.size(); }
+    size_t              getOperatorCount() const { return _operatorCount; }
+    std::vector<Client*> getClients() const;
+    std::vector<Client*> getOperators() const;
+    std::vector<Client*>& getInvited() { return _invited; }
+    ChannelHistory&     getHistory() { return _history; }
+    // "@op +voiced plain", all prefixes with multiPrefix
+    const std::string&  getNames(bool multiPrefix);
+    const NamesCache&   getNamesCache() const { return _names; }
+    // Mask lists by mode letter ('b', 'e', 'I'); NULL from the const one when there are none yet
+    MaskList&           getMaskList(char mode);
+    const MaskList*     findMaskList(char mode) const;
+    size_t              getMaskCount() const;
+    bool                addMask(char mode, const std::string& mask, const std::string& setBy, time_t setAt);
+    bool                removeMask(char mode, const std::string& mask);
+    // Matches +b and no +e. A member's verdict is kept until the lists change
+    // or memberRenamed, so talking in a channel with a long ban list stays cheap.
+    bool                isBanned(Client* client, Membership* membership = NULL);
+    bool                isInviteException(const Client* client) const;
 };
 
 #endif
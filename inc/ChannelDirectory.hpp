@@ -0,0 +1,76 @@
+#ifndef CHANNELDIRECTORY_HPP
+#define CHANNELDIRECTORY_HPP
+
+#include <cstddef>
+#include <ctime>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "FixedString.hpp"
+#include "Mask.hpp"
+
+class Channel;
+
+# define LIST_SENDQ_WATERMARK   (32 * 1024) // a LIST waits while more than this is unsent
+# define LIST_BATCH             64          // entries looked at between two sendq checks
+# define LIST_TURN_BUDGET       4096        // entries looked at per client per loop turn
+
+// What LIST needs to know about a channel, copied out of it so a filter
+// never touches the Channel itself. Channels update their entry as members
+// come and go and topics change.
+struct DirectoryEntry {
+    Channel*    channel;
+    ChannelName name;
+    size_t      users;
+    time_t      created;
+    time_t      topicTime;  // 0 while there is no topic
+};
+
+// A LIST in progress: the ELIST conditions and where the walk stopped.
+// "LIST >10,<500,T<60,#foo*,!#foo-old" -> more than 10 and fewer than 500
+// users, topic set in the last hour, matching #foo* but not #foo-old.
+// C<n/C>n and T<n/T>n are in minutes.
+struct ListQuery {
+    size_t                      minUsers;   // users > minUsers
+    size_t                      maxUsers;   // users < maxUsers, 0 for no bound
+    time_t                      createdAfter;
+    time_t                      createdBefore;
+    time_t                      topicAfter;
+    time_t                      topicBefore;
+    std::vector<std::string>    masks;      // one of them has to match, if any
+    std::vector<CompiledMask>   matchers;   // masks, compiled
+    std::vector<CompiledMask>   excluded;   // none of them may match
+    bool                        byUsers;    // walking the user count index
+    size_t                      nextUsers;
+    unsigned long               nextId;
+
+    ListQuery();
+    void    parse(const std::string& conditions, time_t now); // unknown conditions are ignored
+    bool    matches(const DirectoryEntry& entry) const;
+    bool    onlyNames() const; // plain channel names, looked up instead of walked
+};
+
+// Every channel, in creation order and by user count. LIST walks one of the
+// two and can stop anywhere: the position is a key, not an iterator, so
+// channels may come and go while a client is being served.
+class ChannelDirectory {
+private:
+    std::map<unsigned long, DirectoryEntry>         _entries;   // by id, ids only grow
+    std::set<std::pair<size_t, unsigned long> >     _byUsers;
+    unsigned long                                   _nextId;
+
+public:
+    ChannelDirectory();
+
+    unsigned long   add(Channel* channel, const ChannelName& name, time_t created);
+    void            remove(unsigned long id);
+    void            setUsers(unsigned long id, size_t users);
+    void            setTopicTime(unsigned long id, time_t topicTime);
+    void            setCreated(unsigned long id, time_t created);
+    size_t          size() const { return _entries.size(); }
+    // Appends the matches among the next `budget` entries; false once the walk is over
+    bool            next(ListQuery& query, std::vector<Channel*>& out, size_t budget) const;
+};
+
+#endif
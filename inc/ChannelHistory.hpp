@@ -0,0 +1,111 @@
+#ifndef CHANNELHISTORY_HPP
+#define CHANNELHISTORY_HPP
+
+#include <cstddef>
+#include <vector>
+#include "Arena.hpp"
+
+// Defaults, override with IRCSERV_HISTORY_DEPTH / IRCSERV_HISTORY_CHANNEL_BYTES / IRCSERV_HISTORY_MEMORY
+# define HISTORY_DEPTH          100                 // messages kept per channel
+# define HISTORY_CHANNEL_BYTES  (64 * 1024)         // per channel
+# define HISTORY_MEMORY         (32 * 1024 * 1024)  // all channels together
+# define HISTORY_MSGID_SIZE     16                  // hex digits of HistoryBlock::id
+# define HISTORY_FLOOR          10                  // messages HISTORY_MEMORY never takes from a channel
+
+// One relayed channel message, kept exactly as it went out ("nick!user@host
+// PRIVMSG #chan :text\r\n"). Blocks are reference counted so a replay or a
+// writer can hold on to one after the ring moved on, and they come from
+// per-size free lists: once the rings are full, storing a message reuses the
+// block of the one it evicts.
+struct HistoryBlock {
+    unsigned long long  id;     // server-wide, increasing; the msgid tag is its hex form
+    unsigned long long  time;   // milliseconds since the epoch
+    size_t              size;
+    unsigned int        refs;
+    unsigned char       sizeClass;
+    char                data[1];
+
+    static HistoryBlock*    create(unsigned long long id, unsigned long long time, const StringSpan& line);
+    void                    retain() { refs++; }
+    void                    release();
+    StringSpan              line() const { return StringSpan(data, size); }
+    size_t                  formatId(char* out) const { return formatId(id, out); }
+    static size_t           formatId(unsigned long long id, char* out); // HISTORY_MSGID_SIZE bytes, no terminator
+    static bool             parseId(const std::string& msgid, unsigned long long& id);
+};
+
+// One stored message, wherever it lives: a ring block or a record of the
+// on-disk log (then line points into the mapped segment)
+struct HistoryRecord {
+    unsigned long long  id;
+    unsigned long long  time;
+    StringSpan          line;
+
+    HistoryRecord() : id(0), time(0) {}
+    HistoryRecord(unsigned long long i, unsigned long long t, const StringSpan& l) : id(i), time(t), line(l) {}
+};
+
+// What a CHATHISTORY query asks a store for: records whose key (time or id)
+// is in [low, high] and whose id is below idLimit, the first `limit` of them
+// or the last ones with fromEnd. The ring and the log answer the same
+// ranges, idLimit is how the log is told to stop where the ring takes over.
+struct HistoryRange {
+    bool                byTime;
+    unsigned long long  low;
+    unsigned long long  high;
+    unsigned long long  idLimit;
+    size_t              limit;
+    bool                fromEnd;
+
+    HistoryRange() : byTime(false), low(0), high(~0ULL), idLimit(~0ULL), limit(0), fromEnd(false) {}
+    unsigned long long  key(unsigned long long id, unsigned long long time) const { return byTime ? time : id; }
+};
+
+// Ring of the last messages of one channel, oldest first. Ids and times only
+// grow, so lookups by msgid or timestamp are binary searches over the ring.
+// HISTORY_MEMORY is for all rings together: when it's reached, the oldest
+// message of any channel goes, so idle channels give way to busy ones, down
+// to HISTORY_FLOOR messages each.
+class ChannelHistory {
+private:
+    std::vector<HistoryBlock*>  _ring;  // sized on first append
+    size_t                      _head;  // slot of the oldest entry
+    size_t                      _count;
+    size_t                      _bytes;
+    size_t                      _slot;  // in the server-wide eviction heap, -1 if not there
+
+    ChannelHistory(const ChannelHistory&);
+    ChannelHistory& operator=(const ChannelHistory&);
+
+    void                dropOldest();
+    void                index();
+    void                unindex();
+    static void         sift(size_t slot);
+    HistoryBlock*       store(unsigned long long id, unsigned long long time, const StringSpan& line);
+    size_t              lowerBoundKey(bool byTime, unsigned long long key) const;
+
+public:
+    ChannelHistory();
+    ~ChannelHistory();
+
+    // Stores a copy of line, evicting whatever the limits ask for first
+    HistoryBlock*       append(unsigned long long time, const StringSpan& line);
+    // Same, keeping id and time: messages read back from the log
+    HistoryBlock*       restore(unsigned long long id, unsigned long long time, const StringSpan& line);
+    void                clear();
+    size_t              size() const { return _count; }
+    size_t              bytes() const { return _bytes; }
+    HistoryBlock*       at(size_t index) const { return _ring[(_head + index) % _ring.size()]; }
+    size_t              findId(unsigned long long id) const;        // size() when not kept
+    size_t              lowerBound(unsigned long long time) const;  // first entry at or after time
+    size_t              upperBound(unsigned long long time) const;  // first entry after time
+    void                select(const HistoryRange& range, std::vector<HistoryRecord>& out) const;
+
+    static void         setLimits(size_t depth, size_t channelBytes, size_t totalBytes);
+    static void         loadLimitsFromEnv();
+    static size_t       depth();
+    static size_t       totalBytes(); // in all rings
+    static unsigned long long nextId();
+};
+
+#endif
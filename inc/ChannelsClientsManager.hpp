@@ -5,14 +5,28 @@
 #include "Client.hpp"
 #include "IRCCommand.hpp"
 #include "Reply.hpp"
+#include "Arena.hpp"
+#include "UserIndex.hpp"
+#include "MonitorIndex.hpp"
 #include <vector>
 #include <string>
 #include <map>
+#include <set>
 #include <iostream>
 #include <poll.h>
 #include <unistd.h>
 #include <cstdlib>
 
+# define CHATHISTORY_LIMIT 100 // most messages one CHATHISTORY returns
+# define MESSAGE_TARGETS_LIMIT 10 // most targets of one PRIVMSG or NOTICE, advertised as TARGMAX
+
+// One target of a PRIVMSG or NOTICE, found: either channel or recipient is set
+struct MessageTarget {
+	StringSpan	name;
+	Channel		*channel;
+	Client		*recipient;
+};
+
 
 // Yes, in the IRC protocol, if a client’s connection is not maintained (for example, due to network timeout, client disconnect, or socket error), the server removes the client from all channels and from the server itself.
 
@@ -23,26 +37,75 @@
 // Other users in the same channels are notified with a QUIT message.
 
 
+class MessageView;
+class HistoryLog;
+class HistoryLogView;
+class ConnectionLimiter;
+
 class ChannelsClientsManager {
 public:
     ChannelsClientsManager(std::map<int, Client*> &clients, std::string const &password, std::vector<pollfd> &pollfds);
     ~ChannelsClientsManager();
 	// void setClientsMap(std::map<int, Client*> *clients, std::string const *password, std::vector<pollfd> *pollfds);
 	void handleClientMessage(Client* client);
+	void handleClientInput(Client* client, const char* data, size_t len);
     // void addClientToChannel(Client* client, Channel* channel);
     // void removeClientFromChannel(Client* client, Channel* channel);
     // std::vector<Client*> getClientsInChannel(Channel* channel);
 	Channel							*getChannel(std::string const &channelName); // if null, channel doesn't exit
+	// Handlers turn a target into a ChannelName once and look it up with that
+	Channel							*findChannel(const ChannelName& name);
 	int								getPollSize() const { return _pollfds.size(); }
 	int								getClientsSize() const { return _clients.size(); }
 	int								getChannelsSize() const { return _channels.size(); }
-	void							removeClient(Client &client);
+	void							addClient(Client* client);
+	// Peers in its channels see reason in a QUIT
+	void							removeClient(Client &client, const std::string& reason = "Connection closed");
+	// O(1) lookup for the poll loop, NULL for the listening socket and unknown fds
+	Client							*getClientByFd(int fd) const {
+		return (fd >= 0 && static_cast<size_t>(fd) < _clientsByFd.size()) ? _clientsByFd[fd] : NULL;
+	}
 	void							sendPingToClient(Client* client);
+	// Hot restart: dump/restore clients and channels, client fds are collected in blob order
+	void							saveState(std::ostream& os, std::vector<int>& fds) const;
+	// Transient memory of one loop iteration, the server resets it after each poll round
+	Arena							&getArena() { return _arena; }
+	void							resetArena() { _arena.reset(); }
+	bool							restoreState(std::istream& is, const std::vector<int>& fds, size_t nextFd);
+	// Optional persistent history, owned by the server; NULL keeps history in memory only
+	void							setHistoryLog(HistoryLog* log) { _historyLog = log; }
+	// Told about every client that goes, so its address stops counting
+	void							setConnectionLimiter(ConnectionLimiter* limiter) { _limiter = limiter; }
+	// LIST and WHO output is produced while the client keeps up; the server
+	// loop calls this every round and doesn't sleep while it has more to do
+	void							continueListings();
+	bool							hasRunnableListings() const;
+	// Flood control (FloodControl.hpp), off unless the server turns it on.
+	// Input held back is handled by continueDeferred once the client's budget
+	// allows; deferredTimeout is how long the loop may sleep until then, -1
+	// while nothing waits.
+	void							setFloodControl(bool enabled) { _floodControl = enabled; }
+	void							continueDeferred();
+	int								deferredTimeout() const;
 private:
-    std::map<std::string, Channel*>	_channels;
+    std::map<ChannelName, Channel*>	_channels;
+	ChannelDirectory				_directory;
+	std::map<int, ListQuery>		_listings; // LISTs in progress, by client fd
+	UserIndex						_users; // registered clients, for WHO masks
+	std::map<int, WhoQuery>			_whoQueries; // WHOs in progress, by client fd
+	std::set<int>					_deferred; // fds with input held back by flood control
+	MonitorIndex					_monitors;
+	std::map<NickName, Client*>		_nicks; // registered nicknames, casefolded
 	std::map<int, Client*>			&_clients;
+	std::vector<Client*>			_clientsByFd; // mirrors _clients, indexed by fd
 	std::string const				&_password;
 	std::vector<pollfd>     		&_pollfds;
+	Arena							_arena;
+	unsigned long					_batchCount; // for unique BATCH references
+	unsigned long					_deliveryCount; // for Client::markDelivered
+	HistoryLog						*_historyLog;
+	ConnectionLimiter				*_limiter;
+	bool							_floodControl;
 
 	// void							setNick(Client* client, IRCCommand& command);
 	// Registration
@@ -50,17 +113,57 @@ private:
 	void							setNickname(Client* client, IRCCommand& command);
 	void							registerClient(Client* client, IRCCommand& command);
 	void							handleRegisteredClientMessage(Client* client, IRCCommand& command);
+	bool							processMessage(Client* client, const std::string& message);
+	bool							processMessage(Client* client, const char* line, size_t len);
+	bool							privmsgFromView(Client* client, const MessageView& view, const char* command);
+	bool							admitCommand(Client* client, const char* line, size_t len, unsigned long long now);
+	void							deferInput(Client* client, const char* data, size_t len);
+	bool							findMessageTarget(Client* client, const StringSpan& target, Channel*& channel, Client*& recipient);
+	void							reportMessageTarget(Client* client, const std::string& target);
+	void							relayMessage(Client* client, Channel* channel, Client* recipient, const char* command,
+										const StringSpan& target, const StringSpan* text, const StringSpan& clientTags);
+	void							relayMessage(Client* client, const StringSpan& source, const MessageTarget& target,
+										const StringSpan* text, const StringSpan& clientTags, unsigned long delivery);
+	void							relayToTargets(Client* client, const MessageTarget* targets, size_t count,
+										const char* command, const StringSpan& text, const StringSpan& clientTags);
 	// Command execution
 	void							executePrivmsg(Client* client, IRCCommand& command);
 	void							executeJoin(Client* client, IRCCommand& command);
 	void							executeInvite(Client* client, IRCCommand& command);
 	void							executeTopic(Client* client, IRCCommand& command);
 	void							executeKick(Client* client, IRCCommand& command);
+	void							executePart(Client* client, IRCCommand& command);
 	void							executePing(Client* client, IRCCommand& command);
 	void							executeMode(Client* client, IRCCommand& command);
 	void							executeWhois(Client* client, IRCCommand& command);
+	void							executeStats(Client* client, IRCCommand& command);
+	bool							executeCap(Client* client, IRCCommand& command);
+	void							executeChathistory(Client* client, IRCCommand& command);
+	void							executeNames(Client* client, IRCCommand& command);
+	void							sendNames(Client* client, Channel* channel);
+	void							executeList(Client* client, IRCCommand& command);
+	bool							continueList(Client* client, ListQuery& query);
+	void							appendListEntry(ArenaWriter& out, Client* client, Channel* channel);
+	void							executeWho(Client* client, IRCCommand& command);
+	bool							continueWho(Client* client, WhoQuery& query);
+	void							appendWhoEntry(ArenaWriter& out, Client* client, const WhoQuery& query,
+										Client* target, const Membership* membership);
+	void							executeMonitor(Client* client, IRCCommand& command);
+	void							sendMonitorStatus(Client* client, const std::vector<NickName>& targets);
+	void							notifyMonitors(const Client& target, const NickName& nick, bool online);
+	Channel							*createChannel(const std::string& name);
+	void							selectHistory(Channel* channel, HistoryRange range, std::vector<HistoryRecord>& out, HistoryLogView& view);
+	void							replayHistory(Client* client, Channel* channel, const std::vector<HistoryRecord>& records);
+	void							executeTagmsg(Client* client, const MessageView& view);
+	void							executeQuit(Client* client, IRCCommand& command);
+	void							disconnect(Client* client, const std::string& reason);
+	void							broadcastToPeers(const Client& client, const StringSpan& line);
+	void							broadcastQuit(const Client& client, const std::string& reason);
+	void							leaveChannels(Client& client);
 	// Helper functions
 	void							handleModeFlags(Client &client, Channel &channel, IRCCommand& command);
+	void							sendMaskList(Client* client, Channel* channel, char mode);
+	size_t							countMaskedChannels() const;
 	Client*							getClientByNickname(const std::string& nickname, Client* client);
 	void							continueLoopJoin(size_t &start, size_t &end, const std::string& channels);
 	void							Key_check();
@@ -3,56 +3,151 @@
 
 #include <string>
 #include <vector>
+#include <ctime>
+#include "ObjectPool.hpp"
+#include "Membership.hpp"
+#include "FixedString.hpp"
+#include "Arena.hpp"
+#include "FloodControl.hpp"
+
+class Channel;
+
+// Rarely read identity data, kept out of line so the hot part of Client stays small
+struct ClientIdentity {
+    std::string             username;
+    std::string             realname;
+    std::string             hostname;
+    std::vector<Channel*>   invites;
+    std::string             deferred;   // complete input held back by flood control
+    std::string             hostmask;   // nick!user@host, the source of everything it sends
+    unsigned long           stamp;      // new whenever the hostmask changes
+    unsigned int            address;    // IPv4, host order, as counted by ConnectionLimiter; 0 if none
+};
 
 class Client {
 private:
+    // Hot: the poll loop and a broadcast read only these, 64 bytes on LP64,
+    // so they come first and share one cache line per client.
     int                 _fd;
-    std::string         _nickname;
-    std::string         _username;
-    std::string         _realname;
-    std::string         _hostname;
     bool                _authenticated;
     bool                _registered;
     bool                _isCAPNegotiation;
-    std::vector<std::string> _channels;
-    std::string         _buffer;
+    bool                _quit;          // sent QUIT, the server drops it after this read
+    mutable bool        _sendQueueExceeded; // hit the sendq limit, server drops us
+    unsigned char       _caps;          // enabled Capability bits
     time_t              _connectionTime; // set in seconds
+    mutable unsigned long _deliveryMark;    // see markDelivered
+    // Output that didn't fit in the socket, flushed on POLLOUT by the server loop.
+    // sendMessage is const all over the code base, so the queue is mutable.
+    mutable std::string _sendQueue;
+    // Warm: per message this client sends or is sent
+    mutable size_t      _accountedInput;    // bytes reported to MemoryBudget
+    mutable size_t      _accountedOutput;
+    std::string         _buffer;    // only an unfinished line, empty (and unallocated) between lines
+    NickName            _nickname;  // inline, no heap
+    FloodControl        _flood;
+    std::vector<Membership*> _memberships; // shared with the channels, see Membership.hpp
+    // Cold
+    ClientIdentity*     _identity;
+
+    Client(const Client&);
+    Client& operator=(const Client&);
+
+    void                account() const;
+    void                identityChanged();
+    void                write(const char* data, size_t len) const;
+    void                write(const StringSpan* parts, size_t count) const;
 
 public:
     Client(int fd);
     ~Client();
 
+    // Clients come from a slab pool, see ObjectPool.hpp
+    static void*        operator new(size_t size);
+    static void         operator delete(void* ptr, size_t size);
+    static PoolStats    poolStats();
+
     void                addToBuffer(const std::string& msg);
+    void                addToBuffer(const char* data, size_t len);
     const std::string&  getBuffer() const;
     bool                hasCompleteMessage() const;
     std::string         getNextMessage();
     void                clearBuffer();
 	void				printBuffer() const;
     void                sendMessage(const std::string& msg) const;
-    void				addChannel(const std::string& channel);
-    void                removeChannel(const std::string& channel);
+    void                sendMessage(const char* data, size_t len) const;
+    // Sent as is, head carries whatever tags the line needs
+    void                sendMessage(const StringSpan& head, const StringSpan& body) const;
+    bool                flushSendQueue();
+    // One message reaching a client along several paths (a PRIVMSG to two
+    // channels it is in) is sent once: the first path marks the client with
+    // the message's delivery number, later ones find it marked
+    bool                markDelivered(unsigned long delivery) const
+    {
+        if (_deliveryMark == delivery)
+            return false;
+        _deliveryMark = delivery;
+        return true;
+    }
+    bool                hasPendingOutput() const { return !_sendQueue.empty(); }
+    size_t              getSendQueueSize() const { return _sendQueue.size(); }
+    const std::string&  getSendQueue() const { return _sendQueue; }
+    // Output another process had queued, sent as it is: it may start mid-line
+    void                requeueOutput(const std::string& output) const { write(output.data(), output.size()); }
+    bool                isSendQueueExceeded() const { return _sendQueueExceeded; }
+    // Fds of the clients that blew their sendq since the last call, so the
+    // server drops them without looking at every client on each wakeup
+    static void         takeSendQueueExceeded(std::vector<int>& fds);
+    void                shrinkBuffers();
+    void                attachMembership(Membership* membership);
+    void                detachMembership(Membership* membership);
+    Membership*         findMembership(const Channel* channel) const;
+    void                addInvite(Channel* channel);
+    void                removeInvite(Channel* channel);
     void                updateConnectionTime();
     time_t              getTimePassed() const;
+    time_t              getTimePassed(time_t now) const { return now - _connectionTime; }
+    time_t              getConnectionTime() const { return _connectionTime; }
+    void                setConnectionTime(time_t connectionTime) { _connectionTime = connectionTime; }
+    unsigned int        getAddress() const { return _identity->address; }
+    void                setAddress(unsigned int address) { _identity->address = address; }
     // Getters & Setters
     int                 getFd() const;
-    const std::string&  getNickname() const;
-    void                setNickname(const std::string& nickname);
+    const NickName&     getNickname() const;
+    void                setNickname(const NickName& nickname);
     const std::string&  getUsername() const;
     void                setUsername(const std::string& username);
     const std::string&  getRealname() const;
     void                setRealname(const std::string& realname);
     const std::string&  getHostname() const;
     void                setHostname(const std::string& hostname);
+    // Kept up to date by the three setters above
+    const std::string&  getHostmask() const { return _identity->hostmask; }
+    // Names this nick!user@host, for cached mask verdicts; never reused
+    unsigned long       getIdentityStamp() const { return _identity->stamp; }
     bool                isAuthenticated() const;
 	bool				isNicknameSet() const { return !_nickname.empty(); }
-    bool                isUsernameSet() const { return !_username.empty(); }
+    bool                isUsernameSet() const { return !_identity->username.empty(); }
     void                setAuthenticated(bool authenticated);
     bool                isRegistered() const;
     void                setRegistered(bool registered);
-    std::vector<std::string>& getChannels();
+    FloodControl&       flood() { return _flood; }
+    // Input flood control held back, handled again once the budget allows
+    bool                hasDeferredInput() const { return !_identity->deferred.empty(); }
+    size_t              getDeferredSize() const { return _identity->deferred.size(); }
+    const std::string&  getDeferredInput() const { return _identity->deferred; }
+    void                deferInput(const char* data, size_t len);
+    std::string         takeDeferredInput();
+    bool                hasQuit() const { return _quit; }
+    void                setQuit() { _quit = true; }
+    const std::vector<Membership*>& getMemberships() const { return _memberships; }
+    const std::vector<Channel*>& getInvites() const { return _identity->invites; }
 	void				printClientInfo() const;
     bool				isCAPNegotiation() const;
     void                setCAPNegotiation(bool status);
+    unsigned int        getCaps() const { return _caps; }
+    bool                hasCap(unsigned int cap) const { return (_caps & cap) != 0; }
+    void                setCaps(unsigned int caps) { _caps = static_cast<unsigned char>(caps); }
 
 };
 
@@ -0,0 +1,92 @@
+#ifndef CONNECTIONLIMITER_HPP
+#define CONNECTIONLIMITER_HPP
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+// Defaults, override with IRCSERV_CONNECTIONS_PER_HOST / IRCSERV_CONNECTIONS_PER_NETWORK /
+// IRCSERV_CONNECT_NETWORK_PREFIX / IRCSERV_CONNECT_THROTTLE_MS
+# define CONNECTIONS_PER_HOST       10      // at once from one address
+# define CONNECTIONS_PER_NETWORK    50      // at once from one CONNECT_NETWORK_PREFIX
+# define CONNECT_NETWORK_PREFIX     24      // bits, a /24 is one network
+# define CONNECT_THROTTLE_MS        2000    // charged to a host for each attempt
+# define CONNECT_BURST_MS           10000   // how far ahead that charge may run, ~5 quick reconnects
+# define CONNECT_EXPIRE_PER_ADMIT   4       // idle hosts forgotten per admit at most
+
+// Admission control for new connections, in the accept loop before a Client
+// exists. Addresses (IPv4, host order) live in a path compressed binary trie:
+// a node per prefix that actually branches plus one per host, 32 bytes each,
+// indexes instead of pointers and a free list. Every node counts the
+// connections below it, so the host's and its network's counts both come out
+// of one walk from the root, O(32) whatever the number of hosts. Hosts also
+// carry a reconnect clock, the same token bucket as FloodControl. A host with
+// no connections left waits in a queue until its clock has caught up, each
+// admit forgets a few of those, so no call ever walks the whole trie.
+// Prefixes marked exempt (loopback by default) are counted but never refused.
+class ConnectionLimiter {
+public:
+    enum Verdict {
+        ADMITTED,
+        TOO_MANY_FROM_HOST,
+        TOO_MANY_FROM_NETWORK,
+        THROTTLED
+    };
+
+private:
+    struct Node {
+        unsigned long long  clock;          // hosts only: where reconnect penalties got it, ms
+        unsigned int        bits;           // the prefix, the rest zero
+        unsigned int        connections;    // in this subtree
+        int                 child[2];       // by the bit after the prefix, -1 for none
+        unsigned char       length;         // of the prefix, 32 for a host
+        bool                exempt;
+    };
+
+    // An idle host and when its clock runs out. Stale entries (the host came
+    // back, or was charged again) are skipped, a later one covers it.
+    struct Expiry {
+        unsigned long long  at;
+        unsigned int        address;
+    };
+
+    std::vector<Node>       _nodes;
+    std::vector<int>        _free;
+    std::deque<Expiry>      _idle;
+    int                     _root;
+    size_t                  _perHost;
+    size_t                  _perNetwork;
+    unsigned int            _networkPrefix;
+    unsigned int            _throttle;
+
+    int                     allocate(unsigned int bits, unsigned int length);
+    void                    link(int parent, int side, int node);
+    int                     insert(unsigned int bits, unsigned int length);
+    void                    count(unsigned int address, int delta);
+    size_t                  walk(unsigned int address, int* path) const;
+    void                    prune(const int* path, size_t depth, unsigned int address, unsigned long long now);
+    int                     settle(int at, unsigned long long now);
+    void                    expire(unsigned long long now);
+
+public:
+    ConnectionLimiter();
+
+    void                    setLimits(size_t perHost, size_t perNetwork, unsigned int networkPrefix, unsigned int throttleMs);
+    void                    loadLimitsFromEnv();
+    // Everything under address/length is let in, however many
+    void                    exempt(unsigned int address, unsigned int length);
+
+    // Counts the connection when it is admitted. Every attempt outside an
+    // exempt prefix is charged to the host's reconnect clock, refused or not.
+    Verdict                 admit(unsigned int address, unsigned long long now);
+    // Counts a connection that is already there, after a hot restart
+    void                    restore(unsigned int address);
+    void                    release(unsigned int address, unsigned long long now);
+
+    // Connections from address/length
+    size_t                  connections(unsigned int address, unsigned int length) const;
+    size_t                  nodes() const { return _nodes.size() - _free.size(); }
+    static const char*      reason(Verdict verdict);
+};
+
+#endif
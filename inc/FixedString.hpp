@@ -0,0 +1,136 @@
+#ifndef FIXEDSTRING_HPP
+#define FIXEDSTRING_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <ostream>
+
+// Length limits advertised to clients (NICKLEN / CHANNELLEN)
+# define NICKLEN     30
+# define CHANNELLEN  50
+
+// Casefolding per RFC 1459: A-Z and [\]^ fold to a-z and {|}~
+inline unsigned char ircFold(unsigned char c)
+{
+    return (c >= 'A' && c <= '^') ? c + ('a' - 'A') : c;
+}
+
+// Bounded name stored inline: no heap, and the casefolded hash is computed
+// once on assignment. Equality and ordering are case-insensitive (IRC names
+// are), and a hash or length mismatch settles most compares right away.
+// Input longer than Capacity is kept truncated but flagged, so it never
+// equals a real name; callers reject such names before storing them.
+template <size_t Capacity>
+class FixedString {
+private:
+    unsigned int    _hash;
+    unsigned char   _length;    // Capacity + 1 when the input didn't fit
+    char            _data[Capacity + 1];
+
+    void assign(const char* str, size_t len)
+    {
+        _length = static_cast<unsigned char>(len > Capacity ? Capacity + 1 : len);
+        if (len > Capacity)
+            len = Capacity;
+        std::memcpy(_data, str, len);
+        _data[len] = '\0';
+        // FNV-1a over the folded bytes
+        _hash = 2166136261u;
+        for (size_t i = 0; i < len; ++i)
+        {
+            _hash ^= ircFold(static_cast<unsigned char>(str[i]));
+            _hash *= 16777619u;
+        }
+    }
+
+public:
+    FixedString() : _hash(2166136261u), _length(0) { _data[0] = '\0'; }
+    FixedString(const std::string& str) { assign(str.c_str(), str.size()); }
+    FixedString(const char* str) { assign(str, std::strlen(str)); }
+    FixedString(const char* str, size_t len) { assign(str, len); }
+
+    FixedString& operator=(const std::string& str) { assign(str.c_str(), str.size()); return *this; }
+    FixedString& operator=(const char* str) { assign(str, std::strlen(str)); return *this; }
+
+    static bool     fits(const std::string& str) { return str.size() <= Capacity; }
+    static bool     fits(size_t len) { return len <= Capacity; }
+    static size_t   capacity() { return Capacity; }
+
+    const char*     c_str() const { return _data; }
+    size_t          size() const { return _length > Capacity ? Capacity : _length; }
+    size_t          length() const { return size(); }
+    bool            empty() const { return _length == 0; }
+    bool            truncated() const { return _length > Capacity; }
+    unsigned int    hash() const { return _hash; }
+    char            operator[](size_t i) const { return _data[i]; }
+    // Copies to the heap: replies and logs that are still std::string ask for it
+    std::string     str() const { return std::string(_data, size()); }
+
+    bool equals(const FixedString& other) const
+    {
+        if (_hash != other._hash || _length != other._length)
+            return false;
+        for (size_t i = 0; i < size(); ++i)
+        {
+            if (ircFold(static_cast<unsigned char>(_data[i]))
+                != ircFold(static_cast<unsigned char>(other._data[i])))
+                return false;
+        }
+        return true;
+    }
+
+    // Orders by hash first: fine for map keys, not meant for display order
+    bool less(const FixedString& other) const
+    {
+        if (_hash != other._hash)
+            return _hash < other._hash;
+        if (_length != other._length)
+            return _length < other._length;
+        for (size_t i = 0; i < size(); ++i)
+        {
+            unsigned char a = ircFold(static_cast<unsigned char>(_data[i]));
+            unsigned char b = ircFold(static_cast<unsigned char>(other._data[i]));
+            if (a != b)
+                return a < b;
+        }
+        return false;
+    }
+};
+
+typedef FixedString<NICKLEN>     NickName;
+typedef FixedString<CHANNELLEN>  ChannelName;
+
+template <size_t N>
+bool operator==(const FixedString<N>& a, const FixedString<N>& b) { return a.equals(b); }
+template <size_t N>
+bool operator!=(const FixedString<N>& a, const FixedString<N>& b) { return !a.equals(b); }
+template <size_t N>
+bool operator<(const FixedString<N>& a, const FixedString<N>& b) { return a.less(b); }
+
+template <size_t N>
+bool operator==(const FixedString<N>& a, const std::string& b) { return a.equals(FixedString<N>(b)); }
+template <size_t N>
+bool operator==(const std::string& a, const FixedString<N>& b) { return b.equals(FixedString<N>(a)); }
+template <size_t N>
+bool operator==(const FixedString<N>& a, const char* b) { return a.equals(FixedString<N>(b)); }
+template <size_t N>
+bool operator!=(const FixedString<N>& a, const std::string& b) { return !(a == b); }
+template <size_t N>
+bool operator!=(const std::string& a, const FixedString<N>& b) { return !(b == a); }
+template <size_t N>
+bool operator!=(const FixedString<N>& a, const char* b) { return !(a == b); }
+
+template <size_t N>
+std::string operator+(const std::string& a, const FixedString<N>& b) { return a + b.c_str(); }
+template <size_t N>
+std::string operator+(const FixedString<N>& a, const std::string& b) { return a.str() + b; }
+template <size_t N>
+std::string operator+(const char* a, const FixedString<N>& b) { return std::string(a) + b.c_str(); }
+template <size_t N>
+std::string operator+(const FixedString<N>& a, const char* b) { return a.str() + b; }
+
+template <size_t N>
+std::ostream& operator<<(std::ostream& os, const FixedString<N>& str) { return os << str.c_str(); }
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef FLOODCONTROL_HPP
+#define FLOODCONTROL_HPP
+
+#include <cstddef>
+
+// How far a client's penalty clock may run ahead of real time before its
+// input has to wait: about ten chat lines in a row
+# define FLOOD_BURST_MS 10000
+// Input held back for a client that is over its budget; past this it is
+// disconnected for Excess Flood
+# define FLOOD_EXCESS_BYTES 8192
+
+// Per client command budget, the classic ircd penalty scheme: each command
+// costs some milliseconds (see costOf), charged to a clock that starts at
+// the current time and runs ahead with every command. Once it is more than
+// FLOOD_BURST_MS ahead the next command waits until it isn't. That is a token
+// bucket of FLOOD_BURST_MS refilled at one per millisecond, with the tokens
+// kept as a single timestamp, so charging a command is O(1) and an idle
+// client costs nothing to refill.
+class FloodControl {
+private:
+    unsigned long long  _clock;     // ms, where the client's penalties got it
+
+public:
+    FloodControl() : _clock(0) {}
+
+    // Charges cost when the client is within its burst, false if it has to wait
+    bool                admit(unsigned long long now, unsigned int cost)
+    {
+        if (_clock < now)
+            _clock = now;
+        else if (_clock - now > FLOOD_BURST_MS)
+            return false;
+        _clock += cost;
+        return true;
+    }
+    // When admit will take a command again
+    unsigned long long  readyAt() const { return _clock - FLOOD_BURST_MS; }
+
+    // Penalty of one "[@tags] [:prefix] COMMAND params\r\n" line
+    static unsigned int costOf(const char* line, size_t len);
+};
+
+#endif
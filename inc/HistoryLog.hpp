@@ -0,0 +1,147 @@
+#ifndef HISTORYLOG_HPP
+#define HISTORYLOG_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+#include "ChannelHistory.hpp"
+#include "FixedString.hpp"
+
+// Off unless IRCSERV_HISTORY_DIR is set. Limits per channel, override with
+// IRCSERV_HISTORY_LOG_BYTES / IRCSERV_HISTORY_LOG_DAYS
+# define HISTORY_LOG_BYTES          (64 * 1024 * 1024)
+# define HISTORY_LOG_DAYS           30
+# define HISTORY_LOG_SEGMENT_BYTES  (4 * 1024 * 1024)
+# define HISTORY_LOG_INDEX_EVERY    64      // records between two sparse index entries
+# define HISTORY_LOG_COMMIT_MS      5       // how long a commit waits for more records
+# define HISTORY_LOG_BATCH          1024    // records that start a commit right away
+# define HISTORY_LOG_RECORD_HEADER  24      // size, checksum, id, time
+
+// Every HISTORY_LOG_INDEX_EVERY-th record of a segment, a range query jumps
+// to the closest one and scans at most that many records from there
+struct LogIndexEntry {
+    unsigned long long  id;
+    unsigned long long  time;
+    size_t              offset;
+};
+
+// One file of a channel's log, "<first id>.log". Only the newest segment of
+// a channel grows, readers never map past bytes.
+struct LogSegment {
+    std::string                 path;
+    unsigned long long          firstId;
+    unsigned long long          firstTime;
+    unsigned long long          lastId;
+    unsigned long long          lastTime;
+    size_t                      bytes;
+    size_t                      records;
+    std::vector<LogIndexEntry>  index;
+
+    LogSegment() : firstId(0), firstTime(0), lastId(0), lastTime(0), bytes(0), records(0) {}
+};
+
+struct ChannelLog {
+    std::string             dir;
+    std::vector<LogSegment> segments;   // oldest first
+    int                     fd;         // writer's fd on the newest segment, -1 when closed
+
+    ChannelLog() : fd(-1) {}
+};
+
+// Segments a query mapped. Records handed out point into them, so keep the
+// view until they're sent.
+class HistoryLogView {
+private:
+    std::map<std::string, std::pair<char*, size_t> >    _maps;
+
+    HistoryLogView(const HistoryLogView&);
+    HistoryLogView& operator=(const HistoryLogView&);
+
+public:
+    HistoryLogView() {}
+    ~HistoryLogView();
+
+    const char*     map(const LogSegment& segment);
+};
+
+// Persistent channel history: per channel a directory of append-only
+// segments, each record a small header plus the line exactly as it went out.
+// The event loop only queues retained blocks; a writer thread takes the whole
+// queue at once (group commit: one write and one fdatasync per channel per
+// round), then hands the blocks back to be released on the loop, so block
+// refcounts and the free lists stay single threaded. Queries run on the loop
+// against mmapped segments, through a sparse index of ids and times. The
+// writer also applies retention: whole segments past the age or size limit
+// are dropped, and an oldest segment that is mostly expired is compacted
+// into a new one with only its live tail.
+class HistoryLog {
+private:
+    struct Pending {
+        ChannelName     channel;
+        HistoryBlock*   block;
+    };
+
+    std::string                         _dir;
+    size_t                              _maxBytes;      // per channel
+    unsigned long long                  _maxAge;        // milliseconds, 0 keeps everything
+    size_t                              _segmentBytes;
+    std::map<std::string, ChannelLog>   _channels;      // by directory name; mutated by the writer only, under _mutex
+
+    pthread_t                           _thread;
+    pthread_mutex_t                     _mutex;
+    pthread_cond_t                      _wake;          // loop -> writer: work or stop
+    pthread_cond_t                      _written;       // writer -> flush(): a round finished
+    std::vector<Pending>                _queue;         // loop appends here
+    std::vector<Pending>                _batch;         // writer works on this one
+    std::vector<HistoryBlock*>          _done;          // written, waiting for the loop to release
+    std::vector<HistoryBlock*>          _collected;
+    unsigned long long                  _queued;        // records ever queued
+    unsigned long long                  _committed;     // records ever committed
+    bool                                _flushing;
+    bool                                _stop;
+    bool                                _failed;        // reported a write error already
+
+    HistoryLog(const HistoryLog&);
+    HistoryLog& operator=(const HistoryLog&);
+
+    static void*        run(void* self);
+    void                writerLoop();
+    void                commit();
+    void                writeChannel(const std::string& name, const std::vector<HistoryBlock*>& blocks);
+    bool                openSegment(ChannelLog& log, const HistoryBlock& first);
+    bool                writeAll(ChannelLog& log, const std::string& buffer);
+    void                applyRetention(ChannelLog& log);
+    void                compactOldest(ChannelLog& log, unsigned long long cutoff);
+    void                load();
+    bool                loadSegment(const std::string& path, LogSegment& segment);
+    const ChannelLog*   find(const ChannelName& channel) const;
+    void                selectForward(const ChannelLog& log, const HistoryRange& range,
+                            std::vector<HistoryRecord>& out, HistoryLogView& view) const;
+    void                selectBackward(const ChannelLog& log, const HistoryRange& range,
+                            std::vector<HistoryRecord>& out, HistoryLogView& view) const;
+
+public:
+    HistoryLog(const std::string& dir, size_t maxBytes, unsigned long long maxAge,
+        size_t segmentBytes = HISTORY_LOG_SEGMENT_BYTES);
+    ~HistoryLog(); // writes out what is queued, then stops the writer
+
+    // NULL when IRCSERV_HISTORY_DIR isn't set
+    static HistoryLog*  fromEnv();
+    // Directory name of a channel: casefolded, anything unusual as %XX
+    static std::string  channelDir(const ChannelName& channel);
+
+    // Event loop side. append never touches the disk, it retains the block,
+    // queues it and releases whatever the writer finished with.
+    void                append(const ChannelName& channel, HistoryBlock* block);
+    void                collect();
+    // Waits until everything queued so far is on disk (live upgrade, tests)
+    void                flush();
+    void                select(const ChannelName& channel, const HistoryRange& range,
+                            std::vector<HistoryRecord>& out, HistoryLogView& view);
+    size_t              segmentCount(const ChannelName& channel);
+    const std::string&  dir() const { return _dir; }
+};
+
+#endif
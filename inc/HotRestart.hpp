@@ -0,0 +1,39 @@
+#ifndef HOTRESTART_HPP
+#define HOTRESTART_HPP
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+// Live binary upgrade.
+// The running server serializes its state, forks, and execs a fresh copy of the
+// binary. The state blob and every open descriptor (listening socket first, then
+// the clients in blob order) are passed over a unix socketpair with SCM_RIGHTS.
+// The new process tells us it's ready with a single ack byte, then the old one exits.
+// Connections never drop because the kernel keeps the sockets alive while
+// at least one process holds them.
+
+# define UPGRADE_ENV_FD		"IRCSERV_UPGRADE_FD"
+// Bumped whenever a client or channel record changes layout, a binary must
+// refuse a state it would misread. New data that can be left out goes in a
+// trailing section instead, older states simply end before it.
+// 2: client caps, 3: voiced members in channel records, 4: channel history,
+// 5: channel creation and topic times
+# define UPGRADE_MAGIC		"IRCUPG5"
+# define UPGRADE_ACK		'K'
+# define UPGRADE_TIMEOUT_MS	10000
+# define UPGRADE_FDS_PER_MSG	250 // SCM_MAX_FD is 253 on linux
+
+class HotRestart {
+public:
+    // Transport
+    static bool     sendState(int sock, const std::string& state, const std::vector<int>& fds);
+    static bool     receiveState(int sock, std::string& state, std::vector<int>& fds);
+    static bool     sendAck(int sock);
+    static bool     waitAck(int sock, int timeoutMs);
+    // Serialization helpers: strings are written as "<len>:<bytes>" so they may contain anything
+    static void     putString(std::ostream& os, const std::string& str);
+    static bool     getString(std::istream& is, std::string& str);
+};
+
+#endif
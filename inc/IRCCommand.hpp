@@ -18,7 +18,11 @@ enum ModeFlag {
 	MODE_TOPIC, // topic protection
 	MODE_KEY, // key (password)
 	MODE_OPERATOR, // operator
-	MODE_LIMIT_USER // user limit
+	MODE_LIMIT_USER, // user limit
+	MODE_VOICE, // voice
+	MODE_BAN, // ban mask
+	MODE_EXCEPT, // ban exception mask
+	MODE_INVEX // invite exception mask
 };
 
 class IRCCommand {
@@ -30,6 +34,10 @@ public:
             case 'k': return MODE_KEY; //
             case 'o': return MODE_OPERATOR;
             case 'l': return MODE_LIMIT_USER; //
+            case 'v': return MODE_VOICE;
+            case 'b': return MODE_BAN;
+            case 'e': return MODE_EXCEPT;
+            case 'I': return MODE_INVEX;
 		default:  return MODE_UNKNOWN;
         }
     }
@@ -37,6 +45,7 @@ private:
 	std::string _input;
 	std::string _cmd;
 	std::string _prefix;
+	std::string _tags; // IRCv3 tag section without the '@', kept raw
 	std::vector<std::string> _params;
 	std::string _errorNum;
 	ModeSign _currentModeSign;
@@ -55,8 +64,14 @@ private:
 	void							handlePrivmsgCmd(std::istringstream &iss);
 	void							handleInviteCmd(std::istringstream &iss);
 	void							handleKickCmd(std::istringstream &iss);
+	void							handlePartCmd(std::istringstream &iss);
 	void							handleTopicCmd(std::istringstream &iss);
 	void							handlePingCmd(std::istringstream &iss);
+	void							handleStatsCmd(std::istringstream &iss);
+	void							handleChathistoryCmd(std::istringstream &iss);
+	void							handleChannelListCmd(std::istringstream &iss);
+	void							handleMonitorCmd(std::istringstream &iss);
+	void							handleQuitCmd(std::istringstream &iss);
 	void							processCommand();
 	void							trimCRLF(std::string &str);
 public:
@@ -65,8 +80,9 @@ public:
 	bool							isValid()const;
 	std::string const				&getCommand() const;
 	std::string const				&getPrefix() const;
+	std::string const				&getTags() const;
 	std::vector<std::string> const	&getParams() const;
-	std::string						getParamAt(size_t index) const;
+	std::string const				&getParamAt(size_t index) const;
 	size_t							getParamsCount() const;
 	// getParamAt(2)
 	std::string const				&getErrorNum() const;
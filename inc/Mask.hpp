@@ -0,0 +1,96 @@
+#ifndef MASK_HPP
+#define MASK_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// IRC wildcard masks: '*' matches any run of characters, '?' exactly one.
+// Compared casefolded, like the names they are matched against. maskMatch
+// needs no setup and is fine for a one-off check; it backtracks to the last
+// star, which is quadratic at worst, so anything matched more than once (or
+// against many texts) goes through a CompiledMask instead.
+bool    maskMatch(const char* mask, size_t maskLen, const char* text, size_t textLen);
+bool    isMask(const std::string& str); // has a wildcard at all
+
+inline bool maskMatch(const std::string& mask, const std::string& text)
+{
+    return maskMatch(mask.data(), mask.size(), text.data(), text.size());
+}
+
+// A mask taken apart once, for masks that are matched over and over (ban
+// lists, a WHO or LIST walk): the literal runs between the stars, casefolded,
+// with their '?' kept in place. A run before the first star has to sit at the
+// start of the text, one after the last star at its end, the others are looked
+// for left to right, each search starting where the previous run ended. Runs
+// are searched with a KMP failure table, or with a Shift-And bit table when
+// they have a '?' in them, so no text character is looked at twice and a
+// match is linear in the text whatever the mask ("*a*a*a*a*b" included).
+// Only a run with a '?' that is longer than 64 falls back to trying each
+// offset. The sum of the run lengths rules out texts that are too short.
+class CompiledMask {
+private:
+    struct Run {
+        size_t  offset;     // into _folded, and into _failure for a plain run
+        size_t  length;
+        bool    wildcard;   // has a '?'
+        size_t  table;      // into _tables, npos for a plain run or a long one
+    };
+
+    std::string                     _folded;
+    std::vector<Run>                _runs;
+    std::vector<size_t>             _failure;   // KMP, per plain run at its offset
+    std::vector<unsigned long long> _tables;    // Shift-And, 256 words per run
+    bool                            _anchoredStart; // doesn't start with '*'
+    bool                            _anchoredEnd;   // doesn't end with '*'
+    bool                            _hasStar;
+    size_t                          _minLength;
+    unsigned long                   _id;
+
+    bool    runAt(const Run& run, const char* text) const;
+    // Start of the leftmost fit of run in text[pos, end), npos if none
+    size_t  find(const Run& run, const char* text, size_t pos, size_t end) const;
+    void    prepare(Run& run);
+
+public:
+    CompiledMask();
+    explicit CompiledMask(const std::string& mask);
+
+    bool            matches(const char* text, size_t len) const;
+    bool            matches(const std::string& text) const { return matches(text.data(), text.size()); }
+    // Never reused, and a copy keeps it: what MaskVerdictCache keys on
+    unsigned long   id() const { return _id; }
+};
+
+// Verdicts of compiled masks on one identity (a client's nick!user@host as it
+// is now), in a direct mapped table: a lookup is one probe, a collision just
+// takes the slot over. Mask ids and identity stamps are never reused, so
+// nothing has to be invalidated; when either changes the old pair simply
+// isn't asked about anymore and gets overwritten.
+class MaskVerdictCache {
+private:
+    struct Slot {
+        unsigned long   mask;       // 0 for an empty slot
+        unsigned long   identity;
+        bool            verdict;
+    };
+
+    std::vector<Slot>   _slots;
+    size_t              _hits;
+    size_t              _misses;
+
+    size_t  slot(unsigned long mask, unsigned long identity) const;
+
+public:
+    explicit MaskVerdictCache(size_t slots); // rounded up to a power of two
+
+    // Looks the pair up, and matches text and remembers the verdict if needed
+    bool    matches(const CompiledMask& mask, unsigned long identity, const std::string& text);
+    // -1 when the pair isn't there
+    int     find(unsigned long mask, unsigned long identity);
+    void    store(unsigned long mask, unsigned long identity, bool verdict);
+    size_t  hits() const { return _hits; }
+    size_t  misses() const { return _misses; }
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef MASKLIST_HPP
+#define MASKLIST_HPP
+
+#include <cstddef>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+#include "Mask.hpp"
+
+class Client;
+
+// Most entries of +b, +e and +I together on one channel, advertised as MAXLIST
+# define MASK_LIST_LIMIT 1000
+// Slots of the verdict cache, about 24 bytes each
+# define MASK_VERDICT_SLOTS 16384
+
+struct MaskEntry {
+    std::string     mask;   // nick!user@host, as set
+    std::string     setBy;
+    time_t          setAt;
+    CompiledMask    matcher;
+};
+
+// One of a channel's +b / +e / +I lists. Masks are compiled when they are
+// set, and filed under a literal piece of their host so a check only runs the
+// masks that could match that host at all:
+//   *!*@*.dsl.example.com  under "example.com", the last two labels
+//   *!*@*.com              under "com", the last label
+//   *!*@10.0.*             under "10.", the first label
+// and anything else (*!*@*, or a host that ends and starts with a wildcard)
+// in a short list that is always run. A host's buckets are found with three
+// lookups, so 1000 bans on different hosts cost about as much as a handful.
+// Checks of a client go through a verdict cache shared by every list, so when
+// a ban is added only that new mask is run against the members again.
+class MaskList {
+private:
+    typedef std::map<std::string, std::vector<const MaskEntry*> > Buckets;
+
+    // What the masks run against, with the client when there is one
+    struct Subject {
+        const Client*       client;
+        const std::string*  hostmask;
+    };
+
+    static MaskVerdictCache             _verdicts;
+
+    std::map<std::string, MaskEntry>    _entries;       // by casefolded mask
+    Buckets                             _byLastLabels;
+    Buckets                             _byLastLabel;
+    Buckets                             _byFirstLabel;
+    std::vector<const MaskEntry*>       _unbucketed;
+
+    Buckets*                        bucketFor(const std::string& foldedMask, std::string& key);
+    static bool                     runBucket(const std::vector<const MaskEntry*>& bucket, Subject& subject);
+    static bool                     runBucket(const Buckets& buckets, const std::string& key, Subject& subject);
+    bool                            matches(const std::string& host, Subject& subject) const;
+
+public:
+    // "nick" -> "nick!*@*", "user@host" -> "*!user@host", "nick!user" -> "nick!user@*"
+    static std::string  normalize(const std::string& mask);
+
+    // false when the mask is already there
+    bool                add(const std::string& mask, const std::string& setBy, time_t setAt);
+    bool                remove(const std::string& mask);
+    bool                matches(const Client& client) const;
+    // hostmask is nick!user@host, host its host part
+    bool                matches(const std::string& hostmask, const std::string& host) const;
+    size_t              size() const { return _entries.size(); }
+    bool                empty() const { return _entries.empty(); }
+    const std::map<std::string, MaskEntry>& entries() const { return _entries; }
+    static const MaskVerdictCache&          verdicts() { return _verdicts; }
+};
+
+#endif
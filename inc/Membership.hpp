@@ -0,0 +1,34 @@
+#ifndef MEMBERSHIP_HPP
+#define MEMBERSHIP_HPP
+
+#include <cstddef>
+#include "ObjectPool.hpp"
+
+class Client;
+class Channel;
+
+// One node per (client, channel) pair.
+// The node sits in both the channel's member list and the client's membership
+// list and remembers its position in each, so leaving a channel is two
+// swap-with-last removals: no string compares and no map lookups.
+struct Membership {
+    Client*     client;
+    Channel*    channel;
+    size_t      clientSlot;   // index in client->getMemberships()
+    size_t      channelSlot;  // index in channel->getMembers()
+    bool        isOperator;
+    bool        isVoiced;
+    bool        isBanned;     // verdict of the channel's +b/+e lists...
+    unsigned    bansChecked;  // ...valid while this equals the channel's mask generation
+
+    Membership(Client* c, Channel* ch)
+        : client(c), channel(ch), clientSlot(0), channelSlot(0), isOperator(false), isVoiced(false),
+        isBanned(false), bansChecked(0) {}
+
+    // Nodes come from a slab pool, see ObjectPool.hpp
+    static void*        operator new(size_t size);
+    static void         operator delete(void* ptr, size_t size);
+    static PoolStats    poolStats();
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef MEMORYBUDGET_HPP
+#define MEMORYBUDGET_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Server-wide memory accounting.
+// Client buffers report their capacity here whenever it changes, pooled state
+// (clients, channels, memberships) is read from the pools. Limits are checked
+// by the server loop, which decides what to drop; see Server::enforceMemoryLimits.
+
+// Defaults, override with IRCSERV_CLIENT_RECVQ / IRCSERV_CLIENT_SENDQ / IRCSERV_MEMORY_LIMIT
+# define CLIENT_RECVQ_LIMIT     2048                // partial input kept per client
+# define CLIENT_SENDQ_LIMIT     (256 * 1024)        // unsent output kept per client
+# define SERVER_MEMORY_LIMIT    (256 * 1024 * 1024) // everything accounted below
+# define MEMORY_REFUSE_PERCENT  90                  // stop accepting above this share of the limit
+
+enum MemoryCategory {
+    MEM_INPUT,      // client receive buffers
+    MEM_OUTPUT,     // client send queues, and the arenas replies are built in
+    MEM_CLIENTS,    // Client objects and their identity data
+    MEM_CHANNELS,   // Channel objects and membership nodes
+    MEM_HISTORY,    // channel history
+    MEM_CATEGORIES
+};
+
+class MemoryBudget {
+public:
+    static void         charge(MemoryCategory category, size_t bytes);
+    static void         release(MemoryCategory category, size_t bytes);
+    // Moves an accounted amount to its new value, for buffers that grow and shrink
+    static void         update(MemoryCategory category, size_t& accounted, size_t current);
+    // Heap bytes behind a string, short strings live inside the object
+    static size_t       heapBytes(const std::string& str);
+
+    static size_t       used(MemoryCategory category);
+    static size_t       total();
+    static const char*  categoryName(MemoryCategory category);
+
+    static void         setLimits(size_t clientRecvQ, size_t clientSendQ, size_t serverLimit);
+    static void         loadLimitsFromEnv();
+    static size_t       envSize(const char* name, size_t fallback); // positive number or fallback
+    static size_t       clientRecvQLimit();
+    static size_t       clientSendQLimit();
+    static size_t       serverLimit();
+    static bool         overLimit();    // drop something
+    static bool         nearLimit();    // refuse new connections
+
+    static void         report(std::vector<std::string>& lines);
+};
+
+#endif
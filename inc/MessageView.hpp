@@ -0,0 +1,51 @@
+#ifndef MESSAGEVIEW_HPP
+#define MESSAGEVIEW_HPP
+
+#include <cstddef>
+#include "Arena.hpp"
+
+# define MESSAGE_MAX_PARAMS 15
+
+// Zero-copy view of one IRC line: "[@tags] [:prefix] COMMAND [args...]\r\n".
+// Every field points into the caller's buffer, which must outlive the view.
+// Parameters are only split on first access; the hot PRIVMSG path reads
+// args() directly and never pays for it. Same for IRCv3 message tags: parse()
+// only finds where the tag section ends, single tags are looked up and
+// unescaped when someone asks. IRCCommand remains the full parser for
+// everything that needs validation and owned strings.
+class MessageView {
+private:
+    StringSpan          _line;      // without CRLF
+    StringSpan          _tags;      // raw "a=b;+c", without the '@'
+    StringSpan          _prefix;
+    StringSpan          _command;
+    StringSpan          _args;      // everything after the command, leading spaces skipped
+    mutable bool        _split;
+    mutable size_t      _paramCount;
+    mutable StringSpan  _params[MESSAGE_MAX_PARAMS];
+
+    void                splitParams() const;
+
+public:
+    MessageView();
+
+    bool                parse(const char* line, size_t len); // false when there is no command
+    const StringSpan&   line() const { return _line; }
+    const StringSpan&   tags() const { return _tags; }
+    bool                tag(const char* key, StringSpan& rawValue) const { return findTag(_tags, key, rawValue); }
+    const StringSpan&   prefix() const { return _prefix; }
+    const StringSpan&   command() const { return _command; }
+    const StringSpan&   args() const { return _args; }
+    size_t              paramCount() const;
+    StringSpan          param(size_t index) const;
+
+    // Tag helpers, also used on IRCCommand::getTags().
+    // Values come back raw (still escaped), unescapeTagValue decodes one into the arena.
+    static bool         findTag(const StringSpan& tags, const char* key, StringSpan& rawValue);
+    static StringSpan   unescapeTagValue(const StringSpan& rawValue, Arena& arena);
+    // The client-only ('+') tags, as sent, for relaying. Points into tags when
+    // there is nothing else in there, otherwise the kept tags are copied to the arena.
+    static StringSpan   clientOnlyTags(const StringSpan& tags, Arena& arena);
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef MONITORINDEX_HPP
+#define MONITORINDEX_HPP
+
+#include <cstddef>
+#include <map>
+#include <vector>
+#include "FixedString.hpp"
+
+// Most nicknames one client may MONITOR, advertised as MONITOR=
+# define MONITOR_LIMIT 100
+
+// IRCv3 MONITOR: who watches which nickname. The reverse side (casefolded
+// nick -> watcher fds) is what makes presence pushes cheap: a client coming
+// online, going away or changing nick only costs its own watchers, instead of
+// every client polling with ISON. The forward side is each watcher's list,
+// for MONITOR L/S and to drop everything when the watcher leaves.
+class MonitorIndex {
+private:
+    std::map<NickName, std::vector<int> >   _watchers;
+    std::map<int, std::vector<NickName> >   _targets;   // as the watcher spelled them
+
+    void                            unwatch(const NickName& nick, int fd);
+
+public:
+    // false when fd already watches nick
+    bool                            add(int fd, const NickName& nick);
+    bool                            remove(int fd, const NickName& nick);
+    void                            clear(int fd);
+    size_t                          count(int fd) const;
+    // NULL when nobody watches / the fd watches nothing
+    const std::vector<int>*         watchers(const NickName& nick) const;
+    const std::vector<NickName>*    targets(int fd) const;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef NAMESCACHE_HPP
+#define NAMESCACHE_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "Membership.hpp"
+
+// Longest line a client has to accept, CRLF included
+# define IRC_LINE_MAX 512
+
+// A channel's member list the way RPL_NAMREPLY carries it: "@alice +bob carol".
+// There are two variants: the highest prefix only, and every prefix for
+// multi-prefix clients ("@+alice"). Each is built from the members on first
+// use, then patched in place: a join appends a token, a part removes one, a
+// mode or nick change rewrites one. A JOIN storm into a big channel appends
+// to the string instead of walking every member per joiner. Splitting into
+// 353 lines happens at send time, because how much fits depends on the
+// requester's nick.
+class NamesCache {
+private:
+    std::string     _payload[2];    // [multiPrefix]
+    bool            _valid[2];
+    unsigned long   _builds;        // full rebuilds, tests and benchmarks look at this
+
+    static void     appendToken(std::string& out, const Membership& member, bool multiPrefix);
+    static bool     findToken(const std::string& payload, const char* nick, size_t length, size_t& start, size_t& end);
+    void            replaceToken(const char* nick, size_t length, const Membership* member);
+
+public:
+    NamesCache();
+
+    const std::string&  payload(const std::vector<Membership*>& members, bool multiPrefix);
+    void                added(const Membership& member);
+    void                removed(const Membership& member);
+    void                changed(const Membership& member); // op/voice
+    void                renamed(const std::string& oldNick, const Membership& member);
+    void                invalidate();
+    unsigned long       builds() const { return _builds; }
+    size_t              capacity() const { return _payload[0].capacity() + _payload[1].capacity(); }
+};
+
+#endif
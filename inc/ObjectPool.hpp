@@ -0,0 +1,101 @@
+#ifndef OBJECTPOOL_HPP
+#define OBJECTPOOL_HPP
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// Fixed-size slab allocator.
+// Memory is taken from the system in slabs of SlabObjects slots and never given
+// back while the pool lives; freed slots go on an intrusive free list and are
+// reused first. Under connect/disconnect churn this keeps Client and Channel
+// objects packed in a few slabs instead of scattered over the heap.
+// Used through class-specific operator new/delete, so `new Client(fd)` and
+// `delete client` work unchanged everywhere.
+
+struct PoolStats {
+    size_t  live;       // slots handed out right now
+    size_t  free;       // slots sitting on the free list
+    size_t  highWater;  // most slots ever live at once
+    size_t  slabs;      // slabs taken from the system
+    size_t  objectSize;
+};
+
+template <typename T, size_t SlabObjects = 64>
+class ObjectPool {
+private:
+    // A free slot stores the free list link in place of the object
+    union Slot {
+        Slot*       next;
+        char        storage[sizeof(T)];
+        long double alignDouble;
+        void*       alignPointer;
+    };
+
+    std::vector<Slot*>  _slabs;
+    Slot*               _freeList;
+    size_t              _live;
+    size_t              _free;
+    size_t              _highWater;
+
+    ObjectPool(const ObjectPool&);
+    ObjectPool& operator=(const ObjectPool&);
+
+    void grow()
+    {
+        Slot* slab = static_cast<Slot*>(::operator new(sizeof(Slot) * SlabObjects));
+        _slabs.push_back(slab);
+        // Thread the new slots so the lowest address is handed out first
+        for (size_t i = SlabObjects; i > 0; --i)
+        {
+            slab[i - 1].next = _freeList;
+            _freeList = &slab[i - 1];
+        }
+        _free += SlabObjects;
+    }
+
+public:
+    ObjectPool() : _freeList(NULL), _live(0), _free(0), _highWater(0) {}
+
+    ~ObjectPool()
+    {
+        for (size_t i = 0; i < _slabs.size(); ++i)
+            ::operator delete(_slabs[i]);
+    }
+
+    void* allocate()
+    {
+        if (!_freeList)
+            grow();
+        Slot* slot = _freeList;
+        _freeList = slot->next;
+        _free--;
+        if (++_live > _highWater)
+            _highWater = _live;
+        return slot;
+    }
+
+    void deallocate(void* ptr)
+    {
+        if (!ptr)
+            return;
+        Slot* slot = static_cast<Slot*>(ptr);
+        slot->next = _freeList;
+        _freeList = slot;
+        _live--;
+        _free++;
+    }
+
+    PoolStats stats() const
+    {
+        PoolStats s;
+        s.live = _live;
+        s.free = _free;
+        s.highWater = _highWater;
+        s.slabs = _slabs.size();
+        s.objectSize = sizeof(Slot);
+        return s;
+    }
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef OUTGOINGMESSAGE_HPP
+#define OUTGOINGMESSAGE_HPP
+
+#include "Arena.hpp"
+#include "Capabilities.hpp"
+#include "ServerTime.hpp"
+#include "ChannelHistory.hpp"
+
+// One message on its way to many clients. Recipients whose capabilities
+// change the bytes (message-tags, server-time) get their own line, built in
+// the arena when the first recipient with that set shows up and reused for
+// every other one. A channel costs at most CAP_VARIANTS serializations per
+// message, no matter how many members enabled what.
+class OutgoingMessage {
+private:
+    Arena&              _arena;
+    StringSpan          _body;          // "nick!user@host CMD ...\r\n", the untagged line
+    StringSpan          _clientTags;    // relayed as sent to message-tags clients
+    bool                _tagsOnly;      // TAGMSG, nothing to send to clients without tags
+    mutable char        _timeTag[SERVER_TIME_TAG_SIZE]; // taken from ServerTime when first needed
+    char                _msgid[HISTORY_MSGID_SIZE];
+    bool                _hasMsgid;
+    mutable bool        _built[CAP_VARIANTS];
+    mutable StringSpan  _lines[CAP_VARIANTS];
+
+    const StringSpan&   build(size_t variant) const;
+
+public:
+    OutgoingMessage(Arena& arena, const StringSpan& body,
+        const StringSpan& clientTags = StringSpan(), bool tagsOnly = false);
+
+    // Empty when a client with these capabilities gets nothing
+    const StringSpan&   lineFor(unsigned int caps) const
+    {
+        size_t variant = Capabilities::variant(caps);
+        return _built[variant] ? _lines[variant] : build(variant);
+    }
+    size_t              variantsBuilt() const;
+    // A message kept in history goes out with its msgid and the time it was stored
+    void                setOrigin(const HistoryBlock& block);
+};
+
+#endif
@@ -12,21 +12,33 @@ private:
 	static std::string build(const std::string& code, const std::string& target, const std::string& message);
 public:
 	static void welcome(const Client& client);
+	static void isupport(const Client& client);
 	static void passwordMismatch(const Client& client);
 	static void alreadyRegistered(const Client& client);
 	static void unknownCommand(const Client& client, const std::string& command);
 	static void needMoreParams(const Client& client, const std::string& command);
 	static void nicknameInUse(const Client& client, const std::string& nickname);
+	static void erroneousNickname(const Client& client, const std::string& nickname);
 	static std::string noSuchNick(const std::string& target, const Client& client);
 	static void connectionClosed(const Client& client);
 	static void pongReply(const Client& client, const std::string& server);
 	static void pingToClient(const Client& client, const std::string& server);
 	static void noSuchChannel(const Client& client, const std::string& channel);
 	static void notOnChannel(const Client& client, const std::string& channel);
+	static void cannotSendToChannel(const Client& client, const std::string& channel);
+	static void tooManyTargets(const Client& client, const std::string& target);
 	static void usersDontMatch(const Client& client);
 	static void notOperator(const Client& client, const std::string& channel);
 	static void invalidCommand(const Client& client, const std::string& command);
 	static void messageTooLong(const Client& client);
+	static void noPrivileges(const Client& client);
+	static void statsLine(const Client& client, const std::string& line);
+	static void endOfStats(const Client& client, const std::string& query);
+	static void endOfNames(const Client& client, const std::string& channel);
+	static void invalidCapCommand(const Client& client, const std::string& subcommand);
+	// IRCv3 standard reply: FAIL <command> <code> [<context>] :<description>
+	static void fail(const Client& client, const std::string& command, const std::string& code,
+		const std::string& context, const std::string& description);
 };
 
 #endif // REPLY_HPP
@@ -12,6 +12,7 @@
 #define ERR_WASNOSUCHNICK     "406"
 #define ERR_TOOMANYTARGETS    "407"
 #define ERR_NOORIGIN          "409"
+#define ERR_INVALIDCAPCMD     "410"
 #define ERR_NORECIPIENT       "411"
 #define ERR_NOTEXTTOSEND      "412"
 #define ERR_NOTOPLEVEL        "413"
@@ -42,6 +43,7 @@
 #define ERR_INVITEONLYCHAN    "473"
 #define ERR_BANNEDFROMCHAN    "474"
 #define ERR_BADCHANNELKEY     "475"
+#define ERR_BANLISTFULL       "478"
 #define ERR_NOPRIVILEGES      "481"
 #define ERR_CHANOPRIVSNEEDED  "482"
 #define ERR_CANTKILLSERVER    "483"
@@ -55,6 +57,7 @@
 #define RPL_CREATED           "003"
 #define RPL_MYINFO            "004"
 #define RPL_BOUNCE            "005"
+#define RPL_ISUPPORT          "005"
 #define RPL_USERHOST          "302"
 #define RPL_ISON              "303"
 #define RPL_AWAY              "301"
@@ -75,10 +78,15 @@
 #define RPL_NOTOPIC           "331"
 #define RPL_TOPIC             "332"
 #define RPL_INVITING          "341"
+#define RPL_INVITELIST        "346"
+#define RPL_ENDOFINVITELIST   "347"
+#define RPL_EXCEPTLIST        "348"
+#define RPL_ENDOFEXCEPTLIST   "349"
 #define RPL_SUMMONING         "342"
 #define RPL_VERSION           "351"
 #define RPL_WHOREPLY          "352"
 #define RPL_ENDOFWHO          "315"
+#define RPL_WHOSPCRPL         "354"
 #define RPL_NAMREPLY          "353"
 #define RPL_ENDOFNAMES        "366"
 #define RPL_LINKS             "364"
@@ -93,9 +101,16 @@
 #define RPL_YOUREOPER         "381"
 #define RPL_REHASHING         "382"
 #define RPL_TIME              "391"
+#define RPL_ENDOFSTATS        "219"
+#define RPL_STATSDEBUG        "249"
 #define RPL_USERSSTART        "392"
 #define RPL_USERS             "393"
 #define RPL_ENDOFUSERS        "394"
 #define RPL_NOUSERS           "395"
+#define RPL_MONONLINE         "730"
+#define RPL_MONOFFLINE        "731"
+#define RPL_MONLIST           "732"
+#define RPL_ENDOFMONLIST      "733"
+#define ERR_MONLISTFULL       "734"
 
 #endif // REPLIES_HPP
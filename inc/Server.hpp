@@ -14,11 +14,16 @@
 
 #include <IRCCommand.hpp>
 #include <ChannelsClientsManager.hpp>
+#include <ConnectionLimiter.hpp>
 
 # define PRINT_CLIENT_INFO 0
 # define SEND_PING_AT_HALF_TIME 0
+// Defaults, override with IRCSERV_LISTEN_BACKLOG / IRCSERV_ACCEPT_BATCH
+# define LISTEN_BACKLOG 1024    // connections the kernel queues for us, capped by somaxconn
+# define ACCEPT_BATCH   64      // taken off that queue per wakeup
 class Client;
 class Channel;
+class HistoryLog;
 
 class Server {
 private:
@@ -30,12 +35,25 @@ private:
     std::map<int, Client*>          _clients;    // key - value pair.  key should be unique. 12 - popov 13 - khojazo   (_clients.at(12) - returns popov
     time_t                          _clientTimeToLive; // in seconds
     ChannelsClientsManager          _manager;
+    std::string                     _binaryPath; // what we exec on a live upgrade
+    std::vector<char>               _recvBuffer; // every recv lands here, lines are parsed in place
+    HistoryLog*                     _historyLog; // NULL unless IRCSERV_HISTORY_DIR is set
+    int                             _listenBacklog;
+    size_t                          _acceptBatch;
+    ConnectionLimiter               _limiter;    // who may connect, checked before a Client exists
+
+    std::string                     saveState(std::vector<int>& fds) const;
+    void                            enforceMemoryLimits();
+    void                            acceptClient(int client_fd, const struct sockaddr_in& client_addr);
 public:
     Server(int port, const std::string& password, time_t clientTimeToLive);
+    Server(int handoffFd); // resume from a live upgrade
     ~Server();
     void    start();
     void    handleNewConnection();
     void    handleClientMessage(int clientfd);
+    void    setBinaryPath(const std::string& path) { _binaryPath = path; }
+    bool    upgrade();
 };
 
 #endif
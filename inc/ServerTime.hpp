@@ -0,0 +1,26 @@
+#ifndef SERVERTIME_HPP
+#define SERVERTIME_HPP
+
+#include <sys/time.h>
+#include <string>
+#include "Arena.hpp"
+
+// "time=2026-01-01T12:00:00.000Z"
+# define SERVER_TIME_TAG_SIZE 29
+
+// The IRCv3 server-time tag for the current millisecond. strftime only runs
+// when the second changes, the milliseconds are patched in when they do, so
+// every message and recipient of the same millisecond share one formatted
+// string. The span stays valid until the next call.
+class ServerTime {
+public:
+    static const StringSpan&    tag();
+    static const StringSpan&    tag(const struct timeval& now);
+    static const StringSpan&    tag(unsigned long long milliseconds);
+    static unsigned long long   now();  // milliseconds since the epoch
+    // "2026-01-01T12:00:00.000Z" (milliseconds optional) to milliseconds since the epoch
+    static bool                 parse(const std::string& timestamp, unsigned long long& milliseconds);
+    static unsigned long        formatCount(); // strftime calls so far
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef USERINDEX_HPP
+#define USERINDEX_HPP
+
+#include <cstddef>
+#include <set>
+#include <string>
+#include <vector>
+#include "Mask.hpp"
+
+class Client;
+
+# define WHO_NICK   1
+# define WHO_USER   2
+# define WHO_HOST   4
+# define WHO_REAL   8
+
+// One range of an index a WHO walks: every key starting with prefix
+struct WhoScan {
+    unsigned int    field;  // WHO_NICK / WHO_USER / WHO_HOST
+    std::string     prefix; // casefolded
+    bool            exact;  // the mask had no wildcard, only keys equal to prefix
+};
+
+// WHO <mask> [<flags>][%<fields>[,<token>]] in progress.
+// "nick!user@host" has to match on all three parts, a plain mask on any of
+// the fields it is compared with (nick, user and host; the flags before '%'
+// pick others, 'r' is the realname). The %fields ask for a WHOX (354) reply.
+struct WhoQuery {
+    std::string                 mask;       // as given, for RPL_ENDOFWHO
+    std::string                 channel;    // WHO #chan, the members are listed instead
+    std::string                 nickMask;
+    std::string                 userMask;
+    std::string                 hostMask;
+    std::string                 anyMask;    // plain mask, empty for the nick!user@host form
+    unsigned int                fields;     // what anyMask is compared with
+    // The masks above, compiled once for the whole walk
+    CompiledMask                nickMatcher;
+    CompiledMask                userMatcher;
+    CompiledMask                hostMatcher;
+    CompiledMask                anyMatcher;
+    std::string                 whox;       // requested WHOX fields, empty for 352 replies
+    std::string                 token;
+    // Where the walk is
+    std::vector<WhoScan>        scans;
+    size_t                      phase;      // index into scans
+    bool                        scanDone;   // move on to the next scan
+    std::pair<std::string, int> next;
+    size_t                      position;   // next member, for a channel
+
+    WhoQuery();
+    void    parse(const std::string& mask, const std::string& options);
+    void    splitMask();    // mask into nickMask, userMask and hostMask
+    bool    matchesField(unsigned int field, const Client& client) const;
+    bool    matches(const Client& client) const;
+    // matches, and wasn't already returned by an earlier scan
+    bool    accepts(const Client& client) const;
+};
+
+// Registered clients sorted by casefolded nick, username and host, so a mask
+// with a literal prefix only touches the clients under that prefix. A mask
+// that starts with a wildcard (or asks about realnames) walks the nick index
+// once, which is every client.
+class UserIndex {
+private:
+    typedef std::set<std::pair<std::string, int> > Index;
+
+    Index   _byNick;
+    Index   _byUser;
+    Index   _byHost;
+
+    const Index&    index(unsigned int field) const;
+
+public:
+    static std::string  fold(const std::string& str);
+    static std::string  fold(const char* str, size_t size);
+
+    void    add(const Client& client);
+    void    remove(const Client& client);
+    void    renamed(const Client& client, const std::string& oldNick);
+    size_t  size() const { return _byNick.size(); }
+    // Sets up query.scans for the cheapest walk
+    void    plan(WhoQuery& query) const;
+    // Fds of the next candidates, at most budget of them; false once the walk is over.
+    // Candidates still have to pass query.accepts().
+    bool    next(WhoQuery& query, std::vector<int>& out, size_t budget) const;
+};
+
+#endif
@@ -16,10 +16,12 @@
 #include <cerrno>
 #include <sstream>
 
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE 65536 // one receive buffer shared by all clients, see Server::handleClientMessage
 
 #include "Server.hpp"
 #include "Client.hpp"
 #include "Channel.hpp"
+#include "HotRestart.hpp"
+#include "MemoryBudget.hpp"
 
 #endif
\ No newline at end of file
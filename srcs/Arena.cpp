@@ -0,0 +1,112 @@
+#include "../inc/Arena.hpp"
+#include <new>
+
+static size_t g_arenaBytes;
+
+Arena::Arena() : _chunkSize(0), _offset(0), _total(0), _peak(0), _resets(0) {}
+
+Arena::~Arena()
+{
+    release();
+}
+
+size_t Arena::totalCapacity()
+{
+    return g_arenaBytes;
+}
+
+void Arena::release()
+{
+    for (size_t i = 0; i < _chunks.size(); ++i)
+        ::operator delete(_chunks[i]);
+    _chunks.clear();
+    g_arenaBytes -= _total;
+    _chunkSize = 0;
+    _total = 0;
+}
+
+void Arena::grow(size_t atLeast)
+{
+    size_t size = _chunkSize ? _chunkSize * 2 : ARENA_CHUNK_SIZE;
+    while (size < atLeast)
+        size *= 2;
+    _chunks.push_back(static_cast<char*>(::operator new(size)));
+    _chunkSize = size;
+    _offset = 0;
+    _total += size;
+    g_arenaBytes += size;
+}
+
+char* Arena::allocate(size_t size)
+{
+    // Keep pointer alignment so small structs can live here too
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if (_chunks.empty() || _offset + size > _chunkSize)
+        grow(size);
+    char* ptr = _chunks.back() + _offset;
+    _offset += size;
+    return ptr;
+}
+
+StringSpan Arena::copy(const char* data, size_t size)
+{
+    char* ptr = allocate(size);
+    std::memcpy(ptr, data, size);
+    return StringSpan(ptr, size);
+}
+
+void Arena::reset()
+{
+    if (_chunks.size() > 1)
+    {
+        // Merge into one chunk big enough for what this iteration needed
+        size_t total = _total;
+        release();
+        grow(total);
+        _peak = 0;
+        _resets = 0;
+    }
+    else if (_offset > _peak)
+        _peak = _offset;
+    if (_chunkSize > ARENA_CHUNK_SIZE && ++_resets >= ARENA_SHRINK_RESETS)
+    {
+        // The burst is over, go back to what the recent iterations needed
+        size_t size = ARENA_CHUNK_SIZE;
+        while (size < _peak)
+            size *= 2;
+        if (size < _chunkSize)
+        {
+            release();
+            grow(size);
+        }
+        _peak = 0;
+        _resets = 0;
+    }
+    _offset = 0;
+}
+
+ArenaWriter::ArenaWriter(Arena& arena, size_t expected)
+    : _arena(arena), _data(arena.allocate(expected)), _size(0), _capacity(expected)
+{
+}
+
+void ArenaWriter::reserve(size_t extra)
+{
+    if (_size + extra <= _capacity)
+        return;
+    size_t capacity = _capacity * 2;
+    while (capacity < _size + extra)
+        capacity *= 2;
+    char* data = _arena.allocate(capacity);
+    std::memcpy(data, _data, _size);
+    _data = data;
+    _capacity = capacity;
+}
+
+ArenaWriter& ArenaWriter::append(const char* data, size_t size)
+{
+    reserve(size);
+    std::memcpy(_data + _size, data, size);
+    _size += size;
+    return *this;
+}
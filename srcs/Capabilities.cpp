@@ -0,0 +1,36 @@
+#include "../inc/Capabilities.hpp"
+
+static const struct {
+    Capability  cap;
+    const char* name;
+} capabilityNames[] = {
+    { CAP_SERVER_TIME, "server-time" },
+    { CAP_MESSAGE_TAGS, "message-tags" },
+    { CAP_ECHO_MESSAGE, "echo-message" },
+    { CAP_MULTI_PREFIX, "multi-prefix" },
+    { CAP_BATCH, "batch" }
+};
+
+static const size_t capabilityCount = sizeof(capabilityNames) / sizeof(capabilityNames[0]);
+
+unsigned int Capabilities::fromName(const std::string& name)
+{
+    for (size_t i = 0; i < capabilityCount; ++i)
+        if (name == capabilityNames[i].name)
+            return capabilityNames[i].cap;
+    return 0;
+}
+
+std::string Capabilities::names(unsigned int caps)
+{
+    std::string list;
+    for (size_t i = 0; i < capabilityCount; ++i)
+    {
+        if (!(caps & capabilityNames[i].cap))
+            continue;
+        if (!list.empty())
+            list += ' ';
+        list += capabilityNames[i].name;
+    }
+    return list;
+}
@@ -1,12 +1,84 @@
 #include "../inc/ft_irc.hpp"
 
 Channel::Channel(const std::string& name)
-    : _name(name), _topic(""), _isInviteOnly(false), _topicProtected(false), _key(""), _userLimit(0)
+    : _name(name), _topic(""), _operatorCount(0), _isInviteOnly(false), _topicProtected(false), _key(""), _userLimit(0), _accounted(0),
+    _topicTime(0), _created(time(NULL)), _directory(NULL), _directoryId(0), _masks(NULL), _maskGeneration(1)
 {
+    account();
 }
 
+// Unlink from whoever is still around so no client keeps a dangling node
 Channel::~Channel()
 {
+    _names.invalidate(); // nothing to keep in step anymore
+    if (_directory)
+        _directory->remove(_directoryId);
+    _directory = NULL;
+    while (!_members.empty())
+        removeMembership(_members.back());
+    while (!_invited.empty())
+        removeInvited(_invited.back());
+    delete _masks;
+    MemoryBudget::release(MEM_CHANNELS, _accounted);
+}
+
+// Heap owned by the channel beyond its pool slot, the slot itself is counted by the pool
+void Channel::account()
+{
+    MemoryBudget::update(MEM_CHANNELS, _accounted, MemoryBudget::heapBytes(_topic) + MemoryBudget::heapBytes(_key)
+        + _members.capacity() * sizeof(Membership*) + _invited.capacity() * sizeof(Client*) + _names.capacity());
+}
+
+static ObjectPool<Channel, 32>& channelPool()
+{
+    static ObjectPool<Channel, 32> pool;
+    return pool;
+}
+
+void* Channel::operator new(size_t size)
+{
+    if (size != sizeof(Channel)) // a derived class, let the heap deal with it
+        return ::operator new(size);
+    return channelPool().allocate();
+}
+
+void Channel::operator delete(void* ptr, size_t size)
+{
+    if (size != sizeof(Channel))
+        ::operator delete(ptr);
+    else
+        channelPool().deallocate(ptr);
+}
+
+PoolStats Channel::poolStats()
+{
+    return channelPool().stats();
+}
+
+static ObjectPool<Membership, 256>& membershipPool()
+{
+    static ObjectPool<Membership, 256> pool;
+    return pool;
+}
+
+void* Membership::operator new(size_t size)
+{
+    if (size != sizeof(Membership))
+        return ::operator new(size);
+    return membershipPool().allocate();
+}
+
+void Membership::operator delete(void* ptr, size_t size)
+{
+    if (size != sizeof(Membership))
+        ::operator delete(ptr);
+    else
+        membershipPool().deallocate(ptr);
+}
+
+PoolStats Membership::poolStats()
+{
+    return membershipPool().stats();
 }
 
 void Channel::addClient(Client* client)
@@ -15,141 +87,269 @@ void Channel::addClient(Client* client)
     if (isClientInChannel(client))
         return;
 
-    _clients.push_back(client);
-    client->getChannels().push_back(_name);
+    Membership* membership = new Membership(client, this);
+    membership->channelSlot = _members.size();
+    _members.push_back(membership);
+    client->attachMembership(membership);
+    _names.added(*membership);
+    if (_directory)
+        _directory->setUsers(_directoryId, _members.size());
+    account();
+}
+
+// O(1): swap the node with the last one on both sides
+void Channel::removeMembership(Membership* membership)
+{
+    _names.removed(*membership);
+    Membership* last = _members.back();
+    _members[membership->channelSlot] = last;
+    last->channelSlot = membership->channelSlot;
+    _members.pop_back();
+    if (membership->isOperator)
+        _operatorCount--;
+    membership->client->detachMembership(membership);
+    delete membership;
+    if (_directory)
+        _directory->setUsers(_directoryId, _members.size());
 }
 
 void Channel::removeClient(Client* client)
 {
-    // Remove from clients
-    for (std::vector<Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
-    {
-        if (*it == client)
-        {
-            _clients.erase(it);
-            std::cout << "removed addres: " + client->getNickname() << std::endl;
-            break;
-        }
-    }
+    Membership* membership = client->findMembership(this);
+    if (membership)
+        removeMembership(membership);
+    removeInvited(client);
+}
 
-    // Remove from operators
-    for (std::vector<Client*>::iterator it = _operators.begin(); it != _operators.end(); ++it)
-    {
-        if (*it == client)
-        {
-            std::cout << "removed operator: " + client->getNickname() << std::endl;
-            _operators.erase(it);
-            break;
-        }
-    }
+void Channel::addOperator(Client* client)
+{
+    // Check if client is in channel
+    if (!isClientInChannel(client))
+        addClient(client);
 
-    // Remove from invited list
-    for (std::vector<Client*>::iterator it = _invited.begin(); it != _invited.end(); ++it)
+    Membership* membership = client->findMembership(this);
+    if (membership->isOperator)
+        return;
+    membership->isOperator = true;
+    _operatorCount++;
+    _names.changed(*membership);
+}
+
+void Channel::removeOperator(Client* client)
+{
+    Membership* membership = client->findMembership(this);
+    if (membership && membership->isOperator)
     {
-        if (*it == client)
-        {
-            std::cout << "removed invited: " + client->getNickname() << std::endl;
-            _invited.erase(it);
-            break;
-        }
+        membership->isOperator = false;
+        _operatorCount--;
+        _names.changed(*membership);
     }
+}
 
-    // Remove channel from client's channel list
-    for (std::vector<std::string>::iterator it = client->getChannels().begin(); it != client->getChannels().end(); ++it)
+void Channel::setVoiced(Client* client, bool voiced)
+{
+    Membership* membership = client->findMembership(this);
+    if (membership && membership->isVoiced != voiced)
     {
-        if (*it == _name)
-        {
-            std::cout << "removed channel: " + client->getNickname() << std::endl;
-            client->getChannels().erase(it);
-            break;
-        }
+        membership->isVoiced = voiced;
+        _names.changed(*membership);
     }
 }
 
-void Channel::addOperator(Client* client)
+MaskList& Channel::getMaskList(char mode)
 {
-    // Check if client is already an operator
-    if (isOperator(client))
-        return;
+    if (!_masks)
+        _masks = new ChannelMasks;
+    if (mode == 'e')
+        return _masks->exceptions;
+    if (mode == 'I')
+        return _masks->inviteExceptions;
+    return _masks->bans;
+}
 
-    // Check if client is in channel
-    if (!isClientInChannel(client))
-        addClient(client);
+const MaskList* Channel::findMaskList(char mode) const
+{
+    if (!_masks)
+        return NULL;
+    if (mode == 'e')
+        return &_masks->exceptions;
+    if (mode == 'I')
+        return &_masks->inviteExceptions;
+    return &_masks->bans;
+}
 
-    _operators.push_back(client);
+size_t Channel::getMaskCount() const
+{
+    return _masks ? _masks->bans.size() + _masks->exceptions.size() + _masks->inviteExceptions.size() : 0;
 }
 
-void Channel::removeOperator(Client* client)
+bool Channel::addMask(char mode, const std::string& mask, const std::string& setBy, time_t setAt)
+{
+    if (!getMaskList(mode).add(mask, setBy, setAt))
+        return false;
+    if (mode != 'I')
+        _maskGeneration++;
+    return true;
+}
+
+bool Channel::removeMask(char mode, const std::string& mask)
+{
+    if (!_masks || !getMaskList(mode).remove(mask))
+        return false;
+    if (mode != 'I')
+        _maskGeneration++;
+    return true;
+}
+
+bool Channel::isBanned(Client* client, Membership* membership)
 {
-    for (std::vector<Client*>::iterator it = _operators.begin(); it != _operators.end(); ++it)
+    if (!_masks || _masks->bans.empty())
+        return false;
+    if (membership && membership->bansChecked == _maskGeneration)
+        return membership->isBanned;
+    bool banned = _masks->bans.matches(*client) && !_masks->exceptions.matches(*client);
+    if (membership)
     {
-        if (*it == client)
-        {
-            _operators.erase(it);
-            break;
-        }
+        membership->isBanned = banned;
+        membership->bansChecked = _maskGeneration;
     }
+    return banned;
+}
+
+bool Channel::isInviteException(const Client* client) const
+{
+    return _masks && _masks->inviteExceptions.matches(*client);
+}
+
+bool Channel::isVoiced(Client* client) const
+{
+    if (!client)
+        return false;
+    Membership* membership = client->findMembership(this);
+    return membership && membership->isVoiced;
 }
 
 void Channel::broadcast(const std::string& message, Client* sender)
 {
-    for (std::vector<Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+    broadcast(message.c_str(), message.size(), sender);
+}
+
+void Channel::broadcast(const char* data, size_t len, Client* sender, unsigned long delivery)
+{
+    for (std::vector<Membership*>::iterator it = _members.begin(); it != _members.end(); ++it)
     {
-        if (*it != sender)
-            (*it)->sendMessage(message);
+        if ((*it)->client != sender && (!delivery || (*it)->client->markDelivered(delivery)))
+            (*it)->client->sendMessage(data, len);
     }
 }
 
-bool Channel::isClientInChannel(Client* client) const
+void Channel::broadcast(const OutgoingMessage& message, Client* sender, unsigned long delivery)
 {
-    for (std::vector<Client*>::const_iterator it = _clients.begin(); it != _clients.end(); ++it)
+    for (std::vector<Membership*>::iterator it = _members.begin(); it != _members.end(); ++it)
     {
-        if (*it == client)
-            return true;
+        Client* member = (*it)->client;
+        if (member == sender && !member->hasCap(CAP_ECHO_MESSAGE))
+            continue;
+        if (delivery && member != sender && !member->markDelivered(delivery))
+            continue;
+        const StringSpan& line = message.lineFor(member->getCaps());
+        if (!line.empty())
+            member->sendMessage(line.data, line.size);
     }
-    return false;
+}
+
+// A client is in far fewer channels than a channel has members, so look from the client side
+bool Channel::isClientInChannel(Client* client) const
+{
+    return client && client->findMembership(this) != NULL;
 }
 
 bool Channel::isOperator(Client* client) const
 {
-    for (std::vector<Client*>::const_iterator it = _operators.begin(); it != _operators.end(); ++it)
-    {
-        if (*it == client)
-            return true;
-    }
-    return false;
+    if (!client)
+        return false;
+    Membership* membership = client->findMembership(this);
+    return membership && membership->isOperator;
 }
 
-const std::string& Channel::getName() const
+const ChannelName& Channel::getName() const
 {
     return _name;
 }
 
+const std::string& Channel::getNames(bool multiPrefix)
+{
+    size_t capacity = _names.capacity();
+    const std::string& names = _names.payload(_members, multiPrefix);
+    if (_names.capacity() != capacity)
+        account();
+    return names;
+}
+
 const std::string& Channel::getTopic() const
 {
     return _topic;
 }
 
 void Channel::setTopic(const std::string& topic)
+{
+    setTopic(topic, time(NULL));
+}
+
+void Channel::setTopic(const std::string& topic, time_t setAt)
 {
     _topic = topic;
+    _topicTime = topic.empty() ? 0 : setAt;
+    if (_directory)
+        _directory->setTopicTime(_directoryId, _topicTime);
+    account();
+}
+
+void Channel::setCreated(time_t created)
+{
+    _created = created;
+    if (_directory)
+        _directory->setCreated(_directoryId, _created);
+}
+
+void Channel::listIn(ChannelDirectory* directory)
+{
+    if (_directory)
+        _directory->remove(_directoryId);
+    _directory = directory;
+    if (!_directory)
+        return;
+    _directoryId = _directory->add(this, _name, _created);
+    _directory->setUsers(_directoryId, _members.size());
+    _directory->setTopicTime(_directoryId, _topicTime);
 }
 
-std::vector<Client*>& Channel::getClients()
+std::vector<Client*> Channel::getClients() const
 {
-    return _clients;
+    std::vector<Client*> clients;
+    clients.reserve(_members.size());
+    for (std::vector<Membership*>::const_iterator it = _members.begin(); it != _members.end(); ++it)
+        clients.push_back((*it)->client);
+    return clients;
 }
 
-std::vector<Client*>& Channel::getOperators()
+std::vector<Client*> Channel::getOperators() const
 {
-    return _operators;
+    std::vector<Client*> operators;
+    operators.reserve(_operatorCount);
+    for (std::vector<Membership*>::const_iterator it = _members.begin(); it != _members.end(); ++it)
+    {
+        if ((*it)->isOperator)
+            operators.push_back((*it)->client);
+    }
+    return operators;
 }
 
 bool Channel::isClientInChannel(const std::string& client) const
 {
-    for (std::vector<Client*>::const_iterator it = _clients.begin(); it != _clients.end(); ++it)
+    for (std::vector<Membership*>::const_iterator it = _members.begin(); it != _members.end(); ++it)
     {
-        if ((*it)->getNickname() == client)
+        if ((*it)->client->getNickname() == client)
             return true;
     }
     return false;
@@ -157,23 +357,12 @@ bool Channel::isClientInChannel(const std::string& client) const
 
 void Channel::removeClient(const std::string& client)
 {
-    for (std::vector<Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+    for (std::vector<Membership*>::iterator it = _members.begin(); it != _members.end(); ++it)
     {
-        if ((*it)->getNickname() == client)
+        if ((*it)->client->getNickname() == client)
         {
-            Client* cl = *it;
-            _clients.erase(it);
-            // Also remove from operators if present
-            removeOperator(cl);
-            // Remove channel from client's channel list
-            for (std::vector<std::string>::iterator it2 = cl->getChannels().begin(); it2 != cl->getChannels().end(); ++it2)
-            {
-                if (*it2 == _name)
-                {
-                    cl->getChannels().erase(it2);
-                    break;
-                }
-            }
+            removeMembership(*it);
+            return;
         }
     }
 }
@@ -193,6 +382,8 @@ void Channel::addInvited(Client* client)
     if (isInvited(client))
         return;
     _invited.push_back(client);
+    client->addInvite(this);
+    account();
 }
 
 void Channel::removeInvited(Client* client)
@@ -204,6 +395,7 @@ void Channel::removeInvited(Client* client)
         if (*it == client)
         {
             _invited.erase(it);
+            client->removeInvite(this);
             break;
         }
     }
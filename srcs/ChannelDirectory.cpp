@@ -0,0 +1,179 @@
+#include "../inc/ChannelDirectory.hpp"
+#include "../inc/Mask.hpp"
+#include <cstdlib>
+
+ListQuery::ListQuery()
+    : minUsers(0), maxUsers(0), createdAfter(0), createdBefore(0), topicAfter(0), topicBefore(0),
+    byUsers(false), nextUsers(0), nextId(0)
+{}
+
+static bool parseCount(const std::string& str, size_t start, size_t& value)
+{
+    if (start >= str.size() || str.find_first_not_of("0123456789", start) != std::string::npos)
+        return false;
+    value = static_cast<size_t>(std::strtoul(str.c_str() + start, NULL, 10));
+    return true;
+}
+
+void ListQuery::parse(const std::string& conditions, time_t now)
+{
+    size_t start = 0;
+    while (start <= conditions.size())
+    {
+        size_t end = conditions.find(',', start);
+        if (end == std::string::npos)
+            end = conditions.size();
+        std::string item = conditions.substr(start, end - start);
+        start = end + 1;
+        size_t value;
+        if (item.empty())
+            continue;
+        if (item[0] == '>' && parseCount(item, 1, value))
+            minUsers = value;
+        else if (item[0] == '<' && parseCount(item, 1, value))
+            maxUsers = value;
+        else if ((item[0] == 'C' || item[0] == 'T') && item.size() > 1
+            && (item[1] == '<' || item[1] == '>') && parseCount(item, 2, value))
+        {
+            // "less than n minutes ago" is a lower bound on the time
+            time_t bound = now - static_cast<time_t>(value) * 60;
+            time_t& after = item[0] == 'C' ? createdAfter : topicAfter;
+            time_t& before = item[0] == 'C' ? createdBefore : topicBefore;
+            if (item[1] == '<')
+                after = bound;
+            else
+                before = bound;
+        }
+        else if (item[0] == '!' && item.size() > 1)
+            excluded.push_back(CompiledMask(item.substr(1)));
+        else if (item[0] == '#' || item[0] == '&')
+        {
+            masks.push_back(item);
+            matchers.push_back(CompiledMask(item));
+        }
+    }
+    byUsers = minUsers > 0 || maxUsers > 0;
+    nextUsers = minUsers ? minUsers + 1 : 0;
+}
+
+bool ListQuery::matches(const DirectoryEntry& entry) const
+{
+    if (minUsers && entry.users <= minUsers)
+        return false;
+    if (maxUsers && entry.users >= maxUsers)
+        return false;
+    if ((createdAfter && entry.created <= createdAfter) || (createdBefore && entry.created >= createdBefore))
+        return false;
+    if ((topicAfter || topicBefore) && !entry.topicTime)
+        return false;
+    if ((topicAfter && entry.topicTime <= topicAfter) || (topicBefore && entry.topicTime >= topicBefore))
+        return false;
+    for (size_t i = 0; i < excluded.size(); ++i)
+    {
+        if (excluded[i].matches(entry.name.c_str(), entry.name.size()))
+            return false;
+    }
+    if (masks.empty())
+        return true;
+    for (size_t i = 0; i < matchers.size(); ++i)
+    {
+        if (matchers[i].matches(entry.name.c_str(), entry.name.size()))
+            return true;
+    }
+    return false;
+}
+
+bool ListQuery::onlyNames() const
+{
+    if (masks.empty() || byUsers || createdAfter || createdBefore || topicAfter || topicBefore || !excluded.empty())
+        return false;
+    for (size_t i = 0; i < masks.size(); ++i)
+    {
+        if (isMask(masks[i]))
+            return false;
+    }
+    return true;
+}
+
+ChannelDirectory::ChannelDirectory() : _nextId(1) {}
+
+unsigned long ChannelDirectory::add(Channel* channel, const ChannelName& name, time_t created)
+{
+    unsigned long id = _nextId++;
+    DirectoryEntry& entry = _entries[id];
+    entry.channel = channel;
+    entry.name = name;
+    entry.users = 0;
+    entry.created = created;
+    entry.topicTime = 0;
+    _byUsers.insert(std::make_pair(static_cast<size_t>(0), id));
+    return id;
+}
+
+void ChannelDirectory::remove(unsigned long id)
+{
+    std::map<unsigned long, DirectoryEntry>::iterator it = _entries.find(id);
+    if (it == _entries.end())
+        return;
+    _byUsers.erase(std::make_pair(it->second.users, id));
+    _entries.erase(it);
+}
+
+void ChannelDirectory::setUsers(unsigned long id, size_t users)
+{
+    std::map<unsigned long, DirectoryEntry>::iterator it = _entries.find(id);
+    if (it == _entries.end() || it->second.users == users)
+        return;
+    _byUsers.erase(std::make_pair(it->second.users, id));
+    it->second.users = users;
+    _byUsers.insert(std::make_pair(users, id));
+}
+
+void ChannelDirectory::setTopicTime(unsigned long id, time_t topicTime)
+{
+    std::map<unsigned long, DirectoryEntry>::iterator it = _entries.find(id);
+    if (it != _entries.end())
+        it->second.topicTime = topicTime;
+}
+
+void ChannelDirectory::setCreated(unsigned long id, time_t created)
+{
+    std::map<unsigned long, DirectoryEntry>::iterator it = _entries.find(id);
+    if (it != _entries.end())
+        it->second.created = created;
+}
+
+// A channel whose user count changes mid-walk can move past the position or
+// behind it, so it may show up twice or not at all. Same as on any server.
+bool ChannelDirectory::next(ListQuery& query, std::vector<Channel*>& out, size_t budget) const
+{
+    size_t scanned = 0;
+    if (query.byUsers)
+    {
+        std::set<std::pair<size_t, unsigned long> >::const_iterator it
+            = _byUsers.lower_bound(std::make_pair(query.nextUsers, query.nextId));
+        for (; it != _byUsers.end() && scanned < budget; ++it, ++scanned)
+        {
+            if (query.maxUsers && it->first >= query.maxUsers)
+                return false; // the rest is bigger still
+            const DirectoryEntry& entry = _entries.find(it->second)->second;
+            if (query.matches(entry))
+                out.push_back(entry.channel);
+        }
+        if (it == _byUsers.end())
+            return false;
+        query.nextUsers = it->first;
+        query.nextId = it->second;
+        return true;
+    }
+    std::map<unsigned long, DirectoryEntry>::const_iterator it = _entries.lower_bound(query.nextId);
+    for (; it != _entries.end() && scanned < budget; ++it, ++scanned)
+    {
+        if (query.matches(it->second))
+            out.push_back(it->second.channel);
+    }
+    if (it == _entries.end())
+        return false;
+    query.nextId = it->first;
+    return true;
+}
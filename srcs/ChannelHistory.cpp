@@ -0,0 +1,335 @@
+#include "../inc/ChannelHistory.hpp"
+#include "../inc/MemoryBudget.hpp"
+#include <sys/time.h>
+#include <new>
+
+static size_t g_depth = HISTORY_DEPTH;
+static size_t g_channelBytes = HISTORY_CHANNEL_BYTES;
+static size_t g_totalBytes = HISTORY_MEMORY;
+static size_t g_ringBytes;  // lines held by rings, not by replays or the log writer
+
+// Rings above HISTORY_FLOOR in a binary heap by their oldest id, the top one
+// holds the oldest message that may go. Rings know their slot, and the vector
+// keeps its capacity, so stores don't allocate.
+static const size_t NOT_EVICTABLE = static_cast<size_t>(-1);
+static std::vector<ChannelHistory*> g_evictable;
+
+static bool older(const ChannelHistory* a, const ChannelHistory* b)
+{
+    return a->at(0)->id < b->at(0)->id;
+}
+
+// Block sizes are powers of two from 128 bytes, one free list per size
+# define HISTORY_SIZE_CLASSES 8
+
+static HistoryBlock* g_freeBlocks[HISTORY_SIZE_CLASSES];
+
+static size_t classBytes(unsigned char sizeClass)
+{
+    return static_cast<size_t>(128) << sizeClass;
+}
+
+HistoryBlock* HistoryBlock::create(unsigned long long id, unsigned long long time, const StringSpan& line)
+{
+    size_t needed = sizeof(HistoryBlock) + line.size;
+    unsigned char sizeClass = 0;
+    while (sizeClass < HISTORY_SIZE_CLASSES - 1 && classBytes(sizeClass) < needed)
+        sizeClass++;
+    size_t bytes = classBytes(sizeClass) < needed ? needed : classBytes(sizeClass);
+    HistoryBlock* block;
+    if (bytes == classBytes(sizeClass) && g_freeBlocks[sizeClass])
+    {
+        block = g_freeBlocks[sizeClass];
+        std::memcpy(&g_freeBlocks[sizeClass], block->data, sizeof(HistoryBlock*));
+    }
+    else
+        block = static_cast<HistoryBlock*>(::operator new(bytes));
+    block->id = id;
+    block->time = time;
+    block->size = line.size;
+    block->refs = 1;
+    block->sizeClass = (bytes == classBytes(sizeClass)) ? sizeClass : HISTORY_SIZE_CLASSES;
+    std::memcpy(block->data, line.data, line.size);
+    MemoryBudget::charge(MEM_HISTORY, bytes);
+    return block;
+}
+
+void HistoryBlock::release()
+{
+    if (--refs)
+        return;
+    if (sizeClass == HISTORY_SIZE_CLASSES)
+    {
+        MemoryBudget::release(MEM_HISTORY, sizeof(HistoryBlock) + size);
+        ::operator delete(this);
+        return;
+    }
+    MemoryBudget::release(MEM_HISTORY, classBytes(sizeClass));
+    // The free list link lives where the line was
+    std::memcpy(data, &g_freeBlocks[sizeClass], sizeof(HistoryBlock*));
+    g_freeBlocks[sizeClass] = this;
+}
+
+size_t HistoryBlock::formatId(unsigned long long id, char* out)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < HISTORY_MSGID_SIZE; ++i)
+        out[i] = digits[(id >> (4 * (HISTORY_MSGID_SIZE - 1 - i))) & 0xf];
+    return HISTORY_MSGID_SIZE;
+}
+
+bool HistoryBlock::parseId(const std::string& msgid, unsigned long long& id)
+{
+    if (msgid.size() != HISTORY_MSGID_SIZE)
+        return false;
+    id = 0;
+    for (size_t i = 0; i < msgid.size(); ++i)
+    {
+        char c = msgid[i];
+        int digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else
+            return false;
+        id = (id << 4) | digit;
+    }
+    return true;
+}
+
+ChannelHistory::ChannelHistory() : _head(0), _count(0), _bytes(0), _slot(NOT_EVICTABLE) {}
+
+ChannelHistory::~ChannelHistory()
+{
+    clear();
+}
+
+void ChannelHistory::dropOldest()
+{
+    HistoryBlock* oldest = _ring[_head];
+    _ring[_head] = NULL;
+    _bytes -= oldest->size;
+    g_ringBytes -= oldest->size;
+    oldest->release();
+    _head = (_head + 1) % _ring.size();
+    _count--;
+    index();
+}
+
+// Moves the ring at slot up or down to where its oldest id belongs
+void ChannelHistory::sift(size_t slot)
+{
+    ChannelHistory* history = g_evictable[slot];
+    while (slot && older(history, g_evictable[(slot - 1) / 2]))
+    {
+        g_evictable[slot] = g_evictable[(slot - 1) / 2];
+        g_evictable[slot]->_slot = slot;
+        slot = (slot - 1) / 2;
+    }
+    for (size_t child; (child = 2 * slot + 1) < g_evictable.size(); slot = child)
+    {
+        if (child + 1 < g_evictable.size() && older(g_evictable[child + 1], g_evictable[child]))
+            child++;
+        if (!older(g_evictable[child], history))
+            break;
+        g_evictable[slot] = g_evictable[child];
+        g_evictable[slot]->_slot = slot;
+    }
+    g_evictable[slot] = history;
+    history->_slot = slot;
+}
+
+void ChannelHistory::unindex()
+{
+    if (_slot == NOT_EVICTABLE)
+        return;
+    ChannelHistory* last = g_evictable.back();
+    g_evictable.pop_back();
+    if (last != this)
+    {
+        g_evictable[_slot] = last;
+        sift(_slot);
+    }
+    _slot = NOT_EVICTABLE;
+}
+
+void ChannelHistory::index()
+{
+    if (_count <= HISTORY_FLOOR)
+    {
+        unindex();
+        return;
+    }
+    if (_slot == NOT_EVICTABLE)
+    {
+        _slot = g_evictable.size();
+        g_evictable.push_back(this);
+    }
+    sift(_slot);
+}
+
+HistoryBlock* ChannelHistory::store(unsigned long long id, unsigned long long time, const StringSpan& line)
+{
+    if (_ring.empty())
+        _ring.resize(g_depth, NULL);
+    // Room first, so the evicted block is on its free list before we need one
+    while (_count && (_count == _ring.size() || _bytes + line.size > g_channelBytes))
+        dropOldest();
+    while (g_ringBytes + line.size > g_totalBytes && !g_evictable.empty())
+        g_evictable.front()->dropOldest();
+    if (_count && time < at(_count - 1)->time)
+        time = at(_count - 1)->time; // the clock went back, keep the ring sorted
+    HistoryBlock* block = HistoryBlock::create(id, time, line);
+    _ring[(_head + _count) % _ring.size()] = block;
+    _count++;
+    _bytes += line.size;
+    g_ringBytes += line.size;
+    index();
+    return block;
+}
+
+HistoryBlock* ChannelHistory::append(unsigned long long time, const StringSpan& line)
+{
+    return store(nextId(), time, line);
+}
+
+HistoryBlock* ChannelHistory::restore(unsigned long long id, unsigned long long time, const StringSpan& line)
+{
+    if (_count && id <= at(_count - 1)->id)
+        return NULL;
+    return store(id, time, line);
+}
+
+void ChannelHistory::clear()
+{
+    while (_count)
+        dropOldest();
+    _head = 0;
+}
+
+size_t ChannelHistory::findId(unsigned long long id) const
+{
+    size_t low = 0;
+    size_t high = _count;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (at(middle)->id < id)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return (low < _count && at(low)->id == id) ? low : _count;
+}
+
+size_t ChannelHistory::lowerBound(unsigned long long time) const
+{
+    size_t low = 0;
+    size_t high = _count;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (at(middle)->time < time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+size_t ChannelHistory::upperBound(unsigned long long time) const
+{
+    size_t low = 0;
+    size_t high = _count;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (at(middle)->time <= time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+// First entry whose key is at least key
+size_t ChannelHistory::lowerBoundKey(bool byTime, unsigned long long key) const
+{
+    if (byTime)
+        return lowerBound(key);
+    size_t low = 0;
+    size_t high = _count;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (at(middle)->id < key)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+void ChannelHistory::select(const HistoryRange& range, std::vector<HistoryRecord>& out) const
+{
+    if (range.low > range.high || !range.limit)
+        return;
+    size_t first = lowerBoundKey(range.byTime, range.low);
+    size_t last = (range.high == ~0ULL) ? _count : lowerBoundKey(range.byTime, range.high + 1);
+    size_t idEnd = lowerBoundKey(false, range.idLimit);
+    if (last > idEnd)
+        last = idEnd;
+    if (first >= last)
+        return;
+    if (last - first > range.limit)
+    {
+        if (range.fromEnd)
+            first = last - range.limit;
+        else
+            last = first + range.limit;
+    }
+    for (size_t i = first; i < last; ++i)
+    {
+        HistoryBlock* block = at(i);
+        out.push_back(HistoryRecord(block->id, block->time, block->line()));
+    }
+}
+
+void ChannelHistory::setLimits(size_t depth, size_t channelBytes, size_t totalBytes)
+{
+    g_depth = depth;
+    g_channelBytes = channelBytes;
+    g_totalBytes = totalBytes;
+}
+
+void ChannelHistory::loadLimitsFromEnv()
+{
+    setLimits(MemoryBudget::envSize("IRCSERV_HISTORY_DEPTH", HISTORY_DEPTH),
+              MemoryBudget::envSize("IRCSERV_HISTORY_CHANNEL_BYTES", HISTORY_CHANNEL_BYTES),
+              MemoryBudget::envSize("IRCSERV_HISTORY_MEMORY", HISTORY_MEMORY));
+}
+
+size_t ChannelHistory::totalBytes()
+{
+    return g_ringBytes;
+}
+
+size_t ChannelHistory::depth()
+{
+    return g_depth;
+}
+
+// Starts from the clock in milliseconds shifted left, so ids keep growing
+// across restarts as long as fewer than 4096 messages go out per millisecond
+unsigned long long ChannelHistory::nextId()
+{
+    static unsigned long long next = 0;
+    if (!next)
+    {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        next = (static_cast<unsigned long long>(now.tv_sec) * 1000 + now.tv_usec / 1000) << 12;
+    }
+    return next++;
+}
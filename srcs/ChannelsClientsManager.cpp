@@ -1,13 +1,22 @@
 #include <ChannelsClientsManager.hpp>
+#include <HotRestart.hpp>
+#include <MemoryBudget.hpp>
+#include <MessageView.hpp>
+#include <Capabilities.hpp>
+#include <ServerTime.hpp>
+#include <HistoryLog.hpp>
+#include <ConnectionLimiter.hpp>
+#include <cstring>
+#include <sstream>
 
 
 ChannelsClientsManager::ChannelsClientsManager(std::map<int, Client*> &clients, std::string const &password, std::vector<pollfd> &pollfds)
-	: _clients(clients), _password(password), _pollfds(pollfds)
+	: _clients(clients), _password(password), _pollfds(pollfds), _batchCount(0), _deliveryCount(0), _historyLog(NULL), _limiter(NULL), _floodControl(false)
 {}
 
 ChannelsClientsManager::~ChannelsClientsManager()
 {
-	for (std::map<std::string, Channel*>::iterator it = _channels.begin(); it != _channels.end(); ++it)
+	for (std::map<ChannelName, Channel*>::iterator it = _channels.begin(); it != _channels.end(); ++it)
 		delete it->second;
 	_channels.clear();
 }
@@ -21,29 +30,172 @@ ChannelsClientsManager::~ChannelsClientsManager()
 
 void ChannelsClientsManager::handleClientMessage(Client* client) {
 	// Parse the client's message from its buffer
-	// std::string message = client->getBuffer();
-
 	for (std::string message = client->getNextMessage(); !message.empty(); message = client->getNextMessage())
 	{
-		// std::cout << "MESSAGE: "<< message << std::endl;
-		// message += "\r\n"; // Add CRLF back for parsing // TODO removed in getNextMessage
-		IRCCommand command(message);
-		if (!command.isValid()) {
-			Reply::invalidCommand(*client, command.getCommand());
+		if (!processMessage(client, message))
 			return;
-		}
+	}
+}
+
+static const char *findCRLF(const char *begin, const char *end) {
+	for (const char *p = begin; p + 1 < end; ++p) {
+		if (p[0] == '\r' && p[1] == '\n')
+			return p;
+	}
+	return NULL;
+}
+
+// Bytes fresh from recv. Complete lines are parsed where they lie, only an
+// unterminated tail is copied into the client's buffer. An invalid command
+// drops the rest of the read, like the buffered path always did. A line over
+// the client's flood budget is held back with everything after it.
+void ChannelsClientsManager::handleClientInput(Client* client, const char* data, size_t len) {
+	if (len == 0 || client->hasQuit())
+		return;
+	// Whatever comes while input is held back queues up behind it
+	if (client->hasDeferredInput()) {
+		deferInput(client, data, len);
+		return;
+	}
+	unsigned long long now = _floodControl ? ServerTime::now() : 0;
+	const char *end = data + len;
+
+	// Finish the line an earlier read left behind, its CRLF may even be split between reads
+	if (!client->getBuffer().empty()) {
+		const char *lineEnd;
+		const std::string &tail = client->getBuffer();
+		if (tail[tail.size() - 1] == '\r' && data[0] == '\n')
+			lineEnd = data + 1;
+		else if ((lineEnd = findCRLF(data, end)) != NULL)
+			lineEnd += 2;
 		else {
-			client->updateConnectionTime();
-			// std::cout << "Complete message: " << message << std::endl;
-			if (!client->isRegistered()) {
-				registerClient(client, command);
+			client->addToBuffer(data, len);
+			return;
+		}
+		client->addToBuffer(data, lineEnd - data);
+		data = lineEnd;
+		std::string message = client->getNextMessage();
+		if (!message.empty() && !admitCommand(client, message.c_str(), message.size(), now)) {
+			deferInput(client, message.c_str(), message.size());
+			deferInput(client, data, end - data);
+			return;
+		}
+		if (!message.empty() && !processMessage(client, message)) {
+			client->clearBuffer();
+			return;
+		}
+	}
+
+	for (const char *crlf = findCRLF(data, end); crlf != NULL; crlf = findCRLF(data, end)) {
+		size_t lineLen = crlf + 2 - data;
+		if (lineLen > MemoryBudget::clientRecvQLimit())
+			Reply::messageTooLong(*client);
+		else if (!admitCommand(client, data, lineLen, now)) {
+			deferInput(client, data, end - data);
+			return;
+		}
+		else if (!processMessage(client, data, lineLen))
+			return;
+		data = crlf + 2;
+	}
+	if (data < end)
+		client->addToBuffer(data, end - data);
+}
+
+bool ChannelsClientsManager::admitCommand(Client* client, const char* line, size_t len, unsigned long long now) {
+	return !_floodControl || client->flood().admit(now, FloodControl::costOf(line, len));
+}
+
+// Held back until the budget allows; more than FLOOD_EXCESS_BYTES of it is a flood
+void ChannelsClientsManager::deferInput(Client* client, const char* data, size_t len) {
+	if (!len || client->hasQuit())
+		return;
+	client->deferInput(data, len);
+	_deferred.insert(client->getFd());
+	if (client->getDeferredSize() > FLOOD_EXCESS_BYTES) {
+		client->takeDeferredInput();
+		disconnect(client, "Excess Flood");
+	}
+}
+
+// Clients are taken off the set before their input runs, it may defer again.
+// Whoever quits or floods out on the way is removed right here.
+void ChannelsClientsManager::continueDeferred() {
+	if (_deferred.empty())
+		return;
+	unsigned long long now = ServerTime::now();
+	std::vector<int> ready;
+	for (std::set<int>::const_iterator it = _deferred.begin(); it != _deferred.end(); ++it) {
+		Client *client = getClientByFd(*it);
+		if (!client || client->flood().readyAt() <= now)
+			ready.push_back(*it);
+	}
+	for (size_t i = 0; i < ready.size(); ++i) {
+		_deferred.erase(ready[i]);
+		Client *client = getClientByFd(ready[i]);
+		if (!client)
+			continue;
+		std::string input = client->takeDeferredInput();
+		handleClientInput(client, input.data(), input.size());
+		if (client->hasQuit())
+			removeClient(*client);
+	}
+}
+
+int ChannelsClientsManager::deferredTimeout() const {
+	if (_deferred.empty())
+		return -1;
+	unsigned long long now = ServerTime::now();
+	unsigned long long earliest = 0;
+	for (std::set<int>::const_iterator it = _deferred.begin(); it != _deferred.end(); ++it) {
+		Client *client = getClientByFd(*it);
+		if (!client)
+			return 0;
+		if (it == _deferred.begin() || client->flood().readyAt() < earliest)
+			earliest = client->flood().readyAt();
+	}
+	return earliest <= now ? 0 : static_cast<int>(earliest - now);
+}
+
+bool ChannelsClientsManager::processMessage(Client* client, const std::string& message) {
+	return processMessage(client, message.c_str(), message.size());
+}
+
+// PRIVMSG is most of the traffic, it is served from a view of the line with
+// the outgoing message built in the arena. Anything it can't handle as a plain
+// success (errors, odd syntax) goes through IRCCommand like every other command.
+// TAGMSG carries nothing but tags, so it only exists on the view side.
+bool ChannelsClientsManager::processMessage(Client* client, const char* line, size_t len) {
+	if (client->isRegistered()) {
+		MessageView view;
+		if (view.parse(line, len) && view.prefix().empty()) {
+			if ((view.command().equals("PRIVMSG") && privmsgFromView(client, view, "PRIVMSG"))
+				|| (view.command().equals("NOTICE") && privmsgFromView(client, view, "NOTICE"))) {
+				client->updateConnectionTime();
+				return true;
 			}
-			else {
-				handleRegisteredClientMessage(client, command);
+			if (view.command().equals("TAGMSG")) {
+				executeTagmsg(client, view);
+				client->updateConnectionTime();
+				return true;
 			}
-
 		}
 	}
+	IRCCommand command(std::string(line, len));
+	if (!command.isValid()) {
+		Reply::invalidCommand(*client, command.getCommand());
+		return false;
+	}
+	client->updateConnectionTime();
+	if (command.getCommand() == "QUIT") {
+		executeQuit(client, command);
+		return false; // nothing after QUIT is read
+	}
+	if (!client->isRegistered())
+		registerClient(client, command);
+	else
+		handleRegisteredClientMessage(client, command);
+	return true;
 }
 
 void ChannelsClientsManager::handleRegisteredClientMessage(Client* client, IRCCommand& command)
@@ -63,7 +215,7 @@ void ChannelsClientsManager::handleRegisteredClientMessage(Client* client, IRCCo
 	}
 	else if (command.getCommand() == "JOIN")
 		executeJoin(client, command);
-	else if (command.getCommand() == "PRIVMSG")
+	else if (command.getCommand() == "PRIVMSG" || command.getCommand() == "NOTICE")
 		executePrivmsg(client, command);
 	else if (command.getCommand() == "INVITE")
 		executeInvite(client, command);
@@ -71,6 +223,8 @@ void ChannelsClientsManager::handleRegisteredClientMessage(Client* client, IRCCo
 		executeTopic(client, command);
 	else if (command.getCommand() == "KICK")
 		executeKick(client, command);
+	else if (command.getCommand() == "PART")
+		executePart(client, command);
 	else if (command.getCommand() == "PING") {
 		executePing(client, command);
 	}
@@ -84,6 +238,27 @@ void ChannelsClientsManager::handleRegisteredClientMessage(Client* client, IRCCo
 	else if (command.getCommand() == "WHOIS") {
 		executeWhois(client, command);
 	}
+	else if (command.getCommand() == "STATS") {
+		executeStats(client, command);
+	}
+	else if (command.getCommand() == "CAP") {
+		executeCap(client, command);
+	}
+	else if (command.getCommand() == "CHATHISTORY") {
+		executeChathistory(client, command);
+	}
+	else if (command.getCommand() == "NAMES") {
+		executeNames(client, command);
+	}
+	else if (command.getCommand() == "LIST") {
+		executeList(client, command);
+	}
+	else if (command.getCommand() == "WHO") {
+		executeWho(client, command);
+	}
+	else if (command.getCommand() == "MONITOR") {
+		executeMonitor(client, command);
+	}
 	else
 		Reply::unknownCommand(*client, command.getCommand());
 }
@@ -96,11 +271,11 @@ void ChannelsClientsManager::executeMode(Client* client, IRCCommand& command) {
 	}
 	std::string targetChannel = command.getParamAt(0);
 	if (targetChannel[0] == '#' || targetChannel[0] == '&') {
-		if (_channels.find(targetChannel) == _channels.end()) {
+		Channel *channel = findChannel(targetChannel);
+		if (!channel) {
 			Reply::noSuchChannel(*client, targetChannel);
 			return;
 		}
-		Channel *channel = _channels[targetChannel];
 		if (command.getParamsCount() < 2) {
 			std::string modes = "+";
 			if (channel->isInviteOnly()) modes += "i";
@@ -111,6 +286,14 @@ void ChannelsClientsManager::executeMode(Client* client, IRCCommand& command) {
 				" " + targetChannel + " " + modes + "\r\n");
 			return;
 		}
+		// "MODE #chan b" or "+b" alone asks for the list, anybody may
+		std::string modes = command.getParamAt(1);
+		if (!modes.empty() && modes[0] == '+')
+			modes.erase(0, 1);
+		if (command.getParamsCount() == 2 && (modes == "b" || modes == "e" || modes == "I")) {
+			sendMaskList(client, channel, modes[0]);
+			return;
+		}
 		if (!channel->isOperator(client)) {
 			Reply::notOperator(*client, targetChannel);
 			return;
@@ -119,6 +302,42 @@ void ChannelsClientsManager::executeMode(Client* client, IRCCommand& command) {
 	}
 }
 
+static void appendNumber(ArenaWriter& out, size_t value)
+{
+	char digits[24];
+	size_t start = sizeof(digits);
+	do {
+		digits[--start] = static_cast<char>('0' + value % 10);
+		value /= 10;
+	} while (value);
+	out.append(digits + start, sizeof(digits) - start);
+}
+
+// RPL_BANLIST / RPL_EXCEPTLIST / RPL_INVITELIST, then the end reply
+void ChannelsClientsManager::sendMaskList(Client* client, Channel* channel, char mode)
+{
+	const char* entry = mode == 'e' ? RPL_EXCEPTLIST : mode == 'I' ? RPL_INVITELIST : RPL_BANLIST;
+	const char* end = mode == 'e' ? RPL_ENDOFEXCEPTLIST : mode == 'I' ? RPL_ENDOFINVITELIST : RPL_ENDOFBANLIST;
+	const char* what = mode == 'e' ? "exception" : mode == 'I' ? "invite" : "ban";
+	ArenaWriter out(_arena);
+	const MaskList* list = channel->findMaskList(mode);
+	if (list)
+	{
+		for (std::map<std::string, MaskEntry>::const_iterator it = list->entries().begin(); it != list->entries().end(); ++it)
+		{
+			out << ':' << SERVER_NAME << ' ' << entry << ' ';
+			out.name(client->getNickname()) << ' ';
+			out.name(channel->getName()) << ' ' << it->second.mask << ' ' << it->second.setBy << ' ';
+			appendNumber(out, static_cast<size_t>(it->second.setAt));
+			out << "\r\n";
+		}
+	}
+	out << ':' << SERVER_NAME << ' ' << end << ' ';
+	out.name(client->getNickname()) << ' ';
+	out.name(channel->getName()) << " :End of channel " << what << " list\r\n";
+	client->sendMessage(out.data(), out.size());
+}
+
 void ChannelsClientsManager::handleModeFlags(Client &client, Channel &channel, IRCCommand& command) {
 	std::string modeChanges = command.getParamAt(1);
 	// std::string modeParams = (command.getParamsCount() > 2) ? command.getParamAt(2) : "";
@@ -212,6 +431,36 @@ void ChannelsClientsManager::handleModeFlags(Client &client, Channel &channel, I
 					paramIndex++;
 					break;
 				}
+				case MODE_VOICE: {
+					if (paramIndex >= modeParams.size()) {
+						client.sendMessage(":" + std::string(SERVER_NAME) + " 461 " + client.getNickname() + " MODE :Not enough parameters\r\n");
+						break;
+					}
+					Client* targetClient = getClientByNickname(modeParams[paramIndex], &client);
+					if (!targetClient || !channel.isClientInChannel(targetClient))
+						Reply::usersDontMatch(client);
+					else if (currentSign != NONE)
+						channel.setVoiced(targetClient, currentSign == PLUS);
+					paramIndex++;
+					break;
+				}
+				case MODE_BAN:
+				case MODE_EXCEPT:
+				case MODE_INVEX: {
+					if (paramIndex >= modeParams.size()) {
+						sendMaskList(&client, &channel, c);
+						break;
+					}
+					std::string mask = MaskList::normalize(modeParams[paramIndex++]);
+					if (currentSign == MINUS)
+						channel.removeMask(c, mask);
+					else if (channel.getMaskCount() >= MASK_LIST_LIMIT)
+						client.sendMessage(":" + std::string(SERVER_NAME) + " " + ERR_BANLISTFULL + " " + client.getNickname()
+							+ " " + channel.getName() + " " + c + " :Channel list is full\r\n");
+					else
+						channel.addMask(c, mask, client.getNickname().str(), time(NULL));
+					break;
+				}
 				default:
 					Reply::unknownCommand(client, "MODE");
 					// client.sendMessage(":" + SERVER_NAME + " 472 " + client.getNickname() + " " + c + " :is unknown mode char to me\r\n");
@@ -229,6 +478,30 @@ void ChannelsClientsManager::executePing(Client* client, IRCCommand& command) {
 	Reply::pongReply(*client, command.getParams().at(0));
 }
 
+// STATS z: memory usage. There are no IRC operators here, so only clients
+// connected from the machine itself may ask.
+void ChannelsClientsManager::executeStats(Client* client, IRCCommand& command) {
+	if (command.getParamsCount() < 1) {
+		Reply::needMoreParams(*client, "STATS");
+		return;
+	}
+	std::string query = command.getParamAt(0);
+	if (query == "z") {
+		if (client->getHostname() != "127.0.0.1") {
+			Reply::noPrivileges(*client);
+			return;
+		}
+		std::vector<std::string> lines;
+		MemoryBudget::report(lines);
+		std::ostringstream counts;
+		counts << "in use: " << _clients.size() << " clients, " << _channels.size() << " channels";
+		lines.push_back(counts.str());
+		for (size_t i = 0; i < lines.size(); ++i)
+			Reply::statsLine(*client, lines[i]);
+	}
+	Reply::endOfStats(*client, query);
+}
+
 void ChannelsClientsManager::executeWhois(Client* client, IRCCommand& command) {
 	if (command.getParamsCount() < 1) {
 		client->sendMessage(":" + std::string(SERVER_NAME) + " 431 " + client->getNickname() + " :No nickname given\r\n");
@@ -236,15 +509,8 @@ void ChannelsClientsManager::executeWhois(Client* client, IRCCommand& command) {
 	}
 
 	std::string targetNick = command.getParamAt(0);
-	Client* targetClient = NULL;
-
-	// Find the target client
-	for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
-		if (it->second && it->second->getNickname() == targetNick) {
-			targetClient = it->second;
-			break;
-		}
-	}
+	std::map<NickName, Client*>::const_iterator found = _nicks.find(targetNick);
+	Client* targetClient = (found != _nicks.end()) ? found->second : NULL;
 
 	if (!targetClient) {
 		client->sendMessage(":" + std::string(SERVER_NAME) + " 401 " + client->getNickname() + " " + targetNick + " :No such nick\r\n");
@@ -267,12 +533,7 @@ void ChannelsClientsManager::executeWhois(Client* client, IRCCommand& command) {
 }
 
 bool ChannelsClientsManager::isNickInUse(const std::string& nickname) const {
-	for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); it++)
-	{
-		if (it->second && it->second->getNickname() == nickname)
-			return true;
-	}
-	return false;
+	return _nicks.find(nickname) != _nicks.end();
 }
 
 void ChannelsClientsManager::registerClient(Client* client, IRCCommand& command) {
@@ -306,67 +567,484 @@ void ChannelsClientsManager::registerClient(Client* client, IRCCommand& command)
 		client->setRealname(realname);
 	}
 	else if (command.getCommand() == "CAP") {
-		// For simplicity, we just acknowledge CAP commands without actual negotiation
-		std::string serverName = SERVER_NAME;
-		if (command.getParams().at(0) == "LS") {
-			client->sendMessage(serverName + " CAP * LS :\r\n");
-			client->setCAPNegotiation(true);
-		}
-		else if (command.getParams().at(0) == "ACK") {
-			client->sendMessage(serverName + " CAP * ACK :\r\n");
-			client->setCAPNegotiation(true);
-		}
-		else if (command.getParams().at(0) == "END") {
-			client->setCAPNegotiation(false);
-		}
-		else {
-			Reply::unknownCommand(*client, command.getCommand());
+		if (!executeCap(client, command))
 			return;
-		}
 	}
 	else {
 		Reply::unknownCommand(*client, command.getCommand());
 		return;
 	}
-	if (client->isAuthenticated() && client->isNicknameSet() && client->isUsernameSet()) {
+	if (client->isAuthenticated() && client->isNicknameSet() && client->isUsernameSet()
+		&& !client->isCAPNegotiation()) {
 		client->setRegistered(true);
+		_users.add(*client);
 		Reply::welcome(*client);
+		Reply::isupport(*client);
+		notifyMonitors(*client, client->getNickname(), true);
 	}
 }
 
-void ChannelsClientsManager::executePrivmsg(Client* client, IRCCommand& command)
+// CAP LS / LIST / REQ / END. A client that starts negotiating before it is
+// registered stays unregistered until CAP END. REQ is all or nothing: one
+// unknown capability NAKs the whole list.
+bool ChannelsClientsManager::executeCap(Client* client, IRCCommand& command) {
+	std::string prefix = ":" + std::string(SERVER_NAME) + " CAP "
+		+ (client->isNicknameSet() ? client->getNickname().str() : std::string("*"));
+	const std::string& subcommand = command.getParamAt(0);
+	if (subcommand == "LS" || subcommand == "LIST") {
+		unsigned int caps = (subcommand == "LS") ? static_cast<unsigned int>(CAP_ALL) : client->getCaps();
+		client->sendMessage(prefix + " " + subcommand + " :" + Capabilities::names(caps) + "\r\n");
+		if (!client->isRegistered() && subcommand == "LS")
+			client->setCAPNegotiation(true);
+	}
+	else if (subcommand == "REQ") {
+		std::string requested;
+		for (size_t i = 1; i < command.getParamsCount(); ++i)
+			requested += (i > 1 ? " " : "") + command.getParamAt(i);
+		if (!requested.empty() && requested[0] == ':')
+			requested.erase(0, 1);
+		std::istringstream list(requested);
+		std::string name;
+		unsigned int caps = client->getCaps();
+		bool known = !requested.empty();
+		while (known && list >> name) {
+			bool disable = (name[0] == '-');
+			unsigned int cap = Capabilities::fromName(disable ? name.substr(1) : name);
+			if (!cap)
+				known = false;
+			else if (disable)
+				caps &= ~cap;
+			else
+				caps |= cap;
+		}
+		if (known)
+			client->setCaps(caps);
+		client->sendMessage(prefix + (known ? " ACK :" : " NAK :") + requested + "\r\n");
+		if (!client->isRegistered())
+			client->setCAPNegotiation(true);
+	}
+	else if (subcommand == "END") {
+		client->setCAPNegotiation(false);
+	}
+	else {
+		Reply::invalidCapCommand(*client, subcommand);
+		return false;
+	}
+	return true;
+}
+
+// Channel or nick the message is for, NULL when it doesn't exist or the
+// client isn't in that channel. Nothing is reported here.
+bool ChannelsClientsManager::findMessageTarget(Client* client, const StringSpan& target, Channel*& channel, Client*& recipient)
 {
-	const std::vector<std::string>& params = command.getParams();
-	std::string target = params[0];
-	std::string message = params[1];
-	if (target[0] == '#' || target[0] == '&')
-	{
-		if (_channels.find(target) == _channels.end())
-		{
-			client->sendMessage("server 403: " + client->getNickname() + " sent message to " + target + " :No such channel exist\r\n");
+	channel = NULL;
+	recipient = NULL;
+	if (target.empty())
+		return false;
+	if (target[0] == '#' || target[0] == '&') {
+		if (!ChannelName::fits(target.size))
+			return false;
+		std::map<ChannelName, Channel*>::iterator it = _channels.find(ChannelName(target.data, target.size));
+		if (it == _channels.end())
+			return false;
+		// Banned members may still talk with +o or +v
+		Membership *membership = client->findMembership(it->second);
+		if (!membership || (!membership->isOperator && !membership->isVoiced && it->second->isBanned(client, membership)))
+			return false;
+		channel = it->second;
+		return true;
+	}
+	if (!NickName::fits(target.size))
+		return false;
+	std::map<NickName, Client*>::iterator it = _nicks.find(NickName(target.data, target.size));
+	if (it == _nicks.end())
+		return false;
+	recipient = it->second;
+	return true;
+}
+
+// Serializes "nick!user@host COMMAND target[ :text]" once in the arena, the
+// capability variants are derived from it per recipient (see OutgoingMessage).
+// Channel PRIVMSGs are kept in the channel history and carry its msgid.
+// Client-only tags are kept exactly as the sender wrote them, they are never
+// decoded and re-encoded. Without text (TAGMSG) there is nothing to show
+// clients that don't do tags. With echo-message the sender gets a copy too.
+void ChannelsClientsManager::relayMessage(Client* client, Channel* channel, Client* recipient, const char* command,
+	const StringSpan& target, const StringSpan* text, const StringSpan& clientTags)
+{
+	ArenaWriter source(_arena, 64);
+	source << client->getHostmask() << ' ' << command << ' ';
+	MessageTarget found;
+	found.name = target;
+	found.channel = channel;
+	found.recipient = recipient;
+	relayMessage(client, source.span(), found, text, clientTags, 0);
+}
+
+// source is "nick!user@host COMMAND ", shared by all targets of one message.
+// A nonzero delivery skips whoever already got the message through another target.
+void ChannelsClientsManager::relayMessage(Client* client, const StringSpan& source, const MessageTarget& target,
+	const StringSpan* text, const StringSpan& clientTags, unsigned long delivery)
+{
+	Channel *channel = target.channel;
+	Client *recipient = target.recipient;
+	ArenaWriter out(_arena, source.size + target.name.size + (text ? text->size + 4 : 2));
+	out << source << target.name;
+	if (text)
+		out << " :" << *text;
+	out << "\r\n";
+	OutgoingMessage message(_arena, out.span(), clientTags, text == NULL);
+	if (channel && text) {
+		HistoryBlock *stored = channel->getHistory().append(ServerTime::now(), out.span());
+		message.setOrigin(*stored);
+		if (_historyLog)
+			_historyLog->append(channel->getName(), stored);
+	}
+	if (channel) {
+		channel->broadcast(message, client, delivery);
+		return;
+	}
+	const StringSpan& line = message.lineFor(recipient->getCaps());
+	if (!line.empty() && (!delivery || recipient == client || recipient->markDelivered(delivery)))
+		recipient->sendMessage(line.data, line.size);
+	if (recipient != client && client->hasCap(CAP_ECHO_MESSAGE)) {
+		const StringSpan& echo = message.lineFor(client->getCaps());
+		if (!echo.empty())
+			client->sendMessage(echo.data, echo.size);
+	}
+}
+
+void ChannelsClientsManager::executeTagmsg(Client* client, const MessageView& view)
+{
+	StringSpan target = view.param(0);
+	if (target.empty()) {
+		Reply::needMoreParams(*client, "TAGMSG");
+		return;
+	}
+	Channel *channel;
+	Client *recipient;
+	if (!findMessageTarget(client, target, channel, recipient)) {
+		if (target[0] != '#' && target[0] != '&')
+			getClientByNickname(target.str(), client); // reports 401
+		else if (!(channel = findChannel(ChannelName(target.data, target.size))))
+			Reply::noSuchChannel(*client, target.str());
+		else if (channel->isClientInChannel(client))
+			Reply::cannotSendToChannel(*client, target.str());
+		else
+			Reply::notOnChannel(*client, target.str());
+		return;
+	}
+	StringSpan tags = MessageView::clientOnlyTags(view.tags(), _arena);
+	if (!tags.empty())
+		relayMessage(client, channel, recipient, "TAGMSG", target, NULL, tags);
+}
+
+// CHATHISTORY LATEST <channel> <* | msgid=id | timestamp=ts> <limit>
+// CHATHISTORY BEFORE | AFTER | AROUND <channel> <msgid=id | timestamp=ts> <limit>
+// Only channels the client is in. Messages come oldest first, inside a batch
+// for clients with batch. Stored lines are sent straight from their history
+// blocks or the mapped log, the tags in front are all that gets built.
+void ChannelsClientsManager::executeChathistory(Client* client, IRCCommand& command)
+{
+	if (command.getParamsCount() < 4) {
+		Reply::fail(*client, "CHATHISTORY", "INVALID_PARAMS", "", "Not enough parameters");
+		return;
+	}
+	const std::string& subcommand = command.getParamAt(0);
+	const std::string& target = command.getParamAt(1);
+	const std::string& reference = command.getParamAt(2);
+	if (subcommand != "LATEST" && subcommand != "BEFORE" && subcommand != "AFTER" && subcommand != "AROUND") {
+		Reply::fail(*client, "CHATHISTORY", "INVALID_PARAMS", subcommand, "Unknown subcommand");
+		return;
+	}
+	Channel *channel = getChannel(target);
+	if (!channel || !channel->isClientInChannel(client)) {
+		Reply::fail(*client, "CHATHISTORY", "INVALID_TARGET", subcommand + " " + target, "No history for this target");
+		return;
+	}
+	char *limitEnd;
+	long limit = std::strtol(command.getParamAt(3).c_str(), &limitEnd, 10);
+	if (*limitEnd != '\0' || limit <= 0) {
+		Reply::fail(*client, "CHATHISTORY", "INVALID_PARAMS", subcommand + " " + command.getParamAt(3), "Invalid limit");
+		return;
+	}
+	if (limit > CHATHISTORY_LIMIT)
+		limit = CHATHISTORY_LIMIT;
+
+	// Keys are ids for msgid= and times for timestamp=, both only grow
+	HistoryRange range;
+	unsigned long long value = 0;
+	bool latestAll = (reference == "*" && subcommand == "LATEST");
+	if (latestAll)
+		value = 0;
+	else if (reference.compare(0, 6, "msgid=") == 0 && HistoryBlock::parseId(reference.substr(6), value)) {
+		HistoryRange exact;
+		exact.low = exact.high = value;
+		exact.limit = 1;
+		std::vector<HistoryRecord> found;
+		HistoryLogView view;
+		selectHistory(channel, exact, found, view);
+		if (found.empty()) {
+			replayHistory(client, channel, found); // gone or never there, nothing is around it
 			return;
 		}
-		Channel *channel = _channels[target];
-		if (!channel->isClientInChannel(client))
-		{
-			client->sendMessage("server 404: " + client->getNickname() + " doesn't have access to this channel - " + target + "\r\n");
-			return;
+	}
+	else if (reference.compare(0, 10, "timestamp=") == 0 && ServerTime::parse(reference.substr(10), value))
+		range.byTime = true;
+	else {
+		Reply::fail(*client, "CHATHISTORY", "INVALID_PARAMS", subcommand + " " + reference, "Invalid message reference");
+		return;
+	}
+	size_t wanted = static_cast<size_t>(limit);
+	std::vector<HistoryRecord> records;
+	HistoryLogView view; // keeps log records mapped until they're sent
+	range.limit = wanted;
+	if (subcommand == "LATEST") {
+		if (!latestAll)
+			range.low = value + 1;
+		range.fromEnd = true;
+		selectHistory(channel, range, records, view);
+	}
+	else if (subcommand == "BEFORE") {
+		range.high = value - 1;
+		range.fromEnd = true;
+		if (value)
+			selectHistory(channel, range, records, view);
+	}
+	else if (subcommand == "AFTER") {
+		range.low = value + 1;
+		selectHistory(channel, range, records, view);
+	}
+	else {
+		// Half before the reference, the rest from it on; if that runs out
+		// early the earlier side gets the slack
+		HistoryRange before = range;
+		before.high = value - 1;
+		before.fromEnd = true;
+		before.limit = wanted / 2;
+		if (value)
+			selectHistory(channel, before, records, view);
+		std::vector<HistoryRecord> after;
+		range.low = value;
+		range.limit = wanted - records.size();
+		selectHistory(channel, range, after, view);
+		if (value && records.size() == wanted / 2 && records.size() + after.size() < wanted) {
+			records.clear();
+			before.limit = wanted - after.size();
+			selectHistory(channel, before, records, view);
 		}
-		std::string formatted_msg = client->getNickname() + "!" + client->getUsername() + "@"
-									+ client->getHostname() + " PRIVMSG " + target + " :"
-									+ message + "\r\n";
-		channel->broadcast(formatted_msg, client);
+		records.insert(records.end(), after.begin(), after.end());
+	}
+	replayHistory(client, channel, records);
+}
+
+// The ring has the newest messages, the log (when there is one) everything
+// older: it's asked for what the ring can't answer, stopping at the ring's
+// oldest id so nothing comes twice. Messages still on their way to disk are
+// normally in the ring too, unless the writer is a whole ring behind.
+void ChannelsClientsManager::selectHistory(Channel* channel, HistoryRange range, std::vector<HistoryRecord>& out, HistoryLogView& view)
+{
+	ChannelHistory& history = channel->getHistory();
+	if (!_historyLog) {
+		history.select(range, out);
+		return;
 	}
+	HistoryRange older = range;
+	if (history.size() && history.at(0)->id < older.idLimit)
+		older.idLimit = history.at(0)->id;
+	if (range.fromEnd) {
+		std::vector<HistoryRecord> recent;
+		history.select(range, recent);
+		older.limit = range.limit - recent.size();
+		_historyLog->select(channel->getName(), older, out, view);
+		out.insert(out.end(), recent.begin(), recent.end());
+		return;
+	}
+	size_t before = out.size();
+	_historyLog->select(channel->getName(), older, out, view);
+	range.limit -= out.size() - before;
+	history.select(range, out);
+}
+
+void ChannelsClientsManager::replayHistory(Client* client, Channel* channel, const std::vector<HistoryRecord>& records)
+{
+	std::string batch;
+	if (client->hasCap(CAP_BATCH)) {
+		std::ostringstream reference;
+		reference << "history" << ++_batchCount;
+		batch = reference.str();
+		client->sendMessage(":" + std::string(SERVER_NAME) + " BATCH +" + batch + " chathistory "
+			+ channel->getName() + "\r\n");
+	}
+	bool time = client->hasCap(CAP_SERVER_TIME);
+	bool msgid = client->hasCap(CAP_MESSAGE_TAGS);
+	for (size_t i = 0; i < records.size(); ++i) {
+		const HistoryRecord& record = records[i];
+		ArenaWriter head(_arena, 96);
+		if (!batch.empty())
+			head << "@batch=" << batch;
+		if (time)
+			head << (head.size() ? ';' : '@') << ServerTime::tag(record.time);
+		if (msgid) {
+			char id[HISTORY_MSGID_SIZE];
+			head << (head.size() ? ";msgid=" : "@msgid=");
+			head.append(id, HistoryBlock::formatId(record.id, id));
+		}
+		if (head.size())
+			head << ' ';
+		client->sendMessage(head.span(), record.line);
+	}
+	if (!batch.empty())
+		client->sendMessage(":" + std::string(SERVER_NAME) + " BATCH -" + batch + "\r\n");
+}
+
+// A new channel picks up where its log left off, so after a restart the
+// ring has the last messages again
+Channel* ChannelsClientsManager::createChannel(const std::string& name)
+{
+	Channel *channel = new Channel(name);
+	_channels[channel->getName()] = channel;
+	channel->listIn(&_directory);
+	if (_historyLog) {
+		HistoryRange latest;
+		latest.limit = ChannelHistory::depth();
+		latest.fromEnd = true;
+		std::vector<HistoryRecord> records;
+		HistoryLogView view;
+		_historyLog->select(channel->getName(), latest, records, view);
+		for (size_t i = 0; i < records.size(); ++i)
+			channel->getHistory().restore(records[i].id, records[i].time, records[i].line);
+	}
+	return channel;
+}
+
+// A target named twice (or a nick and its other spelling) counts once
+static void addMessageTarget(MessageTarget* targets, size_t& count, const StringSpan& name, Channel* channel, Client* recipient)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (targets[i].channel == channel && targets[i].recipient == recipient)
+			return;
+	}
+	targets[count].name = name;
+	targets[count].channel = channel;
+	targets[count].recipient = recipient;
+	count++;
+}
+
+// The source prefix is formatted once for all targets, each one only adds its
+// name. With several targets the message gets a delivery number, so a client
+// that shares a few of the channels (or is named as well) gets it only once,
+// through the first target that reaches it.
+void ChannelsClientsManager::relayToTargets(Client* client, const MessageTarget* targets, size_t count,
+	const char* command, const StringSpan& text, const StringSpan& clientTags)
+{
+	ArenaWriter source(_arena, 64);
+	source << client->getHostmask() << ' ' << command << ' ';
+	unsigned long delivery = count > 1 ? ++_deliveryCount : 0;
+	for (size_t i = 0; i < count; ++i)
+		relayMessage(client, source.span(), targets[i], &text, clientTags, delivery);
+}
+
+// Same output as executePrivmsg, without a single heap allocation.
+// Returns false to let the IRCCommand path handle (and report) the message.
+bool ChannelsClientsManager::privmsgFromView(Client* client, const MessageView& view, const char* command)
+{
+	const StringSpan& args = view.args();
+	const char *p = args.data;
+	const char *end = args.data + args.size;
+	if (std::memchr(p, '\r', args.size) || std::memchr(p, '\n', args.size))
+		return false;
+	// Split like IRCCommand does: targets up to a blank, then one optional ':'
+	const char *targetEnd = p;
+	while (targetEnd < end && *targetEnd != ' ' && *targetEnd != '\t')
+		++targetEnd;
+	StringSpan list(p, targetEnd - p);
+	p = targetEnd;
+	while (p < end && (*p == ' ' || *p == '\t'))
+		++p;
+	if (p < end && *p == ':')
+		++p;
+	StringSpan text(p, end - p);
+	if (list.empty() || text.empty())
+		return false;
+
+	// Every target has to be there, errors are reported by the other path
+	MessageTarget targets[MESSAGE_TARGETS_LIMIT];
+	size_t count = 0;
+	size_t named = 0;
+	for (const char *name = list.data; name < targetEnd; ) {
+		const char *comma = static_cast<const char*>(std::memchr(name, ',', targetEnd - name));
+		if (!comma)
+			comma = targetEnd;
+		StringSpan target(name, comma - name);
+		name = comma + 1;
+		if (target.empty())
+			continue;
+		Channel *channel;
+		Client *recipient;
+		if (++named > MESSAGE_TARGETS_LIMIT || !findMessageTarget(client, target, channel, recipient))
+			return false;
+		addMessageTarget(targets, count, target, channel, recipient);
+	}
+	if (!count)
+		return false;
+	StringSpan tags = MessageView::clientOnlyTags(view.tags(), _arena);
+	relayToTargets(client, targets, count, command, text, tags);
+	return true;
+}
+
+// Why a PRIVMSG target wasn't found
+void ChannelsClientsManager::reportMessageTarget(Client* client, const std::string& target)
+{
+	if (target[0] != '#' && target[0] != '&') {
+		getClientByNickname(target, client); // reports 401
+		return;
+	}
+	Channel *channel = getChannel(target);
+	if (!channel)
+		client->sendMessage("server 403: " + client->getNickname() + " sent message to " + target + " :No such channel exist\r\n");
+	else if (!channel->isClientInChannel(client))
+		client->sendMessage("server 404: " + client->getNickname() + " doesn't have access to this channel - " + target + "\r\n");
 	else
-	{
-		Client *target_user;
-		if ((target_user = getClientByNickname(target, client)) == NULL)
-			return ;
-		std::string formatted_msg = client->getNickname() + "!" + client->getUsername() + "@"
-									+ client->getHostname() + " PRIVMSG " + target + " :"
-									+ message + "\r\n";
-		target_user->sendMessage(formatted_msg);
+		Reply::cannotSendToChannel(*client, target);
+}
+
+// PRIVMSG and NOTICE take a comma separated list of targets, each checked on
+// its own. NOTICE never gets an error back, so two bots can't keep answering
+// each other's.
+void ChannelsClientsManager::executePrivmsg(Client* client, IRCCommand& command)
+{
+	const std::vector<std::string>& params = command.getParams();
+	const std::string& list = params[0];
+	const std::string& message = params[1];
+	bool notice = command.getCommand() == "NOTICE";
+	StringSpan text(message.data(), message.size());
+	StringSpan tags = MessageView::clientOnlyTags(StringSpan(command.getTags().data(), command.getTags().size()), _arena);
+	MessageTarget targets[MESSAGE_TARGETS_LIMIT];
+	size_t count = 0;
+	size_t named = 0;
+	size_t start = 0;
+	while (start < list.size()) {
+		size_t end = list.find(',', start);
+		if (end == std::string::npos)
+			end = list.size();
+		StringSpan name(list.data() + start, end - start);
+		start = end + 1;
+		if (name.empty())
+			continue;
+		Channel *channel;
+		Client *recipient;
+		if (++named > MESSAGE_TARGETS_LIMIT) {
+			if (!notice)
+				Reply::tooManyTargets(*client, name.str());
+		}
+		else if (findMessageTarget(client, name, channel, recipient))
+			addMessageTarget(targets, count, name, channel, recipient);
+		else if (!notice)
+			reportMessageTarget(client, name.str());
 	}
+	if (count)
+		relayToTargets(client, targets, count, command.getCommand().c_str(), text, tags);
 }
 
 void ChannelsClientsManager::executeJoin(Client* client, IRCCommand& command)
@@ -395,7 +1073,7 @@ void ChannelsClientsManager::executeJoin(Client* client, IRCCommand& command)
 			else
 				key = keys.substr(key_start, key_end - key_start);
 		}
-		if ((target[0] != '#' && target[0] != '&') || target.length() < 2)
+		if ((target[0] != '#' && target[0] != '&') || target.length() < 2 || !ChannelName::fits(target))
 		{
 			client->sendMessage("server 403: sent invalid characters for channel name to JOIN\r\n");
 			continueLoopJoin(start, end, channels);
@@ -404,15 +1082,12 @@ void ChannelsClientsManager::executeJoin(Client* client, IRCCommand& command)
 			continue;
 		}
 		bool the_first_one = false;
-		Channel *channel;
-		if (_channels.find(target) == _channels.end())
+		Channel *channel = findChannel(target);
+		if (!channel)
 		{
-			channel = new Channel(target);
-			_channels[target] = channel;
+			channel = createChannel(target);
 			the_first_one = true;
 		}
-		else
-			channel = _channels[target];
 		if (channel->isClientInChannel(client))
 		{
 			client->sendMessage("You're already in this channel\r\n");
@@ -423,10 +1098,19 @@ void ChannelsClientsManager::executeJoin(Client* client, IRCCommand& command)
 		}
 		if (!the_first_one)
 		{
+			// An invite gets past a ban, +I past +i
+			if (channel->isBanned(client) && !channel->isInvited(client))
+			{
+				client->sendMessage("server 474: Can't join a channel (+b)\r\n");
+				continueLoopJoin(start, end, channels);
+				if (!keys.empty())
+					continueLoopJoin(key_start, key_end, keys);
+				continue;
+			}
 			if (channel->isInviteOnly())
 			{
 				// Check if the client is invited
-				if (!channel->isInvited(client))
+				if (!channel->isInvited(client) && !channel->isInviteException(client))
 				{
 					client->sendMessage("server 473: Can't join a channel (+i)\r\n");
 					continueLoopJoin(start, end, channels);
@@ -447,7 +1131,7 @@ void ChannelsClientsManager::executeJoin(Client* client, IRCCommand& command)
 					continue;
 				}
 			}
-			if (channel->getUserLimit() > 0 && channel->getClients().size() >= channel->getUserLimit())
+			if (channel->getUserLimit() > 0 && channel->getClientCount() >= channel->getUserLimit())
 			{
 				client->sendMessage("server 471: can't join a full channel(+l)\r\n");
 				continueLoopJoin(start, end, channels);
@@ -462,21 +1146,444 @@ void ChannelsClientsManager::executeJoin(Client* client, IRCCommand& command)
 			channel->addClient(client);
 		if (is_invited == true)
 			channel->removeInvited(client);
-		client->addChannel(target);
-		std::string formatted_msg = client->getNickname() + "!" + client->getUsername() + "@"
-									+ client->getHostname() + " JOIN " + target + "\r\n";
+		std::string formatted_msg = client->getHostmask() + " JOIN " + target + "\r\n";
 		client->sendMessage("Welcome to " + target + " channel!\r\n");
 		channel->broadcast(formatted_msg, client);
 		if (!channel->getTopic().empty())
 			client->sendMessage(channel->getTopic() + "\r\n");
 		else
 			client->sendMessage("Topic of this channel is not set yet\r\n");
+		sendNames(client, channel);
 		continueLoopJoin(start, end, channels);
 		if (!keys.empty())
 			continueLoopJoin(key_start, key_end, keys);
 	}
 }
 
+// RPL_NAMREPLY lines cut from the channel's cached payload: each line takes
+// as many whole tokens as fit in 512 bytes, and all of them go out in one send
+void ChannelsClientsManager::sendNames(Client* client, Channel* channel)
+{
+	const std::string& names = channel->getNames(client->hasCap(CAP_MULTI_PREFIX));
+	ArenaWriter header(_arena, 64);
+	header << ':' << SERVER_NAME << ' ' << RPL_NAMREPLY << ' ';
+	header.name(client->getNickname());
+	header << " = ";
+	header.name(channel->getName());
+	header << " :";
+	size_t budget = IRC_LINE_MAX - 2 - header.size();
+	ArenaWriter out(_arena, names.size() + (names.size() / budget + 2) * (header.size() + 2) + 96);
+	size_t start = 0;
+	while (start < names.size())
+	{
+		size_t end = names.size();
+		if (end - start > budget)
+		{
+			end = names.rfind(' ', start + budget);
+			if (end == std::string::npos || end <= start)
+				end = start + budget; // one token longer than a line, can't happen with NICKLEN
+		}
+		out << header.span();
+		out.append(names.data() + start, end - start);
+		out << "\r\n";
+		start = end + 1;
+	}
+	out << ':' << SERVER_NAME << ' ' << RPL_ENDOFNAMES << ' ';
+	out.name(client->getNickname());
+	out << ' ';
+	out.name(channel->getName());
+	out << " :End of /NAMES list.\r\n";
+	client->sendMessage(out.data(), out.size());
+}
+
+// NAMES #a,#b: only channels that exist; without a channel, just the end reply
+void ChannelsClientsManager::executeNames(Client* client, IRCCommand& command)
+{
+	if (command.getParamsCount() == 0)
+	{
+		Reply::endOfNames(*client, "*");
+		return;
+	}
+	std::string targets = command.getParamAt(0);
+	size_t start = 0;
+	while (start <= targets.size())
+	{
+		size_t end = targets.find(',', start);
+		if (end == std::string::npos)
+			end = targets.size();
+		std::string target = targets.substr(start, end - start);
+		std::map<ChannelName, Channel*>::iterator it = _channels.end();
+		if (ChannelName::fits(target))
+			it = _channels.find(target);
+		if (it != _channels.end())
+			sendNames(client, it->second);
+		else if (!target.empty())
+			Reply::endOfNames(*client, target);
+		start = end + 1;
+	}
+}
+
+// RPL_LIST: "<nick> <channel> <users> :<topic>"
+void ChannelsClientsManager::appendListEntry(ArenaWriter& out, Client* client, Channel* channel)
+{
+	out << ':' << SERVER_NAME << ' ' << RPL_LIST << ' ';
+	out.name(client->getNickname());
+	out << ' ';
+	out.name(channel->getName());
+	out << ' ';
+	appendNumber(out, channel->getClientCount());
+	out << " :" << channel->getTopic() << "\r\n";
+}
+
+// LIST [#a,#b] or ELIST conditions (see ListQuery). Plain names are looked up
+// and answered right away; anything else walks the channel directory, and
+// may take several loop rounds, see continueList.
+void ChannelsClientsManager::executeList(Client* client, IRCCommand& command)
+{
+	ListQuery query;
+	if (command.getParamsCount() > 0)
+		query.parse(command.getParamAt(0), time(NULL));
+	_listings.erase(client->getFd()); // a new LIST replaces one still running
+	client->sendMessage(":" + std::string(SERVER_NAME) + " " + RPL_LISTSTART + " " + client->getNickname() + " Channel :Users  Name\r\n");
+	if (query.onlyNames())
+	{
+		ArenaWriter out(_arena);
+		for (size_t i = 0; i < query.masks.size(); ++i)
+		{
+			Channel *channel = ChannelName::fits(query.masks[i]) ? getChannel(query.masks[i]) : NULL;
+			if (channel)
+				appendListEntry(out, client, channel);
+		}
+		out << ':' << SERVER_NAME << ' ' << RPL_LISTEND << ' ';
+		out.name(client->getNickname());
+		out << " :End of /LIST\r\n";
+		client->sendMessage(out.data(), out.size());
+		return;
+	}
+	if (continueList(client, query))
+		_listings[client->getFd()] = query;
+}
+
+// Formats matches until the client has LIST_SENDQ_WATERMARK bytes waiting or
+// this round's budget is used up, so a huge LIST never sits in memory as a
+// whole and never holds up the loop. True while there is more to come.
+bool ChannelsClientsManager::continueList(Client* client, ListQuery& query)
+{
+	std::vector<Channel*> found;
+	for (size_t scanned = 0; scanned < LIST_TURN_BUDGET; scanned += LIST_BATCH)
+	{
+		if (client->getSendQueueSize() >= LIST_SENDQ_WATERMARK)
+			return true;
+		found.clear();
+		bool more = _directory.next(query, found, LIST_BATCH);
+		ArenaWriter out(_arena);
+		for (size_t i = 0; i < found.size(); ++i)
+			appendListEntry(out, client, found[i]);
+		if (!more)
+		{
+			out << ':' << SERVER_NAME << ' ' << RPL_LISTEND << ' ';
+			out.name(client->getNickname());
+			out << " :End of /LIST\r\n";
+		}
+		if (out.size())
+			client->sendMessage(out.data(), out.size());
+		if (!more)
+			return false;
+	}
+	return true;
+}
+
+void ChannelsClientsManager::continueListings()
+{
+	for (std::map<int, ListQuery>::iterator it = _listings.begin(); it != _listings.end(); )
+	{
+		Client *client = getClientByFd(it->first);
+		if (client && client->getSendQueueSize() >= LIST_SENDQ_WATERMARK)
+			++it; // POLLOUT brings us back once it drained
+		else if (client && continueList(client, it->second))
+			++it;
+		else
+			_listings.erase(it++);
+	}
+	for (std::map<int, WhoQuery>::iterator it = _whoQueries.begin(); it != _whoQueries.end(); )
+	{
+		Client *client = getClientByFd(it->first);
+		if (client && client->getSendQueueSize() >= LIST_SENDQ_WATERMARK)
+			++it;
+		else if (client && continueWho(client, it->second))
+			++it;
+		else
+			_whoQueries.erase(it++);
+	}
+}
+
+bool ChannelsClientsManager::hasRunnableListings() const
+{
+	for (std::map<int, ListQuery>::const_iterator it = _listings.begin(); it != _listings.end(); ++it)
+	{
+		Client *client = getClientByFd(it->first);
+		if (client && client->getSendQueueSize() < LIST_SENDQ_WATERMARK)
+			return true;
+	}
+	for (std::map<int, WhoQuery>::const_iterator it = _whoQueries.begin(); it != _whoQueries.end(); ++it)
+	{
+		Client *client = getClientByFd(it->first);
+		if (client && client->getSendQueueSize() < LIST_SENDQ_WATERMARK)
+			return true;
+	}
+	return false;
+}
+
+// RPL_WHOREPLY "<channel> <user> <host> <server> <nick> <flags> :<hops> <realname>",
+// or for WHOX (RPL_WHOSPCRPL) the requested fields in the fixed order tcuihsnfdlaor
+void ChannelsClientsManager::appendWhoEntry(ArenaWriter& out, Client* client, const WhoQuery& query,
+	Client* target, const Membership* membership)
+{
+	char flags[4];
+	size_t flagsLength = 0;
+	flags[flagsLength++] = 'H';
+	if (membership && membership->isOperator)
+		flags[flagsLength++] = '@';
+	if (membership && membership->isVoiced && (!membership->isOperator || client->hasCap(CAP_MULTI_PREFIX)))
+		flags[flagsLength++] = '+';
+	StringSpan channel = membership ? StringSpan(membership->channel->getName().c_str(), membership->channel->getName().size())
+		: StringSpan("*", 1);
+	out << ':' << SERVER_NAME << ' ' << (query.whox.empty() ? RPL_WHOREPLY : RPL_WHOSPCRPL) << ' ';
+	out.name(client->getNickname());
+	if (query.whox.empty())
+	{
+		out << ' ' << channel << ' ' << target->getUsername() << ' ' << target->getHostname() << ' ' << SERVER_NAME << ' ';
+		out.name(target->getNickname());
+		out << ' ';
+		out.append(flags, flagsLength);
+		out << " :0 " << target->getRealname() << "\r\n";
+		return;
+	}
+	const char *order = "tcuihsnfdlaor";
+	for (const char *field = order; *field; ++field)
+	{
+		if (query.whox.find(*field) == std::string::npos)
+			continue;
+		out << ' ';
+		switch (*field)
+		{
+			case 't': out << (query.token.empty() ? std::string("0") : query.token); break;
+			case 'c': out << channel; break;
+			case 'u': out << target->getUsername(); break;
+			case 'i': case 'h': out << target->getHostname(); break;
+			case 's': out << SERVER_NAME; break;
+			case 'n': out.name(target->getNickname()); break;
+			case 'f': out.append(flags, flagsLength); break;
+			case 'd': out << '0'; break;
+			case 'l': appendNumber(out, static_cast<size_t>(target->getTimePassed())); break;
+			case 'a': out << '0'; break; // no accounts here
+			case 'o': out << "n/a"; break;
+			case 'r': out << ':' << target->getRealname(); break;
+		}
+	}
+	out << "\r\n";
+}
+
+// WHO #chan lists the members, WHO <mask> looks the mask up in the user
+// index (see UserIndex). Both stream like LIST does.
+void ChannelsClientsManager::executeWho(Client* client, IRCCommand& command)
+{
+	WhoQuery query;
+	query.parse(command.getParamAt(0), command.getParamsCount() > 1 ? command.getParamAt(1) : "");
+	_whoQueries.erase(client->getFd());
+	if (query.channel.empty())
+		_users.plan(query);
+	if (continueWho(client, query))
+		_whoQueries[client->getFd()] = query;
+}
+
+bool ChannelsClientsManager::continueWho(Client* client, WhoQuery& query)
+{
+	Channel *channel = NULL;
+	if (!query.channel.empty() && ChannelName::fits(query.channel))
+		channel = getChannel(query.channel);
+	std::vector<int> candidates;
+	bool more = channel != NULL || query.channel.empty();
+	for (size_t scanned = 0; more && scanned < LIST_TURN_BUDGET; scanned += LIST_BATCH)
+	{
+		if (client->getSendQueueSize() >= LIST_SENDQ_WATERMARK)
+			return true;
+		ArenaWriter out(_arena);
+		if (channel)
+		{
+			// Positions shift when someone leaves mid-listing, like LIST that's tolerated
+			const std::vector<Membership*>& members = channel->getMembers();
+			size_t end = std::min(members.size(), query.position + LIST_BATCH);
+			for (; query.position < end; ++query.position)
+				appendWhoEntry(out, client, query, members[query.position]->client, members[query.position]);
+			more = query.position < members.size();
+		}
+		else
+		{
+			candidates.clear();
+			more = _users.next(query, candidates, LIST_BATCH);
+			for (size_t i = 0; i < candidates.size(); ++i)
+			{
+				Client *target = getClientByFd(candidates[i]);
+				if (target && query.accepts(*target))
+					appendWhoEntry(out, client, query, target, NULL);
+			}
+		}
+		if (out.size())
+			client->sendMessage(out.data(), out.size());
+	}
+	if (more)
+		return true;
+	client->sendMessage(":" + std::string(SERVER_NAME) + " " + RPL_ENDOFWHO + " " + client->getNickname() + " "
+		+ (query.mask.empty() ? std::string("*") : query.mask) + " :End of WHO list\r\n");
+	return false;
+}
+
+// MONITOR replies carry a comma separated list as the last parameter, as
+// many items per line as fit in 512 bytes
+static void appendListLines(ArenaWriter& out, const StringSpan& header, const std::vector<std::string>& items)
+{
+	size_t budget = IRC_LINE_MAX - 2 - header.size;
+	size_t used = 0;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		if (used && used + 1 + items[i].size() > budget)
+		{
+			out << "\r\n";
+			used = 0;
+		}
+		if (used)
+		{
+			out << ',';
+			used++;
+		}
+		else
+			out << header;
+		out << items[i];
+		used += items[i].size();
+	}
+	if (used)
+		out << "\r\n";
+}
+
+// RPL_MONONLINE with nick!user@host for the targets that are online,
+// RPL_MONOFFLINE with the name as given for the others
+void ChannelsClientsManager::sendMonitorStatus(Client* client, const std::vector<NickName>& targets)
+{
+	std::vector<std::string> online;
+	std::vector<std::string> offline;
+	for (size_t i = 0; i < targets.size(); ++i)
+	{
+		std::map<NickName, Client*>::const_iterator found = _nicks.find(targets[i]);
+		if (found != _nicks.end() && found->second->isRegistered())
+			online.push_back(found->second->getHostmask());
+		else
+			offline.push_back(targets[i].str());
+	}
+	ArenaWriter out(_arena);
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		ArenaWriter header(_arena, 64);
+		header << ':' << SERVER_NAME << ' ' << (pass == 0 ? RPL_MONONLINE : RPL_MONOFFLINE) << ' ';
+		header.name(client->getNickname());
+		header << " :";
+		appendListLines(out, header.span(), pass == 0 ? online : offline);
+	}
+	if (out.size())
+		client->sendMessage(out.data(), out.size());
+}
+
+// MONITOR + a,b / - a,b / C / L / S
+void ChannelsClientsManager::executeMonitor(Client* client, IRCCommand& command)
+{
+	const std::string& subcommand = command.getParamAt(0);
+	int fd = client->getFd();
+	if (subcommand == "C")
+		_monitors.clear(fd);
+	else if (subcommand == "L")
+	{
+		std::vector<std::string> names;
+		const std::vector<NickName>* targets = _monitors.targets(fd);
+		for (size_t i = 0; targets && i < targets->size(); ++i)
+			names.push_back((*targets)[i].str());
+		ArenaWriter header(_arena, 64);
+		header << ':' << SERVER_NAME << ' ' << RPL_MONLIST << ' ';
+		header.name(client->getNickname());
+		header << " :";
+		ArenaWriter out(_arena);
+		appendListLines(out, header.span(), names);
+		out << ':' << SERVER_NAME << ' ' << RPL_ENDOFMONLIST << ' ';
+		out.name(client->getNickname());
+		out << " :End of MONITOR list\r\n";
+		client->sendMessage(out.data(), out.size());
+	}
+	else if (subcommand == "S")
+	{
+		const std::vector<NickName>* targets = _monitors.targets(fd);
+		if (targets)
+			sendMonitorStatus(client, *targets);
+	}
+	else if ((subcommand == "+" || subcommand == "-") && command.getParamsCount() > 1)
+	{
+		std::string list = command.getParamAt(1);
+		if (!list.empty() && list[0] == ':')
+			list.erase(0, 1);
+		std::vector<NickName> added;
+		size_t start = 0;
+		while (start < list.size())
+		{
+			size_t end = list.find(',', start);
+			if (end == std::string::npos)
+				end = list.size();
+			std::string target = list.substr(start, end - start);
+			if (subcommand == "+" && _monitors.count(fd) >= MONITOR_LIMIT)
+			{
+				// Nothing past the limit is added, the error names what was left out
+				std::ostringstream limit;
+				limit << MONITOR_LIMIT;
+				client->sendMessage(":" + std::string(SERVER_NAME) + " " + ERR_MONLISTFULL + " " + client->getNickname()
+					+ " " + limit.str() + " " + list.substr(start) + " :Monitor list is full\r\n");
+				break;
+			}
+			start = end + 1;
+			if (target.empty() || !NickName::fits(target))
+				continue;
+			if (subcommand == "-")
+				_monitors.remove(fd, target);
+			else if (_monitors.add(fd, target))
+				added.push_back(target);
+		}
+		if (!added.empty())
+			sendMonitorStatus(client, added);
+	}
+	else
+		Reply::needMoreParams(*client, "MONITOR");
+}
+
+// Presence push: one line per watcher of nick, nothing for anyone else
+void ChannelsClientsManager::notifyMonitors(const Client& target, const NickName& nick, bool online)
+{
+	const std::vector<int>* watchers = _monitors.watchers(nick);
+	if (!watchers)
+		return;
+	ArenaWriter body(_arena, 96);
+	body << " :";
+	body.name(nick);
+	if (online)
+		body << '!' << target.getUsername() << '@' << target.getHostname();
+	body << "\r\n";
+	for (size_t i = 0; i < watchers->size(); ++i)
+	{
+		Client *watcher = getClientByFd((*watchers)[i]);
+		if (!watcher)
+			continue;
+		ArenaWriter head(_arena, 64);
+		head << ':' << SERVER_NAME << ' ' << (online ? RPL_MONONLINE : RPL_MONOFFLINE) << ' ';
+		head.name(watcher->getNickname());
+		watcher->sendMessage(head.span(), body.span());
+	}
+}
+
 void ChannelsClientsManager::executeInvite(Client* client, IRCCommand& command)
 {
 	const std::vector<std::string>& params = command.getParams();
@@ -485,10 +1592,11 @@ void ChannelsClientsManager::executeInvite(Client* client, IRCCommand& command)
 	Client *target_user;
 	if ((target_user = getClientByNickname(target_nick, client)) == NULL)
 		return ;
-	if (_channels.find(target_channel) == _channels.end())
+	Channel *channel = findChannel(target_channel);
+	if (!channel)
 	{
 		// Fallback: if nick token actually looks like a channel, swap
-		if (!target_nick.empty() && (target_nick[0] == '#' || target_nick[0] == '&') && _channels.find(target_nick) != _channels.end())
+		if (!target_nick.empty() && (target_nick[0] == '#' || target_nick[0] == '&') && (channel = findChannel(target_nick)))
 		{
 			std::string maybeNick = target_channel;
 			target_channel = target_nick;
@@ -500,7 +1608,6 @@ void ChannelsClientsManager::executeInvite(Client* client, IRCCommand& command)
 			return;
 		}
 	}
-	Channel *channel = _channels[target_channel];
 	if (!channel->isClientInChannel(client))
 	{
 		client->sendMessage("server 442: You don't have access to this channel!\r\n");
@@ -530,12 +1637,12 @@ void ChannelsClientsManager::executeTopic(Client* client, IRCCommand& command)
 		client->sendMessage("server 403: sent invalid characters for channel name to TOPIC\r\n");
 		return;
 	}
-	if (_channels.find(target) == _channels.end())
+	Channel* channel = findChannel(target);
+	if (!channel)
 	{
 		client->sendMessage("This channel doesn't exist!\r\n");
 		return;
 	}
-	Channel* channel = _channels[target];
 	if (!channel->isClientInChannel(client))
 	{
 		client->sendMessage("You don't have access to this channel!\r\n");
@@ -573,9 +1680,7 @@ void ChannelsClientsManager::executeTopic(Client* client, IRCCommand& command)
 		return;
 	}
 	channel->setTopic(new_topic);
-	std::string formatted_msg = client->getNickname() + "!" + client->getUsername() + "@"
-								+ client->getHostname() + " TOPIC " + target + " :"
-								+ new_topic + "\r\n";
+	std::string formatted_msg = client->getHostmask() + " TOPIC " + target + " :" + new_topic + "\r\n";
 	client->sendMessage("You succesfully changed the topic for this channel!\r\n");
 	channel->broadcast(formatted_msg, client);
 }
@@ -590,12 +1695,12 @@ void ChannelsClientsManager::executeKick(Client* client, IRCCommand& command)
 		client->sendMessage("Input must follow irc protocol (#channel or &channel)\r\n");
 		return;
 	}
-	if (_channels.find(target_channel) == _channels.end())
+	Channel *channel = findChannel(target_channel);
+	if (!channel)
 	{
 		client->sendMessage("server 403: This channel doesn't exist!\r\n");
 		return;
 	}
-	Channel *channel = _channels[target_channel];
 	if (!channel->isClientInChannel(client))
 	{
 		client->sendMessage("server 442: You don't have access to this channel!\r\n");
@@ -620,7 +1725,6 @@ void ChannelsClientsManager::executeKick(Client* client, IRCCommand& command)
 	else
 		kick_message = "No specific reason";
 	channel->removeClient(target_user);
-	target_user->removeChannel(target_channel);
 	std::string formatted_msg = "User " + target_nick + " was kicked from " + target_channel
 								+ " by " + client->getNickname()
 								+ " (" + kick_message + ") " + "\r\n";
@@ -629,21 +1733,49 @@ void ChannelsClientsManager::executeKick(Client* client, IRCCommand& command)
 							+ " for this reason: " + kick_message + "\r\n");
 }
 
+void ChannelsClientsManager::executePart(Client* client, IRCCommand& command)
+{
+	const std::vector<std::string>& params = command.getParams();
+	std::string channels = params[0];
+	std::string reason = (params.size() > 1) ? params[1] : client->getNickname().str();
+	size_t start = 0;
+	size_t end = channels.find(',');
+	while (start < channels.length())
+	{
+		std::string target = (end == std::string::npos) ? channels.substr(start) : channels.substr(start, end - start);
+		continueLoopJoin(start, end, channels);
+		Channel *channel = getChannel(target);
+		if (!channel)
+		{
+			Reply::noSuchChannel(*client, target);
+			continue;
+		}
+		Membership *membership = client->findMembership(channel);
+		if (!membership)
+		{
+			Reply::notOnChannel(*client, target);
+			continue;
+		}
+		// The leaving client sees its own PART too
+		channel->broadcast(":" + client->getHostmask() + " PART " + target + " :" + reason + "\r\n");
+		channel->removeMembership(membership);
+		if (channel->getClientCount() == 0)
+		{
+			_channels.erase(channel->getName());
+			delete channel;
+		}
+	}
+}
+
 Client* ChannelsClientsManager::getClientByNickname(const std::string& target_nick, Client* client)
 {
 	Client *target_user = NULL;
 
 	if (!client) // caller should provide a valid client for error replies
         return NULL;
-	for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); it++)
-    {
-        if (it->second && it->second->getNickname() == target_nick)
-        {
-
-            target_user = it->second;
-            break;
-        }
-    }
+	std::map<NickName, Client*>::const_iterator found = _nicks.find(target_nick);
+	if (found != _nicks.end())
+		target_user = found->second;
     if (target_user == NULL)
     {
         client->sendMessage("server 401: No sush nick is exist\r\n");
@@ -670,31 +1802,113 @@ void ChannelsClientsManager::Key_check()
 
 
 Channel* ChannelsClientsManager::getChannel(std::string const &channelName) {
-	std::map<std::string, Channel*>::iterator it = _channels.find(channelName);
+	return findChannel(channelName);
+}
+
+Channel* ChannelsClientsManager::findChannel(const ChannelName& name) {
+	std::map<ChannelName, Channel*>::iterator it = _channels.find(name);
 	if (it != _channels.end())
 		return it->second;
 	return NULL;
 }
 
-void ChannelsClientsManager::removeClient(Client &client)
+void ChannelsClientsManager::addClient(Client* client)
+{
+	int fd = client->getFd();
+	_clients[fd] = client;
+	if (client->isNicknameSet())
+		_nicks[client->getNickname()] = client;
+	if (client->isRegistered())
+		_users.add(*client);
+	if (static_cast<size_t>(fd) >= _clientsByFd.size())
+		_clientsByFd.resize(fd + 1, NULL);
+	_clientsByFd[fd] = client;
+
+	pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	_pollfds.push_back(pfd);
+}
+
+// Everyone sharing a channel with the client gets the line once, however
+// many channels they share: a delivery number marks who has it already
+// instead of collecting the peers in a set first. Not the client itself.
+void ChannelsClientsManager::broadcastToPeers(const Client& client, const StringSpan& line)
+{
+	const std::vector<Membership*>& memberships = client.getMemberships();
+	unsigned long delivery = ++_deliveryCount;
+	for (size_t i = 0; i < memberships.size(); ++i)
+		memberships[i]->channel->broadcast(line.data, line.size, const_cast<Client*>(&client), delivery);
+}
+
+void ChannelsClientsManager::broadcastQuit(const Client& client, const std::string& reason)
+{
+	if (client.getMemberships().empty())
+		return;
+	ArenaWriter out(_arena, 96 + reason.size());
+	out << ':' << client.getHostmask() << " QUIT :" << reason << "\r\n";
+	broadcastToPeers(client, out.span());
+}
+
+// Each membership points straight at its channel, leaving costs O(1) per channel
+void ChannelsClientsManager::leaveChannels(Client& client)
 {
-	std::vector<std::string> clientChannels = client.getChannels();
-	for (size_t i = 0; i < clientChannels.size(); ++i)
+	while (!client.getMemberships().empty())
 	{
-		std::string channelName = clientChannels[i];
-		Channel* channel = getChannel(channelName);
-		if (channel)
-		{
-			channel->removeClient(&client);
-			// If the channel is empty after removal, delete it
-			if (channel->getClients().empty()) {
-				delete channel;
-				_channels.erase(channelName);
-			}
+		Membership *membership = client.getMemberships().back();
+		Channel *channel = membership->channel;
+		channel->removeMembership(membership);
+		// If the channel is empty after removal, delete it
+		if (channel->getClientCount() == 0) {
+			_channels.erase(channel->getName());
+			delete channel;
 		}
 	}
-	// Remove client from the clients map
+}
+
+// QUIT [:reason]: the peers hear about it right away, the connection is
+// closed by the server once it is done with this read (see Client::hasQuit)
+void ChannelsClientsManager::executeQuit(Client* client, IRCCommand& command)
+{
+	disconnect(client, command.getParamsCount() ? "Quit: " + command.getParamAt(0) : "Client Quit");
+}
+
+// Gone as far as everybody else is concerned, the server closes the connection
+// once it is done with the client
+void ChannelsClientsManager::disconnect(Client* client, const std::string& reason)
+{
+	if (client->isRegistered())
+		broadcastQuit(*client, reason);
+	leaveChannels(*client);
+	client->sendMessage("ERROR :Closing Link: " + client->getHostname() + " (" + reason + ")\r\n");
+	client->setQuit();
+}
+
+void ChannelsClientsManager::removeClient(Client &client, const std::string& reason)
+{
+	_listings.erase(client.getFd());
+	_whoQueries.erase(client.getFd());
+	_deferred.erase(client.getFd());
+	_monitors.clear(client.getFd());
+	if (_limiter)
+		_limiter->release(client.getAddress(), ServerTime::now());
+	if (client.isRegistered())
+	{
+		_users.remove(client);
+		notifyMonitors(client, client.getNickname(), false);
+		broadcastQuit(client, reason);
+	}
+	leaveChannels(client);
+	while (!client.getInvites().empty())
+		client.getInvites().back()->removeInvited(&client);
+	// Remove client from the clients map and the nick index
+	std::map<NickName, Client*>::iterator nick = _nicks.find(client.getNickname());
+	if (nick != _nicks.end() && nick->second == &client)
+		_nicks.erase(nick);
 	_clients.erase(client.getFd());
+	if (static_cast<size_t>(client.getFd()) < _clientsByFd.size())
+		_clientsByFd[client.getFd()] = NULL;
 	// Remove client's pollfd entry
 	for (std::vector<pollfd>::iterator it = _pollfds.begin(); it != _pollfds.end(); ++it) {
 		if (it->fd == client.getFd()) {
@@ -715,10 +1929,323 @@ void ChannelsClientsManager::sendPingToClient(Client* client) {
 }
 
 void ChannelsClientsManager::setNickname(Client* client, IRCCommand& command) {
-	std::string newNick = command.getParamAt(0);
-	if (isNickInUse(newNick)) {
+	const std::string& newNick = command.getParamAt(0);
+	if (!NickName::fits(newNick)) {
+		Reply::erroneousNickname(*client, newNick);
+		return;
+	}
+	// Hashed once, the lookup and the rename both use it
+	NickName nick(newNick);
+	// Changing the case of your own nick is fine
+	std::map<NickName, Client*>::iterator owner = _nicks.find(nick);
+	if (owner != _nicks.end() && owner->second != client) {
 		Reply::nicknameInUse(*client, newNick);
 		return;
 	}
-	client->setNickname(newNick);
+	// Announced with the old hostmask, so it is built before anything changes
+	StringSpan announce;
+	if (client->isRegistered() && client->getNickname().str() != newNick) {
+		ArenaWriter out(_arena, 96);
+		out << ':' << client->getHostmask() << " NICK :" << newNick << "\r\n";
+		announce = out.span();
+	}
+	std::string oldNick;
+	if (client->isNicknameSet())
+	{
+		oldNick = client->getNickname().str();
+		_nicks.erase(client->getNickname());
+	}
+	client->setNickname(nick);
+	_nicks[nick] = client;
+	if (client->isRegistered())
+	{
+		_users.renamed(*client, oldNick);
+		// A change of case is still the same nick to its watchers
+		if (client->getNickname() != oldNick)
+		{
+			notifyMonitors(*client, oldNick, false);
+			notifyMonitors(*client, client->getNickname(), true);
+		}
+	}
+	// Cached NAMES payloads carry the nick
+	const std::vector<Membership*>& memberships = client->getMemberships();
+	for (size_t i = 0; i < memberships.size(); ++i)
+		memberships[i]->channel->memberRenamed(oldNick, memberships[i]);
+	// Everything is renamed by now; the client and each peer hear about it once
+	if (!announce.empty()) {
+		client->sendMessage(announce.data, announce.size);
+		broadcastToPeers(*client, announce);
+	}
+}
+
+void ChannelsClientsManager::saveState(std::ostream& os, std::vector<int>& fds) const
+{
+	size_t count = 0;
+	for (std::map<int, Client*>::const_iterator it = _clients.begin(); it != _clients.end(); ++it)
+		if (it->second)
+			count++;
+	os << count << ' ';
+	for (std::map<int, Client*>::const_iterator it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		Client *client = it->second;
+		if (!client)
+			continue;
+		fds.push_back(client->getFd());
+		os << client->getFd() << ' ' << client->isAuthenticated() << ' ' << client->isRegistered() << ' '
+			<< client->isCAPNegotiation() << ' ' << client->getCaps() << ' ' << client->getConnectionTime() << ' ';
+		HotRestart::putString(os, client->getNickname().str());
+		HotRestart::putString(os, client->getUsername());
+		HotRestart::putString(os, client->getRealname());
+		HotRestart::putString(os, client->getHostname());
+		HotRestart::putString(os, client->getBuffer());
+	}
+	// Channel membership is stored as the old fds, restoreState maps them back to the new clients
+	os << _channels.size() << ' ';
+	for (std::map<ChannelName, Channel*>::const_iterator it = _channels.begin(); it != _channels.end(); ++it)
+	{
+		Channel *channel = it->second;
+		HotRestart::putString(os, channel->getName().str());
+		HotRestart::putString(os, channel->getTopic());
+		HotRestart::putString(os, channel->getKey());
+		os << channel->getUserLimit() << ' ' << channel->isInviteOnly() << ' ' << channel->isTopicProtected() << ' '
+			<< channel->getCreated() << ' ' << channel->getTopicTime() << ' ';
+		std::vector<Client*> voiced;
+		for (size_t i = 0; i < channel->getMembers().size(); ++i)
+			if (channel->getMembers()[i]->isVoiced)
+				voiced.push_back(channel->getMembers()[i]->client);
+		std::vector<Client*> lists[4] = { channel->getClients(), channel->getOperators(), channel->getInvited(), voiced };
+		for (size_t l = 0; l < 4; ++l)
+		{
+			os << lists[l].size() << ' ';
+			for (size_t i = 0; i < lists[l].size(); ++i)
+				os << lists[l][i]->getFd() << ' ';
+		}
+		// The CHATHISTORY ring, with the log off it lives nowhere else
+		const ChannelHistory& history = channel->getHistory();
+		os << history.size() << ' ';
+		for (size_t i = 0; i < history.size(); ++i)
+		{
+			os << history.at(i)->id << ' ' << history.at(i)->time << ' ';
+			HotRestart::putString(os, history.at(i)->line().str());
+		}
+	}
+	// MONITOR lists, by old fd like the members
+	std::vector<int> watchers;
+	for (std::map<int, Client*>::const_iterator it = _clients.begin(); it != _clients.end(); ++it)
+		if (it->second && _monitors.targets(it->first))
+			watchers.push_back(it->first);
+	os << watchers.size() << ' ';
+	for (size_t i = 0; i < watchers.size(); ++i)
+	{
+		const std::vector<NickName>& targets = *_monitors.targets(watchers[i]);
+		os << watchers[i] << ' ' << targets.size() << ' ';
+		for (size_t j = 0; j < targets.size(); ++j)
+			HotRestart::putString(os, targets[j].str());
+	}
+	// Ban, exception and invite exception masks of the channels that have any
+	const char modes[] = "beI";
+	os << countMaskedChannels() << ' ';
+	for (std::map<ChannelName, Channel*>::const_iterator it = _channels.begin(); it != _channels.end(); ++it)
+	{
+		if (!it->second->getMaskCount())
+			continue;
+		HotRestart::putString(os, it->second->getName().str());
+		for (size_t m = 0; m < 3; ++m)
+		{
+			const MaskList* list = it->second->findMaskList(modes[m]);
+			os << list->size() << ' ';
+			for (std::map<std::string, MaskEntry>::const_iterator e = list->entries().begin(); e != list->entries().end(); ++e)
+			{
+				HotRestart::putString(os, e->second.mask);
+				HotRestart::putString(os, e->second.setBy);
+				os << e->second.setAt << ' ';
+			}
+		}
+	}
+	// Input flood control was holding back, it goes on after the restart
+	os << _deferred.size() << ' ';
+	for (std::set<int>::const_iterator it = _deferred.begin(); it != _deferred.end(); ++it)
+	{
+		Client *client = getClientByFd(*it);
+		os << *it << ' ';
+		HotRestart::putString(os, client ? client->getDeferredInput() : std::string());
+	}
+	// Output slow readers haven't taken yet, or they'd lose it with the old process
+	std::vector<const Client*> queued;
+	for (std::map<int, Client*>::const_iterator it = _clients.begin(); it != _clients.end(); ++it)
+		if (it->second && it->second->hasPendingOutput())
+			queued.push_back(it->second);
+	os << queued.size() << ' ';
+	for (size_t i = 0; i < queued.size(); ++i)
+	{
+		os << queued[i]->getFd() << ' ';
+		HotRestart::putString(os, queued[i]->getSendQueue());
+	}
+}
+
+size_t ChannelsClientsManager::countMaskedChannels() const
+{
+	size_t count = 0;
+	for (std::map<ChannelName, Channel*>::const_iterator it = _channels.begin(); it != _channels.end(); ++it)
+		if (it->second->getMaskCount())
+			count++;
+	return count;
+}
+
+bool ChannelsClientsManager::restoreState(std::istream& is, const std::vector<int>& fds, size_t nextFd)
+{
+	std::map<int, Client*> byOldFd;
+	size_t count;
+	if (!(is >> count))
+		return false;
+	for (size_t i = 0; i < count; ++i)
+	{
+		int oldFd;
+		bool authenticated, registered, capNegotiation;
+		unsigned int caps;
+		time_t connectionTime;
+		std::string nick, user, real, host, buffer;
+		if (!(is >> oldFd >> authenticated >> registered >> capNegotiation >> caps >> connectionTime)
+			|| !HotRestart::getString(is, nick) || !HotRestart::getString(is, user)
+			|| !HotRestart::getString(is, real) || !HotRestart::getString(is, host)
+			|| !HotRestart::getString(is, buffer) || nextFd >= fds.size())
+			return false;
+		Client *client = new Client(fds[nextFd++]);
+		client->setAuthenticated(authenticated);
+		client->setRegistered(registered);
+		client->setCAPNegotiation(capNegotiation);
+		client->setCaps(caps);
+		client->setConnectionTime(connectionTime);
+		client->setNickname(nick);
+		client->setUsername(user);
+		client->setRealname(real);
+		client->setHostname(host);
+		if (!buffer.empty())
+			client->addToBuffer(buffer);
+		addClient(client);
+		byOldFd[oldFd] = client;
+	}
+	if (!(is >> count))
+		return false;
+	for (size_t i = 0; i < count; ++i)
+	{
+		std::string name, topic, key;
+		size_t limit;
+		bool inviteOnly, topicProtected;
+		time_t created, topicTime;
+		if (!HotRestart::getString(is, name) || !HotRestart::getString(is, topic) || !HotRestart::getString(is, key)
+			|| !(is >> limit >> inviteOnly >> topicProtected >> created >> topicTime))
+			return false;
+		Channel *channel = createChannel(name);
+		channel->setCreated(created);
+		channel->setTopic(topic, topicTime);
+		channel->setKey(key);
+		channel->setUserLimit(limit);
+		channel->setInviteOnly(inviteOnly);
+		channel->setTopicProtected(topicProtected);
+		for (size_t l = 0; l < 4; ++l)
+		{
+			size_t n;
+			if (!(is >> n))
+				return false;
+			for (size_t j = 0; j < n; ++j)
+			{
+				int oldFd;
+				if (!(is >> oldFd))
+					return false;
+				std::map<int, Client*>::iterator found = byOldFd.find(oldFd);
+				if (found == byOldFd.end())
+					continue;
+				if (l == 0)
+					channel->addClient(found->second);
+				else if (l == 1)
+					channel->addOperator(found->second);
+				else if (l == 2)
+					channel->addInvited(found->second);
+				else
+					channel->setVoiced(found->second, true);
+			}
+		}
+		// Ids the log already gave back in createChannel are skipped by restore
+		size_t lines;
+		if (!(is >> lines))
+			return false;
+		for (size_t j = 0; j < lines; ++j)
+		{
+			unsigned long long id, time;
+			std::string line;
+			if (!(is >> id >> time) || !HotRestart::getString(is, line))
+				return false;
+			channel->getHistory().restore(id, time, StringSpan(line.data(), line.size()));
+		}
+	}
+	// Older states end here
+	if (!(is >> count))
+		return true;
+	for (size_t i = 0; i < count; ++i)
+	{
+		int oldFd;
+		size_t n;
+		if (!(is >> oldFd >> n))
+			return false;
+		std::map<int, Client*>::iterator found = byOldFd.find(oldFd);
+		for (size_t j = 0; j < n; ++j)
+		{
+			std::string target;
+			if (!HotRestart::getString(is, target))
+				return false;
+			if (found != byOldFd.end())
+				_monitors.add(found->second->getFd(), target);
+		}
+	}
+	if (!(is >> count))
+		return true;
+	const char modes[] = "beI";
+	for (size_t i = 0; i < count; ++i)
+	{
+		std::string name;
+		if (!HotRestart::getString(is, name))
+			return false;
+		Channel *channel = getChannel(name);
+		for (size_t m = 0; m < 3; ++m)
+		{
+			size_t n;
+			if (!(is >> n))
+				return false;
+			for (size_t j = 0; j < n; ++j)
+			{
+				std::string mask, setBy;
+				time_t setAt;
+				if (!HotRestart::getString(is, mask) || !HotRestart::getString(is, setBy) || !(is >> setAt))
+					return false;
+				if (channel)
+					channel->addMask(modes[m], mask, setBy, setAt);
+			}
+		}
+	}
+	if (!(is >> count))
+		return true;
+	for (size_t i = 0; i < count; ++i)
+	{
+		int oldFd;
+		std::string input;
+		if (!(is >> oldFd) || !HotRestart::getString(is, input))
+			return false;
+		std::map<int, Client*>::iterator found = byOldFd.find(oldFd);
+		if (found != byOldFd.end() && !input.empty())
+			deferInput(found->second, input.data(), input.size());
+	}
+	if (!(is >> count))
+		return true;
+	for (size_t i = 0; i < count; ++i)
+	{
+		int oldFd;
+		std::string output;
+		if (!(is >> oldFd) || !HotRestart::getString(is, output))
+			return false;
+		std::map<int, Client*>::iterator found = byOldFd.find(oldFd);
+		if (found != byOldFd.end())
+			found->second->requeueOutput(output);
+	}
+	return true;
 }
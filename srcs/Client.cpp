@@ -1,21 +1,81 @@
 #include "../inc/ft_irc.hpp"
 
+static unsigned long g_nextIdentityStamp = 1;
+static std::vector<int> g_sendQueueExceeded;
+
 Client::Client(int fd)
-    : _fd(fd), _authenticated(false), _registered(false), _isCAPNegotiation(false), _connectionTime(time(NULL))
+    : _fd(fd), _authenticated(false), _registered(false), _isCAPNegotiation(false), _quit(false), _sendQueueExceeded(false),
+      _caps(0), _connectionTime(time(NULL)), _deliveryMark(0), _accountedInput(0), _accountedOutput(0), _identity(new ClientIdentity)
 {
+    _identity->address = 0;
+    identityChanged();
 }
 
+// Leave whatever is still linked so channels never point at a dead client
 Client::~Client()
 {
+    while (!_memberships.empty())
+        _memberships.back()->channel->removeMembership(_memberships.back());
+    while (!_identity->invites.empty())
+        _identity->invites.back()->removeInvited(this);
+    delete _identity;
+    MemoryBudget::release(MEM_INPUT, _accountedInput);
+    MemoryBudget::release(MEM_OUTPUT, _accountedOutput);
+}
+
+static ObjectPool<Client>& clientPool()
+{
+    static ObjectPool<Client> pool;
+    return pool;
+}
+
+void* Client::operator new(size_t size)
+{
+    if (size != sizeof(Client)) // a derived class, let the heap deal with it
+        return ::operator new(size);
+    return clientPool().allocate();
+}
+
+void Client::operator delete(void* ptr, size_t size)
+{
+    if (size != sizeof(Client))
+        ::operator delete(ptr);
+    else
+        clientPool().deallocate(ptr);
+}
+
+PoolStats Client::poolStats()
+{
+    return clientPool().stats();
 }
 
 void Client::addToBuffer(const std::string& msg)
 {
-    _buffer += msg;
-    if (_buffer.size() > 2048) {
+    addToBuffer(msg.c_str(), msg.size());
+}
+
+void Client::addToBuffer(const char* data, size_t len)
+{
+    _buffer.append(data, len);
+    if (_buffer.size() > MemoryBudget::clientRecvQLimit()) {
         Reply::messageTooLong(*this);
-        _buffer.clear();
+        std::string().swap(_buffer);
     }
+    account();
+}
+
+void Client::deferInput(const char* data, size_t len)
+{
+    _identity->deferred.append(data, len);
+    account();
+}
+
+std::string Client::takeDeferredInput()
+{
+    std::string input;
+    input.swap(_identity->deferred);
+    account();
+    return input;
 }
 
 bool Client::hasCompleteMessage() const
@@ -30,13 +90,18 @@ std::string Client::getNextMessage()
         return "";
 
     std::string message = _buffer.substr(0, pos + 2);
-    _buffer = _buffer.substr(pos + 2);
+    if (pos + 2 == _buffer.size())
+        std::string().swap(_buffer); // idle clients hold no heap
+    else
+        _buffer.erase(0, pos + 2);
+    account();
     return message;
 }
 
 void Client::clearBuffer()
 {
-    _buffer.clear();
+    std::string().swap(_buffer);
+    account();
 }
 
 void Client::printBuffer() const
@@ -44,9 +109,137 @@ void Client::printBuffer() const
     std::cout << "Client Buffer: " << _buffer << std::endl;
 }
 
+// Write straight to the socket while nothing is queued, keep the rest for POLLOUT.
+// A client that lets its queue grow past the sendq limit is a slow consumer:
+// further output is dropped and the server loop disconnects it.
 void Client::sendMessage(const std::string& msg) const
 {
-    send(_fd, msg.c_str(), msg.length(), 0);
+    sendMessage(msg.c_str(), msg.length());
+}
+
+// With server-time, lines the server wrote untagged get the current tag in
+// front. Relayed messages come already tagged from OutgoingMessage.
+void Client::sendMessage(const char* data, size_t len) const
+{
+    if (!hasCap(CAP_SERVER_TIME) || (len && data[0] == '@'))
+    {
+        write(data, len);
+        return;
+    }
+    static std::string stamped; // reused, the server is single threaded
+    const StringSpan& time = ServerTime::tag();
+    stamped.clear();
+    const char* end = data + len;
+    while (data < end)
+    {
+        const char* newline = static_cast<const char*>(std::memchr(data, '\n', end - data));
+        const char* lineEnd = newline ? newline + 1 : end;
+        stamped += '@';
+        stamped.append(time.data, time.size);
+        stamped += ' ';
+        stamped.append(data, lineEnd - data);
+        data = lineEnd;
+    }
+    write(stamped.data(), stamped.size());
+}
+
+void Client::write(const char* data, size_t len) const
+{
+    StringSpan part(data, len);
+    write(&part, 1);
+}
+
+// A line in pieces (tags we build, a body stored elsewhere) goes out in one
+// sendmsg without being joined first. Only what the socket refuses is copied.
+void Client::write(const StringSpan* parts, size_t count) const
+{
+    if (_sendQueueExceeded)
+        return;
+    size_t len = 0;
+    for (size_t i = 0; i < count; ++i)
+        len += parts[i].size;
+    size_t offset = 0;
+    if (_sendQueue.empty())
+    {
+        struct iovec iov[4];
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        for (size_t i = 0; i < count && i < 4; ++i)
+        {
+            iov[i].iov_base = const_cast<char*>(parts[i].data);
+            iov[i].iov_len = parts[i].size;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count < 4 ? count : 4;
+        ssize_t sent = sendmsg(_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == static_cast<ssize_t>(len))
+            return;
+        if (sent > 0)
+            offset = sent;
+        else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return; // the socket is gone, poll will report it
+    }
+    if (_sendQueue.size() + len - offset > MemoryBudget::clientSendQLimit())
+    {
+        _sendQueueExceeded = true;
+        g_sendQueueExceeded.push_back(_fd);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (offset >= parts[i].size)
+        {
+            offset -= parts[i].size;
+            continue;
+        }
+        _sendQueue.append(parts[i].data + offset, parts[i].size - offset);
+        offset = 0;
+    }
+    account();
+}
+
+void Client::takeSendQueueExceeded(std::vector<int>& fds)
+{
+    fds.clear();
+    fds.swap(g_sendQueueExceeded);
+}
+
+void Client::sendMessage(const StringSpan& head, const StringSpan& body) const
+{
+    StringSpan parts[2] = { head, body };
+    write(parts, 2);
+}
+
+// Returns false when the connection is dead
+bool Client::flushSendQueue()
+{
+    if (_sendQueue.empty())
+        return true;
+    ssize_t sent = send(_fd, _sendQueue.c_str(), _sendQueue.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    if (static_cast<size_t>(sent) == _sendQueue.size())
+        std::string().swap(_sendQueue); // give the memory back, a queue is the exception
+    else
+        _sendQueue.erase(0, sent);
+    account();
+    return true;
+}
+
+// Drop spare capacity, used when the server runs short on memory
+void Client::shrinkBuffers()
+{
+    std::string(_buffer).swap(_buffer);
+    std::string(_sendQueue).swap(_sendQueue);
+    account();
+}
+
+// Capacity, not size: what the buffers actually hold on to
+void Client::account() const
+{
+    MemoryBudget::update(MEM_INPUT, _accountedInput,
+        MemoryBudget::heapBytes(_buffer) + MemoryBudget::heapBytes(_identity->deferred));
+    MemoryBudget::update(MEM_OUTPUT, _accountedOutput, MemoryBudget::heapBytes(_sendQueue));
 }
 
 int Client::getFd() const
@@ -54,44 +247,58 @@ int Client::getFd() const
     return _fd;
 }
 
-const std::string& Client::getNickname() const
+const NickName& Client::getNickname() const
 {
     return _nickname;
 }
 
-void Client::setNickname(const std::string& nickname)
+void Client::identityChanged()
+{
+    ClientIdentity& identity = *_identity;
+    identity.hostmask.assign(_nickname.c_str(), _nickname.size());
+    identity.hostmask += '!';
+    identity.hostmask += identity.username;
+    identity.hostmask += '@';
+    identity.hostmask += identity.hostname;
+    identity.stamp = g_nextIdentityStamp++;
+}
+
+void Client::setNickname(const NickName& nickname)
 {
     _nickname = nickname;
+    identityChanged();
 }
 
 const std::string& Client::getUsername() const
 {
-    return _username;
+    return _identity->username;
 }
 
 void Client::setUsername(const std::string& username)
 {
-    _username = username;
+    _identity->username = username;
+    identityChanged();
 }
 
 const std::string& Client::getRealname() const
 {
-    return _realname;
+    return _identity->realname;
 }
 
 void Client::setRealname(const std::string& realname)
 {
-    _realname = realname;
+    _identity->realname = realname;
 }
 
 const std::string& Client::getHostname() const
 {
-    return _hostname;
+    return _identity->hostname;
 }
 
 void Client::setHostname(const std::string& hostname)
 {
-    _hostname = hostname;
+    _identity->hostname = hostname;
+    identityChanged();
 }
 
 bool Client::isAuthenticated() const
@@ -114,26 +321,41 @@ void Client::setRegistered(bool registered)
     _registered = registered;
 }
 
-std::vector<std::string>& Client::getChannels()
+void Client::attachMembership(Membership* membership)
+{
+    membership->clientSlot = _memberships.size();
+    _memberships.push_back(membership);
+}
+
+void Client::detachMembership(Membership* membership)
 {
-    return _channels;
+    Membership* last = _memberships.back();
+    _memberships[membership->clientSlot] = last;
+    last->clientSlot = membership->clientSlot;
+    _memberships.pop_back();
 }
 
-void Client::addChannel(const std::string& channel)
+Membership* Client::findMembership(const Channel* channel) const
 {
-    for (std::vector<std::string>::iterator it = _channels.begin(); it != _channels.end(); ++it)
+    for (std::vector<Membership*>::const_iterator it = _memberships.begin(); it != _memberships.end(); ++it)
     {
-        if (*it == channel)
-            return; // Channel already in list
+        if ((*it)->channel == channel)
+            return *it;
     }
-    _channels.push_back(channel);
+    return NULL;
+}
+
+void Client::addInvite(Channel* channel)
+{
+    _identity->invites.push_back(channel);
 }
 
-void Client::removeChannel(const std::string& channel)
+void Client::removeInvite(Channel* channel)
 {
-    std::vector <std::string>::iterator it = std::find(_channels.begin(), _channels.end(), channel);
-    if (it != _channels.end())
-        _channels.erase(it);
+    std::vector<Channel*>& invites = _identity->invites;
+    std::vector<Channel*>::iterator it = std::find(invites.begin(), invites.end(), channel);
+    if (it != invites.end())
+        invites.erase(it);
 }
 
 std::string const & Client::getBuffer() const
@@ -163,13 +385,13 @@ void Client::printClientInfo() const
 {
     std::cout << "Client FD: " << _fd << std::endl;
     std::cout << "Nickname: " << _nickname << std::endl;
-    std::cout << "Username: " << _username << std::endl;
-    std::cout << "Realname: " << _realname << std::endl;
-    std::cout << "Hostname: " << _hostname << std::endl;
+    std::cout << "Username: " << _identity->username << std::endl;
+    std::cout << "Realname: " << _identity->realname << std::endl;
+    std::cout << "Hostname: " << _identity->hostname << std::endl;
     std::cout << "Authenticated: " << (_authenticated ? "Yes" : "No") << std::endl;
     std::cout << "Registered: " << (_registered ? "Yes" : "No") << std::endl;
     std::cout << "Channels: ";
-    for (std::vector<std::string>::const_iterator it = _channels.begin(); it != _channels.end(); ++it)
-        std::cout << *it << " ";
+    for (std::vector<Membership*>::const_iterator it = _memberships.begin(); it != _memberships.end(); ++it)
+        std::cout << (*it)->channel->getName() << " ";
     std::cout << std::endl;
 }
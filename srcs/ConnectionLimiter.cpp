@@ -0,0 +1,324 @@
+#include "../inc/ConnectionLimiter.hpp"
+#include "../inc/MemoryBudget.hpp"
+
+static unsigned int prefixMask(unsigned int length)
+{
+    return length ? ~0u << (32 - length) : 0;
+}
+
+// Bit pos of the address, 0 being the most significant
+static int bitAt(unsigned int bits, unsigned int pos)
+{
+    return (bits >> (31 - pos)) & 1;
+}
+
+// Whether a and b agree on their first length bits
+static bool samePrefix(unsigned int a, unsigned int b, unsigned int length)
+{
+    return !((a ^ b) & prefixMask(length));
+}
+
+// Leading bits a and b share, at most limit. Only inserts need this.
+static unsigned int commonLength(unsigned int a, unsigned int b, unsigned int limit)
+{
+    unsigned int diff = a ^ b;
+    unsigned int length = 0;
+    for (unsigned int step = 16; diff && step; step >>= 1)
+    {
+        if (!(diff >> (32 - step)))
+        {
+            length += step;
+            diff <<= step;
+        }
+    }
+    if (!diff)
+        length = 32;
+    return length < limit ? length : limit;
+}
+
+ConnectionLimiter::ConnectionLimiter()
+    : _root(-1), _perHost(CONNECTIONS_PER_HOST), _perNetwork(CONNECTIONS_PER_NETWORK),
+      _networkPrefix(CONNECT_NETWORK_PREFIX), _throttle(CONNECT_THROTTLE_MS)
+{
+}
+
+void ConnectionLimiter::setLimits(size_t perHost, size_t perNetwork, unsigned int networkPrefix, unsigned int throttleMs)
+{
+    _perHost = perHost;
+    _perNetwork = perNetwork;
+    _networkPrefix = networkPrefix > 32 ? 32 : networkPrefix;
+    _throttle = throttleMs;
+}
+
+void ConnectionLimiter::loadLimitsFromEnv()
+{
+    setLimits(MemoryBudget::envSize("IRCSERV_CONNECTIONS_PER_HOST", CONNECTIONS_PER_HOST),
+              MemoryBudget::envSize("IRCSERV_CONNECTIONS_PER_NETWORK", CONNECTIONS_PER_NETWORK),
+              MemoryBudget::envSize("IRCSERV_CONNECT_NETWORK_PREFIX", CONNECT_NETWORK_PREFIX),
+              MemoryBudget::envSize("IRCSERV_CONNECT_THROTTLE_MS", CONNECT_THROTTLE_MS));
+}
+
+int ConnectionLimiter::allocate(unsigned int bits, unsigned int length)
+{
+    int at;
+    if (!_free.empty())
+    {
+        at = _free.back();
+        _free.pop_back();
+    }
+    else
+    {
+        at = static_cast<int>(_nodes.size());
+        _nodes.push_back(Node());
+    }
+    Node& node = _nodes[at];
+    node.clock = 0;
+    node.bits = bits & prefixMask(length);
+    node.connections = 0;
+    node.child[0] = -1;
+    node.child[1] = -1;
+    node.length = static_cast<unsigned char>(length);
+    node.exempt = false;
+    return at;
+}
+
+void ConnectionLimiter::link(int parent, int side, int node)
+{
+    if (parent < 0)
+        _root = node;
+    else
+        _nodes[parent].child[side] = node;
+}
+
+// The node for exactly bits/length, created when missing. A new node either
+// hangs below the last prefix of it, goes between that prefix and a longer
+// one it is a prefix of, or needs a fork where the two part.
+int ConnectionLimiter::insert(unsigned int bits, unsigned int length)
+{
+    bits &= prefixMask(length);
+    int parent = -1;
+    int side = 0;
+    int at = _root;
+    while (at >= 0)
+    {
+        const Node& node = _nodes[at];
+        if (node.length > length || !samePrefix(node.bits, bits, node.length))
+            break;
+        if (node.length == length)
+            return at;
+        parent = at;
+        side = bitAt(bits, node.length);
+        at = node.child[side];
+    }
+    int created = allocate(bits, length);
+    int top = created;
+    if (at >= 0)
+    {
+        unsigned int below = _nodes[at].bits;
+        unsigned int common = commonLength(below, bits, _nodes[at].length < length ? _nodes[at].length : length);
+        if (common == length)
+            _nodes[created].child[bitAt(below, length)] = at;
+        else
+        {
+            top = allocate(bits, common);
+            _nodes[top].child[bitAt(bits, common)] = created;
+            _nodes[top].child[bitAt(below, common)] = at;
+        }
+        _nodes[top].connections = _nodes[at].connections;
+    }
+    link(parent, side, top);
+    return created;
+}
+
+// Along the path to a host that is in the trie
+void ConnectionLimiter::count(unsigned int address, int delta)
+{
+    for (int at = _root; at >= 0; )
+    {
+        Node& node = _nodes[at];
+        node.connections += delta;
+        if (node.length == 32)
+            break;
+        at = node.child[bitAt(address, node.length)];
+    }
+}
+
+// One walk gives the exemption, the host and the network count
+ConnectionLimiter::Verdict ConnectionLimiter::admit(unsigned int address, unsigned long long now)
+{
+    expire(now);
+    int path[33];
+    size_t depth = 0;
+    size_t network = 0;
+    bool networkSeen = false;
+    bool exempted = false;
+    const Node* host = NULL;
+    for (int at = _root; at >= 0; )
+    {
+        const Node& node = _nodes[at];
+        if (!networkSeen && node.length >= _networkPrefix)
+        {
+            networkSeen = true;
+            if (samePrefix(node.bits, address, _networkPrefix))
+                network = node.connections;
+        }
+        if (!samePrefix(node.bits, address, node.length))
+            break;
+        path[depth++] = at;
+        exempted = exempted || node.exempt;
+        if (node.length == 32)
+        {
+            host = &node;
+            break;
+        }
+        at = node.child[bitAt(address, node.length)];
+    }
+
+    Verdict verdict = ADMITTED;
+    unsigned long long clock = host ? host->clock : 0;
+    if (!exempted)
+    {
+        if (clock < now)
+            clock = now;
+        if (clock - now > CONNECT_BURST_MS)
+            verdict = THROTTLED;
+        else if (host && host->connections >= _perHost)
+            verdict = TOO_MANY_FROM_HOST;
+        else if (network >= _perNetwork)
+            verdict = TOO_MANY_FROM_NETWORK;
+        clock += _throttle;
+    }
+    if (host)
+    {
+        // Known host, the walk above already is its path
+        _nodes[path[depth - 1]].clock = clock;
+        for (size_t i = 0; verdict == ADMITTED && i < depth; ++i)
+            _nodes[path[i]].connections++;
+    }
+    else
+    {
+        _nodes[insert(address, 32)].clock = clock;
+        if (verdict == ADMITTED)
+            count(address, 1);
+    }
+    if (verdict != ADMITTED && !connections(address, 32))
+    {
+        Expiry idle = { clock, address };
+        _idle.push_back(idle);
+    }
+    return verdict;
+}
+
+void ConnectionLimiter::restore(unsigned int address)
+{
+    insert(address, 32);
+    count(address, 1);
+}
+
+// Nodes from the root down to address' host, or as far as they go
+size_t ConnectionLimiter::walk(unsigned int address, int* path) const
+{
+    size_t depth = 0;
+    int at = _root;
+    while (at >= 0 && samePrefix(_nodes[at].bits, address, _nodes[at].length))
+    {
+        path[depth++] = at;
+        if (_nodes[at].length == 32)
+            break;
+        at = _nodes[at].child[bitAt(address, _nodes[at].length)];
+    }
+    return depth;
+}
+
+void ConnectionLimiter::release(unsigned int address, unsigned long long now)
+{
+    int path[33];
+    size_t depth = walk(address, path);
+    if (!depth || _nodes[path[depth - 1]].length != 32 || !_nodes[path[depth - 1]].connections)
+        return;
+    for (size_t i = 0; i < depth; ++i)
+        _nodes[path[i]].connections--;
+    const Node& host = _nodes[path[depth - 1]];
+    if (!host.connections && host.clock > now)
+    {
+        Expiry idle = { host.clock, address };
+        _idle.push_back(idle);
+    }
+    prune(path, depth, address, now);
+}
+
+// Forgets the oldest idle hosts whose clock has caught up, a few per call
+void ConnectionLimiter::expire(unsigned long long now)
+{
+    int path[33];
+    for (size_t budget = CONNECT_EXPIRE_PER_ADMIT; budget && !_idle.empty() && _idle.front().at <= now; --budget)
+    {
+        unsigned int address = _idle.front().address;
+        _idle.pop_front();
+        size_t depth = walk(address, path);
+        if (depth && _nodes[path[depth - 1]].length == 32)
+            prune(path, depth, address, now);
+    }
+}
+
+// Settles the path bottom up, up to the first node that stays where it is
+void ConnectionLimiter::prune(const int* path, size_t depth, unsigned int address, unsigned long long now)
+{
+    for (size_t i = depth; i-- > 0; )
+    {
+        int settled = settle(path[i], now);
+        if (settled == path[i])
+            break;
+        link(i ? path[i - 1] : -1, i ? bitAt(address, _nodes[path[i - 1]].length) : 0, settled);
+    }
+}
+
+void ConnectionLimiter::exempt(unsigned int address, unsigned int length)
+{
+    _nodes[insert(address, length > 32 ? 32 : length)].exempt = true;
+}
+
+// What takes the place of a node whose children are settled: nothing once an
+// idle host's clock has caught up, its only child for a fork left with one
+int ConnectionLimiter::settle(int at, unsigned long long now)
+{
+    Node& node = _nodes[at];
+    if (node.exempt || (node.child[0] >= 0 && node.child[1] >= 0))
+        return at;
+    int only = node.child[0] >= 0 ? node.child[0] : node.child[1];
+    if (only < 0 && (node.connections || node.clock > now))
+        return at;
+    _free.push_back(at);
+    return only;
+}
+
+size_t ConnectionLimiter::connections(unsigned int address, unsigned int length) const
+{
+    if (length > 32)
+        length = 32;
+    for (int at = _root; at >= 0; )
+    {
+        const Node& node = _nodes[at];
+        if (!samePrefix(node.bits, address, node.length < length ? node.length : length))
+            return 0;
+        if (node.length >= length)
+            return node.connections;
+        at = node.child[bitAt(address, node.length)];
+    }
+    return 0;
+}
+
+const char* ConnectionLimiter::reason(Verdict verdict)
+{
+    switch (verdict)
+    {
+        case TOO_MANY_FROM_HOST:
+            return "Too many host connections";
+        case TOO_MANY_FROM_NETWORK:
+            return "Too many connections from your network";
+        case THROTTLED:
+            return "Throttled: Reconnecting too fast";
+        default:
+            return "Admitted";
+    }
+}
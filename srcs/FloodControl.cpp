@@ -0,0 +1,78 @@
+#include "../inc/FloodControl.hpp"
+#include <cctype>
+#include <cstring>
+
+struct CommandCost {
+    const char*     command;
+    unsigned int    base;       // ms
+    unsigned int    perTarget;  // ms for each comma separated target after the first
+};
+
+// Keepalives and leaving are free. Talking is what the burst is sized for,
+// queries that walk many clients or channels cost more.
+static const CommandCost g_costs[] = {
+    { "PING", 0, 0 },
+    { "PONG", 0, 0 },
+    { "QUIT", 0, 0 },
+    { "PRIVMSG", 1000, 500 },
+    { "NOTICE", 1000, 500 },
+    { "TAGMSG", 500, 250 },
+    { "JOIN", 1000, 1000 },
+    { "PART", 500, 250 },
+    { "WHO", 2000, 0 },
+    { "LIST", 3000, 0 },
+    { "NAMES", 1000, 500 },
+    { "CHATHISTORY", 2000, 0 },
+    { "MONITOR", 500, 0 },
+    { NULL, 500, 0 }            // anything else
+};
+
+static const char* skipWord(const char* p, const char* end)
+{
+    while (p < end && *p != ' ')
+        ++p;
+    while (p < end && *p == ' ')
+        ++p;
+    return p;
+}
+
+// Commands are case insensitive, the table is upper case
+static bool sameCommand(const char* upper, const char* command, size_t len)
+{
+    if (std::strlen(upper) != len)
+        return false;
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (std::toupper(static_cast<unsigned char>(command[i])) != upper[i])
+            return false;
+    }
+    return true;
+}
+
+unsigned int FloodControl::costOf(const char* line, size_t len)
+{
+    const char* p = line;
+    const char* end = line + len;
+    while (end > p && (end[-1] == '\r' || end[-1] == '\n'))
+        --end;
+    if (p < end && *p == '@')
+        p = skipWord(p, end);
+    if (p < end && *p == ':')
+        p = skipWord(p, end);
+    const char* command = p;
+    while (p < end && *p != ' ')
+        ++p;
+    size_t commandLen = p - command;
+    const CommandCost* cost = g_costs;
+    while (cost->command && !sameCommand(cost->command, command, commandLen))
+        ++cost;
+    if (!cost->perTarget)
+        return cost->base;
+    // The first parameter is the target list
+    while (p < end && *p == ' ')
+        ++p;
+    unsigned int targets = 0;
+    for (; p < end && *p != ' '; ++p)
+        targets += *p == ',';
+    return cost->base + targets * cost->perTarget;
+}
@@ -0,0 +1,747 @@
+#include "../inc/HistoryLog.hpp"
+#include "../inc/MemoryBudget.hpp"
+#include "../inc/ServerTime.hpp"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Record layout, host byte order (the files never leave the machine):
+// u32 line size | u32 checksum of the line | u64 id | u64 time | line
+static unsigned int checksum(const char* data, size_t size)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void putRecord(std::string& out, unsigned long long id, unsigned long long time, const StringSpan& line)
+{
+    char header[HISTORY_LOG_RECORD_HEADER];
+    unsigned int size = static_cast<unsigned int>(line.size);
+    unsigned int sum = checksum(line.data, line.size);
+    std::memcpy(header, &size, 4);
+    std::memcpy(header + 4, &sum, 4);
+    std::memcpy(header + 8, &id, 8);
+    std::memcpy(header + 16, &time, 8);
+    out.append(header, sizeof(header));
+    out.append(line.data, line.size);
+}
+
+// False at the end of the valid data: past bytes, or a torn record
+static bool readRecord(const char* data, size_t bytes, size_t offset, HistoryRecord& record, size_t& next, bool verify)
+{
+    if (offset + HISTORY_LOG_RECORD_HEADER > bytes)
+        return false;
+    unsigned int size;
+    unsigned int sum;
+    std::memcpy(&size, data + offset, 4);
+    std::memcpy(&sum, data + offset + 4, 4);
+    std::memcpy(&record.id, data + offset + 8, 8);
+    std::memcpy(&record.time, data + offset + 16, 8);
+    if (size > bytes - offset - HISTORY_LOG_RECORD_HEADER)
+        return false;
+    record.line = StringSpan(data + offset + HISTORY_LOG_RECORD_HEADER, size);
+    if (verify && (size == 0 || checksum(record.line.data, size) != sum))
+        return false;
+    next = offset + HISTORY_LOG_RECORD_HEADER + size;
+    return true;
+}
+
+static std::string segmentName(unsigned long long firstId)
+{
+    static const char digits[] = "0123456789abcdef";
+    char name[HISTORY_MSGID_SIZE + 5];
+    for (size_t i = 0; i < HISTORY_MSGID_SIZE; ++i)
+        name[i] = digits[(firstId >> (4 * (HISTORY_MSGID_SIZE - 1 - i))) & 0xf];
+    std::memcpy(name + HISTORY_MSGID_SIZE, ".log", 4);
+    return std::string(name, HISTORY_MSGID_SIZE + 4);
+}
+
+static bool isSegmentName(const std::string& name)
+{
+    return name.size() == HISTORY_MSGID_SIZE + 4 && name.compare(HISTORY_MSGID_SIZE, 4, ".log") == 0;
+}
+
+// First index entry whose key is at least key
+static size_t indexLowerBound(const std::vector<LogIndexEntry>& index, const HistoryRange& range, unsigned long long key)
+{
+    size_t low = 0;
+    size_t high = index.size();
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (range.key(index[middle].id, index[middle].time) < key)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+HistoryLogView::~HistoryLogView()
+{
+    for (std::map<std::string, std::pair<char*, size_t> >::iterator it = _maps.begin(); it != _maps.end(); ++it)
+        munmap(it->second.first, it->second.second);
+}
+
+// Called with the log's mutex held, so the segment can't be dropped under us.
+// A segment that grew since it was mapped gets mapped again, the old mapping
+// stays valid for the records already handed out and goes with the view.
+const char* HistoryLogView::map(const LogSegment& segment)
+{
+    std::string key = segment.path;
+    std::map<std::string, std::pair<char*, size_t> >::iterator it = _maps.find(key);
+    while (it != _maps.end() && it->second.second < segment.bytes)
+    {
+        key += '+';
+        it = _maps.find(key);
+    }
+    if (it != _maps.end())
+        return it->second.first;
+    if (!segment.bytes)
+        return NULL;
+    int fd = open(segment.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    void* data = mmap(NULL, segment.bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    _maps[key] = std::make_pair(static_cast<char*>(data), segment.bytes);
+    return static_cast<char*>(data);
+}
+
+HistoryLog::HistoryLog(const std::string& dir, size_t maxBytes, unsigned long long maxAge, size_t segmentBytes)
+    : _dir(dir), _maxBytes(maxBytes), _maxAge(maxAge), _segmentBytes(segmentBytes),
+      _queued(0), _committed(0), _flushing(false), _stop(false), _failed(false)
+{
+    if (mkdir(_dir.c_str(), 0755) < 0 && errno != EEXIST)
+        throw std::runtime_error("History log: cannot create " + _dir + ": " + strerror(errno));
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_wake, NULL);
+    pthread_cond_init(&_written, NULL);
+    load();
+    if (pthread_create(&_thread, NULL, &HistoryLog::run, this) != 0)
+    {
+        pthread_cond_destroy(&_written);
+        pthread_cond_destroy(&_wake);
+        pthread_mutex_destroy(&_mutex);
+        throw std::runtime_error("History log: cannot start the writer thread");
+    }
+}
+
+HistoryLog::~HistoryLog()
+{
+    pthread_mutex_lock(&_mutex);
+    _stop = true;
+    pthread_cond_signal(&_wake);
+    pthread_mutex_unlock(&_mutex);
+    pthread_join(_thread, NULL);
+    collect();
+    for (std::map<std::string, ChannelLog>::iterator it = _channels.begin(); it != _channels.end(); ++it)
+    {
+        if (it->second.fd >= 0)
+            close(it->second.fd);
+    }
+    pthread_cond_destroy(&_written);
+    pthread_cond_destroy(&_wake);
+    pthread_mutex_destroy(&_mutex);
+}
+
+HistoryLog* HistoryLog::fromEnv()
+{
+    const char* dir = std::getenv("IRCSERV_HISTORY_DIR");
+    if (!dir || !*dir)
+        return NULL;
+    unsigned long long days = MemoryBudget::envSize("IRCSERV_HISTORY_LOG_DAYS", HISTORY_LOG_DAYS);
+    return new HistoryLog(dir, MemoryBudget::envSize("IRCSERV_HISTORY_LOG_BYTES", HISTORY_LOG_BYTES),
+        days * 24 * 60 * 60 * 1000);
+}
+
+std::string HistoryLog::channelDir(const ChannelName& channel)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    std::string name;
+    for (size_t i = 0; i < channel.size(); ++i)
+    {
+        unsigned char c = ircFold(static_cast<unsigned char>(channel[i]));
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '#' || c == '&' || c == '-' || c == '_')
+            name += static_cast<char>(c);
+        else
+        {
+            name += '%';
+            name += digits[c >> 4];
+            name += digits[c & 0xf];
+        }
+    }
+    return name;
+}
+
+// Event loop side
+
+void HistoryLog::append(const ChannelName& channel, HistoryBlock* block)
+{
+    Pending pending;
+    pending.channel = channel;
+    pending.block = block;
+    block->retain(); // released in collect(), on this thread again
+    pthread_mutex_lock(&_mutex);
+    _queue.push_back(pending);
+    _queued++;
+    // The writer is either idle (first record) or gathering a commit, only a
+    // full batch is worth cutting that short
+    if (_queue.size() == 1 || _queue.size() == HISTORY_LOG_BATCH)
+        pthread_cond_signal(&_wake);
+    bool written = !_done.empty();
+    pthread_mutex_unlock(&_mutex);
+    if (written)
+        collect();
+}
+
+void HistoryLog::collect()
+{
+    pthread_mutex_lock(&_mutex);
+    _collected.swap(_done);
+    pthread_mutex_unlock(&_mutex);
+    for (size_t i = 0; i < _collected.size(); ++i)
+        _collected[i]->release();
+    _collected.clear();
+}
+
+void HistoryLog::flush()
+{
+    pthread_mutex_lock(&_mutex);
+    unsigned long long target = _queued;
+    _flushing = true;
+    pthread_cond_signal(&_wake);
+    while (_committed < target)
+        pthread_cond_wait(&_written, &_mutex);
+    _flushing = false;
+    pthread_mutex_unlock(&_mutex);
+    collect();
+}
+
+const ChannelLog* HistoryLog::find(const ChannelName& channel) const
+{
+    std::map<std::string, ChannelLog>::const_iterator it = _channels.find(channelDir(channel));
+    return it == _channels.end() ? NULL : &it->second;
+}
+
+void HistoryLog::select(const ChannelName& channel, const HistoryRange& range,
+    std::vector<HistoryRecord>& out, HistoryLogView& view)
+{
+    if (range.low > range.high || !range.limit)
+        return;
+    pthread_mutex_lock(&_mutex);
+    const ChannelLog* log = find(channel);
+    if (log)
+    {
+        if (range.fromEnd)
+            selectBackward(*log, range, out, view);
+        else
+            selectForward(*log, range, out, view);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+size_t HistoryLog::segmentCount(const ChannelName& channel)
+{
+    pthread_mutex_lock(&_mutex);
+    const ChannelLog* log = find(channel);
+    size_t count = log ? log->segments.size() : 0;
+    pthread_mutex_unlock(&_mutex);
+    return count;
+}
+
+void HistoryLog::selectForward(const ChannelLog& log, const HistoryRange& range,
+    std::vector<HistoryRecord>& out, HistoryLogView& view) const
+{
+    size_t taken = 0;
+    for (size_t s = 0; s < log.segments.size(); ++s)
+    {
+        const LogSegment& segment = log.segments[s];
+        if (!segment.records || range.key(segment.lastId, segment.lastTime) < range.low)
+            continue;
+        if (range.key(segment.firstId, segment.firstTime) > range.high || segment.firstId >= range.idLimit)
+            return;
+        const char* data = view.map(segment);
+        if (!data)
+            continue;
+        // Everything before the last index entry below low is below low too
+        size_t position = indexLowerBound(segment.index, range, range.low);
+        size_t offset = position ? segment.index[position - 1].offset : 0;
+        HistoryRecord record;
+        size_t next;
+        while (readRecord(data, segment.bytes, offset, record, next, false))
+        {
+            unsigned long long key = range.key(record.id, record.time);
+            if (key > range.high || record.id >= range.idLimit)
+                return;
+            if (key >= range.low)
+            {
+                out.push_back(record);
+                if (++taken == range.limit)
+                    return;
+            }
+            offset = next;
+        }
+    }
+}
+
+// Walks index chunks from the newest, each chunk is scanned forward and its
+// matches taken from the back
+void HistoryLog::selectBackward(const ChannelLog& log, const HistoryRange& range,
+    std::vector<HistoryRecord>& out, HistoryLogView& view) const
+{
+    std::vector<HistoryRecord> newestFirst;
+    std::vector<HistoryRecord> chunk;
+    bool done = false;
+    for (size_t s = log.segments.size(); s-- > 0 && !done; )
+    {
+        const LogSegment& segment = log.segments[s];
+        if (!segment.records || range.key(segment.firstId, segment.firstTime) > range.high
+            || segment.firstId >= range.idLimit)
+            continue;
+        if (range.key(segment.lastId, segment.lastTime) < range.low)
+            break;
+        const char* data = view.map(segment);
+        if (!data)
+            continue;
+        for (size_t j = segment.index.size(); j-- > 0 && !done; )
+        {
+            const LogIndexEntry& entry = segment.index[j];
+            unsigned long long entryKey = range.key(entry.id, entry.time);
+            if (entryKey > range.high || entry.id >= range.idLimit)
+                continue;
+            size_t end = (j + 1 < segment.index.size()) ? segment.index[j + 1].offset : segment.bytes;
+            chunk.clear();
+            HistoryRecord record;
+            size_t offset = entry.offset;
+            size_t next;
+            while (offset < end && readRecord(data, segment.bytes, offset, record, next, false))
+            {
+                unsigned long long key = range.key(record.id, record.time);
+                if (key > range.high || record.id >= range.idLimit)
+                    break;
+                if (key >= range.low)
+                    chunk.push_back(record);
+                offset = next;
+            }
+            for (size_t c = chunk.size(); c-- > 0 && newestFirst.size() < range.limit; )
+                newestFirst.push_back(chunk[c]);
+            done = newestFirst.size() == range.limit || entryKey < range.low;
+        }
+    }
+    out.insert(out.end(), newestFirst.rbegin(), newestFirst.rend());
+}
+
+// Writer thread
+
+void* HistoryLog::run(void* self)
+{
+    static_cast<HistoryLog*>(self)->writerLoop();
+    return NULL;
+}
+
+void HistoryLog::writerLoop()
+{
+    pthread_mutex_lock(&_mutex);
+    while (true)
+    {
+        while (!_stop && _queue.empty())
+        {
+            // Idle: wake up once a minute to expire old segments of quiet channels
+            struct timespec deadline;
+            deadline.tv_sec = time(NULL) + 60;
+            deadline.tv_nsec = 0;
+            if (pthread_cond_timedwait(&_wake, &_mutex, &deadline) == ETIMEDOUT && _queue.empty())
+            {
+                pthread_mutex_unlock(&_mutex);
+                for (std::map<std::string, ChannelLog>::iterator it = _channels.begin(); it != _channels.end(); ++it)
+                    applyRetention(it->second);
+                pthread_mutex_lock(&_mutex);
+            }
+        }
+        if (_queue.empty())
+            break; // stopping, and nothing left to write
+        // Group commit: give the loop a moment to queue more, unless someone waits for us
+        if (!_stop && !_flushing && _queue.size() < HISTORY_LOG_BATCH)
+        {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            long nanoseconds = (now.tv_usec + HISTORY_LOG_COMMIT_MS * 1000L) * 1000L;
+            struct timespec deadline;
+            deadline.tv_sec = now.tv_sec + nanoseconds / 1000000000L;
+            deadline.tv_nsec = nanoseconds % 1000000000L;
+            pthread_cond_timedwait(&_wake, &_mutex, &deadline);
+        }
+        _batch.swap(_queue);
+        pthread_mutex_unlock(&_mutex);
+        commit();
+        pthread_mutex_lock(&_mutex);
+        for (size_t i = 0; i < _batch.size(); ++i)
+            _done.push_back(_batch[i].block);
+        _committed += _batch.size();
+        _batch.clear();
+        pthread_cond_broadcast(&_written);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+// Writes _batch, one channel after the other, keeping their order
+void HistoryLog::commit()
+{
+    std::map<std::string, std::vector<size_t> > byChannel;
+    for (size_t i = 0; i < _batch.size(); ++i)
+        byChannel[channelDir(_batch[i].channel)].push_back(i);
+    for (std::map<std::string, std::vector<size_t> >::iterator it = byChannel.begin(); it != byChannel.end(); ++it)
+    {
+        std::vector<HistoryBlock*> blocks;
+        for (size_t i = 0; i < it->second.size(); ++i)
+            blocks.push_back(_batch[it->second[i]].block);
+        writeChannel(it->first, blocks);
+    }
+}
+
+void HistoryLog::writeChannel(const std::string& name, const std::vector<HistoryBlock*>& blocks)
+{
+    pthread_mutex_lock(&_mutex);
+    ChannelLog& log = _channels[name];
+    pthread_mutex_unlock(&_mutex);
+    if (log.dir.empty())
+    {
+        log.dir = _dir + "/" + name;
+        mkdir(log.dir.c_str(), 0755);
+    }
+    size_t i = 0;
+    while (i < blocks.size())
+    {
+        if (log.fd < 0 && !openSegment(log, *blocks[i]))
+            return;
+        LogSegment& segment = log.segments.back();
+        size_t bytes = segment.bytes;
+        size_t records = segment.records;
+        unsigned long long lastId = segment.lastId;
+        unsigned long long lastTime = segment.lastTime;
+        std::vector<LogIndexEntry> index;
+        std::string buffer;
+        for (; i < blocks.size(); ++i)
+        {
+            const HistoryBlock& block = *blocks[i];
+            size_t size = HISTORY_LOG_RECORD_HEADER + block.size;
+            if (records && bytes + size > _segmentBytes)
+                break;
+            // Lookups need ids and times sorted; an id can't be bumped (it's the msgid),
+            // so an out of order one (the clock went back over a restart) isn't kept
+            if (records && block.id <= lastId)
+                continue;
+            unsigned long long time = (records && block.time < lastTime) ? lastTime : block.time;
+            if (records % HISTORY_LOG_INDEX_EVERY == 0)
+            {
+                LogIndexEntry entry;
+                entry.id = block.id;
+                entry.time = time;
+                entry.offset = bytes;
+                index.push_back(entry);
+            }
+            putRecord(buffer, block.id, time, block.line());
+            bytes += size;
+            records++;
+            lastId = block.id;
+            lastTime = time;
+        }
+        if (!buffer.empty())
+        {
+            if (!writeAll(log, buffer))
+                return;
+            pthread_mutex_lock(&_mutex);
+            if (!segment.records)
+            {
+                segment.firstId = index[0].id;
+                segment.firstTime = index[0].time;
+            }
+            segment.bytes = bytes;
+            segment.records = records;
+            segment.lastId = lastId;
+            segment.lastTime = lastTime;
+            segment.index.insert(segment.index.end(), index.begin(), index.end());
+            pthread_mutex_unlock(&_mutex);
+        }
+        if (i < blocks.size())
+        {
+            close(log.fd); // full, the next record starts a new segment
+            log.fd = -1;
+        }
+    }
+    applyRetention(log);
+}
+
+// Appends to the newest segment while first still fits, otherwise starts one named after it
+bool HistoryLog::openSegment(ChannelLog& log, const HistoryBlock& first)
+{
+    if (!log.segments.empty() && (!log.segments.back().records
+        || log.segments.back().bytes + HISTORY_LOG_RECORD_HEADER + first.size <= _segmentBytes))
+    {
+        log.fd = open(log.segments.back().path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        struct stat info;
+        if (log.fd >= 0 && fstat(log.fd, &info) == 0
+            && static_cast<size_t>(info.st_size) == log.segments.back().bytes)
+            return true;
+        if (log.fd >= 0)
+            close(log.fd);
+    }
+    LogSegment segment;
+    segment.path = log.dir + "/" + segmentName(first.id);
+    segment.firstId = segment.lastId = first.id;
+    segment.firstTime = segment.lastTime = first.time;
+    log.fd = open(segment.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (log.fd < 0)
+    {
+        if (!_failed)
+            std::cerr << "History log: cannot create " << segment.path << ": " << strerror(errno) << std::endl;
+        _failed = true;
+        return false;
+    }
+    pthread_mutex_lock(&_mutex);
+    log.segments.push_back(segment);
+    pthread_mutex_unlock(&_mutex);
+    return true;
+}
+
+bool HistoryLog::writeAll(ChannelLog& log, const std::string& buffer)
+{
+    size_t written = 0;
+    while (written < buffer.size())
+    {
+        ssize_t n = write(log.fd, buffer.data() + written, buffer.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (!_failed)
+                std::cerr << "History log: write failed: " << strerror(errno) << std::endl;
+            _failed = true;
+            // Whatever made it is a torn tail now, cut it so the next round starts clean
+            // (if that fails too, openSegment sees the size mismatch and starts a new file)
+            if (written && ftruncate(log.fd, log.segments.back().bytes) < 0)
+                written = 0;
+            close(log.fd);
+            log.fd = -1;
+            return false;
+        }
+        written += n;
+    }
+    fdatasync(log.fd); // one per channel per commit, however many records went in
+    return true;
+}
+
+void HistoryLog::applyRetention(ChannelLog& log)
+{
+    unsigned long long now = ServerTime::now();
+    unsigned long long cutoff = (_maxAge && now > _maxAge) ? now - _maxAge : 0;
+    size_t total = 0;
+    for (size_t i = 0; i < log.segments.size(); ++i)
+        total += log.segments[i].bytes;
+    while (!log.segments.empty())
+    {
+        const LogSegment& oldest = log.segments.front();
+        bool expired = cutoff && oldest.records && oldest.lastTime < cutoff;
+        bool over = total > _maxBytes && log.segments.size() > 1;
+        if (!expired && !over)
+            break;
+        if (log.segments.size() == 1 && log.fd >= 0)
+        {
+            close(log.fd);
+            log.fd = -1;
+        }
+        std::string path = oldest.path;
+        total -= oldest.bytes;
+        pthread_mutex_lock(&_mutex);
+        log.segments.erase(log.segments.begin());
+        pthread_mutex_unlock(&_mutex);
+        unlink(path.c_str());
+    }
+    if (cutoff && !log.segments.empty() && log.segments.front().records
+        && log.segments.front().firstTime < cutoff)
+        compactOldest(log, cutoff);
+}
+
+// The oldest segment is partly expired: once that's at least half of it,
+// its live tail is copied into a segment of its own and the old file goes
+void HistoryLog::compactOldest(ChannelLog& log, unsigned long long cutoff)
+{
+    const LogSegment& oldest = log.segments.front();
+    int fd = open(oldest.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    void* mapped = mmap(NULL, oldest.bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return;
+    const char* data = static_cast<const char*>(mapped);
+    HistoryRange byTime;
+    byTime.byTime = true;
+    size_t position = indexLowerBound(oldest.index, byTime, cutoff);
+    size_t offset = position ? oldest.index[position - 1].offset : 0;
+    HistoryRecord record;
+    size_t next;
+    while (readRecord(data, oldest.bytes, offset, record, next, false) && record.time < cutoff)
+        offset = next;
+    if (offset * 2 < oldest.bytes || offset >= oldest.bytes)
+    {
+        munmap(mapped, oldest.bytes);
+        return;
+    }
+    // A crash between writing the new file and unlinking the old one leaves
+    // two overlapping segments, load() keeps the newer
+    LogSegment compacted;
+    compacted.path = log.dir + "/" + segmentName(record.id);
+    int out = open(compacted.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = out >= 0;
+    for (size_t done = offset; ok && done < oldest.bytes; )
+    {
+        ssize_t n = write(out, data + done, oldest.bytes - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        ok = n > 0;
+        done += ok ? n : 0;
+    }
+    if (out >= 0)
+    {
+        ok = ok && fdatasync(out) == 0;
+        close(out);
+    }
+    munmap(mapped, oldest.bytes);
+    if (!ok || !loadSegment(compacted.path, compacted))
+    {
+        unlink(compacted.path.c_str());
+        return;
+    }
+    if (log.segments.size() == 1 && log.fd >= 0)
+    {
+        close(log.fd); // reopened on the compacted file by the next write
+        log.fd = -1;
+    }
+    std::string old = oldest.path;
+    pthread_mutex_lock(&_mutex);
+    log.segments.front() = compacted;
+    pthread_mutex_unlock(&_mutex);
+    unlink(old.c_str());
+}
+
+// Startup
+
+// Scans one segment, checking every record, and rebuilds its index. A torn
+// last record (crash mid-write) is cut off.
+bool HistoryLog::loadSegment(const std::string& path, LogSegment& segment)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+    {
+        close(fd);
+        return false;
+    }
+    LogSegment loaded; // path may be segment.path itself
+    loaded.path = path;
+    size_t size = static_cast<size_t>(info.st_size);
+    void* mapped = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (mapped != MAP_FAILED)
+    {
+        const char* data = static_cast<const char*>(mapped);
+        HistoryRecord record;
+        size_t next;
+        while (readRecord(data, size, loaded.bytes, record, next, true))
+        {
+            if (loaded.records && (record.id <= loaded.lastId || record.time < loaded.lastTime))
+                break;
+            if (!loaded.records)
+            {
+                loaded.firstId = record.id;
+                loaded.firstTime = record.time;
+            }
+            if (loaded.records % HISTORY_LOG_INDEX_EVERY == 0)
+            {
+                LogIndexEntry entry;
+                entry.id = record.id;
+                entry.time = record.time;
+                entry.offset = loaded.bytes;
+                loaded.index.push_back(entry);
+            }
+            loaded.lastId = record.id;
+            loaded.lastTime = record.time;
+            loaded.records++;
+            loaded.bytes = next;
+        }
+        munmap(mapped, size);
+    }
+    if (loaded.bytes < size && ftruncate(fd, loaded.bytes) < 0)
+        loaded.bytes = 0;
+    close(fd);
+    segment = loaded;
+    return segment.records > 0;
+}
+
+void HistoryLog::load()
+{
+    DIR* top = opendir(_dir.c_str());
+    if (!top)
+        return;
+    while (struct dirent* channelEntry = readdir(top))
+    {
+        std::string name = channelEntry->d_name;
+        if (name.empty() || name[0] == '.')
+            continue;
+        ChannelLog log;
+        log.dir = _dir + "/" + name;
+        DIR* channelDir = opendir(log.dir.c_str());
+        if (!channelDir)
+            continue;
+        std::vector<std::string> files;
+        while (struct dirent* entry = readdir(channelDir))
+        {
+            if (isSegmentName(entry->d_name))
+                files.push_back(entry->d_name);
+        }
+        closedir(channelDir);
+        std::sort(files.begin(), files.end()); // fixed width hex: sorted by first id
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            LogSegment segment;
+            std::string path = log.dir + "/" + files[i];
+            if (!loadSegment(path, segment))
+            {
+                unlink(path.c_str());
+                continue;
+            }
+            if (!log.segments.empty() && segment.firstId <= log.segments.back().lastId)
+            {
+                // Left over from an interrupted compaction, this one is the compacted copy
+                unlink(log.segments.back().path.c_str());
+                log.segments.pop_back();
+            }
+            log.segments.push_back(segment);
+        }
+        applyRetention(log);
+        if (!log.segments.empty())
+            _channels[name] = log;
+    }
+    closedir(top);
+}
@@ -0,0 +1,184 @@
+#include "../inc/HotRestart.hpp"
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <poll.h>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <sstream>
+
+static bool writeAll(int sock, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool readAll(int sock, char* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = recv(sock, data, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Header is a single text line: "<UPGRADE_MAGIC> <state bytes> <fd count>\n"
+bool HotRestart::sendState(int sock, const std::string& state, const std::vector<int>& fds)
+{
+    std::ostringstream header;
+    header << UPGRADE_MAGIC << " " << state.size() << " " << fds.size() << "\n";
+    std::string head = header.str();
+    if (!writeAll(sock, head.c_str(), head.size()) || !writeAll(sock, state.c_str(), state.size()))
+        return false;
+
+    // Descriptors travel as ancillary data, each batch riding on a single dummy byte
+    for (size_t sent = 0; sent < fds.size(); sent += UPGRADE_FDS_PER_MSG)
+    {
+        size_t batch = fds.size() - sent;
+        if (batch > UPGRADE_FDS_PER_MSG)
+            batch = UPGRADE_FDS_PER_MSG;
+
+        char dummy = 'F';
+        struct iovec iov;
+        iov.iov_base = &dummy;
+        iov.iov_len = 1;
+
+        std::vector<char> control(CMSG_SPACE(batch * sizeof(int)), 0);
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fds[sent], batch * sizeof(int));
+
+        ssize_t n;
+        do {
+            n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        if (n != 1)
+            return false;
+    }
+    return true;
+}
+
+bool HotRestart::receiveState(int sock, std::string& state, std::vector<int>& fds)
+{
+    // Read the header byte by byte, it's short and we must not overread into the fd messages
+    std::string head;
+    char c;
+    while (head.size() < 64)
+    {
+        if (!readAll(sock, &c, 1))
+            return false;
+        if (c == '\n')
+            break;
+        head += c;
+    }
+    std::istringstream iss(head);
+    std::string magic;
+    size_t stateSize = 0;
+    size_t fdCount = 0;
+    if (!(iss >> magic >> stateSize >> fdCount) || magic != UPGRADE_MAGIC)
+        return false;
+
+    state.resize(stateSize);
+    if (stateSize > 0 && !readAll(sock, &state[0], stateSize))
+        return false;
+
+    fds.clear();
+    while (fds.size() < fdCount)
+    {
+        size_t batch = fdCount - fds.size();
+        if (batch > UPGRADE_FDS_PER_MSG)
+            batch = UPGRADE_FDS_PER_MSG;
+
+        char dummy;
+        struct iovec iov;
+        iov.iov_base = &dummy;
+        iov.iov_len = 1;
+
+        std::vector<char> control(CMSG_SPACE(batch * sizeof(int)), 0);
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+
+        ssize_t n;
+        do {
+            n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        } while (n < 0 && errno == EINTR);
+        if (n != 1 || (msg.msg_flags & MSG_CTRUNC))
+            return false;
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            return false;
+        size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        size_t offset = fds.size();
+        fds.resize(offset + received);
+        memcpy(&fds[offset], CMSG_DATA(cmsg), received * sizeof(int));
+    }
+    return true;
+}
+
+bool HotRestart::sendAck(int sock)
+{
+    char ack = UPGRADE_ACK;
+    return writeAll(sock, &ack, 1);
+}
+
+bool HotRestart::waitAck(int sock, int timeoutMs)
+{
+    pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ret;
+    do {
+        ret = poll(&pfd, 1, timeoutMs);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0)
+        return false;
+    char ack = 0;
+    return readAll(sock, &ack, 1) && ack == UPGRADE_ACK;
+}
+
+void HotRestart::putString(std::ostream& os, const std::string& str)
+{
+    os << str.size() << ':' << str << ' ';
+}
+
+bool HotRestart::getString(std::istream& is, std::string& str)
+{
+    size_t len;
+    if (!(is >> len) || is.get() != ':')
+        return false;
+    str.resize(len);
+    if (len > 0 && !is.read(&str[0], len))
+        return false;
+    return true;
+}
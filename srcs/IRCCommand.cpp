@@ -24,6 +24,17 @@ bool IRCCommand::isValid() const {
 }
 
 void IRCCommand::processCommand() {
+    // "@a=b;+c :prefix CMD ..." - the tags are not the command, keep them aside
+    // undecoded (see MessageView::findTag) and parse the rest as usual
+    if (!_input.empty() && _input[0] == '@') {
+        size_t end = _input.find(' ');
+        if (end == std::string::npos) {
+            _errorNum = ERR_NEEDMOREPARAMS;
+            return ;
+        }
+        _tags = _input.substr(1, end - 1);
+        _input.erase(0, end + 1);
+    }
     std::istringstream iss(_input);
     std::string word;
     bool first = true;
@@ -68,16 +79,28 @@ void IRCCommand::handleParameters(std::istringstream &iss) {
         handleCapCmd(iss);
     else if (_cmd == "JOIN")
         handleJoinCmd(iss);
-    else if (_cmd == "PRIVMSG")
+    else if (_cmd == "PRIVMSG" || _cmd == "NOTICE")
         handlePrivmsgCmd(iss);
     else if (_cmd == "INVITE")
         handleInviteCmd(iss);
     else if (_cmd == "KICK")
         handleKickCmd(iss);
+    else if (_cmd == "PART")
+        handlePartCmd(iss);
     else if (_cmd == "TOPIC")
         handleTopicCmd(iss);
     else if (_cmd == "PING" || _cmd == "PONG")
         handlePingCmd(iss);
+    else if (_cmd == "STATS")
+        handleStatsCmd(iss);
+    else if (_cmd == "CHATHISTORY")
+        handleChathistoryCmd(iss);
+    else if (_cmd == "NAMES" || _cmd == "LIST" || _cmd == "WHO")
+        handleChannelListCmd(iss);
+    else if (_cmd == "MONITOR")
+        handleMonitorCmd(iss);
+    else if (_cmd == "QUIT")
+        handleQuitCmd(iss);
 }
 
 void IRCCommand::handlePingCmd(std::istringstream &iss) {
@@ -131,6 +154,58 @@ void IRCCommand::handleJoinCmd(std::istringstream &iss) {
     }
 }
 
+// Checked by the manager, which answers with FAIL replies
+void IRCCommand::handleChathistoryCmd(std::istringstream &iss) {
+    std::string word;
+    while (iss >> word) {
+        trimCRLF(word);
+        if (!word.empty())
+            _params.push_back(word);
+    }
+    _isValid = true;
+}
+
+// NAMES [#chan,#chan2] / LIST [#chan,>10,...] / WHO [mask [%fields]], no parameter is fine too
+void IRCCommand::handleChannelListCmd(std::istringstream &iss) {
+    std::string word;
+    while (iss >> word) {
+        trimCRLF(word);
+        if (!word.empty())
+            _params.push_back(word);
+    }
+    _isValid = true;
+}
+
+// MONITOR <+|-> <target>[,<target>...] / MONITOR <C|L|S>, the manager checks the rest
+void IRCCommand::handleMonitorCmd(std::istringstream &iss) {
+    std::string word;
+    while (iss >> word) {
+        trimCRLF(word);
+        if (!word.empty())
+            _params.push_back(word);
+    }
+    if (_params.empty()) {
+        _isValid = false;
+        _errorNum = ERR_NEEDMOREPARAMS;
+    }
+    else
+        _isValid = true;
+}
+
+// QUIT [:reason], the reason may have blanks
+void IRCCommand::handleQuitCmd(std::istringstream &iss) {
+    std::string reason;
+    std::getline(iss, reason);
+    size_t start = reason.find_first_not_of(" \t");
+    reason = start == std::string::npos ? "" : reason.substr(start);
+    if (!reason.empty() && reason[0] == ':')
+        reason.erase(0, 1);
+    trimCRLF(reason);
+    if (!reason.empty())
+        _params.push_back(reason);
+    _isValid = true;
+}
+
 void IRCCommand::handleCapCmd(std::istringstream &iss) {
     std::string word;
     while (iss >> word) {
@@ -261,7 +336,7 @@ void IRCCommand::handleModeCmd(std::istringstream &iss) {
 void IRCCommand::handleModeCmdParams(std::istringstream &iss) {
     ModeFlag currentFlag;
     while ((currentFlag = getModeFlag()) != MODE_UNKNOWN) {
-        if ((currentFlag == MODE_KEY && _currentModeSign == PLUS) || currentFlag == MODE_OPERATOR) {
+        if ((currentFlag == MODE_KEY && _currentModeSign == PLUS) || currentFlag == MODE_OPERATOR || currentFlag == MODE_VOICE) {
             std::string param;
             if (iss >> param) {
                 trimCRLF(param);
@@ -297,6 +372,14 @@ void IRCCommand::handleModeCmdParams(std::istringstream &iss) {
                 return ;
             }
         }
+        else if (currentFlag == MODE_BAN || currentFlag == MODE_EXCEPT || currentFlag == MODE_INVEX) {
+            // Without a mask it's a request for the list
+            std::string mask;
+            if (iss >> mask) {
+                trimCRLF(mask);
+                _params.push_back(mask);
+            }
+        }
         else if (currentFlag == MODE_LIMIT_USER && _currentModeSign == MINUS) {
             // No parameter needed when removing limit
             continue;
@@ -324,6 +407,10 @@ ModeFlag IRCCommand::getModeFlag() {
                 case 'k': return MODE_KEY;
                 case 'o': return MODE_OPERATOR;
                 case 'l': return MODE_LIMIT_USER;
+                case 'v': return MODE_VOICE;
+                case 'b': return MODE_BAN;
+                case 'e': return MODE_EXCEPT;
+                case 'I': return MODE_INVEX;
             default:  return MODE_UNKNOWN;
             }
         }
@@ -347,6 +434,10 @@ std::string const &IRCCommand::getPrefix() const {
     return _prefix;
 }
 
+std::string const &IRCCommand::getTags() const {
+    return _tags;
+}
+
 std::string const &IRCCommand::getErrorNum() const {
     return _errorNum;
 }
@@ -457,6 +548,43 @@ void IRCCommand::handleKickCmd(std::istringstream &iss)
     _isValid = true;
 }
 
+void IRCCommand::handlePartCmd(std::istringstream &iss) {
+    std::string channels;
+    iss >> channels;
+    trimCRLF(channels);
+
+    if (channels.empty()) {
+        _isValid = false;
+        _errorNum = ERR_NEEDMOREPARAMS;
+        return;
+    }
+    _params.push_back(channels);
+
+    // Optional reason
+    std::string reason;
+    std::getline(iss, reason);
+    size_t firstNonSpace = reason.find_first_not_of(" \t");
+    if (firstNonSpace != std::string::npos)
+        reason = reason.substr(firstNonSpace);
+    if (!reason.empty() && reason[0] == ':')
+        reason = reason.substr(1);
+    trimCRLF(reason);
+    if (!reason.empty())
+        _params.push_back(reason);
+    _isValid = true;
+}
+
+// STATS [<query> [<server>]], the query letter is checked by the manager
+void IRCCommand::handleStatsCmd(std::istringstream &iss) {
+    std::string word;
+    while (_params.size() < 2 && iss >> word) {
+        trimCRLF(word);
+        if (!word.empty())
+            _params.push_back(word);
+    }
+    _isValid = true;
+}
+
 void IRCCommand::handleTopicCmd(std::istringstream &iss) {
     std::string target_channel;
     iss >> target_channel;
@@ -509,6 +637,9 @@ void IRCCommand::trimCRLF(std::string &str) {
 
 bool IRCCommand::isFlagSetValid(std::string const &flags) const {
     char c;
+    // "MODE #chan b" lists the bans
+    if (flags == "b" || flags == "e" || flags == "I")
+        return true;
     if (flags.size() >= 1) {
         c = flags[0];
         if (c != '+' && c != '-')
@@ -516,18 +647,20 @@ bool IRCCommand::isFlagSetValid(std::string const &flags) const {
     }
     for (size_t i = 0; i < flags.size(); ++i) {
         c = flags[i];
-        if (c != 'i' && c != 't' && c != 'k' && c != 'o' && c != 'l' && c != '+' && c != '-') {
+        if (c != 'i' && c != 't' && c != 'k' && c != 'o' && c != 'v' && c != 'l' && c != 'b' && c != 'e' && c != 'I'
+            && c != '+' && c != '-') {
             return false;
         }
     }
     return true;
 }
 
-std::string IRCCommand::getParamAt(size_t index) const {
+std::string const &IRCCommand::getParamAt(size_t index) const {
+    static const std::string empty;
     if (index < _params.size()) {
         return _params[index];
     }
-    return "";
+    return empty;
 }
 
 size_t IRCCommand::getParamsCount() const {
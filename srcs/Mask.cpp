@@ -0,0 +1,252 @@
+#include "../inc/Mask.hpp"
+#include "../inc/FixedString.hpp"
+#include <cstring>
+
+// Greedy, remembering only the last '*': on a mismatch that star swallows one
+// more character and matching resumes behind it. Earlier stars never need to
+// be revisited, whatever they matched the last one can match too.
+bool maskMatch(const char* mask, size_t maskLen, const char* text, size_t textLen)
+{
+    size_t m = 0;
+    size_t t = 0;
+    size_t star = std::string::npos;  // position after the last '*' seen
+    size_t resume = 0;                // where text picks up when we backtrack to it
+    while (t < textLen)
+    {
+        if (m < maskLen && mask[m] == '*')
+        {
+            star = ++m;
+            resume = t;
+        }
+        else if (m < maskLen && (mask[m] == '?'
+            || ircFold(static_cast<unsigned char>(mask[m])) == ircFold(static_cast<unsigned char>(text[t]))))
+        {
+            m++;
+            t++;
+        }
+        else if (star != std::string::npos)
+        {
+            m = star;
+            t = ++resume;
+        }
+        else
+            return false;
+    }
+    while (m < maskLen && mask[m] == '*')
+        m++;
+    return m == maskLen;
+}
+
+bool isMask(const std::string& str)
+{
+    return str.find_first_of("*?") != std::string::npos;
+}
+
+static unsigned long g_nextMaskId = 1;
+
+static inline unsigned char folded(char c)
+{
+    return ircFold(static_cast<unsigned char>(c));
+}
+
+CompiledMask::CompiledMask()
+    : _anchoredStart(true), _anchoredEnd(true), _hasStar(false), _minLength(0), _id(g_nextMaskId++) {}
+
+CompiledMask::CompiledMask(const std::string& mask)
+    : _anchoredStart(mask.empty() || mask[0] != '*'), _anchoredEnd(mask.empty() || mask[mask.size() - 1] != '*'),
+    _hasStar(mask.find('*') != std::string::npos), _minLength(0), _id(g_nextMaskId++)
+{
+    _folded.reserve(mask.size());
+    for (size_t i = 0; i < mask.size(); ++i)
+        _folded += static_cast<char>(folded(mask[i]));
+    _failure.resize(_folded.size());
+    size_t start = 0;
+    while (start <= _folded.size())
+    {
+        size_t star = _folded.find('*', start);
+        if (star == std::string::npos)
+            star = _folded.size();
+        if (star > start)
+        {
+            Run run;
+            run.offset = start;
+            run.length = star - start;
+            prepare(run);
+            _runs.push_back(run);
+            _minLength += run.length;
+        }
+        start = star + 1;
+    }
+}
+
+// A plain run gets its KMP failure table: failure[i] is the length of the
+// longest proper prefix of run[0..i] that is also a suffix of it. A run with a
+// '?' gets a Shift-And table instead, bit j of table[c] is set when c fits at
+// position j, which a '?' does for every c.
+void CompiledMask::prepare(Run& run)
+{
+    const char* literal = _folded.data() + run.offset;
+    run.wildcard = std::memchr(literal, '?', run.length) != NULL;
+    run.table = std::string::npos;
+    if (!run.wildcard)
+    {
+        size_t* failure = &_failure[run.offset];
+        size_t k = 0;
+        failure[0] = 0;
+        for (size_t i = 1; i < run.length; ++i)
+        {
+            while (k && literal[i] != literal[k])
+                k = failure[k - 1];
+            if (literal[i] == literal[k])
+                k++;
+            failure[i] = k;
+        }
+        return;
+    }
+    if (run.length > 64)
+        return;
+    run.table = _tables.size() / 256;
+    _tables.resize(_tables.size() + 256, 0);
+    unsigned long long* table = &_tables[run.table * 256];
+    for (size_t j = 0; j < run.length; ++j)
+    {
+        unsigned long long bit = 1ULL << j;
+        if (literal[j] != '?')
+            table[static_cast<unsigned char>(literal[j])] |= bit;
+        else
+        {
+            for (size_t c = 0; c < 256; ++c)
+                table[c] |= bit;
+        }
+    }
+}
+
+bool CompiledMask::runAt(const Run& run, const char* text) const
+{
+    const char* literal = _folded.data() + run.offset;
+    for (size_t i = 0; i < run.length; ++i)
+    {
+        if (literal[i] != '?' && literal[i] != static_cast<char>(folded(text[i])))
+            return false;
+    }
+    return true;
+}
+
+size_t CompiledMask::find(const Run& run, const char* text, size_t pos, size_t end) const
+{
+    const char* literal = _folded.data() + run.offset;
+    if (!run.wildcard)
+    {
+        const size_t* failure = &_failure[run.offset];
+        size_t k = 0;
+        for (size_t i = pos; i < end; ++i)
+        {
+            char c = static_cast<char>(folded(text[i]));
+            while (k && literal[k] != c)
+                k = failure[k - 1];
+            if (literal[k] == c && ++k == run.length)
+                return i + 1 - run.length;
+        }
+        return std::string::npos;
+    }
+    if (run.table != std::string::npos)
+    {
+        // Bit j of state: the last j + 1 characters fit the first j + 1 of the run
+        const unsigned long long* table = &_tables[run.table * 256];
+        unsigned long long state = 0;
+        unsigned long long goal = 1ULL << (run.length - 1);
+        for (size_t i = pos; i < end; ++i)
+        {
+            state = ((state << 1) | 1) & table[folded(text[i])];
+            if (state & goal)
+                return i + 1 - run.length;
+        }
+        return std::string::npos;
+    }
+    for (; pos + run.length <= end; ++pos)
+    {
+        if (runAt(run, text + pos))
+            return pos;
+    }
+    return std::string::npos;
+}
+
+bool CompiledMask::matches(const char* text, size_t len) const
+{
+    if (len < _minLength || (!_hasStar && len != _minLength))
+        return false;
+    if (!_hasStar)
+        return _runs.empty() || runAt(_runs[0], text);
+    size_t first = 0;
+    size_t last = _runs.size();
+    size_t pos = 0;
+    size_t end = len;
+    if (_anchoredStart && first < last)
+    {
+        if (!runAt(_runs[0], text))
+            return false;
+        pos = _runs[0].length;
+        first++;
+    }
+    if (_anchoredEnd && first < last)
+    {
+        last--;
+        end = len - _runs[last].length;
+        if (!runAt(_runs[last], text + end))
+            return false;
+    }
+    // Leftmost fit for each run in between, taking more can only leave less room
+    for (size_t i = first; i < last; ++i)
+    {
+        size_t found = find(_runs[i], text, pos, end);
+        if (found == std::string::npos)
+            return false;
+        pos = found + _runs[i].length;
+    }
+    return true;
+}
+
+MaskVerdictCache::MaskVerdictCache(size_t slots) : _hits(0), _misses(0)
+{
+    size_t size = 1;
+    while (size < slots)
+        size <<= 1;
+    Slot empty = { 0, 0, false };
+    _slots.assign(size, empty);
+}
+
+size_t MaskVerdictCache::slot(unsigned long mask, unsigned long identity) const
+{
+    unsigned long hash = mask * 2654435761ul ^ identity * 40503ul;
+    return (hash ^ (hash >> 16)) & (_slots.size() - 1);
+}
+
+int MaskVerdictCache::find(unsigned long mask, unsigned long identity)
+{
+    const Slot& entry = _slots[slot(mask, identity)];
+    if (entry.mask != mask || entry.identity != identity)
+    {
+        _misses++;
+        return -1;
+    }
+    _hits++;
+    return entry.verdict;
+}
+
+void MaskVerdictCache::store(unsigned long mask, unsigned long identity, bool verdict)
+{
+    Slot& entry = _slots[slot(mask, identity)];
+    entry.mask = mask;
+    entry.identity = identity;
+    entry.verdict = verdict;
+}
+
+bool MaskVerdictCache::matches(const CompiledMask& mask, unsigned long identity, const std::string& text)
+{
+    int known = find(mask.id(), identity);
+    if (known >= 0)
+        return known;
+    bool verdict = mask.matches(text);
+    store(mask.id(), identity, verdict);
+    return verdict;
+}
@@ -0,0 +1,180 @@
+#include "../inc/MaskList.hpp"
+#include "../inc/Client.hpp"
+
+static std::string foldedCopy(const std::string& str)
+{
+    std::string out(str);
+    for (size_t i = 0; i < out.size(); ++i)
+        out[i] = static_cast<char>(ircFold(static_cast<unsigned char>(out[i])));
+    return out;
+}
+
+// What follows the count-th '.' from the end, all of str when it has fewer
+static std::string lastLabels(const std::string& str, size_t count)
+{
+    size_t end = str.size();
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t dot = end ? str.rfind('.', end - 1) : std::string::npos;
+        if (dot == std::string::npos)
+            return str;
+        if (i + 1 == count)
+            return str.substr(dot + 1);
+        end = dot;
+    }
+    return str;
+}
+
+std::string MaskList::normalize(const std::string& mask)
+{
+    std::string nick, user, host;
+    size_t bang = mask.find('!');
+    size_t at = mask.find('@', bang == std::string::npos ? 0 : bang + 1);
+    if (bang != std::string::npos)
+    {
+        nick = mask.substr(0, bang);
+        user = mask.substr(bang + 1, at == std::string::npos ? std::string::npos : at - bang - 1);
+    }
+    else if (at != std::string::npos)
+        user = mask.substr(0, at);
+    else
+        nick = mask;
+    if (at != std::string::npos)
+        host = mask.substr(at + 1);
+    return (nick.empty() ? "*" : nick) + "!" + (user.empty() ? "*" : user) + "@" + (host.empty() ? "*" : host);
+}
+
+// The host part decides, see the class comment. NULL is the unbucketed list.
+MaskList::Buckets* MaskList::bucketFor(const std::string& foldedMask, std::string& key)
+{
+    size_t at = foldedMask.rfind('@');
+    std::string host = at == std::string::npos ? foldedMask : foldedMask.substr(at + 1);
+    size_t lastWild = host.find_last_of("*?");
+    if (lastWild == std::string::npos)
+    {
+        key = lastLabels(host, 2);
+        return &_byLastLabels;
+    }
+    std::string tail = host.substr(lastWild + 1);
+    size_t dots = 0;
+    for (size_t i = 0; i < tail.size(); ++i)
+        dots += tail[i] == '.';
+    if (dots >= 2)
+    {
+        key = lastLabels(tail, 2);
+        return &_byLastLabels;
+    }
+    if (dots == 1)
+    {
+        key = lastLabels(tail, 1);
+        return &_byLastLabel;
+    }
+    size_t dot = host.find('.');
+    if (dot != std::string::npos && dot < host.find_first_of("*?"))
+    {
+        key = host.substr(0, dot + 1);
+        return &_byFirstLabel;
+    }
+    return NULL;
+}
+
+bool MaskList::add(const std::string& mask, const std::string& setBy, time_t setAt)
+{
+    std::string folded = foldedCopy(mask);
+    if (_entries.find(folded) != _entries.end())
+        return false;
+    MaskEntry& entry = _entries[folded];
+    entry.mask = mask;
+    entry.setBy = setBy;
+    entry.setAt = setAt;
+    entry.matcher = CompiledMask(mask);
+    std::string key;
+    Buckets* buckets = bucketFor(folded, key);
+    (buckets ? (*buckets)[key] : _unbucketed).push_back(&entry);
+    return true;
+}
+
+bool MaskList::remove(const std::string& mask)
+{
+    std::map<std::string, MaskEntry>::iterator found = _entries.find(foldedCopy(mask));
+    if (found == _entries.end())
+        return false;
+    std::string key;
+    Buckets* buckets = bucketFor(found->first, key);
+    Buckets::iterator bucket = buckets ? buckets->find(key) : Buckets::iterator();
+    std::vector<const MaskEntry*>& entries = buckets ? bucket->second : _unbucketed;
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        if (entries[i] == &found->second)
+        {
+            entries[i] = entries.back();
+            entries.pop_back();
+            break;
+        }
+    }
+    if (buckets && entries.empty())
+        buckets->erase(bucket);
+    _entries.erase(found);
+    return true;
+}
+
+MaskVerdictCache MaskList::_verdicts(MASK_VERDICT_SLOTS);
+
+bool MaskList::runBucket(const std::vector<const MaskEntry*>& bucket, Subject& subject)
+{
+    for (size_t i = 0; i < bucket.size(); ++i)
+    {
+        const CompiledMask& matcher = bucket[i]->matcher;
+        if (!subject.client)
+        {
+            if (matcher.matches(*subject.hostmask))
+                return true;
+            continue;
+        }
+        unsigned long identity = subject.client->getIdentityStamp();
+        int verdict = _verdicts.find(matcher.id(), identity);
+        if (verdict < 0)
+        {
+            verdict = matcher.matches(*subject.hostmask);
+            _verdicts.store(matcher.id(), identity, verdict);
+        }
+        if (verdict)
+            return true;
+    }
+    return false;
+}
+
+bool MaskList::runBucket(const Buckets& buckets, const std::string& key, Subject& subject)
+{
+    Buckets::const_iterator found = buckets.find(key);
+    return found != buckets.end() && runBucket(found->second, subject);
+}
+
+bool MaskList::matches(const std::string& host, Subject& subject) const
+{
+    if (_entries.empty())
+        return false;
+    std::string key = foldedCopy(host);
+    if (runBucket(_byLastLabels, lastLabels(key, 2), subject)
+        || runBucket(_byLastLabel, lastLabels(key, 1), subject)
+        || runBucket(_unbucketed, subject))
+        return true;
+    size_t dot = key.find('.');
+    return dot != std::string::npos && runBucket(_byFirstLabel, key.substr(0, dot + 1), subject);
+}
+
+bool MaskList::matches(const std::string& hostmask, const std::string& host) const
+{
+    Subject subject;
+    subject.client = NULL;
+    subject.hostmask = &hostmask;
+    return matches(host, subject);
+}
+
+bool MaskList::matches(const Client& client) const
+{
+    Subject subject;
+    subject.client = &client;
+    subject.hostmask = &client.getHostmask();
+    return matches(client.getHostname(), subject);
+}
@@ -0,0 +1,146 @@
+#include "../inc/MemoryBudget.hpp"
+#include "../inc/Arena.hpp"
+#include "../inc/Client.hpp"
+#include "../inc/Channel.hpp"
+#include "../inc/Membership.hpp"
+#include <cstdlib>
+#include <sstream>
+
+static size_t g_used[MEM_CATEGORIES];
+static size_t g_clientRecvQ = CLIENT_RECVQ_LIMIT;
+static size_t g_clientSendQ = CLIENT_SENDQ_LIMIT;
+static size_t g_serverLimit = SERVER_MEMORY_LIMIT;
+
+// Slabs are never handed back, so what a pool holds is every slot it ever carved
+static size_t poolBytes(const PoolStats& stats)
+{
+    return (stats.live + stats.free) * stats.objectSize;
+}
+
+void MemoryBudget::charge(MemoryCategory category, size_t bytes)
+{
+    g_used[category] += bytes;
+}
+
+void MemoryBudget::release(MemoryCategory category, size_t bytes)
+{
+    g_used[category] -= (bytes > g_used[category]) ? g_used[category] : bytes;
+}
+
+void MemoryBudget::update(MemoryCategory category, size_t& accounted, size_t current)
+{
+    if (current > accounted)
+        charge(category, current - accounted);
+    else
+        release(category, accounted - current);
+    accounted = current;
+}
+
+size_t MemoryBudget::heapBytes(const std::string& str)
+{
+    static const size_t inlineCapacity = std::string().capacity();
+    return str.capacity() > inlineCapacity ? str.capacity() + 1 : 0;
+}
+
+size_t MemoryBudget::used(MemoryCategory category)
+{
+    if (category == MEM_CLIENTS)
+    {
+        PoolStats clients = Client::poolStats();
+        return poolBytes(clients) + clients.live * sizeof(ClientIdentity);
+    }
+    if (category == MEM_CHANNELS)
+        return poolBytes(Channel::poolStats()) + poolBytes(Membership::poolStats()) + g_used[MEM_CHANNELS];
+    if (category == MEM_OUTPUT)
+        return Arena::totalCapacity() + g_used[MEM_OUTPUT];
+    return g_used[category];
+}
+
+size_t MemoryBudget::total()
+{
+    size_t sum = 0;
+    for (int i = 0; i < MEM_CATEGORIES; ++i)
+        sum += used(static_cast<MemoryCategory>(i));
+    return sum;
+}
+
+const char* MemoryBudget::categoryName(MemoryCategory category)
+{
+    switch (category) {
+        case MEM_INPUT:    return "recvq";
+        case MEM_OUTPUT:   return "sendq";
+        case MEM_CLIENTS:  return "clients";
+        case MEM_CHANNELS: return "channels";
+        case MEM_HISTORY:  return "history";
+        default:           return "unknown";
+    }
+}
+
+void MemoryBudget::setLimits(size_t clientRecvQ, size_t clientSendQ, size_t serverLimit)
+{
+    g_clientRecvQ = clientRecvQ;
+    g_clientSendQ = clientSendQ;
+    g_serverLimit = serverLimit;
+}
+
+size_t MemoryBudget::envSize(const char* name, size_t fallback)
+{
+    const char* value = std::getenv(name);
+    if (!value || !*value)
+        return fallback;
+    char* end;
+    unsigned long parsed = std::strtoul(value, &end, 10);
+    if (*end != '\0' || parsed == 0)
+        return fallback;
+    return parsed;
+}
+
+void MemoryBudget::loadLimitsFromEnv()
+{
+    setLimits(envSize("IRCSERV_CLIENT_RECVQ", CLIENT_RECVQ_LIMIT),
+              envSize("IRCSERV_CLIENT_SENDQ", CLIENT_SENDQ_LIMIT),
+              envSize("IRCSERV_MEMORY_LIMIT", SERVER_MEMORY_LIMIT));
+}
+
+size_t MemoryBudget::clientRecvQLimit()
+{
+    return g_clientRecvQ;
+}
+
+size_t MemoryBudget::clientSendQLimit()
+{
+    return g_clientSendQ;
+}
+
+size_t MemoryBudget::serverLimit()
+{
+    return g_serverLimit;
+}
+
+bool MemoryBudget::overLimit()
+{
+    return total() > g_serverLimit;
+}
+
+bool MemoryBudget::nearLimit()
+{
+    return total() > g_serverLimit / 100 * MEMORY_REFUSE_PERCENT;
+}
+
+// One line per category plus the limits, used by STATS z
+void MemoryBudget::report(std::vector<std::string>& lines)
+{
+    for (int i = 0; i < MEM_CATEGORIES; ++i)
+    {
+        MemoryCategory category = static_cast<MemoryCategory>(i);
+        std::ostringstream oss;
+        oss << categoryName(category) << " " << used(category) << " bytes";
+        lines.push_back(oss.str());
+    }
+    std::ostringstream totals;
+    totals << "total " << total() << " of " << g_serverLimit << " bytes";
+    lines.push_back(totals.str());
+    std::ostringstream limits;
+    limits << "per client recvq " << g_clientRecvQ << " sendq " << g_clientSendQ << " bytes";
+    lines.push_back(limits.str());
+}
@@ -0,0 +1,177 @@
+#include "../inc/MessageView.hpp"
+
+MessageView::MessageView() : _split(false), _paramCount(0) {}
+
+static const char* skipSpaces(const char* p, const char* end)
+{
+    while (p < end && *p == ' ')
+        ++p;
+    return p;
+}
+
+static const char* findSpace(const char* p, const char* end)
+{
+    while (p < end && *p != ' ')
+        ++p;
+    return p;
+}
+
+bool MessageView::parse(const char* line, size_t len)
+{
+    if (len >= 2 && line[len - 2] == '\r' && line[len - 1] == '\n')
+        len -= 2;
+    else if (len >= 1 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        len -= 1;
+    _line = StringSpan(line, len);
+    _tags = StringSpan();
+    _prefix = StringSpan();
+    _split = false;
+    _paramCount = 0;
+
+    const char* p = line;
+    const char* end = line + len;
+    if (p < end && *p == '@')
+    {
+        const char* tagsEnd = findSpace(p, end);
+        _tags = StringSpan(p + 1, tagsEnd - p - 1);
+        p = skipSpaces(tagsEnd, end);
+    }
+    if (p < end && *p == ':')
+    {
+        const char* prefixEnd = findSpace(p, end);
+        _prefix = StringSpan(p + 1, prefixEnd - p - 1);
+        p = skipSpaces(prefixEnd, end);
+    }
+    const char* commandEnd = findSpace(p, end);
+    _command = StringSpan(p, commandEnd - p);
+    p = skipSpaces(commandEnd, end);
+    _args = StringSpan(p, end - p);
+    return !_command.empty();
+}
+
+// RFC 1459: space separated, a ':' starts the last parameter which may contain spaces
+void MessageView::splitParams() const
+{
+    const char* p = _args.data;
+    const char* end = _args.data + _args.size;
+    while (p < end && _paramCount < MESSAGE_MAX_PARAMS)
+    {
+        if (*p == ':' || _paramCount == MESSAGE_MAX_PARAMS - 1)
+        {
+            if (*p == ':')
+                ++p;
+            _params[_paramCount++] = StringSpan(p, end - p);
+            break;
+        }
+        const char* paramEnd = findSpace(p, end);
+        _params[_paramCount++] = StringSpan(p, paramEnd - p);
+        p = skipSpaces(paramEnd, end);
+    }
+    _split = true;
+}
+
+size_t MessageView::paramCount() const
+{
+    if (!_split)
+        splitParams();
+    return _paramCount;
+}
+
+StringSpan MessageView::param(size_t index) const
+{
+    if (!_split)
+        splitParams();
+    return index < _paramCount ? _params[index] : StringSpan();
+}
+
+// IRCv3 message-tags: "key[=value];key2..." where a key may start with '+'
+// (client-only) and carry a vendor prefix ("example.com/key").
+bool MessageView::findTag(const StringSpan& tags, const char* key, StringSpan& rawValue)
+{
+    size_t keyLen = std::strlen(key);
+    const char* p = tags.data;
+    const char* end = tags.data + tags.size;
+    while (p < end)
+    {
+        const char* tagEnd = static_cast<const char*>(std::memchr(p, ';', end - p));
+        if (!tagEnd)
+            tagEnd = end;
+        const char* equal = static_cast<const char*>(std::memchr(p, '=', tagEnd - p));
+        const char* keyEnd = equal ? equal : tagEnd;
+        if (static_cast<size_t>(keyEnd - p) == keyLen && std::memcmp(p, key, keyLen) == 0)
+        {
+            rawValue = equal ? StringSpan(equal + 1, tagEnd - equal - 1) : StringSpan();
+            return true;
+        }
+        p = tagEnd + 1;
+    }
+    return false;
+}
+
+// \: -> ';'  \s -> ' '  \\ -> '\'  \r \n -> CR LF, any other escaped char is
+// itself and a lone trailing backslash is dropped
+StringSpan MessageView::unescapeTagValue(const StringSpan& rawValue, Arena& arena)
+{
+    if (rawValue.empty() || !std::memchr(rawValue.data, '\\', rawValue.size))
+        return rawValue;
+    char* out = arena.allocate(rawValue.size);
+    size_t size = 0;
+    for (size_t i = 0; i < rawValue.size; ++i)
+    {
+        char c = rawValue[i];
+        if (c != '\\')
+        {
+            out[size++] = c;
+            continue;
+        }
+        if (++i == rawValue.size)
+            break;
+        switch (rawValue[i])
+        {
+            case ':': out[size++] = ';'; break;
+            case 's': out[size++] = ' '; break;
+            case 'r': out[size++] = '\r'; break;
+            case 'n': out[size++] = '\n'; break;
+            default: out[size++] = rawValue[i]; break;
+        }
+    }
+    return StringSpan(out, size);
+}
+
+StringSpan MessageView::clientOnlyTags(const StringSpan& tags, Arena& arena)
+{
+    const char* p = tags.data;
+    const char* end = tags.data + tags.size;
+    size_t kept = 0;
+    size_t dropped = 0;
+    while (p < end)
+    {
+        const char* tagEnd = static_cast<const char*>(std::memchr(p, ';', end - p));
+        if (!tagEnd)
+            tagEnd = end;
+        if (tagEnd > p && *p == '+')
+            kept++;
+        else
+            dropped++;
+        p = tagEnd + 1;
+    }
+    if (!kept)
+        return StringSpan();
+    if (!dropped)
+        return tags;
+    ArenaWriter out(arena, tags.size);
+    for (p = tags.data; p < end; )
+    {
+        const char* tagEnd = static_cast<const char*>(std::memchr(p, ';', end - p));
+        if (!tagEnd)
+            tagEnd = end;
+        if (tagEnd > p && *p == '+')
+        {
+            if (out.size())
+                out << ';';
+            out.append(p, tagEnd - p);
+        }
+        p = tagEnd + 1;
+    }
+    return out.span();
+}
@@ -0,0 +1,81 @@
+#include "../inc/MonitorIndex.hpp"
+
+// Order doesn't matter on either side, so both erase by swapping with the last
+void MonitorIndex::unwatch(const NickName& nick, int fd)
+{
+    std::map<NickName, std::vector<int> >::iterator entry = _watchers.find(nick);
+    if (entry == _watchers.end())
+        return;
+    std::vector<int>& fds = entry->second;
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        if (fds[i] == fd)
+        {
+            fds[i] = fds.back();
+            fds.pop_back();
+            break;
+        }
+    }
+    if (fds.empty())
+        _watchers.erase(entry);
+}
+
+bool MonitorIndex::add(int fd, const NickName& nick)
+{
+    std::vector<NickName>& targets = _targets[fd];
+    for (size_t i = 0; i < targets.size(); ++i)
+    {
+        if (targets[i] == nick)
+            return false;
+    }
+    targets.push_back(nick);
+    _watchers[nick].push_back(fd);
+    return true;
+}
+
+bool MonitorIndex::remove(int fd, const NickName& nick)
+{
+    std::map<int, std::vector<NickName> >::iterator list = _targets.find(fd);
+    if (list == _targets.end())
+        return false;
+    std::vector<NickName>& targets = list->second;
+    size_t i = 0;
+    while (i < targets.size() && targets[i] != nick)
+        ++i;
+    if (i == targets.size())
+        return false;
+    targets[i] = targets.back();
+    targets.pop_back();
+    if (targets.empty())
+        _targets.erase(list);
+    unwatch(nick, fd);
+    return true;
+}
+
+void MonitorIndex::clear(int fd)
+{
+    std::map<int, std::vector<NickName> >::iterator list = _targets.find(fd);
+    if (list == _targets.end())
+        return;
+    for (size_t i = 0; i < list->second.size(); ++i)
+        unwatch(list->second[i], fd);
+    _targets.erase(list);
+}
+
+size_t MonitorIndex::count(int fd) const
+{
+    std::map<int, std::vector<NickName> >::const_iterator list = _targets.find(fd);
+    return list == _targets.end() ? 0 : list->second.size();
+}
+
+const std::vector<int>* MonitorIndex::watchers(const NickName& nick) const
+{
+    std::map<NickName, std::vector<int> >::const_iterator entry = _watchers.find(nick);
+    return entry == _watchers.end() ? NULL : &entry->second;
+}
+
+const std::vector<NickName>* MonitorIndex::targets(int fd) const
+{
+    std::map<int, std::vector<NickName> >::const_iterator list = _targets.find(fd);
+    return list == _targets.end() ? NULL : &list->second;
+}
@@ -0,0 +1,119 @@
+#include "../inc/NamesCache.hpp"
+#include "../inc/Client.hpp"
+
+NamesCache::NamesCache() : _builds(0)
+{
+    _valid[0] = false;
+    _valid[1] = false;
+}
+
+void NamesCache::appendToken(std::string& out, const Membership& member, bool multiPrefix)
+{
+    if (!out.empty())
+        out += ' ';
+    if (member.isOperator)
+        out += '@';
+    if (member.isVoiced && (multiPrefix || !member.isOperator))
+        out += '+';
+    const NickName& nick = member.client->getNickname();
+    out.append(nick.c_str(), nick.size());
+}
+
+// Token boundaries of nick in payload, prefixes included; a linear scan over
+// the bytes, still far cheaper than touching every member's Client
+bool NamesCache::findToken(const std::string& payload, const char* nick, size_t length, size_t& start, size_t& end)
+{
+    size_t position = 0;
+    while (position < payload.size())
+    {
+        size_t tokenEnd = payload.find(' ', position);
+        if (tokenEnd == std::string::npos)
+            tokenEnd = payload.size();
+        size_t nickStart = position;
+        while (nickStart < tokenEnd && (payload[nickStart] == '@' || payload[nickStart] == '+'))
+            nickStart++;
+        if (tokenEnd - nickStart == length && payload.compare(nickStart, length, nick, length) == 0)
+        {
+            start = position;
+            end = tokenEnd;
+            return true;
+        }
+        position = tokenEnd + 1;
+    }
+    return false;
+}
+
+// Swaps the token of nick for member's current one, or drops it when member is NULL
+void NamesCache::replaceToken(const char* nick, size_t length, const Membership* member)
+{
+    for (int variant = 0; variant < 2; ++variant)
+    {
+        if (!_valid[variant])
+            continue;
+        std::string& payload = _payload[variant];
+        size_t start;
+        size_t end;
+        if (!findToken(payload, nick, length, start, end))
+        {
+            _valid[variant] = false; // out of step somehow, rebuild next time
+            continue;
+        }
+        if (member)
+        {
+            std::string token;
+            appendToken(token, *member, variant == 1);
+            payload.replace(start, end - start, token);
+        }
+        else if (end < payload.size())
+            payload.erase(start, end - start + 1);
+        else
+            payload.erase(start ? start - 1 : 0);
+    }
+}
+
+const std::string& NamesCache::payload(const std::vector<Membership*>& members, bool multiPrefix)
+{
+    int variant = multiPrefix ? 1 : 0;
+    if (!_valid[variant])
+    {
+        std::string& payload = _payload[variant];
+        payload.clear();
+        for (size_t i = 0; i < members.size(); ++i)
+            appendToken(payload, *members[i], multiPrefix);
+        _valid[variant] = true;
+        _builds++;
+    }
+    return _payload[variant];
+}
+
+void NamesCache::added(const Membership& member)
+{
+    for (int variant = 0; variant < 2; ++variant)
+    {
+        if (_valid[variant])
+            appendToken(_payload[variant], member, variant == 1);
+    }
+}
+
+void NamesCache::removed(const Membership& member)
+{
+    const NickName& nick = member.client->getNickname();
+    replaceToken(nick.c_str(), nick.size(), NULL);
+}
+
+void NamesCache::changed(const Membership& member)
+{
+    const NickName& nick = member.client->getNickname();
+    replaceToken(nick.c_str(), nick.size(), &member);
+}
+
+void NamesCache::renamed(const std::string& oldNick, const Membership& member)
+{
+    replaceToken(oldNick.data(), oldNick.size(), &member);
+}
+
+void NamesCache::invalidate()
+{
+    _valid[0] = false;
+    _valid[1] = false;
+}
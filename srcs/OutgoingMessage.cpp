@@ -0,0 +1,60 @@
+#include "../inc/OutgoingMessage.hpp"
+#include "../inc/ServerTime.hpp"
+
+OutgoingMessage::OutgoingMessage(Arena& arena, const StringSpan& body, const StringSpan& clientTags, bool tagsOnly)
+    : _arena(arena), _body(body), _clientTags(clientTags), _tagsOnly(tagsOnly), _hasMsgid(false)
+{
+    _timeTag[0] = '\0';
+    for (size_t i = 0; i < CAP_VARIANTS; ++i)
+        _built[i] = false;
+}
+
+void OutgoingMessage::setOrigin(const HistoryBlock& block)
+{
+    block.formatId(_msgid);
+    _hasMsgid = true;
+    std::memcpy(_timeTag, ServerTime::tag(block.time).data, SERVER_TIME_TAG_SIZE);
+}
+
+const StringSpan& OutgoingMessage::build(size_t variant) const
+{
+    bool tags = variant & 1;
+    bool time = variant & 2;
+    StringSpan& line = _lines[variant];
+    _built[variant] = true;
+    if (_tagsOnly && (!tags || _clientTags.empty()))
+        return line = StringSpan();
+    if (tags && _clientTags.empty() && !_hasMsgid)
+        tags = false;
+    if (!tags && !time)
+        return line = _body;
+    if (time && !_timeTag[0])
+        std::memcpy(_timeTag, ServerTime::tag().data, SERVER_TIME_TAG_SIZE); // all variants show the same instant
+    ArenaWriter out(_arena, _body.size + _clientTags.size + SERVER_TIME_TAG_SIZE + HISTORY_MSGID_SIZE + 12);
+    out << '@';
+    if (time)
+        out.append(_timeTag, SERVER_TIME_TAG_SIZE);
+    if (tags && _hasMsgid)
+    {
+        if (time)
+            out << ';';
+        out << "msgid=";
+        out.append(_msgid, HISTORY_MSGID_SIZE);
+    }
+    if (tags && !_clientTags.empty())
+    {
+        if (time || _hasMsgid)
+            out << ';';
+        out << _clientTags;
+    }
+    out << ' ' << _body;
+    return line = out.span();
+}
+
+size_t OutgoingMessage::variantsBuilt() const
+{
+    size_t built = 0;
+    for (size_t i = 0; i < CAP_VARIANTS; ++i)
+        built += _built[i];
+    return built;
+}
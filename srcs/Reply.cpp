@@ -1,6 +1,9 @@
 
 #include "Reply.hpp"
 #include "Client.hpp"
+#include "MonitorIndex.hpp"
+#include "MaskList.hpp"
+#include "ChannelsClientsManager.hpp"
 #include <sstream>
 #include <string>
 
@@ -16,7 +19,17 @@ std::string Reply::build(const std::string& code, const std::string& target, con
 
 // Example reply builders (add more as needed)
 void Reply::welcome(const Client& client) {
-    client.sendMessage(Reply::build(RPL_WELCOME, client.getNickname(), "Welcome to the ft_IRC Network"));
+    client.sendMessage(Reply::build(RPL_WELCOME, client.getNickname().str(), "Welcome to the ft_IRC Network"));
+}
+
+// RPL_ISUPPORT, right after the welcome. Only what the server actually does.
+void Reply::isupport(const Client& client) {
+    std::ostringstream tokens;
+    tokens << client.getNickname() << " CASEMAPPING=rfc1459 CHANMODES=beI,k,l,it CHANNELLEN=" << CHANNELLEN
+        << " CHANTYPES=#& ELIST=CMNTU EXCEPTS INVEX MAXLIST=beI:" << MASK_LIST_LIMIT << " MONITOR=" << MONITOR_LIMIT
+        << " NICKLEN=" << NICKLEN << " PREFIX=(ov)@+ TARGMAX=NOTICE:" << MESSAGE_TARGETS_LIMIT
+        << ",PRIVMSG:" << MESSAGE_TARGETS_LIMIT << " WHOX";
+    client.sendMessage(build(RPL_ISUPPORT, tokens.str(), "are supported by this server"));
 }
 
 void Reply::passwordMismatch(const Client& client) {
@@ -24,21 +37,25 @@ void Reply::passwordMismatch(const Client& client) {
 }
 
 void Reply::alreadyRegistered(const Client& client) {
-    client.sendMessage(build(ERR_ALREADYREGISTRED, client.getNickname(), "You may not reregister"));
+    client.sendMessage(build(ERR_ALREADYREGISTRED, client.getNickname().str(), "You may not reregister"));
 }
 
 void Reply::unknownCommand(const Client& client, const std::string& command) {
-    client.sendMessage(build(ERR_UNKNOWNCOMMAND, client.getNickname(), command + " Unknown command"));
+    client.sendMessage(build(ERR_UNKNOWNCOMMAND, client.getNickname().str(), command + " Unknown command"));
 }
 
 void Reply::needMoreParams(const Client& client, const std::string& command) {
-    client.sendMessage(build(ERR_NEEDMOREPARAMS, client.getNickname(), command + " Not enough parameters"));
+    client.sendMessage(build(ERR_NEEDMOREPARAMS, client.getNickname().str(), command + " Not enough parameters"));
 }
 
 void Reply::nicknameInUse(const Client& client, const std::string& nickname) {
     client.sendMessage(build(ERR_NICKNAMEINUSE, "*", nickname + " Nickname is already in use"));
 }
 
+void Reply::erroneousNickname(const Client& client, const std::string& nickname) {
+    client.sendMessage(build(ERR_ERRONEUSNICKNAME, "*", nickname + " Erroneous nickname"));
+}
+
 std::string Reply::noSuchNick(const std::string& target, const Client& client) {
     return build(ERR_NOSUCHNICK, target, client.getNickname() + " No such nick/channel");
 }
@@ -63,8 +80,16 @@ void Reply::notOnChannel(const Client& client, const std::string& channel) {
     client.sendMessage(build(ERR_NOTONCHANNEL, channel, " You're not on that channel"));
 }
 
+void Reply::tooManyTargets(const Client& client, const std::string& target) {
+    client.sendMessage(build(ERR_TOOMANYTARGETS, client.getNickname() + " " + target, "Too many recipients"));
+}
+
+void Reply::cannotSendToChannel(const Client& client, const std::string& channel) {
+    client.sendMessage(build(ERR_CANNOTSENDTOCHAN, client.getNickname() + " " + channel, "Cannot send to channel"));
+}
+
 void Reply::usersDontMatch(const Client& client) {
-    client.sendMessage(build(ERR_USERSDONTMATCH, client.getNickname(), "Cannot change mode for other users"));
+    client.sendMessage(build(ERR_USERSDONTMATCH, client.getNickname().str(), "Cannot change mode for other users"));
 }
 
 void Reply::notOperator(const Client& client, const std::string& channel) {
@@ -72,9 +97,36 @@ void Reply::notOperator(const Client& client, const std::string& channel) {
 }
 
 void Reply::invalidCommand(const Client& client, const std::string& command) {
-    client.sendMessage(build(ERR_UNKNOWNCOMMAND, client.getNickname(), command + " :Invalid command format"));
+    client.sendMessage(build(ERR_UNKNOWNCOMMAND, client.getNickname().str(), command + " :Invalid command format"));
 }
 
 void Reply::messageTooLong(const Client& client) {
-    client.sendMessage(build(ERR_MSGTOOLONG, client.getNickname(), "Message too long"));
+    client.sendMessage(build(ERR_MSGTOOLONG, client.getNickname().str(), "Message too long"));
+}
+
+void Reply::noPrivileges(const Client& client) {
+    client.sendMessage(build(ERR_NOPRIVILEGES, client.getNickname().str(), "Permission Denied- You're not an IRC operator"));
+}
+
+void Reply::statsLine(const Client& client, const std::string& line) {
+    client.sendMessage(build(RPL_STATSDEBUG, client.getNickname().str(), line));
+}
+
+void Reply::endOfStats(const Client& client, const std::string& query) {
+    client.sendMessage(":" + std::string(SERVER_NAME) + " " + RPL_ENDOFSTATS + " " + client.getNickname() + " " + query + " :End of STATS report\r\n");
+}
+
+void Reply::endOfNames(const Client& client, const std::string& channel) {
+    client.sendMessage(":" + std::string(SERVER_NAME) + " " + RPL_ENDOFNAMES + " " + client.getNickname() + " " + channel + " :End of /NAMES list.\r\n");
+}
+
+void Reply::fail(const Client& client, const std::string& command, const std::string& code,
+    const std::string& context, const std::string& description) {
+    client.sendMessage(":" + std::string(SERVER_NAME) + " FAIL " + command + " " + code
+        + (context.empty() ? "" : " " + context) + " :" + description + "\r\n");
+}
+
+void Reply::invalidCapCommand(const Client& client, const std::string& subcommand) {
+    std::string nick = client.isNicknameSet() ? client.getNickname().str() : "*";
+    client.sendMessage(":" + std::string(SERVER_NAME) + " " + ERR_INVALIDCAPCMD + " " + nick + " " + subcommand + " :Invalid CAP command\r\n");
 }
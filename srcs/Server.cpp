@@ -1,18 +1,34 @@
 #include "../inc/ft_irc.hpp"
 #include "Reply.hpp"
+#include "HotRestart.hpp"
+#include "HistoryLog.hpp"
 #include <signal.h>
 #include <csignal>
+#include <sys/wait.h>
+
+extern char **environ;
 
 static volatile sig_atomic_t g_terminate = 0;
+static volatile sig_atomic_t g_upgrade = 0;
 static void handle_sigint(int)
 {
     g_terminate = 1;
 }
 
+// kill -USR2 <pid> hands the running server over to a fresh binary
+static void handle_sigusr2(int)
+{
+    g_upgrade = 1;
+}
+
 Server::Server(int port, const std::string& password, time_t timeToLive)
-    : _port(port), _password(password), _clientTimeToLive(timeToLive), _manager(_clients, _password, _pollfds)
+    : _port(port), _password(password), _clientTimeToLive(timeToLive), _manager(_clients, _password, _pollfds),
+      _recvBuffer(BUFFER_SIZE), _historyLog(NULL),
+      _listenBacklog(static_cast<int>(MemoryBudget::envSize("IRCSERV_LISTEN_BACKLOG", LISTEN_BACKLOG))),
+      _acceptBatch(MemoryBudget::envSize("IRCSERV_ACCEPT_BATCH", ACCEPT_BATCH))
 {
     std::signal(SIGINT, handle_sigint);
+    std::signal(SIGUSR2, handle_sigusr2);
     // Create socket
     // AF_INET      IPv4 Internet protocols
     // SOCK_STREAM is for TCP
@@ -64,8 +80,9 @@ Server::Server(int port, const std::string& password, time_t timeToLive)
     // Listen for connections
     // listen(fd, backlog) marks a previously created and bound TCP socket as passive:
     // the kernel will start accepting incoming TCP connection attempts on that socket
-    // and queue them until your program calls accept().
-    if (listen(_socket, 10) < 0)
+    // and queue them until your program calls accept(). The backlog is how many may
+    // wait there (capped by net.core.somaxconn), past it new ones are dropped or reset.
+    if (listen(_socket, _listenBacklog) < 0)
     {
         close(_socket);
         throw std::runtime_error("Failed to listen on socket");
@@ -79,9 +96,81 @@ Server::Server(int port, const std::string& password, time_t timeToLive)
     _pollfds.push_back(pfd);
 
     // _manager.setClientsMap(&_clients, &_password, &_pollfds);
+    _historyLog = HistoryLog::fromEnv();
+    _manager.setHistoryLog(_historyLog);
+    _manager.setFloodControl(true);
+    _limiter.loadLimitsFromEnv();
+    _limiter.exempt(INADDR_LOOPBACK, 8);
+    _manager.setConnectionLimiter(&_limiter);
     std::cout << "Server initialized on port " << _port << std::endl;
 }
 
+// New process side of a live upgrade: everything, including the listening socket,
+// comes from the old process over the handoff socket instead of socket/bind/listen
+Server::Server(int handoffFd)
+    : _socket(-1), _port(0), _clientTimeToLive(0), _manager(_clients, _password, _pollfds),
+      _recvBuffer(BUFFER_SIZE), _historyLog(NULL),
+      _listenBacklog(static_cast<int>(MemoryBudget::envSize("IRCSERV_LISTEN_BACKLOG", LISTEN_BACKLOG))),
+      _acceptBatch(MemoryBudget::envSize("IRCSERV_ACCEPT_BATCH", ACCEPT_BATCH))
+{
+    std::signal(SIGINT, handle_sigint);
+    std::signal(SIGUSR2, handle_sigusr2);
+
+    std::string state;
+    std::vector<int> fds;
+    if (!HotRestart::receiveState(handoffFd, state, fds) || fds.empty())
+    {
+        close(handoffFd);
+        throw std::runtime_error("Failed to receive upgrade state");
+    }
+    std::istringstream iss(state);
+    if (!(iss >> _port >> _clientTimeToLive) || !HotRestart::getString(iss, _password))
+    {
+        close(handoffFd);
+        throw std::runtime_error("Corrupted upgrade state");
+    }
+
+    _socket = fds[0];
+    socklen_t len = sizeof(_address);
+    getsockname(_socket, (struct sockaddr *)&_address, &len);
+    // Listening again only resizes the queue, a new binary may bring a new backlog
+    if (listen(_socket, _listenBacklog) < 0)
+        std::cerr << "Failed to update listen backlog: " << strerror(errno) << std::endl;
+    pollfd pfd;
+    pfd.fd = _socket;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    _pollfds.push_back(pfd);
+
+    // Before the channels come back, they reload their history from it
+    _historyLog = HistoryLog::fromEnv();
+    _manager.setHistoryLog(_historyLog);
+    _manager.setFloodControl(true);
+    _limiter.loadLimitsFromEnv();
+    _limiter.exempt(INADDR_LOOPBACK, 8);
+    _manager.setConnectionLimiter(&_limiter);
+    if (!_manager.restoreState(iss, fds, 1))
+    {
+        close(handoffFd);
+        throw std::runtime_error("Corrupted upgrade state");
+    }
+    // The counts start over from the connections that came along; reconnect
+    // clocks don't survive, nobody reconnected during the upgrade anyway
+    for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+    {
+        struct sockaddr_in peer;
+        socklen_t peerLen = sizeof(peer);
+        if (getpeername(it->first, (struct sockaddr *)&peer, &peerLen) < 0 || peer.sin_family != AF_INET)
+            continue;
+        it->second->setAddress(ntohl(peer.sin_addr.s_addr));
+        _limiter.restore(it->second->getAddress());
+    }
+    // From here on the old process may exit
+    HotRestart::sendAck(handoffFd);
+    close(handoffFd);
+    std::cout << "Server resumed on port " << _port << " with " << _manager.getClientsSize() << " clients" << std::endl;
+}
+
 Server::~Server()
 {
     // Close all client connections
@@ -93,6 +182,7 @@ Server::~Server()
 
     // Close server socket
     close(_socket);
+    delete _historyLog; // writes out what is still queued
     std::cout << "Server shut down" << std::endl;
 }
 
@@ -104,15 +194,47 @@ void Server::start()
     {
         if (g_terminate) // break quickly if signal already received
             break;
-        if (poll(&_pollfds[0], _pollfds.size(), 60000) < 0) /// exit after period of time in milliseconds
+        if (g_upgrade)
+        {
+            g_upgrade = 0;
+            if (upgrade())
+            {
+                std::cout << "Server handed over to the new process" << std::endl;
+                break;
+            }
+        }
+        // Only ask for POLLOUT while something is queued, otherwise poll would spin
+        for (size_t i = 0; i < _pollfds.size(); ++i)
+        {
+            Client *client = _manager.getClientByFd(_pollfds[i].fd);
+            _pollfds[i].events = (client != NULL && client->hasPendingOutput()) ? POLLIN | POLLOUT : POLLIN;
+        }
+        // Don't sleep while a LIST still has output to produce for a client that keeps up
+        int timeout = _manager.hasRunnableListings() ? 0 : 60000;
+        // nor past the moment held back input may go on
+        int deferred = _manager.deferredTimeout();
+        if (deferred >= 0 && deferred < timeout)
+            timeout = deferred;
+        if (poll(&_pollfds[0], _pollfds.size(), timeout) < 0) /// exit after period of time in milliseconds
         {
             if (errno == EINTR)
                 continue;
             throw std::runtime_error("Poll failed");
         }
+        // One clock read per wakeup, not one per client
+        time_t now = time(NULL);
         // Check for activity on each socket
         for (size_t i = 0; i < _pollfds.size(); ++i)
         {
+            if (_pollfds[i].revents & POLLOUT)
+            {
+                Client *client = _manager.getClientByFd(_pollfds[i].fd);
+                if (client != NULL && !client->flushSendQueue())
+                {
+                    _manager.removeClient(*client);
+                    continue;
+                }
+            }
             if (_pollfds[i].revents & POLLIN)
             {
                 // if new connection then the fd
@@ -127,100 +249,236 @@ void Server::start()
             }
             else if (_pollfds[i].revents & (POLLHUP | POLLERR))
             {
-                Client *client = _clients[_pollfds[i].fd];
+                Client *client = _manager.getClientByFd(_pollfds[i].fd);
                 if (_pollfds[i].fd != _socket && client != NULL)
                     _manager.removeClient(*client);
             }
 
-            Client *client = _clients[_pollfds[i].fd];
+            Client *client = _manager.getClientByFd(_pollfds[i].fd);
             if (client != NULL) {
-                if (client->getTimePassed() >= _clientTimeToLive)
-                    _manager.removeClient(*client);
-                else if (client->getTimePassed() >= _clientTimeToLive / 2 && SEND_PING_AT_HALF_TIME)
+                if (client->getTimePassed(now) >= _clientTimeToLive)
+                    _manager.removeClient(*client, "Ping timeout");
+                else if (client->getTimePassed(now) >= _clientTimeToLive / 2 && SEND_PING_AT_HALF_TIME)
                 {
                     _manager.sendPingToClient(client);
                 }
                 continue;
             }
         }
+        _manager.continueDeferred();
+        _manager.continueListings();
+        enforceMemoryLimits();
+        _manager.resetArena();
     }
 }
 
-void Server::handleNewConnection()
+// Graceful degradation, cheapest step first: slow consumers that blew their own
+// sendq go right away; if the server as a whole is over its limit, spare buffer
+// capacity is given back, then the clients with the longest queues are dropped.
+// New connections are refused in handleNewConnection while we're near the limit.
+void Server::enforceMemoryLimits()
 {
-    struct sockaddr_in client_addr;
-    socklen_t addr_size = sizeof(client_addr);
-    //    The accept() system call is used with connection-based socket
-    //    types (SOCK_STREAM, SOCK_SEQPACKET).  It extracts the first
-    //    connection request on the queue of pending connections for the
-    //    listening socket, sockfd, creates a new connected socket, and
-    //    returns a new file descriptor referring to that socket.
-    int client_fd = accept(_socket, (struct sockaddr *)&client_addr, &addr_size);
-    if (client_fd < 0)
-    {
-        std::cerr << "Failed to accept connection: " << strerror(errno) << std::endl;
+    std::vector<int> slow;
+    Client::takeSendQueueExceeded(slow);
+    for (size_t i = 0; i < slow.size(); ++i)
+    {
+        // The fd may have gone, or been reused by someone else, since
+        Client *client = _manager.getClientByFd(slow[i]);
+        if (!client || !client->isSendQueueExceeded())
+            continue;
+        std::cout << "Dropping client (fd: " << slow[i] << "): SendQ exceeded" << std::endl;
+        _manager.removeClient(*client, "SendQ exceeded");
+    }
+    if (!MemoryBudget::overLimit())
         return;
+
+    std::cerr << "Memory limit reached (" << MemoryBudget::total() << " bytes), shrinking buffers" << std::endl;
+    std::vector<std::pair<size_t, Client *> > queued;
+    for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+    {
+        it->second->shrinkBuffers();
+        if (it->second->hasPendingOutput())
+            queued.push_back(std::make_pair(it->second->getSendQueueSize(), it->second));
+    }
+    std::sort(queued.rbegin(), queued.rend());
+    for (size_t i = 0; i < queued.size() && MemoryBudget::overLimit(); ++i)
+    {
+        std::cerr << "Dropping client (fd: " << queued[i].second->getFd() << "): server out of memory" << std::endl;
+        _manager.removeClient(*queued[i].second, "Server out of memory");
     }
+}
 
-    // Set non-blocking mode
-    if (fcntl(client_fd, F_SETFL, O_NONBLOCK) < 0)
+std::string Server::saveState(std::vector<int>& fds) const
+{
+    std::ostringstream oss;
+    oss << _port << ' ' << _clientTimeToLive << ' ';
+    HotRestart::putString(oss, _password);
+    fds.push_back(_socket);
+    _manager.saveState(oss, fds);
+    return oss.str();
+}
+
+// Old process side of a live upgrade. Returns true once the new process has
+// acknowledged the state, the caller then just stops the loop. Our copies of the
+// sockets get closed on the way out but the new process holds its own.
+bool Server::upgrade()
+{
+    if (_binaryPath.empty())
+        return false;
+    // The new process reads the log on startup, it has to be complete by then
+    if (_historyLog)
+        _historyLog->flush();
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        std::cerr << "Upgrade failed: socketpair: " << strerror(errno) << std::endl;
+        return false;
+    }
+    // The child may only close and exec: the history log thread can hold the
+    // malloc or locale lock at fork time, so argv and envp are built up front
+    std::ostringstream fdVariable;
+    fdVariable << UPGRADE_ENV_FD << '=' << sv[1];
+    std::string fdEntry = fdVariable.str();
+    size_t nameLength = std::strlen(UPGRADE_ENV_FD);
+    std::vector<char *> envp;
+    for (char **env = environ; *env; ++env)
+    {
+        if (std::strncmp(*env, UPGRADE_ENV_FD, nameLength) != 0 || (*env)[nameLength] != '=')
+            envp.push_back(*env);
+    }
+    envp.push_back(const_cast<char *>(fdEntry.c_str()));
+    envp.push_back(NULL);
+    char *argv[] = { const_cast<char *>(_binaryPath.c_str()), NULL };
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        std::cerr << "Upgrade failed: fork: " << strerror(errno) << std::endl;
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if (pid == 0)
+    {
+        // Only the handoff socket crosses exec, the new binary gets the rest over SCM_RIGHTS
+        for (size_t i = 0; i < _pollfds.size(); ++i)
+            close(_pollfds[i].fd);
+        close(sv[0]);
+        environ = &envp[0]; // execvp still searches PATH for a bare argv[0]
+        execvp(argv[0], argv);
+        _exit(1);
+    }
+    close(sv[1]);
+
+    std::vector<int> fds;
+    std::string state = saveState(fds);
+    bool ok = HotRestart::sendState(sv[0], state, fds) && HotRestart::waitAck(sv[0], UPGRADE_TIMEOUT_MS);
+    close(sv[0]);
+    if (!ok)
+    {
+        std::cerr << "Upgrade failed: new process did not take over, continuing" << std::endl;
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+    return true;
+}
+
+// One POLLIN on the listener may stand for many queued connections, a restart
+// brings all clients back at once. Take up to _acceptBatch of them per wakeup
+// instead of one, whatever is left keeps the listener readable for the next.
+void Server::handleNewConnection()
+{
+    for (size_t accepted = 0; accepted < _acceptBatch; ++accepted)
     {
-        std::cerr << "Failed to set non-blocking mode for client: " << strerror(errno) << std::endl;
+        struct sockaddr_in client_addr;
+        socklen_t addr_size = sizeof(client_addr);
+        //    accept4 is accept (take the first pending connection off the
+        //    listener's queue as a new socket) that also sets the flags on
+        //    that socket, saving an fcntl per connection.
+#ifdef SOCK_NONBLOCK
+        int client_fd = accept4(_socket, (struct sockaddr *)&client_addr, &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int client_fd = accept(_socket, (struct sockaddr *)&client_addr, &addr_size);
+        if (client_fd >= 0 && fcntl(client_fd, F_SETFL, O_NONBLOCK) < 0)
+        {
+            std::cerr << "Failed to set non-blocking mode for client: " << strerror(errno) << std::endl;
+            close(client_fd);
+            continue;
+        }
+#endif
+        if (client_fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                std::cerr << "Failed to accept connection: " << strerror(errno) << std::endl;
+            return;
+        }
+        acceptClient(client_fd, client_addr);
+    }
+}
+
+void Server::acceptClient(int client_fd, const struct sockaddr_in& client_addr)
+{
+    if (MemoryBudget::nearLimit())
+    {
+        std::string refusal = "ERROR :Server is out of memory, try again later\r\n";
+        send(client_fd, refusal.c_str(), refusal.size(), MSG_NOSIGNAL);
         close(client_fd);
+        std::cerr << "Refused connection: memory limit reached" << std::endl;
         return;
     }
 
-    // Add to pollfds
-    pollfd pfd;
-    pfd.fd = client_fd;
-    pfd.events = POLLIN;
-    pfd.revents = 0;
-    _pollfds.push_back(pfd);
+    // The address is kept as it came, the dotted form is only for the hostname
+    unsigned int address = ntohl(client_addr.sin_addr.s_addr);
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr.sin_addr, host, sizeof(host));
 
-    // Create client
-    Client *client = new Client(client_fd);
-    _clients[client_fd] = client;
-    // _clients[client_fd] = new Client(client_fd);
+    // Per host and per network limits, and how fast a host may come back
+    ConnectionLimiter::Verdict verdict = _limiter.admit(address, ServerTime::now());
+    if (verdict != ConnectionLimiter::ADMITTED)
+    {
+        std::string refusal = "ERROR :Closing Link: " + std::string(host)
+            + " (" + ConnectionLimiter::reason(verdict) + ")\r\n";
+        send(client_fd, refusal.c_str(), refusal.size(), MSG_NOSIGNAL);
+        close(client_fd);
+        std::cerr << "Refused connection from " << host << ": " << ConnectionLimiter::reason(verdict) << std::endl;
+        return;
+    }
 
-    // Set hostname
-    // inet_ntoa(client_addr.sin_addr) converts the IPv4 address in
-    // client_addr.sin_addr into a human‑readable dotted string like "192.168.0.5".
-    client->setHostname(inet_ntoa(client_addr.sin_addr));
+    // Create client, the manager adds it to the clients map, the fd table and pollfds
+    Client *client = new Client(client_fd);
+    _manager.addClient(client);
+    client->setHostname(host);
+    client->setAddress(address);
 
     std::cout << "New connection from " << client->getHostname() << " (fd: " << client_fd << ")" << std::endl;
 
     Reply::welcome(*client);
 }
 
-// bla-bla
+// Complete lines are handled straight out of the shared buffer, only a trailing
+// partial line is copied into the client
 void Server::handleClientMessage(int clientfd)
 {
     // Recieve message
-    Client *client = _clients[clientfd];
-    char buffer[BUFFER_SIZE + 1];
-    memset(buffer, 0, sizeof(buffer));
-    ssize_t bytes_read = recv(clientfd, buffer, BUFFER_SIZE, 0);
-    // std::cout << "ClientFD is: " << clientfd << std::endl;
-    // std::cout << "Bytes read: " << bytes_read << std::endl;
+    Client *client = _manager.getClientByFd(clientfd);
+    if (!client)
+        return;
+    ssize_t bytes_read = recv(clientfd, &_recvBuffer[0], _recvBuffer.size(), 0);
     if (bytes_read <= 0)
     {
-        if (bytes_read == 0 || errno != EAGAIN)
-        {
-            Client *client = _clients[clientfd];
-            if (client)
-                _manager.removeClient(*client);
-            return;
-        }
+        if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            _manager.removeClient(*client);
+        return;
     }
-    // std::cout << "I went through here\n";
-    client->addToBuffer(std::string(buffer, bytes_read));
-    if (!client->hasCompleteMessage())
+    _manager.handleClientInput(client, &_recvBuffer[0], bytes_read);
+    if (client->hasQuit())
     {
-        return ; // Wait for more data
+        _manager.removeClient(*client);
+        return;
     }
-    _manager.handleClientMessage(client);
 
-    client->clearBuffer();
     if (PRINT_CLIENT_INFO && client->isRegistered())
         client->printClientInfo();
 }
@@ -0,0 +1,81 @@
+#include "../inc/ServerTime.hpp"
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+
+static char             g_tag[SERVER_TIME_TAG_SIZE + 1];
+static StringSpan       g_span(g_tag, SERVER_TIME_TAG_SIZE);
+static time_t           g_second = -1;
+static int              g_millisecond = -1;
+static unsigned long    g_formats = 0;
+
+const StringSpan& ServerTime::tag()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return tag(now);
+}
+
+const StringSpan& ServerTime::tag(const struct timeval& now)
+{
+    if (now.tv_sec != g_second)
+    {
+        struct tm utc;
+        gmtime_r(&now.tv_sec, &utc);
+        std::strftime(g_tag, sizeof(g_tag), "time=%Y-%m-%dT%H:%M:%S.", &utc);
+        g_tag[SERVER_TIME_TAG_SIZE - 1] = 'Z';
+        g_second = now.tv_sec;
+        g_millisecond = -1;
+        g_formats++;
+    }
+    int millisecond = static_cast<int>(now.tv_usec / 1000);
+    if (millisecond != g_millisecond)
+    {
+        g_tag[SERVER_TIME_TAG_SIZE - 4] = '0' + millisecond / 100;
+        g_tag[SERVER_TIME_TAG_SIZE - 3] = '0' + millisecond / 10 % 10;
+        g_tag[SERVER_TIME_TAG_SIZE - 2] = '0' + millisecond % 10;
+        g_millisecond = millisecond;
+    }
+    return g_span;
+}
+
+const StringSpan& ServerTime::tag(unsigned long long milliseconds)
+{
+    struct timeval at;
+    at.tv_sec = static_cast<time_t>(milliseconds / 1000);
+    at.tv_usec = static_cast<suseconds_t>(milliseconds % 1000 * 1000);
+    return tag(at);
+}
+
+unsigned long long ServerTime::now()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return static_cast<unsigned long long>(now.tv_sec) * 1000 + now.tv_usec / 1000;
+}
+
+bool ServerTime::parse(const std::string& timestamp, unsigned long long& milliseconds)
+{
+    struct tm utc;
+    int millis = 0;
+    char zone = 0;
+    std::memset(&utc, 0, sizeof(utc));
+    int fields = std::sscanf(timestamp.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d.%3d%c", &utc.tm_year, &utc.tm_mon,
+        &utc.tm_mday, &utc.tm_hour, &utc.tm_min, &utc.tm_sec, &millis, &zone);
+    if (fields == 6)
+        fields = std::sscanf(timestamp.c_str(), "%*d-%*d-%*dT%*d:%*d:%*d%c", &zone) == 1 ? 8 : 0;
+    if (fields != 8 || zone != 'Z' || millis < 0 || utc.tm_year < 1970)
+        return false;
+    utc.tm_year -= 1900;
+    utc.tm_mon -= 1;
+    time_t seconds = timegm(&utc);
+    if (seconds == static_cast<time_t>(-1))
+        return false;
+    milliseconds = static_cast<unsigned long long>(seconds) * 1000 + millis;
+    return true;
+}
+
+unsigned long ServerTime::formatCount()
+{
+    return g_formats;
+}
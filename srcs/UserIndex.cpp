@@ -0,0 +1,229 @@
+#include "../inc/UserIndex.hpp"
+#include "../inc/Client.hpp"
+#include "../inc/Mask.hpp"
+
+WhoQuery::WhoQuery() : fields(WHO_NICK | WHO_USER | WHO_HOST), phase(0), scanDone(false), position(0) {}
+
+// Options are "[flags][%fields[,token]]", e.g. "n%nuhr,42"
+void WhoQuery::parse(const std::string& whoMask, const std::string& options)
+{
+    mask = whoMask;
+    std::string flags = options.substr(0, options.find('%'));
+    if (options.find('%') != std::string::npos)
+    {
+        whox = options.substr(options.find('%') + 1);
+        size_t comma = whox.find(',');
+        if (comma != std::string::npos)
+        {
+            token = whox.substr(comma + 1);
+            whox.erase(comma);
+        }
+    }
+    unsigned int picked = 0;
+    for (size_t i = 0; i < flags.size(); ++i)
+    {
+        if (flags[i] == 'n')
+            picked |= WHO_NICK;
+        else if (flags[i] == 'u')
+            picked |= WHO_USER;
+        else if (flags[i] == 'h' || flags[i] == 'i')
+            picked |= WHO_HOST;
+        else if (flags[i] == 'r')
+            picked |= WHO_REAL;
+    }
+    if (picked)
+        fields = picked;
+    if (!mask.empty() && (mask[0] == '#' || mask[0] == '&'))
+    {
+        channel = mask;
+        return;
+    }
+    if (mask.empty() || mask == "0")
+        anyMask = "*";
+    else if (mask.find('!') == std::string::npos && mask.find('@') == std::string::npos)
+        anyMask = mask;
+    else
+        splitMask();
+    nickMatcher = CompiledMask(nickMask);
+    userMatcher = CompiledMask(userMask);
+    hostMatcher = CompiledMask(hostMask);
+    anyMatcher = CompiledMask(anyMask);
+}
+
+// nick!user@host or user@host, a missing part matches anything
+void WhoQuery::splitMask()
+{
+    size_t bang = mask.find('!');
+    size_t at = mask.find('@');
+    if (bang != std::string::npos)
+    {
+        nickMask = mask.substr(0, bang);
+        size_t userEnd = (at != std::string::npos && at > bang) ? at : mask.size();
+        userMask = mask.substr(bang + 1, userEnd - bang - 1);
+    }
+    else
+        userMask = mask.substr(0, at);
+    if (at != std::string::npos)
+        hostMask = mask.substr(at + 1);
+    if (nickMask.empty())
+        nickMask = "*";
+    if (userMask.empty())
+        userMask = "*";
+    if (hostMask.empty())
+        hostMask = "*";
+}
+
+bool WhoQuery::matchesField(unsigned int field, const Client& client) const
+{
+    if (field == WHO_NICK)
+        return anyMatcher.matches(client.getNickname().c_str(), client.getNickname().size());
+    if (field == WHO_USER)
+        return anyMatcher.matches(client.getUsername());
+    if (field == WHO_HOST)
+        return anyMatcher.matches(client.getHostname());
+    return anyMatcher.matches(client.getRealname());
+}
+
+bool WhoQuery::matches(const Client& client) const
+{
+    if (anyMask.empty())
+        return nickMatcher.matches(client.getNickname().c_str(), client.getNickname().size())
+            && userMatcher.matches(client.getUsername()) && hostMatcher.matches(client.getHostname());
+    for (unsigned int field = WHO_NICK; field <= WHO_REAL; field <<= 1)
+    {
+        if ((fields & field) && matchesField(field, client))
+            return true;
+    }
+    return false;
+}
+
+bool WhoQuery::accepts(const Client& client) const
+{
+    if (!matches(client))
+        return false;
+    // A plain mask is looked up in several indexes, whoever matched an
+    // earlier one was listed there
+    for (size_t i = 0; i < phase && i < scans.size(); ++i)
+    {
+        if (matchesField(scans[i].field, client))
+            return false;
+    }
+    return true;
+}
+
+std::string UserIndex::fold(const std::string& str)
+{
+    return fold(str.data(), str.size());
+}
+
+std::string UserIndex::fold(const char* str, size_t size)
+{
+    std::string folded(str, size);
+    for (size_t i = 0; i < folded.size(); ++i)
+        folded[i] = static_cast<char>(ircFold(static_cast<unsigned char>(folded[i])));
+    return folded;
+}
+
+const UserIndex::Index& UserIndex::index(unsigned int field) const
+{
+    if (field == WHO_USER)
+        return _byUser;
+    if (field == WHO_HOST)
+        return _byHost;
+    return _byNick;
+}
+
+void UserIndex::add(const Client& client)
+{
+    _byNick.insert(std::make_pair(fold(client.getNickname().c_str(), client.getNickname().size()), client.getFd()));
+    _byUser.insert(std::make_pair(fold(client.getUsername()), client.getFd()));
+    _byHost.insert(std::make_pair(fold(client.getHostname()), client.getFd()));
+}
+
+void UserIndex::remove(const Client& client)
+{
+    _byNick.erase(std::make_pair(fold(client.getNickname().c_str(), client.getNickname().size()), client.getFd()));
+    _byUser.erase(std::make_pair(fold(client.getUsername()), client.getFd()));
+    _byHost.erase(std::make_pair(fold(client.getHostname()), client.getFd()));
+}
+
+void UserIndex::renamed(const Client& client, const std::string& oldNick)
+{
+    _byNick.erase(std::make_pair(fold(oldNick), client.getFd()));
+    _byNick.insert(std::make_pair(fold(client.getNickname().c_str(), client.getNickname().size()), client.getFd()));
+}
+
+static WhoScan scanFor(unsigned int field, const std::string& mask)
+{
+    WhoScan scan;
+    scan.field = field;
+    scan.prefix = UserIndex::fold(mask.substr(0, mask.find_first_of("*?")));
+    scan.exact = !isMask(mask);
+    return scan;
+}
+
+void UserIndex::plan(WhoQuery& query) const
+{
+    query.scans.clear();
+    query.phase = 0;
+    query.scanDone = false;
+    if (query.anyMask.empty())
+    {
+        // All parts have to match: walk the part with the longest literal prefix
+        WhoScan scan = scanFor(WHO_NICK, query.nickMask);
+        WhoScan user = scanFor(WHO_USER, query.userMask);
+        WhoScan host = scanFor(WHO_HOST, query.hostMask);
+        if (user.prefix.size() > scan.prefix.size())
+            scan = user;
+        if (host.prefix.size() > scan.prefix.size())
+            scan = host;
+        query.scans.push_back(scan);
+    }
+    else if (scanFor(WHO_NICK, query.anyMask).prefix.empty() || (query.fields & WHO_REAL))
+    {
+        // One match is enough, so every field needs a prefix; else it's one walk over everybody
+        query.scans.push_back(scanFor(WHO_NICK, "*"));
+    }
+    else
+    {
+        for (unsigned int field = WHO_NICK; field <= WHO_HOST; field <<= 1)
+        {
+            if (query.fields & field)
+                query.scans.push_back(scanFor(field, query.anyMask));
+        }
+    }
+    query.next = std::make_pair(query.scans[0].prefix, -1);
+}
+
+// One call never crosses from one scan into the next, so everything it
+// returns came from query.phase, which accepts() relies on
+bool UserIndex::next(WhoQuery& query, std::vector<int>& out, size_t budget) const
+{
+    if (query.scanDone)
+    {
+        query.scanDone = false;
+        if (++query.phase >= query.scans.size())
+            return false;
+        query.next = std::make_pair(query.scans[query.phase].prefix, -1);
+    }
+    const WhoScan& scan = query.scans[query.phase];
+    const Index& keys = index(scan.field);
+    Index::const_iterator it = keys.lower_bound(query.next);
+    for (size_t scanned = 0; it != keys.end() && scanned < budget; ++it, ++scanned)
+    {
+        if (it->first.compare(0, scan.prefix.size(), scan.prefix) != 0
+            || (scan.exact && it->first.size() != scan.prefix.size()))
+        {
+            it = keys.end(); // sorted, so the range is over
+            break;
+        }
+        out.push_back(it->second);
+    }
+    if (it != keys.end())
+    {
+        query.next = *it;
+        return true;
+    }
+    query.scanDone = true;
+    return query.phase + 1 < query.scans.size();
+}
@@ -2,6 +2,28 @@
 
 int main(int argc, char **argv)
 {
+    MemoryBudget::loadLimitsFromEnv();
+    ChannelHistory::loadLimitsFromEnv();
+
+    // Started by a live upgrade, the old process passes us its state
+    if (const char *handoff = std::getenv(UPGRADE_ENV_FD))
+    {
+        int handoffFd = std::atoi(handoff);
+        unsetenv(UPGRADE_ENV_FD);
+        try
+        {
+            Server server(handoffFd);
+            server.setBinaryPath(argv[0]);
+            server.start();
+        }
+        catch (std::exception &e)
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
     if (argc != 3)
     {
         std::cerr << "Usage: " << argv[0] << " <port> <password>" << std::endl;
@@ -25,6 +47,7 @@ int main(int argc, char **argv)
     try
     {
         Server server(port, password, 400);
+        server.setBinaryPath(argv[0]);
         server.start();
     }
     catch (std::exception &e)